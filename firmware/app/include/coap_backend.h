@@ -15,7 +15,9 @@
  *
  * @member recv     Wait for and process one response.
  *                  Blocks until a response arrives or a timeout expires.
- *                  Returns 0 on success, negative errno on hard error.
+ *                  Returns 0 on success, the number of seconds to wait
+ *                  before sending again if the server is overloaded
+ *                  (5.03 with Max-Age), negative errno on hard error.
  *
  * @member cleanup  Release all resources (socket, session, context, …).
  */
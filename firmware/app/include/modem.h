@@ -1,6 +1,9 @@
 #ifndef MODEM_H
 #define MODEM_H
 
+#include <stddef.h>
+
 int modem_configure(void);
+int modem_get_imei(char *buf, size_t len);
 
 #endif /* MODEM_H */
@@ -0,0 +1,29 @@
+#ifndef SNAPSHOT_ENCODER_H
+#define SNAPSHOT_ENCODER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sensor.h"
+
+/* Content-Format of the payloads produced by snapshot_encode(), selected by
+   the CONFIG_SNAPSHOT_ENCODING_* choice */
+#if defined(CONFIG_SNAPSHOT_ENCODING_CBOR)
+#define SNAPSHOT_CONTENT_FORMAT 60  /* application/cbor */
+#elif defined(CONFIG_SNAPSHOT_ENCODING_SENML_CBOR)
+#define SNAPSHOT_CONTENT_FORMAT 112 /* application/senml+cbor */
+#else
+#define SNAPSHOT_CONTENT_FORMAT 50  /* application/json */
+#endif
+
+#define SNAPSHOT_BUF_SIZE 1024
+
+/**
+ * @brief Serialise a snapshot in the configured encoding
+ *
+ * @return Payload length on success, negative errno on failure.
+ */
+int snapshot_encode(const sensor_snapshot_t *snapshot, uint8_t *buf,
+                    size_t buf_len);
+
+#endif /* SNAPSHOT_ENCODER_H */
@@ -1,8 +1,12 @@
+#include <stdio.h>
+#include <string.h>
 #include <zephyr/kernel.h>
 #include <zephyr/logging/log.h>
 #include <coap3/coap.h>
 
 #include "coap_backend.h"
+#include "modem.h"
+#include "snapshot_encoder.h"
 
 LOG_MODULE_REGISTER(coap_libcoap, LOG_LEVEL_DBG);
 
@@ -12,14 +16,25 @@ LOG_MODULE_REGISTER(coap_libcoap, LOG_LEVEL_DBG);
 
 #define RECV_TIMEOUT_MS 5000
 
+/* Same limit as the server, terminating NUL included */
+#define COAP_DEVICE_ID_MAX_LEN 64
+
 static coap_context_t *g_ctx     = NULL;
 static coap_session_t *g_session = NULL;
 static coap_uri_t      g_uri;
 static coap_address_t  g_dst;
 
+/* g_uri points into this buffer: COAP_SERVER_URI plus the device id query */
+static char g_uri_buf[sizeof(COAP_SERVER_URI) + sizeof("?d=") +
+                      COAP_DEVICE_ID_MAX_LEN];
+
 /* Set to 1 by the response handler; reset to 0 before each send */
 static volatile int response_received;
 
+/* Max-Age of a 5.03 answer, in seconds: set by the response handler, 0 for
+   any other answer */
+static volatile uint32_t retry_after_s;
+
 static int resolve_address(coap_str_const_t *host, uint16_t port,
                            coap_address_t *dst, int scheme_hint_bits)
 {
@@ -49,7 +64,28 @@ static coap_response_t response_handler(coap_session_t   *session,
 	ARG_UNUSED(sent);
 	ARG_UNUSED(id);
 
-	if (coap_get_data_large(received, &len, &data, &offset, &total)) {
+	/* The server is overloaded and tells us when to come back. Without
+	   a Max-Age option, the default of 60 s applies (RFC 7252). */
+	if (coap_pdu_get_code(received) ==
+	    COAP_RESPONSE_CODE_SERVICE_UNAVAILABLE) {
+		coap_opt_iterator_t opt_iter;
+		coap_opt_t *opt = coap_check_option(received, COAP_OPTION_MAXAGE,
+						    &opt_iter);
+
+		retry_after_s = opt ? coap_decode_var_bytes(coap_opt_value(opt),
+							    coap_opt_length(opt))
+				    : 60;
+		if (retry_after_s == 0) {
+			retry_after_s = 1;
+		}
+		response_received = 1;
+		return COAP_RESPONSE_OK;
+	}
+
+	/* 2.04 carries no payload */
+	if (!coap_get_data_large(received, &len, &data, &offset, &total)) {
+		response_received = 1;
+	} else {
     LOG_INF("Response (%zu/%zu bytes): %*.*s",
 		       len + offset, total,
 		       (int)len, (int)len, (const char *)data);
@@ -72,10 +108,28 @@ static int libcoap_init()
   }
   coap_context_set_block_mode(g_ctx, COAP_BLOCK_USE_LIBCOAP);
 
+  /* Identify the device with the "d" query parameter: the server would
+     fall back to our source address, which the carrier NAT changes */
+  char device_id[COAP_DEVICE_ID_MAX_LEN] = CONFIG_COAP_DEVICE_ID;
+
+  if (device_id[0] == '\0' &&
+      modem_get_imei(device_id, sizeof(device_id)) != 0) {
+    LOG_WRN("No device id, the server will use the source address");
+    device_id[0] = '\0';
+  }
+
+  if (device_id[0] != '\0') {
+    snprintf(g_uri_buf, sizeof(g_uri_buf), "%s?d=%s", COAP_SERVER_URI,
+             device_id);
+  } else {
+    snprintf(g_uri_buf, sizeof(g_uri_buf), "%s", COAP_SERVER_URI);
+  }
+  LOG_INF("Device id: %s", device_id[0] ? device_id : "(none)");
+
   /* Parse the server URI */
-  if (coap_split_uri((const uint8_t *)COAP_SERVER_URI, strlen(COAP_SERVER_URI),
+  if (coap_split_uri((const uint8_t *)g_uri_buf, strlen(g_uri_buf),
                      &g_uri) != 0) {
-    LOG_ERR("Failed to parse URI: %s", COAP_SERVER_URI);
+    LOG_ERR("Failed to parse URI: %s", g_uri_buf);
     return -EINVAL;
   }
 
@@ -125,7 +179,7 @@ static int libcoap_send(const uint8_t *payload, size_t len)
 
   uint8_t fmt_buf[2];
   size_t  fmt_len = coap_encode_var_safe(fmt_buf, sizeof(fmt_buf),
-                                         COAP_MEDIATYPE_APPLICATION_JSON);
+                                         SNAPSHOT_CONTENT_FORMAT);
   coap_add_option(pdu, COAP_OPTION_CONTENT_FORMAT, fmt_len, fmt_buf);
 
   coap_add_data(pdu, len, payload);
@@ -154,6 +208,7 @@ static int libcoap_recv(void)
   int64_t deadline;
 
   response_received = 0;
+  retry_after_s     = 0;
   deadline = k_uptime_get() + RECV_TIMEOUT_MS;
 
   while (!response_received && k_uptime_get() < deadline) {
@@ -164,7 +219,7 @@ static int libcoap_recv(void)
     LOG_WRN("No response received within %d ms", RECV_TIMEOUT_MS);
   }
 
-  return 0;
+  return (int)retry_after_s;
 }
 
 static void libcoap_cleanup(void)
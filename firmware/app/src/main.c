@@ -1,14 +1,13 @@
 #include <zephyr/logging/log.h>
+#include <zephyr/random/random.h>
 #include <stdio.h>
-#include <cJSON.h>
 
 #include "modem.h"
 #include "network_events.h"
 #include "sensor.h"
 #include "coap_backend.h"
 #include "sensor_reader.h"
-
-#define JSON_BUF_SIZE 1024
+#include "snapshot_encoder.h"
 
 LOG_MODULE_REGISTER(nrf_sensor_gateway, LOG_LEVEL_DBG);
 
@@ -16,72 +15,51 @@ K_EVENT_DEFINE(network_events);
 
 static const coap_backend_t *coap = &coap_backend_libcoap;
 
-static int snapshot_to_json(const sensor_snapshot_t *snapshot, char *buf,
-                            size_t buf_len)
+/* How long to wait after the server refused a snapshot: its hint, capped,
+   plus up to a quarter more so that devices refused together spread out */
+static uint32_t retry_delay_s(int hint_s)
 {
-  int ret = -ENOMEM;
-
-  cJSON *root = cJSON_CreateObject();
-  if (!root) {
-    return -ENOMEM;
-  }
+  uint32_t delay = MIN((uint32_t)hint_s, CONFIG_COAP_RETRY_MAX_S);
 
-  cJSON_AddNumberToObject(root, "ts", (double)snapshot->timestamp_ms);
-
-  cJSON *readings = cJSON_AddArrayToObject(root, "readings");
-  if (!readings) {
-    goto cleanup;
-  }
+  return delay + sys_rand32_get() % (delay / 4 + 1);
+}
 
-  for (size_t i = 0; i < snapshot->count; i++) {
-    const sensor_reading_t *r = &snapshot->readings[i];
+/* An overloaded server answers with when to send again: the snapshot is
+   kept and sent then, the next ones wait in the queue meanwhile */
+static void send_snapshot(const uint8_t *payload, size_t len)
+{
+  int err;
 
-    cJSON *entry = cJSON_CreateObject();
-    if (!entry) {
-      goto cleanup;
+  for (;;) {
+    err = coap->send(payload, len);
+    if (err) {
+      LOG_ERR("CoAP send failed (%d) — dropping snapshot", err);
+      return;
     }
 
-    cJSON_AddStringToObject(entry, "n", r->name);
-    cJSON_AddNumberToObject(entry, "t", r->type);
-
-    switch (r->type) {
-    case SENSOR_TYPE_FLOAT:
-      cJSON_AddNumberToObject(entry, "v", (double)r->value.f);
-      break;
-    case SENSOR_TYPE_INT:
-      cJSON_AddNumberToObject(entry, "v", r->value.i);
-      break;
-    case SENSOR_TYPE_STRING:
-      cJSON_AddStringToObject(entry, "v", r->value.s);
-      break;
-    case SENSOR_TYPE_BOOL:
-      cJSON_AddBoolToObject(entry, "v", r->value.b);
+    err = coap->recv();
+    if (err <= 0) {
       break;
-    default:
-      cJSON_Delete(entry);
-      ret = -EINVAL;
-      goto cleanup;
     }
 
-    cJSON_AddItemToArray(readings, entry);
-  }
+    uint32_t delay = retry_delay_s(err);
 
-  if (!cJSON_PrintPreallocated(root, buf, (int)buf_len, false)) {
-    goto cleanup;
+    LOG_WRN("Server overloaded — sending again in %u s", delay);
+    k_sleep(K_SECONDS(delay));
   }
 
-  ret = (int)strlen(buf);
-
-cleanup:
-  cJSON_Delete(root);
-  return ret;
+  if (err == -ETIMEDOUT) {
+    LOG_WRN("CoAP ACK timeout — snapshot may be lost");
+  } else if (err) {
+    LOG_ERR("CoAP recv error (%d)", err);
+  }
 }
 
 int main(void)
 {
   int               err;
   sensor_snapshot_t snapshot;
-  char              json_buf[JSON_BUF_SIZE];
+  uint8_t           payload[SNAPSHOT_BUF_SIZE];
 
   /* Connect to lte-m (blocking function) */
   err = modem_configure();
@@ -100,27 +78,20 @@ int main(void)
 
   while (1) {
     k_msgq_get(&sensor_msgq, &snapshot, K_FOREVER);
-    int len = snapshot_to_json(&snapshot, json_buf, sizeof(json_buf));
+    int len = snapshot_encode(&snapshot, payload, sizeof(payload));
     if (len < 0) {
-      LOG_ERR("JSON encoding failed (%d) — dropping snapshot", len);
+      LOG_ERR("Snapshot encoding failed (%d) — dropping snapshot", len);
       continue;
     }
 
     LOG_DBG("Sending snapshot: %zu readings, %d bytes", snapshot.count, len);
-    LOG_DBG("%s", json_buf);
-
-    err = coap->send((const uint8_t *)json_buf, (size_t)len);
-    if (err) {
-      LOG_ERR("CoAP send failed (%d) — dropping snapshot", err);
-      continue;
+    if (IS_ENABLED(CONFIG_SNAPSHOT_ENCODING_JSON)) {
+      LOG_DBG("%.*s", len, (const char *)payload);
+    } else {
+      LOG_HEXDUMP_DBG(payload, len, "Payload");
     }
 
-    err = coap->recv();
-    if (err == -ETIMEDOUT) {
-      LOG_WRN("CoAP ACK timeout — snapshot may be lost");
-    } else if (err) {
-      LOG_ERR("CoAP recv error (%d)", err);
-    }
+    send_snapshot(payload, (size_t)len);
   }
 
   return 0;
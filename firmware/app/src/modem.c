@@ -1,7 +1,11 @@
 #include <modem/lte_lc.h>
 #include <modem/nrf_modem_lib.h>
+#include <nrf_modem_at.h>
+#include <string.h>
 #include <zephyr/logging/log.h>
 
+#include "modem.h"
+
 LOG_MODULE_REGISTER(modem, LOG_LEVEL_DBG);
 
 static K_SEM_DEFINE(lte_connected_sem, 0, 1);
@@ -52,3 +56,28 @@ int modem_configure(void)
 	LOG_INF("Connected to LTE network");
 	return 0;
 }
+
+/**
+ * @brief Read the IMEI of the modem
+ *
+ * Must be called after modem_configure() has initialized the modem library.
+ *
+ * @param buf Output buffer, NUL-terminated on success
+ * @param len Size of buf (16 bytes hold an IMEI)
+ *
+ * @return 0 on success, a negative error code otherwise
+ */
+int modem_get_imei(char *buf, size_t len)
+{
+	int err;
+
+	/* the response is the IMEI followed by "\r\nOK\r\n" */
+	err = nrf_modem_at_cmd(buf, len, "AT+CGSN");
+	if (err) {
+		LOG_ERR("AT+CGSN failed: %d", err);
+		return err < 0 ? err : -EIO;
+	}
+
+	buf[strcspn(buf, "\r\n")] = '\0';
+	return 0;
+}
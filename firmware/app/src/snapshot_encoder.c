@@ -0,0 +1,204 @@
+#include <zephyr/kernel.h>
+#include <errno.h>
+#include <string.h>
+
+#if defined(CONFIG_SNAPSHOT_ENCODING_JSON)
+#include <cJSON.h>
+#else
+#include <zcbor_encode.h>
+#endif
+
+#include "snapshot_encoder.h"
+
+#if defined(CONFIG_SNAPSHOT_ENCODING_JSON)
+
+/*
+ * {"ts": <ms>, "readings": [{"n": <name>, "t": <type>, "v": <value>}, ...]}
+ */
+int snapshot_encode(const sensor_snapshot_t *snapshot, uint8_t *buf,
+                    size_t buf_len)
+{
+  int ret = -ENOMEM;
+
+  cJSON *root = cJSON_CreateObject();
+  if (!root) {
+    return -ENOMEM;
+  }
+
+  cJSON_AddNumberToObject(root, "ts", (double)snapshot->timestamp_ms);
+
+  cJSON *readings = cJSON_AddArrayToObject(root, "readings");
+  if (!readings) {
+    goto cleanup;
+  }
+
+  for (size_t i = 0; i < snapshot->count; i++) {
+    const sensor_reading_t *r = &snapshot->readings[i];
+
+    cJSON *entry = cJSON_CreateObject();
+    if (!entry) {
+      goto cleanup;
+    }
+
+    cJSON_AddStringToObject(entry, "n", r->name);
+    cJSON_AddNumberToObject(entry, "t", r->type);
+
+    switch (r->type) {
+    case SENSOR_TYPE_FLOAT:
+      cJSON_AddNumberToObject(entry, "v", (double)r->value.f);
+      break;
+    case SENSOR_TYPE_INT:
+      cJSON_AddNumberToObject(entry, "v", r->value.i);
+      break;
+    case SENSOR_TYPE_STRING:
+      cJSON_AddStringToObject(entry, "v", r->value.s);
+      break;
+    case SENSOR_TYPE_BOOL:
+      cJSON_AddBoolToObject(entry, "v", r->value.b);
+      break;
+    default:
+      cJSON_Delete(entry);
+      ret = -EINVAL;
+      goto cleanup;
+    }
+
+    cJSON_AddItemToArray(readings, entry);
+  }
+
+  if (!cJSON_PrintPreallocated(root, (char *)buf, (int)buf_len, false)) {
+    goto cleanup;
+  }
+
+  ret = (int)strlen((char *)buf);
+
+cleanup:
+  cJSON_Delete(root);
+  return ret;
+}
+
+#else /* CBOR encodings */
+
+/* Floats go out as float32, the precision the sensors have; integers,
+   string lengths and container sizes take their shortest form */
+static bool encode_value(zcbor_state_t *state, const sensor_reading_t *r)
+{
+  switch (r->type) {
+  case SENSOR_TYPE_FLOAT:
+    return zcbor_float32_put(state, r->value.f);
+  case SENSOR_TYPE_INT:
+    return zcbor_int32_put(state, r->value.i);
+  case SENSOR_TYPE_STRING:
+    return zcbor_tstr_encode_ptr(state, r->value.s,
+                                 strnlen(r->value.s, sizeof(r->value.s)));
+  case SENSOR_TYPE_BOOL:
+    return zcbor_bool_put(state, r->value.b);
+  default:
+    return false;
+  }
+}
+
+static bool encode_name(zcbor_state_t *state, const sensor_reading_t *r)
+{
+  return zcbor_tstr_encode_ptr(state, r->name,
+                               strnlen(r->name, sizeof(r->name)));
+}
+
+#if defined(CONFIG_SNAPSHOT_ENCODING_CBOR)
+
+/*
+ * The JSON document, as CBOR: same keys, binary numbers
+ */
+static bool encode_snapshot(zcbor_state_t *state,
+                            const sensor_snapshot_t *snapshot)
+{
+  bool ok;
+
+  ok = zcbor_map_start_encode(state, 2) && zcbor_tstr_put_lit(state, "ts") &&
+       zcbor_int64_put(state, snapshot->timestamp_ms) &&
+       zcbor_tstr_put_lit(state, "readings") &&
+       zcbor_list_start_encode(state, snapshot->count);
+
+  for (size_t i = 0; ok && i < snapshot->count; i++) {
+    const sensor_reading_t *r = &snapshot->readings[i];
+
+    ok = zcbor_map_start_encode(state, 3) && zcbor_tstr_put_lit(state, "n") &&
+         encode_name(state, r) && zcbor_tstr_put_lit(state, "t") &&
+         zcbor_uint32_put(state, r->type) && zcbor_tstr_put_lit(state, "v") &&
+         encode_value(state, r) && zcbor_map_end_encode(state, 3);
+  }
+
+  return ok && zcbor_list_end_encode(state, snapshot->count) &&
+         zcbor_map_end_encode(state, 2);
+}
+
+#else /* CONFIG_SNAPSHOT_ENCODING_SENML_CBOR */
+
+/* SenML labels (RFC 8428) */
+#define SENML_BASE_TIME -3
+#define SENML_NAME      0
+#define SENML_VALUE     2
+#define SENML_STRING    3
+#define SENML_BOOL      4
+
+/*
+ * A SenML pack, one record per reading: [{bt, n, v}, {n, v}, ...]
+ * The value label carries the type (v for numbers, vs, vb); integers and
+ * floats stay apart through their CBOR encoding.
+ */
+static bool encode_snapshot(zcbor_state_t *state,
+                            const sensor_snapshot_t *snapshot)
+{
+  static const int32_t value_label[] = {
+    [SENSOR_TYPE_FLOAT]  = SENML_VALUE,
+    [SENSOR_TYPE_INT]    = SENML_VALUE,
+    [SENSOR_TYPE_STRING] = SENML_STRING,
+    [SENSOR_TYPE_BOOL]   = SENML_BOOL,
+  };
+  bool ok;
+
+  ok = zcbor_list_start_encode(state, snapshot->count);
+
+  for (size_t i = 0; ok && i < snapshot->count; i++) {
+    const sensor_reading_t *r = &snapshot->readings[i];
+    size_t                  fields = i == 0 ? 3 : 2;
+
+    if (r->type > SENSOR_TYPE_BOOL) {
+      return false;
+    }
+
+    ok = zcbor_map_start_encode(state, fields);
+
+    /* base time on the first record, in seconds: integral when possible */
+    if (ok && i == 0) {
+      ok = zcbor_int32_put(state, SENML_BASE_TIME) &&
+           (snapshot->timestamp_ms % 1000 == 0
+              ? zcbor_int64_put(state, snapshot->timestamp_ms / 1000)
+              : zcbor_float64_put(state,
+                                  (double)snapshot->timestamp_ms / 1000.0));
+    }
+
+    ok = ok && zcbor_int32_put(state, SENML_NAME) && encode_name(state, r) &&
+         zcbor_int32_put(state, value_label[r->type]) &&
+         encode_value(state, r) && zcbor_map_end_encode(state, fields);
+  }
+
+  return ok && zcbor_list_end_encode(state, snapshot->count);
+}
+
+#endif
+
+int snapshot_encode(const sensor_snapshot_t *snapshot, uint8_t *buf,
+                    size_t buf_len)
+{
+  /* one backup per nesting level: pack/readings, record */
+  ZCBOR_STATE_E(state, 3, buf, buf_len, 1);
+
+  if (!encode_snapshot(state, snapshot)) {
+    return zcbor_peek_error(state) == ZCBOR_ERR_NO_PAYLOAD ? -ENOMEM
+                                                          : -EINVAL;
+  }
+
+  return (int)(state->payload - buf);
+}
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "snapshot_parser.h"
+
+#define BENCH_PATH_MAX 256
+#define BENCH_READINGS 16 /* readings of a full board snapshot */
+
+/* Every suite runs each of its cases for a fixed number of iterations,
+   multiplied by this scale factor (-s on the command line) */
+extern double g_bench_scale;
+
+/* False when the C library does not let bench_alloc.c count allocations */
+extern const bool g_bench_alloc_counted;
+
+typedef struct {
+  uint64_t ns;
+  uint64_t allocs;
+} bench_mark_t;
+
+uint64_t bench_now_ns(void);
+uint64_t bench_iterations(uint64_t base);
+uint64_t bench_alloc_count(void);
+void     bench_mark(bench_mark_t *mark);
+void     bench_report(const char *suite, const char *name, uint64_t iterations,
+                      const bench_mark_t *start, double bytes_per_op,
+                      size_t rows_per_op);
+
+int  bench_tmpfile(char *path, size_t len);
+void bench_tmpfile_remove(const char *path);
+
+/* Inputs shared by the suites: a full board snapshot, its JSON encoding and
+   IMEI-like device names */
+void   bench_snapshot_board(parsed_snapshot_t *s);
+size_t bench_payload_json(const parsed_snapshot_t *s, const uint8_t **out);
+void   bench_device_name(char *buf, size_t len, size_t index);
+
+int bench_parser_run(void);
+int bench_registry_run(void);
+int bench_storage_run(void);
+int bench_pipeline_run(void);
+int bench_dedup_run(void);
+
+#endif /* BENCH_H */
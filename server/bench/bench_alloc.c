@@ -0,0 +1,56 @@
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "bench.h"
+
+/* Heap allocation counter. glibc lets a program replace malloc() and
+   friends and still reach its own allocator through the __libc_ entry
+   points, which also catches the allocations made inside SQLite. Elsewhere
+   the allocs_per_op column is left empty. */
+
+static _Atomic uint64_t g_allocs;
+
+#ifdef __GLIBC__
+
+const bool g_bench_alloc_counted = true;
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void  __libc_free(void *ptr);
+
+void *malloc(size_t size)
+{
+  atomic_fetch_add_explicit(&g_allocs, 1, memory_order_relaxed);
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+  atomic_fetch_add_explicit(&g_allocs, 1, memory_order_relaxed);
+  return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+  atomic_fetch_add_explicit(&g_allocs, 1, memory_order_relaxed);
+  return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+  __libc_free(ptr);
+}
+
+#else
+
+const bool g_bench_alloc_counted = false;
+
+#endif
+
+uint64_t bench_alloc_count(void)
+{
+  return atomic_load_explicit(&g_allocs, memory_order_relaxed);
+}
@@ -0,0 +1,97 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "bench.h"
+#include "dedup.h"
+
+/* Devices each sending a full board snapshot a minute, for DEDUP_MINUTES,
+   into a table of the default size */
+#define DEDUP_DEVICES 500000
+#define DEDUP_MINUTES 8
+#define DEDUP_MIN_NS  (60ull * 1000000000)
+#define DEVICE_ID_LEN 32
+
+static uint64_t fingerprint(const char *device, uint64_t minute,
+                            const uint8_t *payload, size_t len)
+{
+  uint64_t h = dedup_hash(0, device, strlen(device));
+
+  /* the snapshot timestamp, which the payload would carry */
+  h = dedup_hash(h, &minute, sizeof(minute));
+  return dedup_hash(h, payload, len);
+}
+
+/* Looks every snapshot of a past minute up again, as a retransmission
+   would, and returns how many were recognised */
+static uint64_t dedup_replay(uint64_t devices, uint64_t minute,
+                             uint64_t now_ns, const uint8_t *payload,
+                             size_t len)
+{
+  uint64_t found = 0;
+  char     device[DEVICE_ID_LEN];
+
+  for (uint64_t d = 0; d < devices; d++) {
+    bench_device_name(device, sizeof(device), d % DEDUP_DEVICES);
+    found += dedup_seen(fingerprint(device, minute, payload, len), now_ns);
+  }
+  return found;
+}
+
+/**
+ * @brief Dedup table: look up and add fresh snapshots, look retransmissions
+ *        up, and report how far back duplicates are still recognised
+ *
+ * @return 0 on success, -1 on error
+ */
+int bench_dedup_run(void)
+{
+  parsed_snapshot_t snap    = {0};
+  const uint8_t    *payload;
+  size_t            len;
+  uint64_t          devices = bench_iterations(DEDUP_DEVICES);
+  uint64_t          now_ns  = DEDUP_MIN_NS;
+  uint64_t          found   = 0;
+  bench_mark_t      start;
+  char              device[DEVICE_ID_LEN];
+
+  bench_snapshot_board(&snap);
+  len = bench_payload_json(&snap, &payload);
+  if (len == 0 || dedup_init(DEDUP_MEM_LIMIT_DEFAULT,
+                             DEDUP_WINDOW_S_DEFAULT) != 0) {
+    return -1;
+  }
+
+  /* what the handler does with a new snapshot: hash it, miss, add it */
+  bench_mark(&start);
+  for (uint64_t m = 0; m < DEDUP_MINUTES; m++, now_ns += DEDUP_MIN_NS) {
+    for (uint64_t d = 0; d < devices; d++) {
+      uint64_t fp;
+
+      bench_device_name(device, sizeof(device), d % DEDUP_DEVICES);
+      fp = fingerprint(device, m, payload, len);
+      found += dedup_seen(fp, now_ns);
+      dedup_add(fp, now_ns);
+    }
+  }
+  bench_report("dedup", "miss-add", devices * DEDUP_MINUTES, &start,
+               (double)len, 0);
+  fprintf(stderr, "dedup: %llu new snapshots taken for duplicates\n",
+          (unsigned long long)found);
+
+  /* retransmissions of the last minute's snapshots */
+  bench_mark(&start);
+  dedup_replay(devices, DEDUP_MINUTES - 1, now_ns, payload, len);
+  bench_report("dedup", "hit", devices, &start, (double)len, 0);
+
+  /* the table keeps the most recent snapshots it has room for */
+  for (uint64_t age = 1; age <= DEDUP_MINUTES; age++) {
+    found = dedup_replay(devices, DEDUP_MINUTES - age, now_ns, payload, len);
+    fprintf(stderr, "dedup: %llu devices, %llu min old snapshots: %.2f%% "
+                    "recognised\n",
+            (unsigned long long)devices, (unsigned long long)age,
+            100.0 * (double)found / (double)devices);
+  }
+
+  dedup_close();
+  return 0;
+}
@@ -0,0 +1,181 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+typedef struct {
+  const char *name;
+  int (*run)(void);
+} bench_suite_t;
+
+static const bench_suite_t g_suites[] = {
+  {"parser", bench_parser_run},
+  {"registry", bench_registry_run},
+  {"storage", bench_storage_run},
+  {"pipeline", bench_pipeline_run},
+  {"dedup", bench_dedup_run},
+};
+
+#define SUITE_COUNT (sizeof(g_suites) / sizeof(g_suites[0]))
+
+double g_bench_scale = 1.0;
+
+/* Results only: everything the server code prints on stdout goes to stderr
+   so the CSV stays parseable */
+static FILE *g_out;
+
+uint64_t bench_now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+uint64_t bench_iterations(uint64_t base)
+{
+  uint64_t n = (uint64_t)((double)base * g_bench_scale);
+
+  return n > 0 ? n : 1;
+}
+
+void bench_mark(bench_mark_t *mark)
+{
+  mark->allocs = bench_alloc_count();
+  mark->ns     = bench_now_ns();
+}
+
+/**
+ * @brief Print one result line (CSV, see the header printed by main)
+ *
+ * @param suite        Suite name
+ * @param name         Case name
+ * @param iterations   Operations run since start
+ * @param start        Taken with bench_mark() before the first operation
+ * @param bytes_per_op Input bytes per operation (stored bytes per reading
+ *                     for the storage formats), 0 if not meaningful
+ * @param rows_per_op  Readings per operation, 0 if not meaningful
+ */
+void bench_report(const char *suite, const char *name, uint64_t iterations,
+                  const bench_mark_t *start, double bytes_per_op,
+                  size_t rows_per_op)
+{
+  uint64_t elapsed_ns = bench_now_ns() - start->ns;
+  uint64_t allocs     = bench_alloc_count() - start->allocs;
+  double   ns_per_op  = (double)elapsed_ns / (double)iterations;
+  double   mb_per_s   = 0;
+  char     allocs_per_op[32] = "";
+
+  if (bytes_per_op > 0) {
+    mb_per_s = bytes_per_op * 1e3 / ns_per_op;
+  }
+  if (g_bench_alloc_counted) {
+    snprintf(allocs_per_op, sizeof(allocs_per_op), "%.2f",
+             (double)allocs / (double)iterations);
+  }
+
+  fprintf(g_out, "%s,%s,%llu,%.1f,%.0f,%s,%.6g,%.1f,%.0f\n", suite, name,
+          (unsigned long long)iterations, ns_per_op, 1e9 / ns_per_op,
+          allocs_per_op, bytes_per_op, mb_per_s,
+          (double)rows_per_op * 1e9 / ns_per_op);
+  fflush(g_out);
+}
+
+/**
+ * @brief Create an empty file for a benchmark database
+ *
+ * @param path Filled with the file path
+ * @param len  Size of path
+ *
+ * @return 0 on success, -1 on error
+ */
+int bench_tmpfile(char *path, size_t len)
+{
+  const char *dir = getenv("TMPDIR");
+  int         fd;
+
+  snprintf(path, len, "%s/coap-bench-XXXXXX", dir ? dir : "/tmp");
+  fd = mkstemp(path);
+  if (fd < 0) {
+    fprintf(stderr, "cannot create a temporary file in %s\n",
+            dir ? dir : "/tmp");
+    return -1;
+  }
+  close(fd);
+  return 0;
+}
+
+/**
+ * @brief Remove a benchmark database along with its journal files and its
+ *        spool directory, once empty
+ */
+void bench_tmpfile_remove(const char *path)
+{
+  static const char *const suffixes[] = {"", "-journal", "-wal", "-shm"};
+  char                     name[BENCH_PATH_MAX + 16];
+
+  for (size_t i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++) {
+    snprintf(name, sizeof(name), "%s%s", path, suffixes[i]);
+    unlink(name);
+  }
+  snprintf(name, sizeof(name), "%s-spool", path);
+  rmdir(name);
+}
+
+static void usage(const char *prog)
+{
+  fprintf(stderr, "Usage: %s [-s <scale>] [suite...]\n  suites:", prog);
+  for (size_t i = 0; i < SUITE_COUNT; i++) {
+    fprintf(stderr, " %s", g_suites[i].name);
+  }
+  fprintf(stderr, "\n");
+}
+
+int main(int argc, char **argv)
+{
+  int opt;
+  int ret = 0;
+
+  while ((opt = getopt(argc, argv, "s:")) != -1) {
+    switch (opt) {
+    case 's':
+      g_bench_scale = strtod(optarg, NULL);
+      if (g_bench_scale <= 0) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  g_out = fdopen(dup(STDOUT_FILENO), "w");
+  if (!g_out || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+    perror("stdout");
+    return 1;
+  }
+
+  fprintf(g_out, "suite,case,iterations,ns_per_op,ops_per_s,allocs_per_op,"
+                 "bytes,mb_per_s,rows_per_s\n");
+
+  for (size_t i = 0; i < SUITE_COUNT; i++) {
+    bool selected = optind == argc;
+
+    for (int a = optind; a < argc; a++) {
+      if (strcmp(argv[a], g_suites[i].name) == 0) {
+        selected = true;
+      }
+    }
+    if (selected && g_suites[i].run() != 0) {
+      fprintf(stderr, "suite '%s' failed\n", g_suites[i].name);
+      ret = 1;
+    }
+  }
+  return ret;
+}
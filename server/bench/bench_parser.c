@@ -0,0 +1,462 @@
+#include <math.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "snapshot_parser.h"
+#ifdef BENCH_WITH_CJSON
+#include "snapshot_parser_cjson.h"
+#endif
+
+#define PAYLOAD_MAX_LEN 8192
+
+/* Uptime in ms, like the firmware's k_uptime_get() timestamps */
+#define BENCH_TIMESTAMP_MS 123456789
+
+typedef enum {
+  FORMAT_JSON,
+  FORMAT_CBOR,
+  FORMAT_SENML,
+} payload_format_t;
+
+typedef struct {
+  const char      *name;
+  payload_format_t format;
+  int (*parse)(const uint8_t *, size_t, parsed_snapshot_t *);
+} parser_impl_t;
+
+static int parse_json(const uint8_t *buf, size_t len, parsed_snapshot_t *out)
+{
+  return parse_snapshot_json((const char *)buf, len, out);
+}
+
+#ifdef BENCH_WITH_CJSON
+static int parse_cjson(const uint8_t *buf, size_t len, parsed_snapshot_t *out)
+{
+  return parse_snapshot_cjson((const char *)buf, len, out);
+}
+#endif
+
+static const parser_impl_t g_impls[] = {
+  {"json", FORMAT_JSON, parse_json},
+#ifdef BENCH_WITH_CJSON
+  {"json-cjson", FORMAT_JSON, parse_cjson},
+#endif
+  {"cbor", FORMAT_CBOR, parse_snapshot_cbor},
+  {"senml-cbor", FORMAT_SENML, parse_snapshot_senml},
+};
+
+static uint8_t g_payload[PAYLOAD_MAX_LEN];
+
+/*
+ * Encoders producing what the firmware puts on the wire
+ */
+
+typedef struct {
+  uint8_t *buf;
+  size_t   len;
+} out_t;
+
+static void put_raw(out_t *o, const void *data, size_t len)
+{
+  if (o->len + len <= PAYLOAD_MAX_LEN) {
+    memcpy(o->buf + o->len, data, len);
+  }
+  o->len += len;
+}
+
+static void put_fmt(out_t *o, const char *fmt, ...)
+  __attribute__((format(printf, 2, 3)));
+
+static void put_fmt(out_t *o, const char *fmt, ...)
+{
+  char    tmp[128];
+  va_list args;
+  int     n;
+
+  va_start(args, fmt);
+  n = vsnprintf(tmp, sizeof(tmp), fmt, args);
+  va_end(args);
+  put_raw(o, tmp, (size_t)n);
+}
+
+/* Numbers as cJSON prints them */
+static void put_json_number(out_t *o, double d)
+{
+  char buf[32];
+
+  if (d == (double)(int)d) {
+    put_fmt(o, "%d", (int)d);
+    return;
+  }
+  snprintf(buf, sizeof(buf), "%1.15g", d);
+  if (strtod(buf, NULL) != d) {
+    snprintf(buf, sizeof(buf), "%1.17g", d);
+  }
+  put_raw(o, buf, strlen(buf));
+}
+
+static void encode_json(out_t *o, const parsed_snapshot_t *s)
+{
+  put_fmt(o, "{\"ts\":");
+  put_json_number(o, (double)s->timestamp_ms);
+  put_fmt(o, ",\"readings\":[");
+  for (size_t i = 0; i < s->count; i++) {
+    const parsed_reading_t *r = &s->readings[i];
+
+    put_fmt(o, "%s{\"n\":\"%s\",\"t\":%d,\"v\":", i ? "," : "", r->name,
+            r->type);
+    switch (r->type) {
+    case SENSOR_TYPE_FLOAT:
+      put_json_number(o, (double)r->value.f);
+      break;
+    case SENSOR_TYPE_INT:
+      put_json_number(o, r->value.i);
+      break;
+    case SENSOR_TYPE_STRING:
+      put_fmt(o, "\"%s\"", r->value.s);
+      break;
+    default:
+      put_fmt(o, "%s", r->value.b ? "true" : "false");
+      break;
+    }
+    put_fmt(o, "}");
+  }
+  put_fmt(o, "]}");
+}
+
+static void cbor_head(out_t *o, unsigned major, uint64_t arg)
+{
+  uint8_t b[9];
+  size_t  n;
+
+  if (arg < 24) {
+    b[0] = (uint8_t)(major << 5 | arg);
+    n    = 1;
+  } else if (arg <= UINT8_MAX) {
+    b[0] = (uint8_t)(major << 5 | 24);
+    n    = 2;
+  } else if (arg <= UINT16_MAX) {
+    b[0] = (uint8_t)(major << 5 | 25);
+    n    = 3;
+  } else if (arg <= UINT32_MAX) {
+    b[0] = (uint8_t)(major << 5 | 26);
+    n    = 5;
+  } else {
+    b[0] = (uint8_t)(major << 5 | 27);
+    n    = 9;
+  }
+  for (size_t i = 1; i < n; i++) {
+    b[i] = (uint8_t)(arg >> (8 * (n - 1 - i)));
+  }
+  put_raw(o, b, n);
+}
+
+static void cbor_int(out_t *o, int64_t v)
+{
+  if (v < 0) {
+    cbor_head(o, 1, (uint64_t)(-1 - v));
+  } else {
+    cbor_head(o, 0, (uint64_t)v);
+  }
+}
+
+static void cbor_text(out_t *o, const char *s)
+{
+  cbor_head(o, 3, strlen(s));
+  put_raw(o, s, strlen(s));
+}
+
+static void cbor_float32(out_t *o, float f)
+{
+  uint32_t bits;
+  uint8_t  b[5];
+
+  memcpy(&bits, &f, sizeof(bits));
+  b[0] = 0xfa;
+  for (int i = 0; i < 4; i++) {
+    b[1 + i] = (uint8_t)(bits >> (24 - 8 * i));
+  }
+  put_raw(o, b, sizeof(b));
+}
+
+static void cbor_float64(out_t *o, double d)
+{
+  uint64_t bits;
+  uint8_t  b[9];
+
+  memcpy(&bits, &d, sizeof(bits));
+  b[0] = 0xfb;
+  for (int i = 0; i < 8; i++) {
+    b[1 + i] = (uint8_t)(bits >> (56 - 8 * i));
+  }
+  put_raw(o, b, sizeof(b));
+}
+
+static void cbor_bool(out_t *o, bool b)
+{
+  uint8_t v = b ? 0xf5 : 0xf4;
+
+  put_raw(o, &v, 1);
+}
+
+static void cbor_reading_value(out_t *o, const parsed_reading_t *r)
+{
+  switch (r->type) {
+  case SENSOR_TYPE_FLOAT:
+    cbor_float32(o, r->value.f);
+    break;
+  case SENSOR_TYPE_INT:
+    cbor_int(o, r->value.i);
+    break;
+  case SENSOR_TYPE_STRING:
+    cbor_text(o, r->value.s);
+    break;
+  default:
+    cbor_bool(o, r->value.b);
+    break;
+  }
+}
+
+static void encode_cbor(out_t *o, const parsed_snapshot_t *s)
+{
+  cbor_head(o, 5, 2);
+  cbor_text(o, "ts");
+  cbor_int(o, s->timestamp_ms);
+  cbor_text(o, "readings");
+  cbor_head(o, 4, s->count);
+  for (size_t i = 0; i < s->count; i++) {
+    cbor_head(o, 5, 3);
+    cbor_text(o, "n");
+    cbor_text(o, s->readings[i].name);
+    cbor_text(o, "t");
+    cbor_int(o, s->readings[i].type);
+    cbor_text(o, "v");
+    cbor_reading_value(o, &s->readings[i]);
+  }
+}
+
+static void encode_senml(out_t *o, const parsed_snapshot_t *s)
+{
+  static const int value_label[] = {2, 2, 3, 4};
+
+  cbor_head(o, 4, s->count);
+  for (size_t i = 0; i < s->count; i++) {
+    const parsed_reading_t *r = &s->readings[i];
+
+    cbor_head(o, 5, i == 0 ? 3 : 2);
+    if (i == 0) {
+      cbor_int(o, -3);
+      if (s->timestamp_ms % 1000 == 0) {
+        cbor_int(o, s->timestamp_ms / 1000);
+      } else {
+        cbor_float64(o, (double)s->timestamp_ms / 1000.0);
+      }
+    }
+    cbor_int(o, 0);
+    cbor_text(o, r->name);
+    cbor_int(o, value_label[r->type]);
+    cbor_reading_value(o, r);
+  }
+}
+
+static size_t encode(payload_format_t format, const parsed_snapshot_t *s)
+{
+  out_t o = {g_payload, 0};
+
+  switch (format) {
+  case FORMAT_JSON:
+    encode_json(&o, s);
+    break;
+  case FORMAT_CBOR:
+    encode_cbor(&o, s);
+    break;
+  case FORMAT_SENML:
+    encode_senml(&o, s);
+    break;
+  }
+  return o.len <= PAYLOAD_MAX_LEN ? o.len : 0;
+}
+
+/**
+ * @brief Encode a snapshot the way the firmware JSON encoder does
+ *
+ * @param s   Snapshot to encode
+ * @param out Set to the payload, valid until the next call
+ *
+ * @return Payload length, 0 if it does not fit
+ */
+size_t bench_payload_json(const parsed_snapshot_t *s, const uint8_t **out)
+{
+  *out = g_payload;
+  return encode(FORMAT_JSON, s);
+}
+
+/*
+ * Snapshots
+ */
+
+static void add_reading(parsed_snapshot_t *s, const char *name,
+                        sensor_type_t type)
+{
+  parsed_reading_t *r = &s->readings[s->count++];
+
+  snprintf(r->name, sizeof(r->name), "%s", name);
+  r->type = type;
+}
+
+/* What the firmware sends today: a single temperature channel */
+static void snapshot_single(parsed_snapshot_t *s)
+{
+  add_reading(s, "temperature", SENSOR_TYPE_FLOAT);
+  s->readings[0].value.f = 21.37f;
+}
+
+/**
+ * @brief A full board: BENCH_READINGS channels of every type
+ *
+ * @param s Snapshot to add the readings to
+ */
+void bench_snapshot_board(parsed_snapshot_t *s)
+{
+  static const char *names[] = {"temperature", "humidity", "pressure",
+                                "battery_mv",  "rssi",     "door_open"};
+  char               name[SENSOR_NAME_MAX_LEN];
+
+  for (int i = 0; i < BENCH_READINGS; i++) {
+    parsed_reading_t *r;
+
+    snprintf(name, sizeof(name), "%s_%d", names[i % 6], i);
+    add_reading(s, name, (sensor_type_t)(i % 4));
+    r = &s->readings[i];
+
+    switch (r->type) {
+    case SENSOR_TYPE_FLOAT:
+      r->value.f = 20.0f + (float)i * 1.37f;
+      break;
+    case SENSOR_TYPE_INT:
+      r->value.i = 3300 - i * 17;
+      break;
+    case SENSOR_TYPE_STRING:
+      snprintf(r->value.s, sizeof(r->value.s), "state-%d", i);
+      break;
+    default:
+      r->value.b = i & 4;
+      break;
+    }
+  }
+}
+
+/* Everything that makes JSON parsing slow while staying valid:
+   pretty-printed, unknown keys with nested values before the useful ones,
+   escaped names at the length limit, exponent floats and long escaped
+   strings. JSON only: the binary formats have no equivalent. */
+static size_t payload_worst_case(void)
+{
+  char  *buf = (char *)g_payload;
+  size_t len;
+
+  len = (size_t)snprintf(
+    buf, PAYLOAD_MAX_LEN,
+    "{\n  \"fw\": {\"version\": [1, 2, 3], \"build\": \"2024-06-10T12:00:00Z\","
+    " \"flags\": [true, false, null, {\"x\": [[], {}]}]},\n"
+    "  \"readings\": [\n");
+  for (int i = 0; i < BENCH_READINGS; i++) {
+    len += (size_t)snprintf(
+      buf + len, PAYLOAD_MAX_LEN - len,
+      "%s    {\n      \"meta\": {\"unit\": \"\\u00b0C\", \"cal\": "
+      "[1.0e-3, -2.5E+2, 3.14159265358979]},\n"
+      "      \"n\": \"\\u0063hannel-with-a-very-long-name-\\u00e9\\u00e8"
+      "\\ud83d\\ude00-%02d-padding\",\n"
+      "      \"t\": %d,\n"
+      "      \"v\": %s\n    }",
+      i ? ",\n" : "", i, i % 2 ? 2 : 0,
+      i % 2 ? "\"line one\\nline two\\ttab \\\"quoted\\\" \\\\ "
+              "\\/slash \\u2603 snowman padding padding padding\""
+            : "-1.2345678901234567e-7");
+  }
+  len += (size_t)snprintf(buf + len, PAYLOAD_MAX_LEN - len,
+                          "\n  ],\n  \"ts\": 1718000000123\n}\n");
+  return len;
+}
+
+typedef struct {
+  const char *name;
+  void (*build)(parsed_snapshot_t *);
+  uint64_t iterations;
+} snapshot_case_t;
+
+static const snapshot_case_t g_cases[] = {
+  {"single", snapshot_single, 2000000},
+  {"realistic-16", bench_snapshot_board, 200000},
+};
+
+static int run_one(const char *case_name, const parser_impl_t *impl,
+                   size_t len, uint64_t iters, const parsed_snapshot_t *want)
+{
+  parsed_snapshot_t snap;
+  char              name[64];
+
+  if (impl->parse(g_payload, len, &snap) != 0 || snap.count == 0) {
+    fprintf(stderr, "parser/%s: %s rejected the payload\n", case_name,
+            impl->name);
+    return -1;
+  }
+
+  /* every format has to decode to the same snapshot */
+  if (want && (snap.count != want->count ||
+               snap.timestamp_ms != want->timestamp_ms ||
+               memcmp(snap.readings, want->readings,
+                      want->count * sizeof(want->readings[0])) != 0)) {
+    fprintf(stderr, "parser/%s: %s decoded a different snapshot\n",
+            case_name, impl->name);
+    return -1;
+  }
+
+  /* warm-up */
+  for (uint64_t n = 0; n < iters / 10; n++) {
+    impl->parse(g_payload, len, &snap);
+  }
+
+  bench_mark_t start;
+  bench_mark(&start);
+  for (uint64_t n = 0; n < iters; n++) {
+    impl->parse(g_payload, len, &snap);
+  }
+
+  snprintf(name, sizeof(name), "%s/%s", case_name, impl->name);
+  bench_report("parser", name, iters, &start, len, snap.count);
+  return 0;
+}
+
+int bench_parser_run(void)
+{
+  for (size_t c = 0; c < sizeof(g_cases) / sizeof(g_cases[0]); c++) {
+    parsed_snapshot_t want = {0};
+    uint64_t          iters = bench_iterations(g_cases[c].iterations);
+
+    want.timestamp_ms = BENCH_TIMESTAMP_MS;
+    g_cases[c].build(&want);
+
+    for (size_t i = 0; i < sizeof(g_impls) / sizeof(g_impls[0]); i++) {
+      size_t len = encode(g_impls[i].format, &want);
+
+      if (len == 0 ||
+          run_one(g_cases[c].name, &g_impls[i], len, iters, &want) != 0) {
+        return -1;
+      }
+    }
+  }
+
+  for (size_t i = 0; i < sizeof(g_impls) / sizeof(g_impls[0]); i++) {
+    if (g_impls[i].format == FORMAT_JSON &&
+        run_one("worst-case-16", &g_impls[i], payload_worst_case(),
+                bench_iterations(50000), NULL) != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
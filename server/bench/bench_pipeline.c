@@ -0,0 +1,352 @@
+#include <dirent.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "db.h"
+#include "sensor.h"
+#include "snapshot_store.h"
+#include "spool.h"
+
+/* Devices taking turns, as many as the loadgen default */
+#define PIPELINE_DEVICES 100
+
+/* Commit latency: snapshots queued at a steady rate, the way the workers
+   would at PIPELINE_RATE snapshots a second, each waiting for its ack */
+#define PIPELINE_RATE      1000
+#define PIPELINE_LATENCIES 5000
+
+/* Restart after a crash: snapshots left in the spool by as many workers,
+   replayed while the workers queue as many new ones */
+#define PIPELINE_REPLAY_WORKERS 4
+#define PIPELINE_REPLAYED       20000
+
+static const struct {
+  const char      *name;
+  db_commit_mode_t commit_mode;
+  uint64_t         snapshots;
+  bool             spool;
+} g_cases[] = {
+  {"json-16/batch", DB_COMMIT_BATCH, 50000, false},
+  {"json-16/snapshot", DB_COMMIT_SNAPSHOT, 20000, false},
+  {"json-16/batch+spool", DB_COMMIT_BATCH, 50000, true},
+};
+
+/* Wait until the writer thread has handed every reading to SQLite, then
+   stop it, which commits the last transaction */
+static int pipeline_drain(uint64_t rows)
+{
+  db_writer_stats_t stats;
+
+  do {
+    sched_yield();
+    db_writer_get_stats(&stats);
+  } while (stats.readings_written + stats.readings_failed < rows);
+
+  db_writer_stop();
+  return stats.readings_failed == 0 ? 0 : -1;
+}
+
+/* What handle_snapshot_post() does once it has the payload: parse it, update
+   the registry, queue the readings; plus the writer thread committing them */
+static int run_case(size_t c)
+{
+  db_config_t       cfg     = DB_CONFIG_DEFAULT;
+  parsed_snapshot_t snap    = {0};
+  uint64_t          iters   = bench_iterations(g_cases[c].snapshots);
+  uint64_t          full    = 0; /* retries on a full storage queue */
+  unsigned int      workers = 1;
+  const uint8_t    *payload;
+  size_t            len;
+  size_t            rows;
+  bench_mark_t      start;
+  char              path[BENCH_PATH_MAX];
+  char              spool[BENCH_PATH_MAX + 8];
+  char              device[32];
+  char              name[64];
+
+  cfg.durability  = DB_DURABILITY_FAST;
+  cfg.commit_mode = g_cases[c].commit_mode;
+
+  bench_snapshot_board(&snap);
+  rows = snap.count;
+  len  = bench_payload_json(&snap, &payload);
+  if (len == 0) {
+    return -1;
+  }
+
+  if (bench_tmpfile(path, sizeof(path)) != 0) {
+    return -1;
+  }
+  sensor_reg_init(SENSOR_REG_MEM_LIMIT_DEFAULT);
+  if (db_init(path, &cfg) != 0 || db_writer_start(1) != 0) {
+    goto error;
+  }
+  snprintf(spool, sizeof(spool), "%s-spool", path);
+  if (g_cases[c].spool &&
+      spool_open(spool, workers, snapshot_replay, &workers) != 0) {
+    goto error;
+  }
+
+  bench_mark(&start);
+  for (uint64_t k = 0; k < iters; k++) {
+    if (parse_snapshot_json((const char *)payload, len, &snap) != 0) {
+      goto error;
+    }
+    bench_device_name(device, sizeof(device), k % PIPELINE_DEVICES);
+    while (snapshot_store(0, device, &snap, false, NULL) != 0) {
+      full++;
+      sched_yield();
+    }
+  }
+  if (pipeline_drain(iters * rows) != 0) {
+    goto error;
+  }
+  spool_close();
+
+  snprintf(name, sizeof(name), "%s", g_cases[c].name);
+  bench_report("pipeline", name, iters, &start, len, rows);
+  if (full > 0) {
+    fprintf(stderr, "pipeline/%s: storage queue full %llu times\n",
+            g_cases[c].name, (unsigned long long)full);
+  }
+
+  db_close();
+  sensor_reg_close(sensor_reg_get());
+  bench_tmpfile_remove(path);
+  return 0;
+
+error:
+  fprintf(stderr, "pipeline/%s: failed\n", g_cases[c].name);
+  db_writer_stop();
+  spool_close();
+  db_close();
+  sensor_reg_close(sensor_reg_get());
+  bench_tmpfile_remove(path);
+  return -1;
+}
+
+/* Segment files a spool left behind */
+static int spool_leftovers(const char *dir)
+{
+  struct dirent *e;
+  DIR           *d = opendir(dir);
+  int            n = 0;
+
+  if (!d) {
+    return -1;
+  }
+  while ((e = readdir(d))) {
+    n += e->d_name[0] != '.';
+  }
+  closedir(d);
+  return n;
+}
+
+/* spool_open() after a crash of a run with several workers: each stream is
+   replayed while the workers already queue new snapshots, which must not
+   let the spool delete a segment before its snapshots are committed. The
+   spool is left empty once everything is. */
+static int run_replay(void)
+{
+  db_config_t       cfg     = DB_CONFIG_DEFAULT;
+  parsed_snapshot_t snap    = {0};
+  uint64_t          iters   = bench_iterations(PIPELINE_REPLAYED);
+  unsigned int      workers = PIPELINE_REPLAY_WORKERS;
+  db_spool_pos_t    pos;
+  bench_mark_t      start;
+  size_t            rows;
+  int               left;
+  char              path[BENCH_PATH_MAX];
+  char              spool[BENCH_PATH_MAX + 8];
+  char              device[32];
+
+  cfg.durability  = DB_DURABILITY_FAST;
+  cfg.commit_mode = DB_COMMIT_BATCH;
+
+  bench_snapshot_board(&snap);
+  rows = snap.count;
+  if (bench_tmpfile(path, sizeof(path)) != 0) {
+    return -1;
+  }
+  snprintf(spool, sizeof(spool), "%s-spool", path);
+
+  /* the run that crashed: appended, never queued */
+  sensor_reg_init(SENSOR_REG_MEM_LIMIT_DEFAULT);
+  if (db_init(path, &cfg) != 0 || db_writer_start(workers) != 0 ||
+      spool_open(spool, workers, snapshot_replay, &workers) != 0) {
+    goto error;
+  }
+  for (uint64_t k = 0; k < iters; k++) {
+    bench_device_name(device, sizeof(device), k % PIPELINE_DEVICES);
+    if (spool_append(k % workers, device, &snap, &pos) != 0) {
+      goto error;
+    }
+  }
+  spool_close();
+  db_writer_stop();
+  db_close();
+  sensor_reg_close(sensor_reg_get());
+
+  sensor_reg_init(SENSOR_REG_MEM_LIMIT_DEFAULT);
+  if (db_init(path, &cfg) != 0 || db_writer_start(workers) != 0) {
+    goto error;
+  }
+  bench_mark(&start);
+  if (spool_open(spool, workers, snapshot_replay, &workers) != 0) {
+    goto error;
+  }
+  for (uint64_t k = 0; k < iters; k++) {
+    bench_device_name(device, sizeof(device), k % PIPELINE_DEVICES);
+    while (snapshot_store(k % workers, device, &snap, false, NULL) != 0) {
+      sched_yield();
+    }
+  }
+  if (pipeline_drain(2 * iters * rows) != 0) {
+    goto error;
+  }
+  spool_close();
+
+  bench_report("pipeline", "json-16/replay-4", 2 * iters, &start, 0, rows);
+  left = spool_leftovers(spool);
+  if (left != 0) {
+    fprintf(stderr, "pipeline/replay: %d spool segments left\n", left);
+    goto error;
+  }
+
+  db_close();
+  sensor_reg_close(sensor_reg_get());
+  bench_tmpfile_remove(path);
+  return 0;
+
+error:
+  fprintf(stderr, "pipeline/replay: failed\n");
+  db_writer_stop();
+  spool_close();
+  db_close();
+  sensor_reg_close(sensor_reg_get());
+  bench_tmpfile_remove(path);
+  return -1;
+}
+
+static int latency_cmp(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+
+  return (x > y) - (x < y);
+}
+
+static void latency_print(const char *what, uint64_t *ns, size_t n)
+{
+  qsort(ns, n, sizeof(*ns), latency_cmp);
+  fprintf(stderr, "pipeline/latency: %-22s p50 %8.3f ms  p99 %8.3f ms\n",
+          what, (double)ns[n / 2] / 1e6, (double)ns[n * 99 / 100] / 1e6);
+}
+
+/* How long a worker would hold a snapshot's response back: until
+   snapshot_store() returns, as piggybacked responses do, or until the
+   writer acks its commit, as separate responses do */
+static int run_latency(void)
+{
+  db_config_t       cfg    = DB_CONFIG_DEFAULT;
+  parsed_snapshot_t snap   = {0};
+  uint64_t          n      = bench_iterations(PIPELINE_LATENCIES);
+  uint64_t          acked  = 0;
+  uint64_t          period = 1000000000ull / PIPELINE_RATE;
+  uint64_t         *queued = calloc(n, sizeof(*queued));
+  uint64_t         *stored = calloc(n, sizeof(*stored));
+  uint64_t         *commit = calloc(n, sizeof(*commit));
+  uint64_t          next;
+  int               status[64];
+  char              path[BENCH_PATH_MAX];
+  char              device[32];
+
+  cfg.durability  = DB_DURABILITY_FAST;
+  cfg.commit_mode = DB_COMMIT_BATCH;
+
+  bench_snapshot_board(&snap);
+  if (!queued || !stored || !commit ||
+      bench_tmpfile(path, sizeof(path)) != 0) {
+    free(queued);
+    free(stored);
+    free(commit);
+    return -1;
+  }
+  sensor_reg_init(SENSOR_REG_MEM_LIMIT_DEFAULT);
+  if (db_init(path, &cfg) != 0 || db_writer_start(1) != 0) {
+    goto error;
+  }
+
+  next = bench_now_ns();
+  for (uint64_t k = 0; k < n || acked < n;) {
+    uint64_t now = bench_now_ns();
+    size_t   got;
+
+    if (k < n && now >= next) {
+      bench_device_name(device, sizeof(device), k % PIPELINE_DEVICES);
+      queued[k] = now;
+      while (snapshot_store(0, device, &snap, true, NULL) != 0) {
+        sched_yield();
+      }
+      stored[k] = bench_now_ns() - now;
+      k++;
+      next += period;
+    }
+    got = db_acks_pop(0, status, 64);
+    now = bench_now_ns();
+    for (size_t i = 0; i < got; i++, acked++) {
+      if (status[i] != 0) {
+        goto error;
+      }
+      commit[acked] = now - queued[acked];
+    }
+    if (got == 0 && k == n) {
+      sched_yield();
+    }
+  }
+  db_writer_stop();
+
+  latency_print("queued (piggybacked)", stored, n);
+  latency_print("committed (separate)", commit, n);
+
+  db_close();
+  sensor_reg_close(sensor_reg_get());
+  bench_tmpfile_remove(path);
+  free(queued);
+  free(stored);
+  free(commit);
+  return 0;
+
+error:
+  fprintf(stderr, "pipeline/latency: failed\n");
+  db_writer_stop();
+  db_close();
+  sensor_reg_close(sensor_reg_get());
+  bench_tmpfile_remove(path);
+  free(queued);
+  free(stored);
+  free(commit);
+  return -1;
+}
+
+/**
+ * @brief Handler path: JSON payload bytes to committed rows, without
+ *        sockets, and how long a response waits for each
+ *
+ * @return 0 on success, -1 on error
+ */
+int bench_pipeline_run(void)
+{
+  for (size_t c = 0; c < sizeof(g_cases) / sizeof(g_cases[0]); c++) {
+    if (run_case(c) != 0) {
+      return -1;
+    }
+  }
+  if (run_replay() != 0) {
+    return -1;
+  }
+  return run_latency();
+}
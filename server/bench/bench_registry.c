@@ -0,0 +1,178 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "sensor.h"
+
+/* Channels are spread over devices of CHANNELS_PER_DEVICE channels each,
+   named like the firmware names them: IMEI device ids, short channel names */
+#define CHANNELS_PER_DEVICE 5
+#define DEVICE_ID_LEN       32
+
+/* Devices sending full board snapshots in the update case */
+#define UPDATE_DEVICES 1000
+
+static const char *const g_names[CHANNELS_PER_DEVICE] = {
+  "temperature", "humidity", "pressure", "battery_mv", "rssi"};
+
+static const struct {
+  const char *name;
+  size_t      channels;
+  uint64_t    lookups;
+} g_cases[] = {
+  {"10", 10, 20000000},
+  {"10k", 10000, 10000000},
+  {"1M", 1000000, 5000000},
+};
+
+static char (*g_devices)[DEVICE_ID_LEN];
+
+/**
+ * @brief Name of the index-th simulated device, an IMEI-like string
+ */
+void bench_device_name(char *buf, size_t len, size_t index)
+{
+  snprintf(buf, len, "35265610%07zu", index);
+}
+
+/* xorshift32: lookups in a random order, so the 1M case measures cache
+   misses and not the prefetcher */
+static uint32_t next_index(uint32_t *state, size_t n)
+{
+  uint32_t x = *state;
+
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  *state = x;
+  return (uint32_t)(x % n);
+}
+
+static int run_case(size_t c)
+{
+  sensor_registry_t *reg;
+  size_t             n       = g_cases[c].channels;
+  size_t             devices = (n + CHANNELS_PER_DEVICE - 1) /
+                               CHANNELS_PER_DEVICE;
+  uint64_t           iters   = bench_iterations(g_cases[c].lookups);
+  uint32_t           state   = 2463534242u;
+  bench_mark_t       start;
+  char               name[64];
+
+  g_devices = malloc(devices * sizeof(*g_devices));
+  if (!g_devices) {
+    return -1;
+  }
+  for (size_t d = 0; d < devices; d++) {
+    bench_device_name(g_devices[d], DEVICE_ID_LEN, d);
+  }
+
+  reg = sensor_reg_init(SENSOR_REG_MEM_LIMIT_DEFAULT);
+
+  bench_mark(&start);
+  for (size_t i = 0; i < n; i++) {
+    if (!sensor_channel_register(reg, g_devices[i / CHANNELS_PER_DEVICE],
+                                 g_names[i % CHANNELS_PER_DEVICE],
+                                 SENSOR_TYPE_FLOAT)) {
+      fprintf(stderr, "registry/%s: insert %zu failed\n", g_cases[c].name, i);
+      goto error;
+    }
+  }
+  snprintf(name, sizeof(name), "insert-%s", g_cases[c].name);
+  bench_report("registry", name, n, &start, 0, 1);
+
+  fprintf(stderr, "registry/%s: %zu channels in %zu bytes (%.1f B/channel)\n",
+          g_cases[c].name, reg->count, reg->mem_used,
+          (double)reg->mem_used / (double)reg->count);
+
+  bench_mark(&start);
+  for (uint64_t k = 0; k < iters; k++) {
+    size_t i = next_index(&state, n);
+
+    sensor_reg_channel_t *ch =
+      sensor_channel_register(reg, g_devices[i / CHANNELS_PER_DEVICE],
+                              g_names[i % CHANNELS_PER_DEVICE],
+                              SENSOR_TYPE_FLOAT);
+    if (!ch || reg->count != n) {
+      fprintf(stderr, "registry/%s: lookup %zu failed\n", g_cases[c].name, i);
+      goto error;
+    }
+  }
+  snprintf(name, sizeof(name), "lookup-%s", g_cases[c].name);
+  bench_report("registry", name, iters, &start, 0, 1);
+
+  sensor_reg_close(reg);
+  free(g_devices);
+  return 0;
+
+error:
+  sensor_reg_close(reg);
+  free(g_devices);
+  return -1;
+}
+
+/* What the snapshot handler does with the registry: register then update
+   every reading of a full board snapshot, devices taking turns */
+static int run_update(void)
+{
+  sensor_registry_t *reg;
+  parsed_snapshot_t  snap  = {0};
+  uint64_t           iters = bench_iterations(1000000);
+  bench_mark_t       start;
+  char               device[DEVICE_ID_LEN];
+
+  bench_snapshot_board(&snap);
+  reg = sensor_reg_init(SENSOR_REG_MEM_LIMIT_DEFAULT);
+
+  bench_mark(&start);
+  for (uint64_t k = 0; k < iters; k++) {
+    bench_device_name(device, sizeof(device), k % UPDATE_DEVICES);
+
+    for (size_t i = 0; i < snap.count; i++) {
+      parsed_reading_t     *r = &snap.readings[i];
+      sensor_reg_channel_t *ch =
+        sensor_channel_register(reg, device, r->name, r->type);
+
+      if (!ch) {
+        fprintf(stderr, "registry/update: register failed\n");
+        sensor_reg_close(reg);
+        return -1;
+      }
+      switch (r->type) {
+      case SENSOR_TYPE_FLOAT:
+        sensor_channel_update_float(ch, r->value.f + (float)k);
+        break;
+      case SENSOR_TYPE_INT:
+        sensor_channel_update_int(ch, r->value.i + (int)k);
+        break;
+      case SENSOR_TYPE_STRING:
+        sensor_channel_update_string(ch, r->value.s);
+        break;
+      default:
+        sensor_channel_update_bool(ch, k & 1);
+        break;
+      }
+    }
+  }
+  bench_report("registry", "update-16", iters, &start, 0, snap.count);
+
+  sensor_reg_close(reg);
+  return 0;
+}
+
+/**
+ * @brief Channel registry: build it up to 10, 10k and 1M channels, then
+ *        look channels up in a random order; update full snapshots
+ *
+ * @return 0 on success, -1 on error
+ */
+int bench_registry_run(void)
+{
+  for (size_t c = 0; c < sizeof(g_cases) / sizeof(g_cases[0]); c++) {
+    if (run_case(c) != 0) {
+      return -1;
+    }
+  }
+  return run_update();
+}
@@ -0,0 +1,321 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <sqlite3.h>
+
+#include "bench.h"
+#include "db.h"
+#include "query.h"
+
+/* Rows go to STORAGE_DEVICES devices, a full board snapshot at a time */
+#define STORAGE_DEVICES 100
+
+static const struct {
+  const char      *name;
+  db_durability_t  durability;
+  db_commit_mode_t commit_mode;
+  uint64_t         partition_ms;
+  uint64_t         rows;
+} g_cases[] = {
+  {"fast/batch", DB_DURABILITY_FAST, DB_COMMIT_BATCH, 0, 500000},
+  {"fast/batch-hourly", DB_DURABILITY_FAST, DB_COMMIT_BATCH,
+   DB_ROLLUP_HOUR_MS, 500000},
+  {"fast/snapshot", DB_DURABILITY_FAST, DB_COMMIT_SNAPSHOT, 0, 200000},
+  {"safe/snapshot", DB_DURABILITY_SAFE, DB_COMMIT_SNAPSHOT, 0, 50000},
+  {"default/autocommit", DB_DURABILITY_DEFAULT, DB_COMMIT_AUTOCOMMIT, 0,
+   2000},
+};
+
+/* db_insert_reading() as the writer thread calls it, without the queue */
+static int run_case(size_t c)
+{
+  db_config_t       cfg   = DB_CONFIG_DEFAULT;
+  parsed_snapshot_t snap  = {0};
+  uint64_t          iters = bench_iterations(g_cases[c].rows);
+  uint64_t          rows  = 0;
+  bench_mark_t      start;
+  char              path[BENCH_PATH_MAX];
+  char              device[32];
+  char              name[64];
+
+  cfg.durability   = g_cases[c].durability;
+  cfg.commit_mode  = g_cases[c].commit_mode;
+  cfg.partition_ms = g_cases[c].partition_ms;
+  bench_snapshot_board(&snap);
+
+  if (bench_tmpfile(path, sizeof(path)) != 0) {
+    return -1;
+  }
+  if (db_init(path, &cfg) != 0) {
+    goto error;
+  }
+
+  bench_mark(&start);
+  for (size_t d = 0; rows < iters; d = (d + 1) % STORAGE_DEVICES) {
+    int device_id;
+
+    bench_device_name(device, sizeof(device), d);
+    if (db_snapshot_begin() != 0) {
+      goto error;
+    }
+    device_id = db_device_get_or_create(device);
+    if (device_id <= 0) {
+      goto error;
+    }
+    for (size_t i = 0; i < snap.count && rows < iters; i++, rows++) {
+      if (db_insert_reading(device_id, &snap.readings[i],
+                            (int64_t)rows) != 0) {
+        goto error;
+      }
+    }
+    if (db_snapshot_end() != 0) {
+      goto error;
+    }
+  }
+  if (db_flush() != 0) {
+    goto error;
+  }
+
+  snprintf(name, sizeof(name), "insert/%s", g_cases[c].name);
+  bench_report("storage", name, rows, &start, 0, 1);
+
+  db_close();
+  bench_tmpfile_remove(path);
+  return 0;
+
+error:
+  fprintf(stderr, "storage/%s: insert failed\n", g_cases[c].name);
+  db_close();
+  bench_tmpfile_remove(path);
+  return -1;
+}
+
+/* Storage formats: one device reporting FORMAT_CHANNELS channels every 5 s,
+   give or take 50 ms, with values moving like real sensors' */
+#define FORMAT_CHANNELS 8
+#define FORMAT_SAMPLES  20000 /* per channel */
+#define FORMAT_SCANS    20    /* full scans of every channel */
+#define FORMAT_BLOCK    1024  /* bytes, the largest Block2 block */
+
+static const sensor_type_t g_format_types[FORMAT_CHANNELS] = {
+  SENSOR_TYPE_FLOAT, SENSOR_TYPE_FLOAT, SENSOR_TYPE_FLOAT, SENSOR_TYPE_FLOAT,
+  SENSOR_TYPE_INT,   SENSOR_TYPE_INT,   SENSOR_TYPE_BOOL,  SENSOR_TYPE_BOOL,
+};
+
+static uint32_t format_rand(uint32_t *state)
+{
+  uint32_t x = *state;
+
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  *state = x;
+  return x;
+}
+
+/* Next value of every channel: floats walk by hundredths, ints count up,
+   bools flip now and then */
+static void format_step(sensor_channel_t *chs, uint32_t *state)
+{
+  for (size_t i = 0; i < FORMAT_CHANNELS; i++) {
+    uint32_t r = format_rand(state);
+
+    switch (chs[i].type) {
+    case SENSOR_TYPE_FLOAT:
+      chs[i].value.f = (float)((double)(int)(chs[i].value.f * 100.0f + 0.5f +
+                                             (float)(r % 21) - 10.0f) /
+                               100.0);
+      break;
+    case SENSOR_TYPE_INT:
+      chs[i].value.i += (int)(r % 4);
+      break;
+    default:
+      chs[i].value.b ^= r % 20 == 0;
+      break;
+    }
+  }
+}
+
+/* Bytes of the tables and indexes holding readings, once compacted */
+static double format_bytes(const char *path)
+{
+  sqlite3      *db   = NULL;
+  sqlite3_stmt *stmt = NULL;
+  double        size = 0;
+
+  if (sqlite3_open(path, &db) != SQLITE_OK ||
+      sqlite3_exec(db, "VACUUM;", NULL, NULL, NULL) != SQLITE_OK ||
+      sqlite3_prepare_v2(db,
+                         "SELECT sum(pgsize) FROM dbstat"
+                         " WHERE name IN ('readings',"
+                         " 'idx_readings_channel_time', 'chunks',"
+                         " 'idx_chunks_channel_time');",
+                         -1, &stmt, NULL) != SQLITE_OK) {
+    fprintf(stderr, "storage: cannot measure %s: %s\n", path,
+            sqlite3_errmsg(db));
+  } else if (sqlite3_step(stmt) == SQLITE_ROW) {
+    size = sqlite3_column_double(stmt, 0);
+  }
+  sqlite3_finalize(stmt);
+  sqlite3_close(db);
+  return size;
+}
+
+/* Scans every channel in full through the query cursors, as GET
+   /sensor/query does: a block at a time, the longest one telling how long
+   a query can hold up the worker that serves it */
+static int format_scan(const char *storage, uint64_t rows, double bytes)
+{
+  query_params_t  params = {.from = INT64_MIN, .to = INT64_MAX,
+                            .limit = QUERY_LIMIT_MAX};
+  query_cursor_t *cur;
+  uint64_t        scans = bench_iterations(FORMAT_SCANS);
+  uint64_t        bytes_out = 0;
+  uint64_t        blocks    = 0;
+  uint64_t        block_ns  = 0;
+  uint64_t        slowest   = 0;
+  bench_mark_t    start;
+  char            buf[FORMAT_BLOCK];
+  char            name[64];
+  bool            done;
+
+  snprintf(params.device, sizeof(params.device), "bench-format");
+  bench_mark(&start);
+  for (uint64_t n = 0; n < scans; n++) {
+    for (size_t i = 0; i < FORMAT_CHANNELS; i++) {
+      uint64_t began = bench_now_ns();
+
+      snprintf(params.channel, sizeof(params.channel), "ch%zu", i);
+      if (query_open(&params, &cur) != 0) {
+        return -1;
+      }
+      do {
+        ssize_t  len = query_read(cur, buf, sizeof(buf), &done);
+        uint64_t now = bench_now_ns();
+
+        if (len < 0) {
+          query_close(cur);
+          return -1;
+        }
+        bytes_out += (uint64_t)len;
+        blocks++;
+        block_ns += now - began;
+        if (now - began > slowest) {
+          slowest = now - began;
+        }
+        began = now;
+      } while (!done);
+      query_close(cur);
+    }
+  }
+  if (bytes_out < rows * scans * 4) { /* "[t,v]" at the very least */
+    fprintf(stderr, "storage: scan returned %llu bytes\n",
+            (unsigned long long)bytes_out);
+    return -1;
+  }
+
+  snprintf(name, sizeof(name), "scan/%s", storage);
+  bench_report("storage", name, rows * scans, &start, bytes, 1);
+  fprintf(stderr, "storage/%s: %.3f ms per block, %.3f ms at most\n", name,
+          (double)block_ns / (double)blocks / 1e6, (double)slowest / 1e6);
+  return 0;
+}
+
+/* Inserts the same series with each storage and layout, then reports the
+   bytes stored per reading and how fast range queries read them back */
+static int run_format(db_storage_t storage, db_layout_t layout,
+                      const char *storage_name)
+{
+  db_config_t      cfg     = DB_CONFIG_DEFAULT;
+  sensor_channel_t chs[FORMAT_CHANNELS];
+  uint64_t         samples = bench_iterations(FORMAT_SAMPLES);
+  uint64_t         rows    = samples * FORMAT_CHANNELS;
+  uint32_t         state   = 2463534242u;
+  int64_t          ts      = 1700000000000;
+  bench_mark_t     start;
+  double           bytes;
+  char             path[BENCH_PATH_MAX];
+  char             name[64];
+  int              device_id;
+
+  cfg.durability  = DB_DURABILITY_FAST;
+  cfg.commit_mode = DB_COMMIT_BATCH;
+  cfg.storage     = storage;
+  cfg.layout      = layout;
+  memset(chs, 0, sizeof(chs));
+  for (size_t i = 0; i < FORMAT_CHANNELS; i++) {
+    snprintf(chs[i].name, sizeof(chs[i].name), "ch%zu", i);
+    chs[i].type      = g_format_types[i];
+    chs[i].has_value = true;
+    if (chs[i].type == SENSOR_TYPE_FLOAT) {
+      chs[i].value.f = 20.0f + (float)i;
+    }
+  }
+
+  if (bench_tmpfile(path, sizeof(path)) != 0) {
+    return -1;
+  }
+  if (db_init(path, &cfg) != 0 || db_snapshot_begin() != 0 ||
+      (device_id = db_device_get_or_create("bench-format")) <= 0 ||
+      db_snapshot_end() != 0) {
+    goto error;
+  }
+
+  bench_mark(&start);
+  for (uint64_t n = 0; n < samples; n++) {
+    format_step(chs, &state);
+    ts += 4950 + format_rand(&state) % 101;
+    if (db_snapshot_begin() != 0) {
+      goto error;
+    }
+    for (size_t i = 0; i < FORMAT_CHANNELS; i++) {
+      if (db_insert_reading(device_id, &chs[i], ts) != 0) {
+        goto error;
+      }
+    }
+    if (db_snapshot_end() != 0 || db_tick() != 0) {
+      goto error;
+    }
+  }
+  db_close(); /* chunk storage seals the last full chunks */
+  snprintf(name, sizeof(name), "insert/%s", storage_name);
+  bench_report("storage", name, rows, &start, 0, 1);
+
+  bytes = format_bytes(path) / (double)rows;
+  if (query_pool_init(path, 1) != 0 || !query_pool_enabled() ||
+      format_scan(storage_name, rows, bytes) != 0) {
+    query_pool_close();
+    goto error;
+  }
+  query_pool_close();
+  bench_tmpfile_remove(path);
+  return 0;
+
+error:
+  fprintf(stderr, "storage/%s: failed\n", storage_name);
+  db_close();
+  bench_tmpfile_remove(path);
+  return -1;
+}
+
+/**
+ * @brief Storage: insert readings into a temporary database with each
+ *        durability profile and commit mode, then compare the storage
+ *        formats
+ *
+ * @return 0 on success, -1 on error
+ */
+int bench_storage_run(void)
+{
+  for (size_t c = 0; c < sizeof(g_cases) / sizeof(g_cases[0]); c++) {
+    if (run_case(c) != 0) {
+      return -1;
+    }
+  }
+  if (run_format(DB_STORAGE_ROWS, DB_LAYOUT_WIDE, "rows") != 0 ||
+      run_format(DB_STORAGE_ROWS, DB_LAYOUT_COMPACT, "compact") != 0 ||
+      run_format(DB_STORAGE_CHUNKS, DB_LAYOUT_WIDE, "chunks") != 0) {
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,10 @@
+#ifndef SNAPSHOT_PARSER_CJSON_H
+#define SNAPSHOT_PARSER_CJSON_H
+
+#include <stddef.h>
+
+#include "snapshot_parser.h"
+
+int parse_snapshot_cjson(const char *buf, size_t len, parsed_snapshot_t *out);
+
+#endif /* SNAPSHOT_PARSER_CJSON_H */
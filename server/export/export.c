@@ -0,0 +1,673 @@
+/*
+ * Bulk export of readings
+ *
+ * Streams the readings of a set of channels over a time range out of the
+ * server's database, as CSV or as a column-oriented binary file, while the
+ * server keeps ingesting. Rows are read through the query module on one
+ * read-only connection held in a single read transaction: in WAL mode the
+ * export sees one snapshot of the database and never blocks the writer.
+ * Each channel is one range scan of idx_readings_channel_time (or of the
+ * partitions, the compact table or the chunks, whatever the storage), and
+ * the output goes through a buffer of EXPORT_BUFFER_BYTES written with
+ * large write()s: memory use does not depend on the number of rows.
+ *
+ * Binary layout, in host byte order, every array aligned on 8 bytes so the
+ * file can be mmap()ed and its columns used in place:
+ *
+ *   header    char magic[8] "RDGCOL01", uint32 channels, uint32 reserved,
+ *             uint64 rows, uint64 blocks (both 0 unless written with -o)
+ *   channels  per channel: uint32 id, uint32 type (sensor_type_t),
+ *             uint16 device length, uint16 channel length, then both names,
+ *             not terminated; the table is padded to 8 bytes
+ *   blocks    uint32 rows, uint32 reserved, int64 ts[rows],
+ *             double value[rows], uint32 channel[rows] (index in the
+ *             table), padded to 8 bytes; a block of 0 rows ends the file
+ *
+ * Ints and bools are stored as doubles, exact up to 2^53, and a NULL value
+ * as NaN. String channels have no place in a numeric column: they are left
+ * out of binary exports.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <math.h>
+#include <sqlite3.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "query.h"
+#include "sensor.h"
+
+#define EXPORT_BUFFER_BYTES (1u << 20)
+#define EXPORT_BLOCK_ROWS   65536 /* rows per block of a binary export */
+#define EXPORT_ROW_MAX      64    /* timestamp and numeric value of a row */
+
+/* "<device>,<channel>," with both quoted */
+#define EXPORT_PREFIX_MAX                                                      \
+  (2 * (SENSOR_DEVICE_MAX_LEN + SENSOR_NAME_MAX_LEN) + 8)
+
+static const char g_magic[8] = {'R', 'D', 'G', 'C', 'O', 'L', '0', '1'};
+
+typedef enum {
+  EXPORT_CSV = 0,
+  EXPORT_COLUMNS,
+} export_format_t;
+
+typedef struct {
+  int64_t       id;
+  sensor_type_t type;
+  char          device[SENSOR_DEVICE_MAX_LEN];
+  char          name[SENSOR_NAME_MAX_LEN];
+} export_channel_t;
+
+typedef struct {
+  int      fd;
+  uint8_t *buf; /* EXPORT_BUFFER_BYTES */
+  size_t   len;
+  uint64_t bytes; /* written so far */
+} export_out_t;
+
+/* One block of a binary export, filled one row at a time */
+typedef struct {
+  uint32_t  rows;
+  int64_t  *ts;
+  double   *value;
+  uint32_t *channel;
+} export_block_t;
+
+typedef struct {
+  const char     *db_path;
+  const char     *out_path; /* NULL for stdout */
+  export_format_t format;
+  const char    **devices;
+  size_t          device_count;
+  const char    **channels;
+  size_t          channel_count;
+  int64_t         from;
+  int64_t         to;
+} export_config_t;
+
+static export_config_t   g_cfg = {
+  .from = INT64_MIN,
+  .to   = INT64_MAX,
+};
+static export_channel_t *g_channels      = NULL;
+static size_t            g_channel_count = 0;
+static size_t            g_channel_cap   = 0;
+
+/* Channels of the devices and with the names asked for, or every one */
+static const char *const g_sql_channels =
+  "SELECT c.id, c.type, d.name, c.name"
+  "  FROM devices d"
+  "  JOIN channels c ON c.device_id = d.id"
+  " WHERE (?1 IS NULL OR d.name = ?1) AND (?2 IS NULL OR c.name = ?2)"
+  " ORDER BY d.name, c.name;";
+
+static double export_now_s(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static int export_flush(export_out_t *out)
+{
+  size_t off = 0;
+
+  while (off < out->len) {
+    ssize_t n = write(out->fd, out->buf + off, out->len - off);
+
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      LOG_ERROR("export: write failed: %s", strerror(errno));
+      return -1;
+    }
+    off += (size_t)n;
+  }
+  out->bytes += out->len;
+  out->len = 0;
+  return 0;
+}
+
+static int export_write(export_out_t *out, const void *data, size_t len)
+{
+  const uint8_t *p = data;
+
+  while (len > 0) {
+    size_t take = EXPORT_BUFFER_BYTES - out->len;
+
+    if (take == 0) {
+      if (export_flush(out) != 0) {
+        return -1;
+      }
+      continue;
+    }
+    if (take > len) {
+      take = len;
+    }
+    memcpy(out->buf + out->len, p, take);
+    out->len += take;
+    p += take;
+    len -= take;
+  }
+  return 0;
+}
+
+static int export_pad(export_out_t *out)
+{
+  static const uint8_t zeros[8] = {0};
+  size_t               at       = (size_t)(out->bytes + out->len);
+
+  return export_write(out, zeros, (8 - at % 8) % 8);
+}
+
+/* Appends s as a CSV field, quoted if it has to be */
+static size_t export_put_field(char *buf, size_t size, const char *s)
+{
+  size_t n = 0;
+
+  if (!strpbrk(s, ",\"\r\n")) {
+    return (size_t)snprintf(buf, size, "%s", s);
+  }
+  buf[n++] = '"';
+  for (; *s && n + 3 < size; s++) {
+    if (*s == '"') {
+      buf[n++] = '"';
+    }
+    buf[n++] = *s;
+  }
+  buf[n++] = '"';
+  buf[n]   = '\0';
+  return n;
+}
+
+/* Adds the channels matching one device and one channel name, either
+   possibly NULL. A channel is unique per device and name, so distinct
+   pairs never list the same one twice. */
+static int export_list(sqlite3_stmt *stmt, const char *device,
+                       const char *name)
+{
+  int rc;
+
+  if (sqlite3_bind_text(stmt, 1, device, -1, SQLITE_STATIC) != SQLITE_OK ||
+      sqlite3_bind_text(stmt, 2, name, -1, SQLITE_STATIC) != SQLITE_OK) {
+    return -1;
+  }
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    export_channel_t *ch;
+
+    if (g_channel_count == g_channel_cap) {
+      size_t cap = g_channel_cap ? g_channel_cap * 2 : 64;
+
+      ch = realloc(g_channels, cap * sizeof(*ch));
+      if (!ch) {
+        rc = SQLITE_NOMEM;
+        break;
+      }
+      g_channels    = ch;
+      g_channel_cap = cap;
+    }
+    ch       = &g_channels[g_channel_count++];
+    ch->id   = sqlite3_column_int64(stmt, 0);
+    ch->type = sqlite3_column_int(stmt, 1);
+    snprintf(ch->device, sizeof(ch->device), "%s",
+             (const char *)sqlite3_column_text(stmt, 2));
+    snprintf(ch->name, sizeof(ch->name), "%s",
+             (const char *)sqlite3_column_text(stmt, 3));
+  }
+  sqlite3_reset(stmt);
+  return rc == SQLITE_DONE ? 0 : -1;
+}
+
+static int export_name_cmp(const void *a, const void *b)
+{
+  return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+/* Sorts names and drops the repeated ones, returns how many are left */
+static size_t export_unique(const char **names, size_t count)
+{
+  size_t kept = 0;
+
+  qsort(names, count, sizeof(*names), export_name_cmp);
+  for (size_t i = 0; i < count; i++) {
+    if (kept == 0 || strcmp(names[i], names[kept - 1]) != 0) {
+      names[kept++] = names[i];
+    }
+  }
+  return kept;
+}
+
+/* Looks up the channels to export. Done before the read transaction is
+   taken: channels are only ever added, so every one listed is in it. */
+static int export_channels(void)
+{
+  sqlite3      *db      = NULL;
+  sqlite3_stmt *stmt    = NULL;
+  size_t        devices;
+  size_t        names;
+  int           rc = -1;
+
+  /* repeated -d or -c would list their channels, and export them, twice */
+  g_cfg.device_count  = export_unique(g_cfg.devices, g_cfg.device_count);
+  g_cfg.channel_count = export_unique(g_cfg.channels, g_cfg.channel_count);
+  devices             = g_cfg.device_count ? g_cfg.device_count : 1;
+  names               = g_cfg.channel_count ? g_cfg.channel_count : 1;
+
+  if (sqlite3_open_v2(g_cfg.db_path, &db, SQLITE_OPEN_READONLY, NULL) !=
+        SQLITE_OK ||
+      sqlite3_prepare_v2(db, g_sql_channels, -1, &stmt, NULL) != SQLITE_OK) {
+    LOG_ERROR("export: cannot read the channels of '%s': %s", g_cfg.db_path,
+              db ? sqlite3_errmsg(db) : "out of memory");
+    goto error;
+  }
+  for (size_t d = 0; d < devices; d++) {
+    for (size_t c = 0; c < names; c++) {
+      if (export_list(stmt,
+                      g_cfg.device_count ? g_cfg.devices[d] : NULL,
+                      g_cfg.channel_count ? g_cfg.channels[c] : NULL) != 0) {
+        LOG_ERROR("export: channel lookup failed: %s", sqlite3_errmsg(db));
+        goto error;
+      }
+    }
+  }
+  rc = 0;
+
+error:
+  sqlite3_finalize(stmt);
+  sqlite3_close(db);
+  return rc;
+}
+
+static int export_csv_row(export_out_t *out, const char *prefix,
+                          size_t prefix_len, const query_row_t *row)
+{
+  char   buf[EXPORT_ROW_MAX];
+  size_t n;
+
+  if (out->len + prefix_len + EXPORT_ROW_MAX > EXPORT_BUFFER_BYTES &&
+      export_flush(out) != 0) {
+    return -1;
+  }
+  memcpy(out->buf + out->len, prefix, prefix_len);
+  out->len += prefix_len;
+
+  n = (size_t)snprintf(buf, sizeof(buf), "%" PRId64 ",", row->ts);
+  switch (row->type) {
+  case SENSOR_TYPE_FLOAT:
+    n += query_put_float(buf + n, sizeof(buf) - n, row->value.f);
+    break;
+  case SENSOR_TYPE_INT:
+    n += (size_t)snprintf(buf + n, sizeof(buf) - n, "%" PRId64,
+                          row->value.i);
+    break;
+  case SENSOR_TYPE_BOOL:
+    n += (size_t)snprintf(buf + n, sizeof(buf) - n, "%s",
+                          row->value.b ? "true" : "false");
+    break;
+  case SENSOR_TYPE_STRING:
+    /* may be longer than the row buffer: written as it goes */
+    memcpy(out->buf + out->len, buf, n);
+    out->len += n;
+    n = 0;
+    if (!strpbrk(row->value.s, ",\"\r\n")) {
+      if (export_write(out, row->value.s, strlen(row->value.s)) != 0) {
+        return -1;
+      }
+    } else {
+      const char *s = row->value.s;
+
+      if (export_write(out, "\"", 1) != 0) {
+        return -1;
+      }
+      for (const char *q; (q = strchr(s, '"')); s = q + 1) {
+        if (export_write(out, s, (size_t)(q - s) + 1) != 0 ||
+            export_write(out, "\"", 1) != 0) {
+          return -1;
+        }
+      }
+      if (export_write(out, s, strlen(s)) != 0 ||
+          export_write(out, "\"", 1) != 0) {
+        return -1;
+      }
+    }
+    break;
+  default:
+    break;
+  }
+  buf[n++] = '\n';
+  return export_write(out, buf, n);
+}
+
+static int export_block_flush(export_out_t *out, export_block_t *block)
+{
+  uint32_t head[2] = {block->rows, 0};
+
+  if (export_write(out, head, sizeof(head)) != 0 ||
+      export_write(out, block->ts, block->rows * sizeof(*block->ts)) != 0 ||
+      export_write(out, block->value, block->rows * sizeof(*block->value)) !=
+        0 ||
+      export_write(out, block->channel,
+                   block->rows * sizeof(*block->channel)) != 0 ||
+      export_pad(out) != 0) {
+    return -1;
+  }
+  block->rows = 0;
+  return 0;
+}
+
+static int export_header(export_out_t *out, uint64_t rows, uint64_t blocks)
+{
+  uint32_t count    = 0;
+  uint32_t reserved = 0;
+
+  for (size_t i = 0; i < g_channel_count; i++) {
+    count += g_channels[i].type != SENSOR_TYPE_STRING;
+  }
+  if (export_write(out, g_magic, sizeof(g_magic)) != 0 ||
+      export_write(out, &count, sizeof(count)) != 0 ||
+      export_write(out, &reserved, sizeof(reserved)) != 0 ||
+      export_write(out, &rows, sizeof(rows)) != 0 ||
+      export_write(out, &blocks, sizeof(blocks)) != 0) {
+    return -1;
+  }
+  for (size_t i = 0; i < g_channel_count; i++) {
+    const export_channel_t *ch = &g_channels[i];
+    uint32_t                id_type[2] = {(uint32_t)ch->id, ch->type};
+    uint16_t                lens[2]    = {(uint16_t)strlen(ch->device),
+                                          (uint16_t)strlen(ch->name)};
+
+    if (ch->type == SENSOR_TYPE_STRING) {
+      continue;
+    }
+    if (export_write(out, id_type, sizeof(id_type)) != 0 ||
+        export_write(out, lens, sizeof(lens)) != 0 ||
+        export_write(out, ch->device, lens[0]) != 0 ||
+        export_write(out, ch->name, lens[1]) != 0) {
+      return -1;
+    }
+  }
+  return export_pad(out);
+}
+
+/* Streams the readings of every channel, one channel after the other,
+   each oldest first */
+static int export_rows(export_out_t *out, uint64_t *rows)
+{
+  export_block_t block  = {0};
+  uint64_t       blocks = 0;
+  uint32_t       index  = 0;
+  int            rc     = -1;
+
+  if (g_cfg.format == EXPORT_CSV) {
+    static const char header[] = "device,channel,timestamp,value\n";
+
+    if (export_write(out, header, sizeof(header) - 1) != 0) {
+      return -1;
+    }
+  } else {
+    block.ts      = malloc(EXPORT_BLOCK_ROWS * sizeof(*block.ts));
+    block.value   = malloc(EXPORT_BLOCK_ROWS * sizeof(*block.value));
+    block.channel = malloc(EXPORT_BLOCK_ROWS * sizeof(*block.channel));
+    if (!block.ts || !block.value || !block.channel) {
+      LOG_ERROR("export: out of memory");
+      goto error;
+    }
+    if (export_header(out, 0, 0) != 0) {
+      goto error;
+    }
+  }
+
+  for (size_t i = 0; i < g_channel_count; i++) {
+    const export_channel_t *ch     = &g_channels[i];
+    query_params_t          params = {
+      .from  = g_cfg.from,
+      .to    = g_cfg.to,
+      .limit = QUERY_LIMIT_ALL,
+    };
+    query_cursor_t *cur;
+    query_row_t     row;
+    char            prefix[EXPORT_PREFIX_MAX];
+    size_t          prefix_len;
+    int             got;
+
+    if (g_cfg.format == EXPORT_COLUMNS && ch->type == SENSOR_TYPE_STRING) {
+      LOG_WARN("export: string channel %s/%s left out of the binary export",
+               ch->device, ch->name);
+      continue;
+    }
+    snprintf(params.device, sizeof(params.device), "%s", ch->device);
+    snprintf(params.channel, sizeof(params.channel), "%s", ch->name);
+    prefix_len = export_put_field(prefix, sizeof(prefix), ch->device);
+    prefix[prefix_len++] = ',';
+    prefix_len += export_put_field(prefix + prefix_len,
+                                   sizeof(prefix) - prefix_len, ch->name);
+    prefix[prefix_len++] = ',';
+
+    if (query_open(&params, &cur) != 0) {
+      goto error;
+    }
+    while ((got = query_next_row(cur, &row)) == 1) {
+      (*rows)++;
+      if (g_cfg.format == EXPORT_CSV) {
+        if (export_csv_row(out, prefix, prefix_len, &row) != 0) {
+          break;
+        }
+        continue;
+      }
+
+      block.ts[block.rows]      = row.ts;
+      block.channel[block.rows] = index;
+      switch (row.type) {
+      case SENSOR_TYPE_FLOAT:
+        block.value[block.rows] = row.value.f;
+        break;
+      case SENSOR_TYPE_INT:
+        block.value[block.rows] = (double)row.value.i;
+        break;
+      case SENSOR_TYPE_BOOL:
+        block.value[block.rows] = row.value.b;
+        break;
+      default:
+        block.value[block.rows] = NAN;
+        break;
+      }
+      if (++block.rows == EXPORT_BLOCK_ROWS) {
+        if (export_block_flush(out, &block) != 0) {
+          break;
+        }
+        blocks++;
+      }
+    }
+    query_close(cur);
+    if (got != 0) {
+      goto error;
+    }
+    index++;
+  }
+
+  if (g_cfg.format == EXPORT_COLUMNS) {
+    if (block.rows > 0) {
+      if (export_block_flush(out, &block) != 0) {
+        goto error;
+      }
+      blocks++;
+    }
+    /* the end marker, then the counts in the header of a file of our
+       own */
+    if (export_block_flush(out, &block) != 0 || export_flush(out) != 0) {
+      goto error;
+    }
+    if (g_cfg.out_path) {
+      uint64_t bytes = out->bytes;
+
+      out->bytes = 0;
+      if (lseek(out->fd, 0, SEEK_SET) != 0 ||
+          export_header(out, *rows, blocks) != 0 || export_flush(out) != 0) {
+        LOG_ERROR("export: cannot rewrite the header: %s", strerror(errno));
+        goto error;
+      }
+      out->bytes = bytes;
+    }
+  }
+  rc = export_flush(out);
+
+error:
+  free(block.ts);
+  free(block.value);
+  free(block.channel);
+  return rc;
+}
+
+static void usage(const char *prog)
+{
+  fprintf(stderr,
+          "Usage: %s [options] <database>\n"
+          "  -d <device>   export this device, repeatable (default: all)\n"
+          "  -c <channel>  export the channels of that name, repeatable "
+          "(default: all)\n"
+          "  -f <ms>       first timestamp, included (default: none)\n"
+          "  -t <ms>       last timestamp, excluded (default: none)\n"
+          "  -F <format>   csv or columns (default: csv)\n"
+          "  -o <file>     output file (default: stdout)\n",
+          prog);
+}
+
+static int parse_int64(const char *s, int64_t *out)
+{
+  char *end;
+
+  errno = 0;
+  *out  = strtoll(s, &end, 10);
+  return errno == 0 && *s != '\0' && *end == '\0' ? 0 : -1;
+}
+
+static int parse_args(int argc, char **argv)
+{
+  int opt;
+
+  g_cfg.devices  = calloc((size_t)argc, sizeof(*g_cfg.devices));
+  g_cfg.channels = calloc((size_t)argc, sizeof(*g_cfg.channels));
+  if (!g_cfg.devices || !g_cfg.channels) {
+    return -1;
+  }
+
+  while ((opt = getopt(argc, argv, "d:c:f:t:F:o:")) != -1) {
+    switch (opt) {
+    case 'd':
+      g_cfg.devices[g_cfg.device_count++] = optarg;
+      break;
+    case 'c':
+      g_cfg.channels[g_cfg.channel_count++] = optarg;
+      break;
+    case 'f':
+      if (parse_int64(optarg, &g_cfg.from) != 0) {
+        return -1;
+      }
+      break;
+    case 't':
+      if (parse_int64(optarg, &g_cfg.to) != 0) {
+        return -1;
+      }
+      break;
+    case 'F':
+      if (strcmp(optarg, "csv") == 0) {
+        g_cfg.format = EXPORT_CSV;
+      } else if (strcmp(optarg, "columns") == 0) {
+        g_cfg.format = EXPORT_COLUMNS;
+      } else {
+        return -1;
+      }
+      break;
+    case 'o':
+      g_cfg.out_path = optarg;
+      break;
+    default:
+      return -1;
+    }
+  }
+
+  if (optind != argc - 1) {
+    return -1;
+  }
+  g_cfg.db_path = argv[optind];
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  export_out_t out    = {.fd = STDOUT_FILENO};
+  uint64_t     rows   = 0;
+  int          status = EXIT_FAILURE;
+  double       start;
+  double       elapsed;
+
+  /* the data may go to stdout: only errors and warnings, on stderr */
+  g_log_level = LOG_LEVEL_WARN;
+  if (parse_args(argc, argv) != 0) {
+    usage(argv[0]);
+    goto error;
+  }
+
+  if (export_channels() != 0 || query_pool_init(g_cfg.db_path, 1) != 0) {
+    goto error;
+  }
+  if (!query_pool_enabled()) {
+    LOG_ERROR("export: '%s' is not in WAL mode, the export would block "
+              "the server: run it with -p safe or -p fast",
+              g_cfg.db_path);
+    goto error;
+  }
+  if (query_pool_hold() != 0) {
+    goto error;
+  }
+
+  out.buf = malloc(EXPORT_BUFFER_BYTES);
+  if (!out.buf) {
+    LOG_ERROR("export: out of memory");
+    goto error;
+  }
+  if (g_cfg.out_path) {
+    out.fd = open(g_cfg.out_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out.fd < 0) {
+      LOG_ERROR("export: cannot open '%s': %s", g_cfg.out_path,
+                strerror(errno));
+      goto error;
+    }
+  }
+
+  start = export_now_s();
+  if (export_rows(&out, &rows) != 0) {
+    goto error;
+  }
+  elapsed = export_now_s() - start;
+  fprintf(stderr,
+          "%" PRIu64 " rows of %zu channels in %.3f s: %.0f rows/s, "
+          "%.1f MB/s\n",
+          rows, g_channel_count, elapsed, elapsed > 0 ? rows / elapsed : 0,
+          elapsed > 0 ? out.bytes / elapsed / 1e6 : 0);
+  status = EXIT_SUCCESS;
+
+error:
+  if (g_cfg.out_path && out.fd >= 0 &&
+      (close(out.fd) != 0 && status == EXIT_SUCCESS)) {
+    LOG_ERROR("export: cannot close '%s': %s", g_cfg.out_path,
+              strerror(errno));
+    status = EXIT_FAILURE;
+  }
+  query_pool_close();
+  free(out.buf);
+  free(g_channels);
+  free(g_cfg.devices);
+  free(g_cfg.channels);
+  return status;
+}
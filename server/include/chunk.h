@@ -0,0 +1,37 @@
+#ifndef CHUNK_H
+#define CHUNK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sensor.h"
+
+#define CHUNK_SAMPLES 512 /* samples per sealed chunk, and the most a chunk
+                             holds */
+
+/* Largest encoding of CHUNK_SAMPLES samples: a 3-byte header, then at most
+   69 bits of timestamp and 69 bits of value per sample */
+#define CHUNK_SIZE_MAX (3 + (CHUNK_SAMPLES * 138 + 7) / 8)
+
+/* One numeric reading of a chunk. Floats are kept as the device sent them,
+   in 32 bits. */
+typedef struct {
+  int64_t ts;
+  union {
+    float   f;
+    int32_t i;
+    bool    b;
+  } value;
+} chunk_sample_t;
+
+/* Compressed series of samples of one numeric type. Timestamps are stored
+   as deltas of deltas and values as XORs with the previous value (floats),
+   deltas of deltas (ints) or one bit (bools), each in a variable number of
+   bits: a regular series costs a few bits per sample. */
+size_t chunk_encode(sensor_type_t type, const chunk_sample_t *samples,
+                    size_t count, uint8_t *buf, size_t size);
+int    chunk_decode(const uint8_t *data, size_t len, sensor_type_t *type,
+                    chunk_sample_t *out, size_t max);
+
+#endif /* CHUNK_H */
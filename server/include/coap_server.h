@@ -6,12 +6,43 @@
 
 #define COAP_SERVER_PORT 5683
 
-/* COAP_RESOURCE_CHECK_TIME is 1 second in libcoap — how often
-   the library checks for observable resource updates and retransmits */
-#define COAP_SERVER_TIMEOUT_MS (COAP_RESOURCE_CHECK_TIME * 1000)
+/* Each worker is one I/O thread with its own libcoap context */
+#define COAP_SERVER_MAX_WORKERS 64
 
-int  coap_server_init(uint16_t port);
+/* How a stored snapshot is answered */
+typedef enum {
+  COAP_SERVER_RESPONSE_PIGGYBACKED = 0, /* 2.04 in the ACK, once queued */
+  COAP_SERVER_RESPONSE_SEPARATE,        /* empty ACK, then 2.04 once
+                                           committed */
+  COAP_SERVER_RESPONSE_LAST
+} coap_server_response_t;
+
+/* Period of the housekeeping timer of a worker, which expires idle query
+   transfers. A worker otherwise sleeps until a packet, a libcoap timeout,
+   a commit or a change made by another worker wakes it up. */
+#define COAP_SERVER_HOUSEKEEPING_MS 1000
+#define COAP_SERVER_EPOLL_EVENTS    16
+
+/* GET /sensor/query: Block2 transfers kept open per worker, how long one may
+   wait for its next block, and the largest block size (SZX 6 = 1024 B) */
+#define COAP_SERVER_QUERY_TRANSFERS 4
+#define COAP_SERVER_QUERY_IDLE_MS   10000
+#define COAP_SERVER_QUERY_BLOCK_SZX 6
+#define COAP_SERVER_QUERY_BLOCK_MAX (1 << (COAP_SERVER_QUERY_BLOCK_SZX + 4))
+#define COAP_SERVER_QUERY_MAX_LEN   256 /* Uri-Query */
+
+/* Queries are read on the worker that serves them, a block at a time. A
+   transfer that has to be restarted past its first block produces and drops
+   the blocks before it: at most this many bytes, about 256 blocks or 20 ms
+   of SQLite on the worker. */
+#define COAP_SERVER_QUERY_SKIP_MAX (256u << 10)
+
+int  coap_server_response_from_string(const char             *name,
+                                      coap_server_response_t *out);
+int  coap_server_init(uint16_t port, unsigned int workers,
+                      coap_server_response_t response);
 void coap_server_cleanup(void);
-void coap_server_loop(volatile bool *stop);
+int  coap_server_loop(int signal_fd);
+void coap_server_stop(void);
 
 #endif /* !COAP_SERVER_H */
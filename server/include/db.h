@@ -2,12 +2,155 @@
 #define DB_H
 
 #include <sqlite3.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #include "sensor.h"
 
-int  db_init(const char *path);
-int  db_insert_reading(const sensor_channel_t *ch, int64_t timestamp);
+/* Journal / sync / cache settings applied right after the database is
+   opened. See g_profiles in db.c for the exact PRAGMAs of each profile. */
+typedef enum {
+  DB_DURABILITY_DEFAULT = 0, /* rollback journal, synchronous=FULL */
+  DB_DURABILITY_SAFE,        /* WAL, synchronous=FULL */
+  DB_DURABILITY_FAST,        /* WAL, synchronous=NORMAL, mmap, big cache */
+  DB_DURABILITY_LAST
+} db_durability_t;
+
+/* How readings are grouped into transactions */
+typedef enum {
+  DB_COMMIT_AUTOCOMMIT = 0, /* one transaction per reading */
+  DB_COMMIT_SNAPSHOT,       /* one transaction per received snapshot */
+  DB_COMMIT_BATCH,          /* every batch_rows rows or batch_ms ms */
+  DB_COMMIT_LAST
+} db_commit_mode_t;
+
+/* Where numeric readings end up */
+typedef enum {
+  DB_STORAGE_ROWS = 0, /* one readings row each */
+  DB_STORAGE_CHUNKS,   /* compressed chunks of CHUNK_SAMPLES per channel */
+  DB_STORAGE_LAST
+} db_storage_t;
+
+/* Columns of the readings tables */
+typedef enum {
+  DB_LAYOUT_WIDE = 0, /* one column per value type, rowid and time index */
+  DB_LAYOUT_COMPACT,  /* one value column, clustered by channel and time */
+  DB_LAYOUT_LAST
+} db_layout_t;
+
+typedef struct {
+  db_durability_t  durability;
+  db_commit_mode_t commit_mode;
+  unsigned int     batch_rows;     /* DB_COMMIT_BATCH only */
+  unsigned int     batch_ms;       /* DB_COMMIT_BATCH only */
+  size_t           queue_capacity; /* per-producer queue size, in records:
+                                      one per reading plus one per snapshot */
+  uint64_t         partition_ms;   /* one readings table per period of
+                                      timestamps, 0 for a single table */
+  uint64_t         retention_ms;   /* partitions older than this are
+                                      dropped, 0 to keep them */
+  uint64_t         disk_budget;    /* oldest partitions are dropped while
+                                      the database uses more bytes, 0 for
+                                      no limit */
+  db_storage_t     storage;
+  db_layout_t      layout;
+} db_config_t;
+
+/* Rollup levels kept up to date on insert, finest first: count, sum, min,
+   max and last value of every numeric channel per bucket of that width */
+#define DB_ROLLUP_LEVELS    2
+#define DB_ROLLUP_MINUTE_MS 60000
+#define DB_ROLLUP_HOUR_MS   3600000
+#define DB_ROLLUP_FLUSH_MS  300000 /* open buckets are written this often */
+
+/* Partitions are whole hours. A partitioned database opened without a
+   period goes on with the width of its newest partition, daily if it has
+   none. */
+#define DB_PARTITION_MS_DEFAULT 86400000
+#define DB_RETENTION_CHECK_MS   60000
+
+/* A WAL written to since the last checkpoint is checkpointed this often,
+   PASSIVE, by the writer */
+#define DB_CHECKPOINT_MS 10000
+
+#define DB_BATCH_ROWS_DEFAULT     512
+#define DB_BATCH_MS_DEFAULT       200
+#define DB_QUEUE_CAPACITY_DEFAULT 65536
+#define DB_MAX_PRODUCERS          64
+#define DB_ACKS_MAX               1024 /* per producer, see db_acks_pop() */
+
+/* Admission control: a producer refuses snapshots once its queue is
+   DB_SHED_HIGH_PCT full or the writer is DB_SHED_LAG_HIGH_MS behind, and
+   takes them again only once both are back under the low marks. Refused
+   devices are told to retry once the backlog is written, 1 s at least and
+   DB_SHED_RETRY_MAX_S at most. */
+#define DB_SHED_HIGH_PCT    75
+#define DB_SHED_LOW_PCT     25
+#define DB_SHED_LAG_HIGH_MS 2000
+#define DB_SHED_LAG_LOW_MS  500
+#define DB_SHED_RETRY_MAX_S 60
+
+/* Where a snapshot was appended to the spool (see spool.h). Positions of
+   one stream packed with DB_SPOOL_POS() compare in append order. */
+typedef struct {
+  unsigned int stream;  /* producer that appended it */
+  uint32_t     segment; /* 0 if it was not spooled */
+  uint32_t     end;     /* offset just past its record */
+} db_spool_pos_t;
+
+#define DB_SPOOL_POS(segment, end) ((uint64_t)(segment) << 32 | (end))
+
+#define DB_CONFIG_DEFAULT                                                      \
+  {                                                                            \
+    .durability = DB_DURABILITY_DEFAULT, .commit_mode = DB_COMMIT_AUTOCOMMIT,  \
+    .batch_rows = DB_BATCH_ROWS_DEFAULT, .batch_ms = DB_BATCH_MS_DEFAULT,      \
+    .queue_capacity = DB_QUEUE_CAPACITY_DEFAULT,                               \
+  }
+
+/* Writer queue observability, all counters are cumulative since start */
+typedef struct {
+  size_t   queue_depth;        /* records waiting to be written right now */
+  size_t   queue_capacity;     /* size of all the queues, in records */
+  size_t   queue_depth_max;    /* high-water mark of a single queue */
+  uint64_t readings_written;   /* readings handed to SQLite */
+  uint64_t readings_failed;    /* readings SQLite refused */
+  uint64_t snapshots_shed;     /* snapshots rejected, the queue was full */
+  uint64_t snapshots_refused;  /* snapshots refused by db_admit() */
+  unsigned producers_shedding; /* producers refusing snapshots right now */
+  uint64_t lag_ms;             /* time in queue of the last records written */
+  uint64_t drain_rate;         /* records the writer applies per second */
+  uint64_t queue_time_avg_us;
+  uint64_t queue_time_max_us;
+} db_writer_stats_t;
+
+int  db_durability_from_string(const char *name, db_durability_t *out);
+int  db_commit_mode_from_string(const char *name, db_commit_mode_t *out);
+int  db_storage_from_string(const char *name, db_storage_t *out);
+int  db_layout_from_string(const char *name, db_layout_t *out);
+
+int  db_init(const char *path, const db_config_t *cfg);
+int  db_snapshot_begin(void);
+int  db_device_get_or_create(const char *name);
+int  db_insert_reading(int device_id, const sensor_channel_t *ch,
+                       int64_t timestamp);
+int  db_snapshot_end(void);
+int  db_tick(void);
+int  db_flush(void);
 void db_close(void);
 
+int    db_writer_start(unsigned int producers);
+int    db_enqueue_snapshot(unsigned int producer, const char *device,
+                           sensor_channel_t *const *channels, size_t count,
+                           int64_t timestamp, bool ack,
+                           const db_spool_pos_t *spool);
+size_t db_acks_pop(unsigned int producer, int *status, size_t max);
+void   db_acks_notify(unsigned int producer, int fd);
+int    db_admit(unsigned int producer);
+int    db_retry_after_s(void);
+void   db_writer_get_stats(db_writer_stats_t *out);
+void   db_writer_stop(void);
+
+uint64_t db_spool_committed(unsigned int stream);
+
 #endif /* DB_H */
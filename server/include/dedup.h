@@ -0,0 +1,25 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define DEDUP_MEM_LIMIT_DEFAULT (16u << 20) /* 2M snapshots */
+#define DEDUP_WINDOW_S_DEFAULT  3600
+#define DEDUP_WINDOW_S_MAX      (1u << 22) /* ~48 days */
+
+/* Snapshots already stored, by fingerprint, so a retransmitted or replayed
+   snapshot is acknowledged again without being parsed or stored twice. The
+   table is allocated once: when it is full, the entries closest to expiry
+   make room for new ones. Every worker shares it, without locks. It holds
+   a whole window with 8 bytes per snapshot received in that window: the
+   default covers it up to about 580 snapshots/s. */
+int      dedup_init(size_t mem_limit, unsigned int window_s);
+void     dedup_close(void);
+bool     dedup_enabled(void);
+uint64_t dedup_hash(uint64_t seed, const void *data, size_t len);
+bool     dedup_seen(uint64_t fingerprint, uint64_t now_ns);
+void     dedup_add(uint64_t fingerprint, uint64_t now_ns);
+
+#endif /* DEDUP_H */
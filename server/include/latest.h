@@ -0,0 +1,21 @@
+#ifndef LATEST_H
+#define LATEST_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* GET /sensor/latest/<device>: latest values of a device as
+   {"d":"<device>","values":{"<channel>":<value>,...}}, channels without a
+   value yet being left out */
+typedef struct {
+  uint32_t     version; /* device version the body was rendered from */
+  unsigned int refs;
+  size_t       len;
+  char         data[];
+} latest_body_t;
+
+latest_body_t *latest_body_get(size_t device);
+void           latest_body_put(latest_body_t *body);
+void           latest_close(void);
+
+#endif /* LATEST_H */
@@ -0,0 +1,51 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdarg.h>
+#include <stdbool.h>
+
+typedef enum {
+  LOG_LEVEL_ERROR = 0, /* the server failed at something */
+  LOG_LEVEL_WARN,      /* a request was refused, or data was dropped */
+  LOG_LEVEL_INFO,      /* startup, shutdown and periodic statistics */
+  LOG_LEVEL_DEBUG,     /* per request */
+  LOG_LEVEL_LAST
+} log_level_t;
+
+/* Most verbose level compiled in: the calls above it are dead code the
+   compiler drops (make LOG_LEVEL_MAX=LOG_LEVEL_INFO) */
+#ifndef LOG_LEVEL_MAX
+#define LOG_LEVEL_MAX LOG_LEVEL_DEBUG
+#endif
+
+#define LOG_LINE_MAX       240  /* bytes of a message, longer ones are cut */
+#define LOG_THREAD_RECORDS 1024 /* records buffered per thread */
+#define LOG_THREADS_MAX    128
+#define LOG_FLUSH_MS       50
+#define LOG_RATE_BURST     5 /* errors and warnings per call site per second */
+
+/* Runtime level, read on every call: kept out of the functions so that a
+   disabled call costs one load and one branch, its arguments unevaluated */
+extern log_level_t g_log_level;
+
+#define LOG(level, ...)                                                        \
+  do {                                                                         \
+    if ((level) <= LOG_LEVEL_MAX && (level) <= g_log_level) {                  \
+      log_write((level), __VA_ARGS__);                                         \
+    }                                                                          \
+  } while (0)
+
+#define LOG_ERROR(...) LOG(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define LOG_WARN(...)  LOG(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_INFO(...)  LOG(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_DEBUG(...) LOG(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+int  log_level_from_string(const char *name, log_level_t *out);
+int  log_init(const char *path);
+void log_close(void);
+void log_write(log_level_t level, const char *fmt, ...)
+  __attribute__((format(printf, 2, 3)));
+void log_vwrite(log_level_t level, const char *fmt, va_list args)
+  __attribute__((format(printf, 2, 0)));
+
+#endif /* LOG_H */
@@ -0,0 +1,42 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* One slot per thread that records: the CoAP workers use their worker
+   index, the db writer thread uses METRICS_SLOT_WRITER */
+#define METRICS_MAX_SLOTS   72
+#define METRICS_SLOT_WRITER (METRICS_MAX_SLOTS - 1)
+
+/* Histogram buckets: <= 1us, 2us, 4us, ... 2^(N-2)us (~1s), then +Inf */
+#define METRICS_BUCKETS 22
+
+typedef enum {
+  METRICS_SNAPSHOTS = 0, /* snapshots received with a payload */
+  METRICS_PARSE_FAILURES,
+  METRICS_QUEUE_FULL,    /* snapshots rejected with 5.03 */
+  METRICS_BYTES_IN,      /* snapshot payload bytes */
+  METRICS_DUPLICATES,    /* snapshots found in the dedup table */
+  METRICS_DEDUP_MISSES,  /* snapshots looked up and not found */
+  METRICS_REFUSED,       /* snapshots refused with 5.03 by db_admit() */
+  METRICS_LOST,          /* deferred snapshots answered 5.00 */
+  METRICS_COUNTER_LAST
+} metrics_counter_t;
+
+typedef enum {
+  METRICS_HIST_PARSE = 0, /* payload decoding */
+  METRICS_HIST_STORE,     /* registry update and queueing, in the handler */
+  METRICS_HIST_DB,        /* writing one snapshot, in the writer thread */
+  METRICS_HIST_HANDLER,   /* whole snapshot handler */
+  METRICS_HIST_COMMIT,    /* queueing to commit, separate responses only */
+  METRICS_HIST_LAST
+} metrics_hist_t;
+
+uint64_t metrics_now_ns(void);
+void     metrics_add(unsigned int slot, metrics_counter_t counter, uint64_t n);
+void     metrics_observe(unsigned int slot, metrics_hist_t hist,
+                         uint64_t elapsed_ns);
+int      metrics_render(char **out, size_t *len);
+
+#endif /* METRICS_H */
@@ -0,0 +1,68 @@
+#ifndef QUERY_H
+#define QUERY_H
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "sensor.h"
+
+#define QUERY_POOL_SIZE_DEFAULT 2
+#define QUERY_POOL_MAX          16
+#define QUERY_LIMIT_DEFAULT     1000
+#define QUERY_LIMIT_MAX         1000000
+#define QUERY_LIMIT_ALL         UINT_MAX /* query_open() only: no limit */
+
+/* query_open() result when every connection of the pool is in use */
+#define QUERY_ERR_BUSY -2
+
+/* GET /sensor/query?d=<device>&ch=<channel>&from=<ms>&to=<ms>&limit=<n>,
+   readings with from <= timestamp < to, oldest first. With &res=<ms>,
+   buckets of that width starting in that range, from the rollups. */
+typedef struct {
+  char         device[SENSOR_DEVICE_MAX_LEN];
+  char         channel[SENSOR_NAME_MAX_LEN];
+  int64_t      from;
+  int64_t      to;
+  unsigned int limit;
+  int64_t      resolution; /* 0 for readings */
+} query_params_t;
+
+/* A reading of the result, see query_next_row() */
+typedef struct {
+  int64_t       ts;
+  sensor_type_t type; /* SENSOR_TYPE_LAST when the value is NULL */
+  union {
+    double      f;
+    int64_t     i;
+    bool        b;
+    const char *s; /* valid until the next row */
+  } value;
+} query_row_t;
+
+/* A running query: a pooled read-only connection and its statement,
+   producing the result document a few bytes at a time */
+typedef struct query_cursor query_cursor_t;
+
+int  query_pool_init(const char *path, unsigned int size);
+void query_pool_close(void);
+bool query_pool_enabled(void);
+int  query_pool_hold(void);
+
+int     query_params_parse(const char *query, size_t len, query_params_t *out);
+int     query_open(const query_params_t *params, query_cursor_t **out);
+ssize_t query_read(query_cursor_t *cur, char *buf, size_t len, bool *done);
+int     query_next_row(query_cursor_t *cur, query_row_t *row);
+void    query_close(query_cursor_t *cur);
+
+/* JSON output helpers, shared with the latest values resources. A string
+   of up to len bytes, quoted and with every byte escaped as \u00XX, fits
+   in QUERY_STRING_MAX(len) bytes. */
+#define QUERY_STRING_MAX(len) (6 * (len) + 8)
+
+size_t query_put_string(char *buf, size_t size, const char *s);
+size_t query_put_float(char *buf, size_t size, double d);
+
+#endif /* QUERY_H */
@@ -0,0 +1,8 @@
+#ifndef REUSEPORT_H
+#define REUSEPORT_H
+
+#include <stdbool.h>
+
+void reuseport_set(bool enable);
+
+#endif /* !REUSEPORT_H */
@@ -0,0 +1,35 @@
+#ifndef RING_H
+#define RING_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define RING_CACHE_LINE 64
+
+/**
+ * @brief Bounded single-producer / single-consumer ring of fixed-size records
+ *
+ * Lock-free: the producer only writes head, the consumer only writes tail.
+ * Both indexes grow monotonically and are masked on access, so capacity
+ * must be a power of two. Each index lives on its own cache line to avoid
+ * false sharing between the two threads.
+ */
+typedef struct {
+  _Alignas(RING_CACHE_LINE) _Atomic size_t head;
+  _Alignas(RING_CACHE_LINE) _Atomic size_t tail;
+  _Alignas(RING_CACHE_LINE) size_t capacity;
+  size_t   mask;
+  size_t   elem_size;
+  uint8_t *buf;
+} ring_t;
+
+int    ring_init(ring_t *ring, size_t capacity, size_t elem_size);
+void   ring_free(ring_t *ring);
+size_t ring_count(ring_t *ring);
+size_t ring_space(ring_t *ring);
+int    ring_push(ring_t *ring, const void *elem);
+int    ring_push_n(ring_t *ring, const void *elems, size_t n);
+size_t ring_pop_n(ring_t *ring, void *out, size_t max);
+
+#endif /* RING_H */
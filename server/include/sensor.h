@@ -3,10 +3,16 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
-#define SENSOR_NAME_MAX_LEN 64
-#define SENSOR_MAX_CHANNELS 16
+#define SENSOR_NAME_MAX_LEN   64
+#define SENSOR_MAX_READINGS   256 /* per snapshot */
 #define SENSOR_STRING_MAX_LEN 64
+#define SENSOR_DEVICE_MAX_LEN 64
+
+#define SENSOR_REG_MEM_LIMIT_DEFAULT (96u << 20) /* ~1M channels */
+#define SENSOR_REG_CHUNK_SIZE        (64 * 1024) /* arena chunk, <= 64 KiB */
+#define SENSOR_REG_CHANGES           4096 /* change log entries, power of 2 */
 
 typedef enum {
   SENSOR_TYPE_FIRST = 0,
@@ -24,6 +30,8 @@ typedef union {
   bool  b;
 } sensor_value_t;
 
+/* One reading: a named value, as parsed from a snapshot and queued for
+   storage */
 typedef struct {
   char           name[SENSOR_NAME_MAX_LEN];
   sensor_type_t  type;
@@ -32,20 +40,98 @@ typedef struct {
 
 } sensor_channel_t;
 
+/* Latest value of a registered channel, allocated in the registry arena
+   together with its key (and its string buffer for string channels) so a
+   lookup touches one cache line. Channels are per device: two devices
+   reporting "temperature" own two distinct entries. */
+typedef struct {
+  union {
+    float f;
+    int   i;
+    bool  b;
+    char *s; /* SENSOR_STRING_MAX_LEN bytes, right after the key */
+  } value;
+  uint32_t device;  /* arena reference of the owning device */
+  uint32_t next;    /* next channel of the same device, 0 at the end */
+  uint16_t key_len;
+  uint8_t  type;
+  bool     has_value;
+  char     key[]; /* "<device>\0<name>\0" */
+} sensor_reg_channel_t;
+
+/* A device: the head of the list of its channels, and a version bumped by
+   sensor_device_touch() whenever one of its values changes. Devices are
+   numbered in order of appearance. */
 typedef struct {
-  sensor_channel_t channels[SENSOR_MAX_CHANNELS];
-  size_t           count;
+  uint32_t first; /* most recently registered channel, 0 if none */
+  uint32_t version;
+  uint32_t index;
+  uint16_t key_len;
+  char     key[]; /* "<device>\0" */
+} sensor_reg_device_t;
+
+/* Open-addressing index, load factor <= 1/2. A channel is referenced by
+   its arena position, (chunk + 1) << 16 | offset, to keep slots 8 bytes. */
+typedef struct {
+  uint32_t hash;
+  uint32_t ref; /* 0 if the slot is empty */
+} sensor_reg_slot_t;
+
+/* Channels never move once registered: the arena only ever gains chunks and
+   only the slot table is reallocated as the registry grows. Everything is
+   accounted against mem_limit. */
+typedef struct {
+  sensor_reg_slot_t *slots;
+  size_t             slot_cap; /* power of two */
+  size_t             count;
+  char             **chunks; /* SENSOR_REG_CHUNK_SIZE bytes each */
+  size_t             chunk_count;
+  size_t             chunk_cap;
+  size_t             chunk_used; /* bytes used in the last chunk */
+  size_t             mem_used;
+  size_t             mem_limit;
+
+  /* devices: their own index, and their arena references by number */
+  sensor_reg_slot_t *dev_slots;
+  size_t             dev_slot_cap;
+  size_t             dev_count;
+  uint32_t          *devices;
+  size_t             dev_cap;
+
+  /* numbers of the devices touched, change_seq being the total ever logged:
+     a reader more than SENSOR_REG_CHANGES entries behind has lost some */
+  uint32_t           changes[SENSOR_REG_CHANGES];
+  uint64_t           change_seq;
 } sensor_registry_t;
 
-sensor_registry_t *sensor_reg_init(void);
+/* Called for each channel of a device, with the registry locked */
+typedef void (*sensor_channel_visit_t)(const sensor_reg_channel_t *ch,
+                                       void                       *arg);
+
+sensor_registry_t *sensor_reg_init(size_t mem_limit);
 void               sensor_reg_close(sensor_registry_t *reg);
 sensor_registry_t *sensor_reg_get();
+void               sensor_reg_get_stats(sensor_registry_t *reg, size_t *channels,
+                                        size_t *mem_used);
+
+sensor_reg_channel_t *sensor_channel_register(sensor_registry_t *reg,
+                                              const char        *device,
+                                              const char        *name,
+                                              sensor_type_t      type);
+int sensor_channel_update_float(sensor_reg_channel_t *ch, float value);
+int sensor_channel_update_int(sensor_reg_channel_t *ch, int value);
+int sensor_channel_update_string(sensor_reg_channel_t *ch, const char *value);
+int sensor_channel_update_bool(sensor_reg_channel_t *ch, bool value);
 
-sensor_channel_t *sensor_channel_register(sensor_registry_t *reg,
-                                          const char *name, sensor_type_t type);
-int sensor_channel_update_float(sensor_channel_t *ch, float value);
-int sensor_channel_update_int(sensor_channel_t *ch, int value);
-int sensor_channel_update_string(sensor_channel_t *ch, const char *value);
-int sensor_channel_update_bool(sensor_channel_t *ch, bool value);
+void     sensor_device_touch(sensor_registry_t *reg,
+                             const sensor_reg_channel_t *ch);
+size_t   sensor_device_count(sensor_registry_t *reg);
+uint32_t sensor_device_version(sensor_registry_t *reg, size_t index);
+int      sensor_device_name(sensor_registry_t *reg, size_t index, char *buf,
+                            size_t len);
+uint32_t sensor_device_visit(sensor_registry_t *reg, size_t index,
+                             sensor_channel_visit_t visit, void *arg);
+bool     sensor_device_changes(sensor_registry_t *reg, uint64_t *since,
+                               uint32_t *out, size_t *count);
 
 #endif /* SENSOR_H */
@@ -8,11 +8,22 @@
 typedef sensor_channel_t parsed_reading_t;
 
 typedef struct {
-  parsed_reading_t readings[SENSOR_MAX_CHANNELS];
+  parsed_reading_t readings[SENSOR_MAX_READINGS];
   size_t           count;
   int64_t          timestamp_ms;
+  char             device[SENSOR_DEVICE_MAX_LEN]; /* empty if not given */
 } parsed_snapshot_t;
 
 int parse_snapshot_json(const char *buf, size_t len, parsed_snapshot_t *out);
+int parse_snapshot_cbor(const uint8_t *buf, size_t len, parsed_snapshot_t *out);
+int parse_snapshot_senml(const uint8_t *buf, size_t len,
+                         parsed_snapshot_t *out);
+
+/* Shared by the decoders: a rate-limited warning about a malformed payload,
+   prefixed with who; and a number clamped to the range of the type */
+void    parser_warn(const char *who, const char *fmt, ...)
+  __attribute__((format(printf, 2, 3)));
+int     parser_to_int(double d);
+int64_t parser_to_int64(double d);
 
 #endif /* SNAPSHOT_PARSER_H */
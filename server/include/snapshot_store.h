@@ -0,0 +1,14 @@
+#ifndef SNAPSHOT_STORE_H
+#define SNAPSHOT_STORE_H
+
+#include <stdbool.h>
+
+#include "db.h"
+#include "snapshot_parser.h"
+
+int snapshot_store(unsigned int producer, const char *device,
+                   parsed_snapshot_t *snap, bool ack, bool *changed);
+int snapshot_replay(parsed_snapshot_t *snap, const db_spool_pos_t *pos,
+                    void *arg);
+
+#endif /* SNAPSHOT_STORE_H */
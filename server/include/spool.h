@@ -0,0 +1,33 @@
+#ifndef SPOOL_H
+#define SPOOL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "db.h"
+#include "snapshot_parser.h"
+
+#define SPOOL_SEGMENT_BYTES (16u << 20) /* a segment is closed past this */
+#define SPOOL_SYNC_MS       50          /* appends wait this long for a sync */
+
+/* Called by spool_open() for each snapshot not committed yet, in the order
+   it was appended to its stream. The device is in snap->device. A nonzero
+   return stops the replay and fails spool_open(). */
+typedef int (*spool_replay_fn)(parsed_snapshot_t    *snap,
+                               const db_spool_pos_t *pos, void *arg);
+
+/* Write-ahead log of the snapshots in front of the storage queue: each
+   producer appends the snapshots it queues to a stream of segment files of
+   its own, with one write(), and a background thread syncs them at most
+   SPOOL_SYNC_MS later, and sleeps while nothing is appended. Segments are
+   deleted once all their snapshots are committed, see
+   db_spool_committed(). */
+int  spool_open(const char *dir, unsigned int streams, spool_replay_fn replay,
+                void *arg);
+bool spool_enabled(void);
+int  spool_append(unsigned int stream, const char *device,
+                  const parsed_snapshot_t *snap, db_spool_pos_t *pos);
+void spool_cancel(unsigned int stream);
+void spool_close(void);
+
+#endif /* SPOOL_H */
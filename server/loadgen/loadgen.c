@@ -0,0 +1,738 @@
+/*
+ * CoAP load generator
+ *
+ * Simulates N devices POSTing snapshots to sensor/snapshot at a fixed total
+ * rate and reports throughput, response latency percentiles, retransmissions
+ * and errors. Every device owns a libcoap client session, hence a socket
+ * and a source port of its own, so the server sees N distinct peers.
+ *
+ * The schedule is open-loop: requests go out at their planned time whether
+ * or not earlier ones were answered, and latency is measured from that
+ * planned time, so a stalled server shows up in the percentiles instead of
+ * silently lowering the request rate.
+ */
+#include <coap3/coap.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LG_MAX_THREADS  64
+#define LG_MAX_CHANNELS 256
+#define LG_WINDOW       64  /* requests in flight tracked per device */
+#define LG_PAYLOAD_MAX  (LG_MAX_CHANNELS * 64 + 64)
+
+/* Log-linear latency histogram: exact below 64 ns, then 32 buckets per
+   power of two (~3% resolution) */
+#define LG_HIST_SUB     32
+#define LG_HIST_BUCKETS (64 + 58 * LG_HIST_SUB)
+
+typedef struct {
+  uint64_t requests; /* handed to libcoap */
+  uint64_t ok;       /* 2.xx */
+  uint64_t client_errors;
+  uint64_t server_errors;
+  uint64_t unavailable; /* 5.03, also counted in server_errors */
+  uint64_t timeouts;    /* CON given up after MAX_RETRANSMIT */
+  uint64_t resets;
+  uint64_t send_failures;
+  uint64_t retransmissions;
+  uint64_t untracked; /* answered after LG_WINDOW newer requests */
+  uint64_t hist[LG_HIST_BUCKETS];
+} lg_stats_t;
+
+typedef struct {
+  coap_session_t *session;
+  uint32_t        index;
+  uint32_t        seq;
+  char            query[24];
+  uint32_t        sent_seq[LG_WINDOW];
+  uint64_t        sent_ns[LG_WINDOW]; /* 0 once answered */
+} lg_device_t;
+
+typedef struct lg_worker {
+  unsigned int    id;
+  pthread_t       thread;
+  coap_context_t *ctx;
+  lg_device_t    *devices;
+  size_t          device_count;
+  uint64_t        interval_ns;
+  lg_stats_t      stats;
+} lg_worker_t;
+
+typedef struct {
+  const char  *host;
+  uint16_t     port;
+  unsigned int devices;
+  unsigned int threads;
+  double       rate;
+  unsigned int con_percent;
+  unsigned int channels;
+  unsigned int duration_s;
+  unsigned int grace_s;
+} lg_config_t;
+
+static lg_config_t    g_cfg = {
+  .host        = "127.0.0.1",
+  .port        = 5683,
+  .devices     = 100,
+  .threads     = 1,
+  .rate        = 1000,
+  .con_percent = 100,
+  .channels    = 16,
+  .duration_s  = 10,
+  .grace_s     = 5,
+};
+static coap_address_t g_dst;
+static lg_worker_t    g_workers[LG_MAX_THREADS];
+static uint64_t       g_start_ns;
+static uint64_t       g_end_ns;
+
+static uint64_t lg_now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * Latency histogram
+ */
+
+static size_t lg_hist_bucket(uint64_t v)
+{
+  unsigned int e;
+
+  if (v < 64) {
+    return (size_t)v;
+  }
+  e = 63 - (unsigned int)__builtin_clzll(v);
+  return 64 + (e - 6) * LG_HIST_SUB + ((v >> (e - 5)) & (LG_HIST_SUB - 1));
+}
+
+/* Upper bound of a bucket, in ns */
+static uint64_t lg_hist_value(size_t b)
+{
+  unsigned int e;
+
+  if (b < 64) {
+    return b;
+  }
+  e = (unsigned int)((b - 64) / LG_HIST_SUB) + 6;
+  return ((uint64_t)(LG_HIST_SUB + (b - 64) % LG_HIST_SUB + 1) << (e - 5)) - 1;
+}
+
+static uint64_t lg_hist_percentile(const uint64_t *hist, uint64_t total,
+                                   double q)
+{
+  uint64_t rank = (uint64_t)ceil(q * (double)total);
+  uint64_t seen = 0;
+
+  if (total == 0) {
+    return 0;
+  }
+  for (size_t b = 0; b < LG_HIST_BUCKETS; b++) {
+    seen += hist[b];
+    if (seen >= rank) {
+      return lg_hist_value(b);
+    }
+  }
+  return lg_hist_value(LG_HIST_BUCKETS - 1);
+}
+
+/*
+ * Payload
+ */
+
+/* Same document as the firmware JSON encoder, with values that move a
+   little at every request */
+static size_t lg_build_payload(char *buf, size_t size, uint32_t device,
+                               uint32_t seq, uint64_t ts_ms)
+{
+  static const char *const names[] = {"temperature", "humidity", "pressure",
+                                      "battery_mv",  "rssi",     "door_open"};
+  size_t                   len;
+
+  len = (size_t)snprintf(buf, size, "{\"ts\":%llu,\"readings\":[",
+                         (unsigned long long)ts_ms);
+
+  for (unsigned int i = 0; i < g_cfg.channels && len < size; i++) {
+    const char *sep  = i ? "," : "";
+    const char *name = names[i % 6];
+
+    switch (i % 4) {
+    case 0:
+      len += (size_t)snprintf(buf + len, size - len,
+                              "%s{\"n\":\"%s_%u\",\"t\":0,\"v\":%.2f}", sep,
+                              name, i, 20.0 + (double)((seq + i) % 100) / 10);
+      break;
+    case 1:
+      len += (size_t)snprintf(buf + len, size - len,
+                              "%s{\"n\":\"%s_%u\",\"t\":1,\"v\":%u}", sep, name,
+                              i, 3300 - (seq + device) % 200);
+      break;
+    case 2:
+      len += (size_t)snprintf(buf + len, size - len,
+                              "%s{\"n\":\"%s_%u\",\"t\":2,\"v\":\"state-%u\"}",
+                              sep, name, i, seq % 4);
+      break;
+    default:
+      len += (size_t)snprintf(buf + len, size - len,
+                              "%s{\"n\":\"%s_%u\",\"t\":3,\"v\":%s}", sep, name,
+                              i, (seq + i) & 1 ? "true" : "false");
+      break;
+    }
+  }
+
+  if (len < size) {
+    len += (size_t)snprintf(buf + len, size - len, "]}");
+  }
+  return len < size ? len : 0;
+}
+
+/*
+ * libcoap handlers
+ */
+
+static lg_worker_t *lg_worker_of(coap_session_t *session)
+{
+  return coap_context_get_app_data(coap_session_get_context(session));
+}
+
+/* The token is the device sequence number of the request */
+static lg_device_t *lg_request_of(coap_session_t *session, const coap_pdu_t *pdu,
+                                  uint32_t *seq)
+{
+  coap_bin_const_t token = coap_pdu_get_token(pdu);
+
+  if (token.length != sizeof(*seq)) {
+    return NULL;
+  }
+  memcpy(seq, token.s, sizeof(*seq));
+  return coap_session_get_app_data(session);
+}
+
+/* Latency of an answered request, 0 if it was already accounted for */
+static uint64_t lg_complete(lg_worker_t *worker, lg_device_t *dev, uint32_t seq)
+{
+  size_t   slot = seq % LG_WINDOW;
+  uint64_t sent = dev->sent_ns[slot];
+
+  if (dev->sent_seq[slot] != seq) {
+    worker->stats.untracked++;
+    return 0;
+  }
+  if (sent == 0) {
+    return 0;
+  }
+  dev->sent_ns[slot] = 0;
+  return lg_now_ns() - sent;
+}
+
+static coap_response_t lg_response(coap_session_t   *session,
+                                   const coap_pdu_t *sent,
+                                   const coap_pdu_t *received,
+                                   const coap_mid_t  mid)
+{
+  lg_worker_t *worker = lg_worker_of(session);
+  lg_device_t *dev;
+  uint32_t     seq;
+  uint64_t     latency;
+
+  (void)sent;
+  (void)mid;
+
+  dev = lg_request_of(session, received, &seq);
+  if (!dev) {
+    return COAP_RESPONSE_OK;
+  }
+  latency = lg_complete(worker, dev, seq);
+  if (latency == 0) {
+    return COAP_RESPONSE_OK;
+  }
+
+  worker->stats.hist[lg_hist_bucket(latency)]++;
+
+  coap_pdu_code_t code = coap_pdu_get_code(received);
+  switch (COAP_RESPONSE_CLASS(code)) {
+  case 2:
+    worker->stats.ok++;
+    break;
+  case 4:
+    worker->stats.client_errors++;
+    break;
+  default:
+    worker->stats.server_errors++;
+    if (code == COAP_RESPONSE_CODE_SERVICE_UNAVAILABLE) {
+      worker->stats.unavailable++;
+    }
+    break;
+  }
+  return COAP_RESPONSE_OK;
+}
+
+static void lg_nack(coap_session_t *session, const coap_pdu_t *sent,
+                    const coap_nack_reason_t reason, const coap_mid_t mid)
+{
+  lg_worker_t *worker = lg_worker_of(session);
+  lg_device_t *dev;
+  uint32_t     seq;
+
+  (void)mid;
+
+  if (!sent || !(dev = lg_request_of(session, sent, &seq)) ||
+      lg_complete(worker, dev, seq) == 0) {
+    return;
+  }
+
+  if (reason == COAP_NACK_RST) {
+    worker->stats.resets++;
+  } else {
+    worker->stats.timeouts++;
+  }
+}
+
+static int lg_event(coap_session_t *session, const coap_event_t event)
+{
+  if (event == COAP_EVENT_MSG_RETRANSMITTED) {
+    lg_worker_of(session)->stats.retransmissions++;
+  }
+  return 0;
+}
+
+/*
+ * Workers
+ */
+
+static void lg_release_payload(coap_session_t *session, void *data)
+{
+  (void)session;
+  free(data);
+}
+
+static void lg_send(lg_worker_t *worker, lg_device_t *dev, uint64_t planned_ns)
+{
+  static const uint8_t path_sensor[]   = "sensor";
+  static const uint8_t path_snapshot[] = "snapshot";
+  char                 payload[LG_PAYLOAD_MAX];
+  uint8_t              fmt[2];
+  size_t               fmt_len;
+  size_t               len;
+  uint32_t             seq = ++dev->seq;
+  coap_pdu_type_t      type;
+  coap_pdu_t          *pdu;
+  char                *data;
+
+  type = (seq * 37 + dev->index) % 100 < g_cfg.con_percent
+           ? COAP_MESSAGE_CON
+           : COAP_MESSAGE_NON;
+
+  len = lg_build_payload(payload, sizeof(payload), dev->index, seq,
+                         (planned_ns - g_start_ns) / 1000000);
+  pdu = coap_pdu_init(type, COAP_REQUEST_CODE_POST,
+                      coap_new_message_id(dev->session),
+                      coap_session_max_pdu_size(dev->session));
+  if (len == 0 || !pdu) {
+    goto error;
+  }
+
+  fmt_len = coap_encode_var_safe(fmt, sizeof(fmt),
+                                 COAP_MEDIATYPE_APPLICATION_JSON);
+  if (!coap_add_token(pdu, sizeof(seq), (const uint8_t *)&seq) ||
+      !coap_add_option(pdu, COAP_OPTION_URI_PATH, sizeof(path_sensor) - 1,
+                       path_sensor) ||
+      !coap_add_option(pdu, COAP_OPTION_URI_PATH, sizeof(path_snapshot) - 1,
+                       path_snapshot) ||
+      !coap_add_option(pdu, COAP_OPTION_CONTENT_FORMAT, fmt_len, fmt) ||
+      !coap_add_option(pdu, COAP_OPTION_URI_QUERY, strlen(dev->query),
+                       (const uint8_t *)dev->query)) {
+    goto error;
+  }
+
+  /* libcoap splits payloads larger than a PDU into Block1 transfers */
+  data = malloc(len);
+  if (!data) {
+    goto error;
+  }
+  memcpy(data, payload, len);
+  if (!coap_add_data_large_request(dev->session, pdu, len,
+                                   (const uint8_t *)data, lg_release_payload,
+                                   data)) {
+    free(data);
+    goto error;
+  }
+
+  size_t slot         = seq % LG_WINDOW;
+  dev->sent_seq[slot] = seq;
+  dev->sent_ns[slot]  = planned_ns;
+  worker->stats.requests++;
+
+  if (coap_send(dev->session, pdu) == COAP_INVALID_MID) {
+    dev->sent_ns[slot] = 0;
+    worker->stats.send_failures++;
+  }
+  return;
+
+error:
+  if (pdu) {
+    coap_delete_pdu(pdu);
+  }
+  worker->stats.send_failures++;
+}
+
+static uint64_t lg_in_flight(const lg_worker_t *worker)
+{
+  uint64_t n = 0;
+
+  for (size_t i = 0; i < worker->device_count; i++) {
+    for (size_t s = 0; s < LG_WINDOW; s++) {
+      n += worker->devices[i].sent_ns[s] != 0;
+    }
+  }
+  return n;
+}
+
+static void *lg_worker_main(void *arg)
+{
+  lg_worker_t *worker  = arg;
+  uint64_t     next_ns = g_start_ns + worker->id * worker->interval_ns /
+                                     g_cfg.threads;
+  size_t       rr      = 0;
+  uint64_t     now;
+
+  while ((now = lg_now_ns()) < g_end_ns) {
+    while (next_ns <= now && next_ns < g_end_ns) {
+      lg_send(worker, &worker->devices[rr], next_ns);
+      rr = (rr + 1) % worker->device_count;
+      next_ns += worker->interval_ns;
+    }
+
+    uint64_t wait_ns = next_ns > now ? next_ns - now : 0;
+    coap_io_process(worker->ctx, wait_ns >= 1000000
+                                   ? (uint32_t)(wait_ns / 1000000)
+                                   : COAP_IO_NO_WAIT);
+  }
+
+  /* let the last requests be answered or retransmitted */
+  uint64_t grace_end = g_end_ns + (uint64_t)g_cfg.grace_s * 1000000000;
+  while (lg_now_ns() < grace_end && lg_in_flight(worker) > 0) {
+    coap_io_process(worker->ctx, 10);
+  }
+  return NULL;
+}
+
+static int lg_worker_init(lg_worker_t *worker, unsigned int id, size_t first,
+                          size_t count)
+{
+  memset(worker, 0, sizeof(*worker));
+  worker->id           = id;
+  worker->device_count = count;
+  worker->interval_ns  = (uint64_t)(1e9 * g_cfg.threads / g_cfg.rate);
+
+  worker->ctx = coap_new_context(NULL);
+  if (!worker->ctx) {
+    fprintf(stderr, "Failed to create CoAP context\n");
+    return -1;
+  }
+  coap_context_set_app_data(worker->ctx, worker);
+  coap_context_set_block_mode(worker->ctx,
+                              COAP_BLOCK_USE_LIBCOAP | COAP_BLOCK_SINGLE_BODY);
+  coap_register_response_handler(worker->ctx, lg_response);
+  coap_register_nack_handler(worker->ctx, lg_nack);
+  coap_register_event_handler(worker->ctx, lg_event);
+
+  worker->devices = calloc(count, sizeof(*worker->devices));
+  if (!worker->devices) {
+    fprintf(stderr, "Cannot allocate %zu devices\n", count);
+    return -1;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    lg_device_t *dev = &worker->devices[i];
+
+    dev->index = (uint32_t)(first + i);
+    snprintf(dev->query, sizeof(dev->query), "d=loadgen-%u", dev->index);
+
+    /* one session per device: its own socket, its own source port */
+    dev->session =
+      coap_new_client_session(worker->ctx, NULL, &g_dst, COAP_PROTO_UDP);
+    if (!dev->session) {
+      fprintf(stderr, "Failed to create session %zu (open files limit?)\n",
+              first + i);
+      return -1;
+    }
+    coap_session_set_app_data(dev->session, dev);
+  }
+  return 0;
+}
+
+static void lg_worker_free(lg_worker_t *worker)
+{
+  if (worker->ctx) {
+    coap_free_context(worker->ctx);
+    worker->ctx = NULL;
+  }
+  free(worker->devices);
+  worker->devices = NULL;
+}
+
+/*
+ * Report
+ */
+
+static void lg_report(double elapsed_s)
+{
+  lg_stats_t total = {0};
+  uint64_t   answered;
+  uint64_t   in_flight = 0;
+
+  for (unsigned int t = 0; t < g_cfg.threads; t++) {
+    const lg_stats_t *s = &g_workers[t].stats;
+
+    total.requests += s->requests;
+    total.ok += s->ok;
+    total.client_errors += s->client_errors;
+    total.server_errors += s->server_errors;
+    total.unavailable += s->unavailable;
+    total.timeouts += s->timeouts;
+    total.resets += s->resets;
+    total.send_failures += s->send_failures;
+    total.retransmissions += s->retransmissions;
+    total.untracked += s->untracked;
+    for (size_t b = 0; b < LG_HIST_BUCKETS; b++) {
+      total.hist[b] += s->hist[b];
+    }
+    in_flight += lg_in_flight(&g_workers[t]);
+  }
+
+  answered = total.ok + total.client_errors + total.server_errors;
+  uint64_t errors = total.client_errors + total.server_errors +
+                    total.timeouts + total.resets + total.send_failures +
+                    in_flight;
+
+  double p50  = lg_hist_percentile(total.hist, answered, 0.50) / 1e3;
+  double p99  = lg_hist_percentile(total.hist, answered, 0.99) / 1e3;
+  double p999 = lg_hist_percentile(total.hist, answered, 0.999) / 1e3;
+  double max  = lg_hist_percentile(total.hist, answered, 1.0) / 1e3;
+
+  fprintf(stderr,
+          "devices=%u threads=%u rate=%.0f/s con=%u%% channels=%u "
+          "duration=%us\n"
+          "requests        %llu (%.0f/s)\n"
+          "answered        %llu (%.0f/s), 2.xx %llu\n"
+          "errors          %llu: 4.xx %llu, 5.xx %llu (5.03 %llu), "
+          "timeout %llu, reset %llu, send %llu, unanswered %llu\n"
+          "retransmissions %llu\n"
+          "latency         p50 %.0f us, p99 %.0f us, p99.9 %.0f us, "
+          "max %.0f us\n",
+          g_cfg.devices, g_cfg.threads, g_cfg.rate, g_cfg.con_percent,
+          g_cfg.channels, g_cfg.duration_s,
+          (unsigned long long)total.requests, total.requests / elapsed_s,
+          (unsigned long long)answered, answered / elapsed_s,
+          (unsigned long long)total.ok, (unsigned long long)errors,
+          (unsigned long long)total.client_errors,
+          (unsigned long long)total.server_errors,
+          (unsigned long long)total.unavailable,
+          (unsigned long long)total.timeouts,
+          (unsigned long long)total.resets,
+          (unsigned long long)total.send_failures,
+          (unsigned long long)in_flight,
+          (unsigned long long)total.retransmissions, p50, p99, p999, max);
+  if (total.untracked > 0) {
+    fprintf(stderr, "%llu late answers were not timed (more than %d requests "
+                    "in flight on a device)\n",
+            (unsigned long long)total.untracked, LG_WINDOW);
+  }
+
+  /* one CSV row for regression runs, same spirit as coap-server-bench */
+  fprintf(stdout,
+          "devices,threads,rate,con_percent,channels,duration_s,requests,"
+          "answered,ok,errors,retransmissions,rps,p50_us,p99_us,p999_us,"
+          "max_us\n"
+          "%u,%u,%.0f,%u,%u,%u,%llu,%llu,%llu,%llu,%llu,%.1f,%.0f,%.0f,%.0f,"
+          "%.0f\n",
+          g_cfg.devices, g_cfg.threads, g_cfg.rate, g_cfg.con_percent,
+          g_cfg.channels, g_cfg.duration_s, (unsigned long long)total.requests,
+          (unsigned long long)answered, (unsigned long long)total.ok,
+          (unsigned long long)errors,
+          (unsigned long long)total.retransmissions, answered / elapsed_s, p50,
+          p99, p999, max);
+}
+
+/*
+ * Main
+ */
+
+static void usage(const char *prog)
+{
+  fprintf(stderr,
+          "Usage: %s [options] [host [port]]\n"
+          "  -n <devices>  simulated devices, one source port each "
+          "(default: %u)\n"
+          "  -r <rate>     total requests per second (default: %.0f)\n"
+          "  -d <s>        test duration (default: %u)\n"
+          "  -c <percent>  share of confirmable requests, the rest is NON "
+          "(default: %u)\n"
+          "  -k <count>    readings per snapshot, 1..%d (default: %u)\n"
+          "  -t <threads>  sending threads, 1..%d (default: %u)\n"
+          "  -g <s>        wait for late answers after the test "
+          "(default: %u)\n"
+          "  host, port    server address (default: %s %u)\n",
+          prog, g_cfg.devices, g_cfg.rate, g_cfg.duration_s, g_cfg.con_percent,
+          LG_MAX_CHANNELS, g_cfg.channels, LG_MAX_THREADS, g_cfg.threads,
+          g_cfg.grace_s, g_cfg.host, g_cfg.port);
+}
+
+static int parse_args(int argc, char **argv)
+{
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:r:d:c:k:t:g:")) != -1) {
+    switch (opt) {
+    case 'n':
+      g_cfg.devices = (unsigned int)strtoul(optarg, NULL, 10);
+      break;
+    case 'r':
+      g_cfg.rate = strtod(optarg, NULL);
+      break;
+    case 'd':
+      g_cfg.duration_s = (unsigned int)strtoul(optarg, NULL, 10);
+      break;
+    case 'c':
+      g_cfg.con_percent = (unsigned int)strtoul(optarg, NULL, 10);
+      break;
+    case 'k':
+      g_cfg.channels = (unsigned int)strtoul(optarg, NULL, 10);
+      break;
+    case 't':
+      g_cfg.threads = (unsigned int)strtoul(optarg, NULL, 10);
+      break;
+    case 'g':
+      g_cfg.grace_s = (unsigned int)strtoul(optarg, NULL, 10);
+      break;
+    default:
+      return -1;
+    }
+  }
+
+  if (optind < argc) {
+    g_cfg.host = argv[optind++];
+  }
+  if (optind < argc) {
+    g_cfg.port = (uint16_t)strtoul(argv[optind++], NULL, 10);
+  }
+
+  if (g_cfg.devices == 0 || g_cfg.rate <= 0 || g_cfg.duration_s == 0 ||
+      g_cfg.con_percent > 100 || g_cfg.channels == 0 ||
+      g_cfg.channels > LG_MAX_CHANNELS || g_cfg.threads == 0 ||
+      g_cfg.threads > LG_MAX_THREADS || g_cfg.threads > g_cfg.devices) {
+    return -1;
+  }
+  return 0;
+}
+
+/* One socket per device: make sure the open files limit allows it */
+static int raise_fd_limit(void)
+{
+  struct rlimit rl;
+  rlim_t        need = (rlim_t)g_cfg.devices + 64;
+
+  if (getrlimit(RLIMIT_NOFILE, &rl) != 0) {
+    return -1;
+  }
+  if (rl.rlim_cur >= need) {
+    return 0;
+  }
+  rl.rlim_cur = rl.rlim_max < need ? rl.rlim_max : need;
+  if (setrlimit(RLIMIT_NOFILE, &rl) != 0 || rl.rlim_cur < need) {
+    fprintf(stderr, "Open files limit too low for %u devices (max %llu)\n",
+            g_cfg.devices, (unsigned long long)rl.rlim_max);
+    return -1;
+  }
+  return 0;
+}
+
+static int resolve_server(void)
+{
+  coap_str_const_t  host = {strlen(g_cfg.host), (const uint8_t *)g_cfg.host};
+  coap_addr_info_t *info;
+
+  info = coap_resolve_address_info(&host, g_cfg.port, g_cfg.port, g_cfg.port,
+                                   g_cfg.port, AF_UNSPEC, 1 << 0 /* coap */,
+                                   COAP_RESOLVE_TYPE_REMOTE);
+  if (!info) {
+    fprintf(stderr, "Cannot resolve %s\n", g_cfg.host);
+    return -1;
+  }
+  g_dst = info->addr;
+  coap_free_address_info(info);
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  unsigned int started = 0;
+  size_t       first   = 0;
+  int          ret     = 1;
+
+  if (parse_args(argc, argv) != 0) {
+    usage(argv[0]);
+    return 1;
+  }
+  if (raise_fd_limit() != 0) {
+    return 1;
+  }
+
+  coap_startup();
+  coap_set_log_level(COAP_LOG_WARN);
+
+  if (resolve_server() != 0) {
+    goto out;
+  }
+
+  for (unsigned int t = 0; t < g_cfg.threads; t++) {
+    size_t count = g_cfg.devices / g_cfg.threads +
+                   (t < g_cfg.devices % g_cfg.threads);
+
+    if (lg_worker_init(&g_workers[t], t, first, count) != 0) {
+      g_cfg.threads = t + 1;
+      goto out;
+    }
+    first += count;
+  }
+
+  g_start_ns = lg_now_ns();
+  g_end_ns   = g_start_ns + (uint64_t)g_cfg.duration_s * 1000000000;
+
+  for (; started < g_cfg.threads; started++) {
+    if (pthread_create(&g_workers[started].thread, NULL, lg_worker_main,
+                       &g_workers[started]) != 0) {
+      fprintf(stderr, "Failed to start thread %u: %s\n", started,
+              strerror(errno));
+      break;
+    }
+  }
+  for (unsigned int t = 0; t < started; t++) {
+    pthread_join(g_workers[t].thread, NULL);
+  }
+
+  if (started == g_cfg.threads) {
+    lg_report((double)g_cfg.duration_s);
+    ret = 0;
+  }
+
+out:
+  for (unsigned int t = 0; t < g_cfg.threads; t++) {
+    lg_worker_free(&g_workers[t]);
+  }
+  coap_cleanup();
+  return ret;
+}
@@ -0,0 +1,306 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "chunk.h"
+
+/*
+ * Chunk layout: the sensor type (1 byte) and the sample count (2 bytes,
+ * little endian), then a bit stream, most significant bit first:
+ *
+ *   first timestamp (64 bits) and first value (32 bits, 1 for bools),
+ *   then per sample its timestamp and its value.
+ *
+ * A timestamp, like an int value, is the difference between its delta to
+ * the previous one and the previous delta, zigzag encoded, behind a prefix
+ * giving its width:
+ *
+ *   0 → 0, 10 → 7 bits, 110 → 9 bits, 1110 → 12 bits,
+ *   11110 → 20 bits, 11111 → 64 bits
+ *
+ * A float is XORed with the previous float: 0 when equal, 10 and the
+ * meaningful bits when they fit in the window of the previous XOR, else
+ * 11, the count of leading zeros (5 bits), the count of meaningful bits
+ * minus one (5 bits) and the meaningful bits.
+ */
+
+#define CHUNK_HEADER_SIZE 3
+
+typedef struct {
+  uint8_t *buf;
+  size_t   size;
+  size_t   pos;
+  uint64_t acc; /* fewer than 8 bits not written yet */
+  unsigned n;
+  bool     overflow;
+} chunk_writer_t;
+
+typedef struct {
+  const uint8_t *buf;
+  size_t         size;
+  size_t         pos;
+  uint64_t       acc;
+  unsigned       n; /* bits of acc not read yet */
+  bool           overrun;
+} chunk_reader_t;
+
+static const struct {
+  unsigned prefix_len;
+  unsigned prefix;
+  unsigned bits;
+} g_dod_classes[] = {
+  {2, 0x2, 7}, {3, 0x6, 9}, {4, 0xe, 12}, {5, 0x1e, 20}, {5, 0x1f, 64},
+};
+
+#define CHUNK_DOD_CLASSES (sizeof(g_dod_classes) / sizeof(g_dod_classes[0]))
+
+static void chunk_put(chunk_writer_t *w, uint64_t v, unsigned n)
+{
+  if (n > 32) {
+    chunk_put(w, v >> 32, n - 32);
+    n = 32;
+  }
+  w->acc = (w->acc << n) | (v & ((1ull << n) - 1));
+  w->n += n;
+  while (w->n >= 8) {
+    w->n -= 8;
+    if (w->pos < w->size) {
+      w->buf[w->pos++] = (uint8_t)(w->acc >> w->n);
+    } else {
+      w->overflow = true;
+    }
+  }
+}
+
+static void chunk_put_end(chunk_writer_t *w)
+{
+  if (w->n > 0) {
+    chunk_put(w, 0, 8 - w->n);
+  }
+}
+
+static uint64_t chunk_get(chunk_reader_t *r, unsigned n)
+{
+  if (n > 32) {
+    uint64_t hi = chunk_get(r, n - 32);
+
+    return hi << 32 | chunk_get(r, 32);
+  }
+  while (r->n < n) {
+    if (r->pos < r->size) {
+      r->acc = r->acc << 8 | r->buf[r->pos++];
+    } else {
+      r->acc <<= 8;
+      r->overrun = true;
+    }
+    r->n += 8;
+  }
+  r->n -= n;
+  return (r->acc >> r->n) & ((1ull << n) - 1);
+}
+
+static void chunk_put_dod(chunk_writer_t *w, int64_t dod)
+{
+  uint64_t z = ((uint64_t)dod << 1) ^ (uint64_t)(dod >> 63);
+
+  if (z == 0) {
+    chunk_put(w, 0, 1);
+    return;
+  }
+  for (size_t i = 0; i < CHUNK_DOD_CLASSES; i++) {
+    if (g_dod_classes[i].bits == 64 || z < 1ull << g_dod_classes[i].bits) {
+      chunk_put(w, g_dod_classes[i].prefix, g_dod_classes[i].prefix_len);
+      chunk_put(w, z, g_dod_classes[i].bits);
+      return;
+    }
+  }
+}
+
+static int64_t chunk_get_dod(chunk_reader_t *r)
+{
+  unsigned ones = 0;
+  uint64_t z;
+
+  while (ones < 5 && chunk_get(r, 1)) {
+    ones++;
+  }
+  if (ones == 0) {
+    return 0;
+  }
+  z = chunk_get(r, g_dod_classes[ones - 1].bits);
+  return (int64_t)(z >> 1) ^ -(int64_t)(z & 1);
+}
+
+static uint32_t chunk_float_bits(float f)
+{
+  uint32_t u;
+
+  memcpy(&u, &f, sizeof(u));
+  return u;
+}
+
+static float chunk_bits_float(uint32_t u)
+{
+  float f;
+
+  memcpy(&f, &u, sizeof(f));
+  return f;
+}
+
+/**
+ * @brief Encode samples sorted by timestamp
+ *
+ * @param type    SENSOR_TYPE_FLOAT, SENSOR_TYPE_INT or SENSOR_TYPE_BOOL
+ * @param samples Samples, the value member matching type
+ * @param count   1..CHUNK_SAMPLES
+ * @param buf     Destination, CHUNK_SIZE_MAX bytes is always enough
+ * @param size    Size of buf
+ *
+ * @return Bytes written, 0 if the arguments are invalid or buf too small
+ */
+size_t chunk_encode(sensor_type_t type, const chunk_sample_t *samples,
+                    size_t count, uint8_t *buf, size_t size)
+{
+  chunk_writer_t w          = {.buf = buf, .size = size};
+  int64_t        delta      = 0;
+  int64_t        value_diff = 0;
+  unsigned       lead       = 33; /* no window yet */
+  unsigned       trail      = 0;
+
+  if (count == 0 || count > CHUNK_SAMPLES || size < CHUNK_HEADER_SIZE ||
+      (type != SENSOR_TYPE_FLOAT && type != SENSOR_TYPE_INT &&
+       type != SENSOR_TYPE_BOOL)) {
+    return 0;
+  }
+  buf[0] = (uint8_t)type;
+  buf[1] = (uint8_t)(count & 0xff);
+  buf[2] = (uint8_t)(count >> 8);
+  w.pos  = CHUNK_HEADER_SIZE;
+
+  chunk_put(&w, (uint64_t)samples[0].ts, 64);
+  switch (type) {
+  case SENSOR_TYPE_FLOAT:
+    chunk_put(&w, chunk_float_bits(samples[0].value.f), 32);
+    break;
+  case SENSOR_TYPE_INT:
+    chunk_put(&w, (uint32_t)samples[0].value.i, 32);
+    break;
+  default:
+    chunk_put(&w, samples[0].value.b, 1);
+    break;
+  }
+
+  for (size_t i = 1; i < count; i++) {
+    int64_t d = samples[i].ts - samples[i - 1].ts;
+
+    chunk_put_dod(&w, d - delta);
+    delta = d;
+
+    if (type == SENSOR_TYPE_FLOAT) {
+      uint32_t x = chunk_float_bits(samples[i].value.f) ^
+                   chunk_float_bits(samples[i - 1].value.f);
+
+      if (x == 0) {
+        chunk_put(&w, 0, 1);
+      } else if (lead <= 32 && (unsigned)__builtin_clz(x) >= lead &&
+                 (unsigned)__builtin_ctz(x) >= trail) {
+        chunk_put(&w, 0x2, 2);
+        chunk_put(&w, x >> trail, 32 - lead - trail);
+      } else {
+        lead  = (unsigned)__builtin_clz(x);
+        trail = (unsigned)__builtin_ctz(x);
+        chunk_put(&w, 0x3, 2);
+        chunk_put(&w, lead, 5);
+        chunk_put(&w, 32 - lead - trail - 1, 5);
+        chunk_put(&w, x >> trail, 32 - lead - trail);
+      }
+    } else if (type == SENSOR_TYPE_INT) {
+      int64_t v = (int64_t)samples[i].value.i - samples[i - 1].value.i;
+
+      chunk_put_dod(&w, v - value_diff);
+      value_diff = v;
+    } else {
+      chunk_put(&w, samples[i].value.b, 1);
+    }
+  }
+  chunk_put_end(&w);
+
+  return w.overflow ? 0 : w.pos;
+}
+
+/**
+ * @brief Decode a chunk written by chunk_encode()
+ *
+ * @param data Encoded chunk
+ * @param len  Size of data
+ * @param type Set to the type of the samples
+ * @param out  Filled with the samples, in timestamp order
+ * @param max  Size of out, CHUNK_SAMPLES is always enough
+ *
+ * @return Number of samples, -1 if the chunk is malformed or out too small
+ */
+int chunk_decode(const uint8_t *data, size_t len, sensor_type_t *type,
+                 chunk_sample_t *out, size_t max)
+{
+  chunk_reader_t r          = {.buf = data, .size = len};
+  size_t         count;
+  int64_t        delta      = 0;
+  int64_t        value_diff = 0;
+  unsigned       lead       = 0;
+  unsigned       trail      = 0;
+
+  if (len < CHUNK_HEADER_SIZE) {
+    return -1;
+  }
+  *type = (sensor_type_t)data[0];
+  count = (size_t)data[1] | (size_t)data[2] << 8;
+  if (count == 0 || count > max ||
+      (*type != SENSOR_TYPE_FLOAT && *type != SENSOR_TYPE_INT &&
+       *type != SENSOR_TYPE_BOOL)) {
+    return -1;
+  }
+  r.pos = CHUNK_HEADER_SIZE;
+
+  out[0].ts = (int64_t)chunk_get(&r, 64);
+  switch (*type) {
+  case SENSOR_TYPE_FLOAT:
+    out[0].value.f = chunk_bits_float((uint32_t)chunk_get(&r, 32));
+    break;
+  case SENSOR_TYPE_INT:
+    out[0].value.i = (int32_t)(uint32_t)chunk_get(&r, 32);
+    break;
+  default:
+    out[0].value.b = chunk_get(&r, 1) != 0;
+    break;
+  }
+
+  for (size_t i = 1; i < count; i++) {
+    delta += chunk_get_dod(&r);
+    out[i].ts = out[i - 1].ts + delta;
+
+    if (*type == SENSOR_TYPE_FLOAT) {
+      uint32_t x = 0;
+
+      if (chunk_get(&r, 1)) {
+        if (chunk_get(&r, 1)) {
+          lead  = (unsigned)chunk_get(&r, 5);
+          trail = 32 - lead - ((unsigned)chunk_get(&r, 5) + 1);
+          if (lead + trail >= 32) {
+            return -1;
+          }
+        }
+        x = (uint32_t)chunk_get(&r, 32 - lead - trail) << trail;
+      }
+      out[i].value.f =
+        chunk_bits_float(chunk_float_bits(out[i - 1].value.f) ^ x);
+    } else if (*type == SENSOR_TYPE_INT) {
+      value_diff += chunk_get_dod(&r);
+      out[i].value.i = (int32_t)((int64_t)out[i - 1].value.i + value_diff);
+    } else {
+      out[i].value.b = chunk_get(&r, 1) != 0;
+    }
+  }
+
+  return r.overrun ? -1 : (int)count;
+}
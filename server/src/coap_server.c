@@ -1,92 +1,819 @@
 #include <coap3/coap.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
 
 #include "coap_server.h"
+#include "db.h"
+#include "dedup.h"
+#include "latest.h"
+#include "log.h"
+#include "metrics.h"
+#include "query.h"
+#include "reuseport.h"
 #include "sensor.h"
 #include "snapshot_parser.h"
-#include "db.h"
+#include "snapshot_store.h"
 
-static coap_context_t *g_ctx = NULL;
+/* A /sensor/query response being sent block by block. The cursor stays
+   open between blocks, so a block is produced from where the previous one
+   stopped instead of re-running the query. */
+typedef struct {
+  const coap_session_t *session; /* compared only, never dereferenced */
+  query_cursor_t       *cursor;  /* NULL if the slot is free */
+  char                  query[COAP_SERVER_QUERY_MAX_LEN];
+  uint32_t              next_block;
+  unsigned int          szx;
+  uint64_t              last_used_ns;
+} query_transfer_t;
 
-static void handle_snapshot_post(coap_resource_t     *resource,
-                                 coap_session_t      *session,
-                                 const coap_pdu_t    *request,
-                                 const coap_string_t *query,
-                                 coap_pdu_t          *response)
+/* A snapshot answered with an empty ACK, waiting for its readings to be
+   committed before its separate response is sent */
+typedef struct {
+  coap_session_t *session; /* referenced until then */
+  uint8_t         token[8];
+  size_t          token_len;
+  uint64_t        fingerprint;
+  uint64_t        queued_ns;
+} deferred_t;
+
+/* Outcome of a deferred snapshot, as the app data of its async state */
+#define DEFERRED_STORED ((void *)1)
+#define DEFERRED_LOST   ((void *)2)
+
+/* Periodic tasks of a worker, each on a timerfd of its own, see
+   g_timers */
+#define WORKER_TIMERS 1
+
+/* Source of an epoll event of a worker, in its data */
+enum {
+  WORKER_EVENT_COAP = 0, /* the epoll fd of libcoap */
+  WORKER_EVENT_WAKE,
+  WORKER_EVENT_SIGNAL,
+  WORKER_EVENT_TIMER, /* plus the index of the timer */
+};
+
+/* One libcoap context per I/O thread. Contexts are never shared: each
+   worker owns its endpoint, its sessions, its storage queue, its query
+   transfers and its own /sensor/latest/<device> resources, observed by the
+   clients it serves.
+
+   A worker sleeps in epoll_wait() on the fd of libcoap, its timers and its
+   wake eventfd. Other threads write to the eventfd when it has something
+   to do: the db writer once snapshots it waits for are committed, the
+   other workers once they changed latest values, and worker 0 on
+   shutdown. */
+typedef struct {
+  unsigned int      id;
+  coap_context_t   *ctx;
+  pthread_t         thread;
+  int               epoll_fd;
+  int               wake_fd;
+  int               timer_fds[WORKER_TIMERS];
+  atomic_bool       woken;   /* wake_fd written to and not read yet */
+  bool              changed; /* latest values changed, the other workers
+                                not woken up yet */
+  query_transfer_t  transfers[COAP_SERVER_QUERY_TRANSFERS];
+  coap_resource_t **latest;       /* by device number, NULL if not served */
+  size_t            latest_count; /* devices seen */
+  size_t            latest_cap;
+  uint64_t          latest_seq;   /* position in the registry change log */
+  deferred_t       *deferred;     /* FIFO of DB_ACKS_MAX, in queue order */
+  size_t            deferred_head;
+  size_t            deferred_count;
+} coap_worker_t;
+
+_Static_assert(COAP_SERVER_MAX_WORKERS <= METRICS_SLOT_WRITER,
+               "every worker needs a metrics slot of its own");
+
+static const char *const g_responses[COAP_SERVER_RESPONSE_LAST] = {
+  [COAP_SERVER_RESPONSE_PIGGYBACKED] = "piggybacked",
+  [COAP_SERVER_RESPONSE_SEPARATE]    = "separate",
+};
+
+static coap_worker_t          g_workers[COAP_SERVER_MAX_WORKERS];
+static unsigned int           g_worker_count = 0;
+static coap_server_response_t g_response = COAP_SERVER_RESPONSE_PIGGYBACKED;
+static atomic_bool            g_stop      = false;
+static int                    g_signal_fd = -1;
+
+/**
+ * @brief Look up a snapshot response mode by its name
+ *
+ * @param name Mode name ("piggybacked" or "separate")
+ * @param out  Set to the matching mode on success
+ *
+ * @return 0 on success, -1 if the name is unknown
+ */
+int coap_server_response_from_string(const char             *name,
+                                     coap_server_response_t *out)
 {
-  size_t         len    = 0;
-  size_t         offset = 0;
-  size_t         total  = 0;
-  const uint8_t *data   = NULL;
+  for (int i = 0; i < COAP_SERVER_RESPONSE_LAST; i++) {
+    if (strcmp(g_responses[i], name) == 0) {
+      *out = (coap_server_response_t)i;
+      return 0;
+    }
+  }
+  return -1;
+}
 
-  (void)resource;
-  (void)session;
-  (void)query;
+/* Content-Format of a request, JSON when the option is absent (the format
+   the first firmware releases sent) */
+static unsigned int snapshot_content_format(const coap_pdu_t *request)
+{
+  coap_opt_iterator_t opt_iter;
+  coap_opt_t         *opt;
+
+  opt = coap_check_option(request, COAP_OPTION_CONTENT_FORMAT, &opt_iter);
+  if (!opt) {
+    return COAP_MEDIATYPE_APPLICATION_JSON;
+  }
+  return coap_decode_var_bytes(coap_opt_value(opt), coap_opt_length(opt));
+}
+
+/* The `d` query parameter, if there is one */
+static bool snapshot_query_device(const coap_string_t *query, char *out,
+                                  size_t len)
+{
+  const char *p;
+  const char *end;
+
+  if (!query) {
+    return false;
+  }
+  p   = (const char *)query->s;
+  end = p + query->length;
+  while (p < end) {
+    const char *amp = memchr(p, '&', (size_t)(end - p));
+    size_t      n   = (size_t)((amp ? amp : end) - p);
+
+    if (n > 2 && p[0] == 'd' && p[1] == '=') {
+      snprintf(out, len, "%.*s", (int)(n - 2), p + 2);
+      return true;
+    }
+    p += n + 1;
+  }
+  return false;
+}
+
+static void snapshot_peer(const coap_session_t *session, char *out,
+                          size_t len)
+{
+  len = coap_print_addr(coap_session_get_addr_remote(session),
+                        (unsigned char *)out, len - 1);
+  out[len] = '\0';
+}
+
+/* Identity of the device that sent a snapshot, in order of preference: the
+   `d` query parameter, the identifier carried in the payload, then the
+   source address. The address is the last resort only: behind a carrier
+   NAT it changes over time and several devices may share it. */
+static void snapshot_device(const coap_session_t    *session,
+                            const coap_string_t     *query,
+                            const parsed_snapshot_t *snap, char *out,
+                            size_t len)
+{
+  if (snapshot_query_device(query, out, len)) {
+    return;
+  }
+
+  if (snap->device[0] != '\0') {
+    snprintf(out, len, "%s", snap->device);
+    return;
+  }
+
+  snapshot_peer(session, out, len);
+}
+
+/* Fingerprint of a snapshot for the dedup table, computed before parsing:
+   its sender and its exact bytes. A retransmission or a replay carries the
+   same bytes, timestamp included. The sender is the `d` query parameter or
+   else the source address, which a device identified in its payload only
+   keeps across retransmissions. */
+static uint64_t snapshot_fingerprint(const coap_session_t *session,
+                                     const coap_string_t  *query,
+                                     unsigned int          format,
+                                     const uint8_t        *data,
+                                     size_t                len)
+{
+  char     sender[SENSOR_DEVICE_MAX_LEN];
+  uint64_t h;
+
+  if (!snapshot_query_device(query, sender, sizeof(sender))) {
+    snapshot_peer(session, sender, sizeof(sender));
+  }
+  h = dedup_hash(0, sender, strlen(sender));
+  h = dedup_hash(h, &format, sizeof(format));
+  return dedup_hash(h, data, len);
+}
+
+/* 5.03 with a hint of when to come back. Without Max-Age a client would
+   assume the default of 60 s. */
+static void set_unavailable(coap_pdu_t *response, unsigned int max_age_s)
+{
+  uint8_t max_age[4];
+
+  coap_pdu_set_code(response, COAP_RESPONSE_CODE_SERVICE_UNAVAILABLE);
+  coap_add_option(response, COAP_OPTION_MAXAGE,
+                  coap_encode_var_safe(max_age, sizeof(max_age), max_age_s),
+                  max_age);
+}
+
+/* Registers the async state of a snapshot to answer once committed, in the
+   separate response mode. NULL when it is to be answered right away: other
+   mode, nothing to commit, too many snapshots waiting already, or a token
+   too long to keep. */
+static coap_async_t *snapshot_defer(coap_worker_t           *worker,
+                                    coap_session_t          *session,
+                                    const coap_pdu_t        *request,
+                                    const parsed_snapshot_t *snap)
+{
+  if (!worker->deferred || snap->count == 0 ||
+      worker->deferred_count == DB_ACKS_MAX ||
+      coap_pdu_get_token(request).length > sizeof(worker->deferred->token)) {
+    return NULL;
+  }
+  /* a delay of 0: wait for coap_async_trigger() */
+  return coap_register_async(session, request, 0);
+}
+
+static void deferred_push(coap_worker_t *worker, coap_session_t *session,
+                          const coap_pdu_t *request, uint64_t fingerprint)
+{
+  coap_bin_const_t token = coap_pdu_get_token(request);
+  size_t           tail  =
+    (worker->deferred_head + worker->deferred_count) % DB_ACKS_MAX;
+  deferred_t *d = &worker->deferred[tail];
+
+  d->session   = coap_session_reference(session);
+  d->token_len = token.length;
+  memcpy(d->token, token.s, token.length);
+  d->fingerprint = fingerprint;
+  d->queued_ns   = metrics_now_ns();
+  worker->deferred_count++;
+}
+
+/* Trigger the separate responses of the snapshots whose commit is over.
+   The outcomes come in queue order, as the snapshots in the FIFO. */
+static void deferred_poll(coap_worker_t *worker)
+{
+  int      status[64];
+  size_t   n;
+  uint64_t now_ns = metrics_now_ns();
+
+  while ((n = db_acks_pop(worker->id, status, 64)) > 0) {
+    for (size_t i = 0; i < n; i++) {
+      deferred_t      *d     = &worker->deferred[worker->deferred_head];
+      coap_bin_const_t token = {.length = d->token_len, .s = d->token};
+      coap_async_t    *async = coap_find_async(d->session, token);
+
+      /* gone if the session was dropped meanwhile */
+      if (async) {
+        coap_async_set_app_data(async, status[i] == 0 ? DEFERRED_STORED
+                                                      : DEFERRED_LOST);
+        coap_async_trigger(async);
+      }
+      if (status[i] == 0) {
+        dedup_add(d->fingerprint, now_ns);
+      } else {
+        metrics_add(worker->id, METRICS_LOST, 1);
+      }
+      metrics_observe(worker->id, METRICS_HIST_COMMIT,
+                      now_ns - d->queued_ns);
+      coap_session_release(d->session);
+
+      worker->deferred_head = (worker->deferred_head + 1) % DB_ACKS_MAX;
+      worker->deferred_count--;
+    }
+  }
+}
+
+static void deferred_release(coap_worker_t *worker)
+{
+  for (; worker->deferred_count > 0; worker->deferred_count--) {
+    coap_session_release(worker->deferred[worker->deferred_head].session);
+    worker->deferred_head = (worker->deferred_head + 1) % DB_ACKS_MAX;
+  }
+  free(worker->deferred);
+  worker->deferred = NULL;
+}
+
+/* Second call of the handler for a deferred snapshot: its separate
+   response, once deferred_poll() has triggered it */
+static void snapshot_answer(coap_session_t *session, coap_async_t *async,
+                            coap_pdu_t *response)
+{
+  void *outcome = coap_async_get_app_data(async);
+
+  if (!outcome) {
+    /* not committed yet: a retransmission, left to the empty ACK */
+    return;
+  }
+  coap_pdu_set_code(response, outcome == DEFERRED_STORED
+                                ? COAP_RESPONSE_CODE_CHANGED
+                                : COAP_RESPONSE_CODE_INTERNAL_ERROR);
+  coap_free_async(session, async);
+}
+
+static void snapshot_post(coap_worker_t       *worker,
+                          coap_session_t      *session,
+                          const coap_pdu_t    *request,
+                          const coap_string_t *query,
+                          coap_pdu_t          *response)
+{
+  size_t         len         = 0;
+  size_t         offset      = 0;
+  size_t         total       = 0;
+  const uint8_t *data        = NULL;
+  uint64_t       fingerprint = 0;
+  unsigned int   format;
+  uint64_t       start_ns;
 
   /* COAP_BLOCK_SINGLE_BODY is set so this is always the complete body */
   if (!coap_get_data_large(request, &len, &data, &offset, &total)) {
-    fprintf(stderr, "handle_snapshot_post: failed to get payload\n");
+    LOG_WARN("handle_snapshot_post: failed to get payload");
     coap_pdu_set_code(response, COAP_RESPONSE_CODE_BAD_REQUEST);
     return;
   }
 
   if (len == 0 || data == NULL) {
-    fprintf(stderr, "handle_snapshot_post: empty payload\n");
+    LOG_WARN("handle_snapshot_post: empty payload");
     coap_pdu_set_code(response, COAP_RESPONSE_CODE_BAD_REQUEST);
     return;
   }
 
-  fprintf(stdout, "Received snapshot: %.*s\n", (unsigned int)len, data);
+  metrics_add(worker->id, METRICS_SNAPSHOTS, 1);
+  metrics_add(worker->id, METRICS_BYTES_IN, len);
+
+  /* A snapshot already stored, retransmitted because our ACK was lost or
+     replayed by the device, is acknowledged again as is */
+  format   = snapshot_content_format(request);
+  start_ns = metrics_now_ns();
+  if (dedup_enabled()) {
+    fingerprint = snapshot_fingerprint(session, query, format, data, len);
+    if (dedup_seen(fingerprint, start_ns)) {
+      metrics_add(worker->id, METRICS_DUPLICATES, 1);
+      coap_pdu_set_code(response, COAP_RESPONSE_CODE_CHANGED);
+      return;
+    }
+    metrics_add(worker->id, METRICS_DEDUP_MISSES, 1);
+  }
+
+  /* Storage is falling behind: refuse the snapshot before spending anything
+     on it, and tell the device when the backlog should be written */
+  if (db_admit(worker->id) != 0) {
+    metrics_add(worker->id, METRICS_REFUSED, 1);
+    set_unavailable(response, (unsigned int)db_retry_after_s());
+    return;
+  }
 
-  /* Parse the snapshot */
+  /* Parse the snapshot according to its Content-Format */
   parsed_snapshot_t snap;
-  if (parse_snapshot_json((const char *)data, len, &snap) != 0) {
-    fprintf(stderr, "handle_snapshot_post: JSON parse failed\n");
+  int               ret;
+
+  switch (format) {
+  case COAP_MEDIATYPE_APPLICATION_JSON:
+    LOG_DEBUG("Received snapshot: %.*s", (unsigned int)len, data);
+    ret = parse_snapshot_json((const char *)data, len, &snap);
+    break;
+  case COAP_MEDIATYPE_APPLICATION_CBOR:
+    LOG_DEBUG("Received CBOR snapshot (%zu bytes)", len);
+    ret = parse_snapshot_cbor(data, len, &snap);
+    break;
+  case COAP_MEDIATYPE_APPLICATION_SENML_CBOR:
+    LOG_DEBUG("Received SenML-CBOR snapshot (%zu bytes)", len);
+    ret = parse_snapshot_senml(data, len, &snap);
+    break;
+  default:
+    LOG_WARN("handle_snapshot_post: unsupported Content-Format");
+    metrics_add(worker->id, METRICS_PARSE_FAILURES, 1);
+    coap_pdu_set_code(response,
+                      COAP_RESPONSE_CODE_UNSUPPORTED_CONTENT_FORMAT);
+    return;
+  }
+  metrics_observe(worker->id, METRICS_HIST_PARSE, metrics_now_ns() - start_ns);
+
+  if (ret != 0) {
+    LOG_WARN("handle_snapshot_post: snapshot parse failed");
+    metrics_add(worker->id, METRICS_PARSE_FAILURES, 1);
     coap_pdu_set_code(response, COAP_RESPONSE_CODE_BAD_REQUEST);
     return;
   }
 
-  /* Insert each reading into the DB */
-  for (size_t i = 0; i < snap.count; i++) {
-    parsed_reading_t *r = &snap.readings[i];
+  char device[SENSOR_DEVICE_MAX_LEN];
+  snapshot_device(session, query, &snap, device, sizeof(device));
+
+  coap_async_t *async = snapshot_defer(worker, session, request, &snap);
 
-    sensor_registry_t *reg = sensor_reg_get();
+  bool changed;
 
-    sensor_channel_t *ch = sensor_channel_register(reg, r->name, r->type);
-    if (!ch) {
-      fprintf(stderr, "handle_snapshot_post: failed to register channel '%s'\n",
-              r->name);
-      continue;
+  start_ns = metrics_now_ns();
+  ret = snapshot_store(worker->id, device, &snap, async != NULL, &changed);
+  metrics_observe(worker->id, METRICS_HIST_STORE, metrics_now_ns() - start_ns);
+  worker->changed |= changed;
+  if (ret != 0) {
+    LOG_WARN("handle_snapshot_post: storage queue full or spool failed, "
+             "rejecting snapshot");
+    if (async) {
+      coap_free_async(session, async);
     }
+    metrics_add(worker->id, METRICS_QUEUE_FULL, 1);
+    set_unavailable(response, (unsigned int)db_retry_after_s());
+    return;
+  }
 
-    switch (r->type) {
-    case SENSOR_TYPE_FLOAT:
-      sensor_channel_update_float(ch, r->value.f);
-      break;
-    case SENSOR_TYPE_INT:
-      sensor_channel_update_int(ch, r->value.i);
-      break;
-    case SENSOR_TYPE_STRING:
-      sensor_channel_update_string(ch, r->value.s);
-      break;
-    case SENSOR_TYPE_BOOL:
-      sensor_channel_update_bool(ch, r->value.b);
-      break;
-    case SENSOR_TYPE_LAST:
-      break;
+  if (async) {
+    /* no response code: libcoap sends an empty ACK, the 2.04 follows once
+       the readings are committed */
+    deferred_push(worker, session, request, fingerprint);
+    return;
+  }
+
+  /* only now: a snapshot refused above is taken when it comes again */
+  dedup_add(fingerprint, start_ns);
+  coap_pdu_set_code(response, COAP_RESPONSE_CODE_CHANGED);
+}
+
+static void handle_snapshot_post(coap_resource_t     *resource,
+                                 coap_session_t      *session,
+                                 const coap_pdu_t    *request,
+                                 const coap_string_t *query,
+                                 coap_pdu_t          *response)
+{
+  uint64_t       start_ns = metrics_now_ns();
+  coap_worker_t *worker =
+    coap_context_get_app_data(coap_session_get_context(session));
+  coap_async_t *async;
+
+  (void)resource;
+
+  if (worker->deferred &&
+      (async = coap_find_async(session, coap_pdu_get_token(request)))) {
+    snapshot_answer(session, async, response);
+    return;
+  }
+
+  snapshot_post(worker, session, request, query, response);
+  metrics_observe(worker->id, METRICS_HIST_HANDLER,
+                  metrics_now_ns() - start_ns);
+}
+
+static void release_metrics(coap_session_t *session, void *text)
+{
+  (void)session;
+  free(text);
+}
+
+/* Rendered at block 0 of every GET; libcoap keeps the body and serves the
+   following Block2 blocks from it, so a transfer is one consistent view */
+static void handle_metrics_get(coap_resource_t     *resource,
+                               coap_session_t      *session,
+                               const coap_pdu_t    *request,
+                               const coap_string_t *query,
+                               coap_pdu_t          *response)
+{
+  char  *text;
+  size_t len;
+
+  if (metrics_render(&text, &len) != 0) {
+    LOG_ERROR("handle_metrics_get: cannot render metrics");
+    coap_pdu_set_code(response, COAP_RESPONSE_CODE_INTERNAL_ERROR);
+    return;
+  }
+
+  coap_pdu_set_code(response, COAP_RESPONSE_CODE_CONTENT);
+  /* the text is released by libcoap, on error too */
+  if (!coap_add_data_large_response(resource, session, request, response,
+                                    query, COAP_MEDIATYPE_TEXT_PLAIN, 0, 0,
+                                    len, (const uint8_t *)text,
+                                    release_metrics, text)) {
+    LOG_ERROR("handle_metrics_get: cannot add the payload");
+    coap_pdu_set_code(response, COAP_RESPONSE_CODE_INTERNAL_ERROR);
+  }
+}
+
+static void query_transfer_end(query_transfer_t *t)
+{
+  if (t->cursor) {
+    query_close(t->cursor);
+    t->cursor = NULL;
+  }
+}
+
+/* Close the transfers whose client stopped asking for blocks */
+static void query_transfers_expire(coap_worker_t *worker)
+{
+  uint64_t now_ns = metrics_now_ns();
+
+  for (size_t i = 0; i < COAP_SERVER_QUERY_TRANSFERS; i++) {
+    query_transfer_t *t = &worker->transfers[i];
+
+    if (t->cursor &&
+        now_ns - t->last_used_ns > COAP_SERVER_QUERY_IDLE_MS * 1000000ull) {
+      query_transfer_end(t);
     }
+  }
+}
 
-    if (db_insert_reading(ch, snap.timestamp_ms) != 0) {
-      fprintf(stderr, "handle_snapshot_post: db insert failed for '%s'\n",
-              r->name);
-      /* don't abort: best effort for remaining channels */
+/* The transfer a Block2 request continues, or NULL */
+static query_transfer_t *query_transfer_find(coap_worker_t        *worker,
+                                             const coap_session_t *session,
+                                             const coap_string_t  *query,
+                                             uint32_t num, unsigned int szx)
+{
+  for (size_t i = 0; i < COAP_SERVER_QUERY_TRANSFERS; i++) {
+    query_transfer_t *t = &worker->transfers[i];
+
+    if (t->cursor && t->session == session && t->next_block == num &&
+        t->szx == szx && strlen(t->query) == query->length &&
+        memcmp(t->query, query->s, query->length) == 0) {
+      return t;
     }
   }
+  return NULL;
+}
 
-  coap_pdu_set_code(response, COAP_RESPONSE_CODE_CHANGED);
+/* A free slot, or the least recently used one */
+static query_transfer_t *query_transfer_slot(coap_worker_t *worker)
+{
+  query_transfer_t *lru = &worker->transfers[0];
+
+  for (size_t i = 0; i < COAP_SERVER_QUERY_TRANSFERS; i++) {
+    query_transfer_t *t = &worker->transfers[i];
+
+    if (!t->cursor) {
+      return t;
+    }
+    if (t->last_used_ns < lru->last_used_ns) {
+      lru = t;
+    }
+  }
+  query_transfer_end(lru);
+  return lru;
+}
+
+/* Start a transfer at block num. Blocks before it are produced and dropped:
+   that only happens when a client restarts or resumes a transfer this
+   worker no longer has, and only up to COAP_SERVER_QUERY_SKIP_MAX, so a
+   client cannot have the worker scan a whole result for one block. */
+static query_transfer_t *query_transfer_start(coap_worker_t        *worker,
+                                              const coap_session_t *session,
+                                              const coap_string_t  *query,
+                                              uint32_t num, unsigned int szx,
+                                              coap_pdu_t *response)
+{
+  query_transfer_t *t;
+  query_params_t    params;
+  char              skip[COAP_SERVER_QUERY_BLOCK_MAX];
+  size_t            size = 1u << (szx + 4);
+  bool              done = false;
+  int               rc;
+
+  if ((uint64_t)num * size > COAP_SERVER_QUERY_SKIP_MAX ||
+      query_params_parse((const char *)query->s, query->length, &params) !=
+        0) {
+    coap_pdu_set_code(response, COAP_RESPONSE_CODE_BAD_REQUEST);
+    return NULL;
+  }
+
+  t  = query_transfer_slot(worker);
+  rc = query_open(&params, &t->cursor);
+  if (rc != 0) {
+    t->cursor = NULL;
+    if (rc == QUERY_ERR_BUSY) {
+      /* every connection is streaming: try again in a second */
+      set_unavailable(response, 1);
+    } else {
+      coap_pdu_set_code(response, COAP_RESPONSE_CODE_INTERNAL_ERROR);
+    }
+    return NULL;
+  }
+
+  t->session    = session;
+  t->next_block = num;
+  t->szx        = szx;
+  memcpy(t->query, query->s, query->length);
+  t->query[query->length] = '\0';
+
+  for (uint32_t b = 0; b < num; b++) {
+    if (done || query_read(t->cursor, skip, size, &done) < 0) {
+      query_transfer_end(t);
+      coap_pdu_set_code(response, COAP_RESPONSE_CODE_BAD_REQUEST);
+      return NULL;
+    }
+  }
+  if (done) {
+    query_transfer_end(t);
+    coap_pdu_set_code(response, COAP_RESPONSE_CODE_BAD_REQUEST);
+    return NULL;
+  }
+  return t;
+}
+
+static void handle_query_get(coap_resource_t     *resource,
+                             coap_session_t      *session,
+                             const coap_pdu_t    *request,
+                             const coap_string_t *query,
+                             coap_pdu_t          *response)
+{
+  coap_worker_t *worker =
+    coap_context_get_app_data(coap_session_get_context(session));
+  query_transfer_t *t;
+  coap_block_b_t    block;
+  bool              blockwise = false;
+  uint32_t          num       = 0;
+  unsigned int      szx       = COAP_SERVER_QUERY_BLOCK_SZX;
+  char              buf[COAP_SERVER_QUERY_BLOCK_MAX];
+  uint8_t           opt[4];
+  ssize_t           n;
+  bool              done;
+
+  (void)resource;
+
+  if (!query_pool_enabled()) {
+    coap_pdu_set_code(response, COAP_RESPONSE_CODE_NOT_IMPLEMENTED);
+    return;
+  }
+  if (!query || query->length >= COAP_SERVER_QUERY_MAX_LEN) {
+    coap_pdu_set_code(response, COAP_RESPONSE_CODE_BAD_REQUEST);
+    return;
+  }
+
+  /* the client may ask for smaller blocks than ours, never for larger */
+  if (coap_get_block_b(session, request, COAP_OPTION_BLOCK2, &block)) {
+    blockwise = true;
+    num       = block.num;
+    if (block.szx < szx) {
+      szx = block.szx;
+    }
+  }
+
+  t = query_transfer_find(worker, session, query, num, szx);
+  if (!t) {
+    t = query_transfer_start(worker, session, query, num, szx, response);
+    if (!t) {
+      return;
+    }
+  }
+
+  n = query_read(t->cursor, buf, 1u << (szx + 4), &done);
+  if (n < 0) {
+    query_transfer_end(t);
+    coap_pdu_set_code(response, COAP_RESPONSE_CODE_INTERNAL_ERROR);
+    return;
+  }
+
+  coap_pdu_set_code(response, COAP_RESPONSE_CODE_CONTENT);
+  coap_add_option(response, COAP_OPTION_CONTENT_FORMAT,
+                  coap_encode_var_safe(opt, sizeof(opt),
+                                       COAP_MEDIATYPE_APPLICATION_JSON),
+                  opt);
+  if (blockwise || !done) {
+    coap_add_option(response, COAP_OPTION_BLOCK2,
+                    coap_encode_var_safe(opt, sizeof(opt),
+                                         num << 4 | !done << 3 | szx),
+                    opt);
+  }
+  coap_add_data(response, (size_t)n, (const uint8_t *)buf);
+
+  if (done) {
+    query_transfer_end(t);
+  } else {
+    t->next_block   = num + 1;
+    t->last_used_ns = metrics_now_ns();
+  }
+}
+
+static void release_latest(coap_session_t *session, void *body)
+{
+  (void)session;
+  latest_body_put(body);
+}
+
+/* Serves GETs and notifications alike: the body is rendered once per change
+   of the device and shared by every observer, and its version doubles as
+   the ETag */
+static void handle_latest_get(coap_resource_t     *resource,
+                              coap_session_t      *session,
+                              const coap_pdu_t    *request,
+                              const coap_string_t *query,
+                              coap_pdu_t          *response)
+{
+  size_t         device = (uintptr_t)coap_resource_get_userdata(resource);
+  latest_body_t *body   = latest_body_get(device);
+
+  if (!body) {
+    coap_pdu_set_code(response, COAP_RESPONSE_CODE_INTERNAL_ERROR);
+    return;
+  }
+
+  coap_pdu_set_code(response, COAP_RESPONSE_CODE_CONTENT);
+  /* the reference is dropped by libcoap, on error too */
+  if (!coap_add_data_large_response(resource, session, request, response,
+                                    query, COAP_MEDIATYPE_APPLICATION_JSON, -1,
+                                    body->version, body->len,
+                                    (const uint8_t *)body->data,
+                                    release_latest, body)) {
+    LOG_ERROR("handle_latest_get: cannot add the payload");
+    coap_pdu_set_code(response, COAP_RESPONSE_CODE_INTERNAL_ERROR);
+  }
+}
+
+/* Creates the observable resource of a device new to the worker. Devices
+   with names that make no URI path segment are not served. */
+static int latest_add(coap_worker_t *worker, size_t device)
+{
+  coap_resource_t  *r;
+  coap_str_const_t *uri;
+  char              name[SENSOR_DEVICE_MAX_LEN];
+  char              path[SENSOR_DEVICE_MAX_LEN + 16];
+  int               len;
+
+  if (worker->latest_count == worker->latest_cap) {
+    size_t            cap = worker->latest_cap ? worker->latest_cap * 2 : 64;
+    coap_resource_t **latest;
+
+    latest = realloc(worker->latest, cap * sizeof(*latest));
+    if (!latest) {
+      return -1;
+    }
+    worker->latest     = latest;
+    worker->latest_cap = cap;
+  }
+  worker->latest[device] = NULL;
+
+  if (sensor_device_name(sensor_reg_get(), device, name, sizeof(name)) != 0 ||
+      name[0] == '\0' || strchr(name, '/') || strchr(name, '?')) {
+    return 0;
+  }
+  len = snprintf(path, sizeof(path), "sensor/latest/%s", name);
+  uri = coap_new_str_const((const uint8_t *)path, (size_t)len);
+  if (!uri) {
+    return -1;
+  }
+  r = coap_resource_init(uri, COAP_RESOURCE_FLAGS_RELEASE_URI);
+  if (!r) {
+    return -1;
+  }
+
+  coap_register_request_handler(r, COAP_REQUEST_GET, handle_latest_get);
+  coap_resource_set_get_observable(r, 1);
+  coap_resource_set_userdata(r, (void *)(uintptr_t)device);
+  coap_add_attr(r, coap_make_str_const("ct"), coap_make_str_const("50"), 0);
+  coap_add_attr(r, coap_make_str_const("obs"), NULL, 0);
+
+  coap_add_resource(worker->ctx, r);
+  worker->latest[device] = r;
+  return 0;
+}
+
+/* After every wakeup: serve the devices that appeared and mark the ones
+   that changed. libcoap sends the notifications of a dirty resource once,
+   however many snapshots changed it since, at its next
+   coap_io_prepare_epoll(). */
+static void latest_poll(coap_worker_t *worker)
+{
+  sensor_registry_t *reg   = sensor_reg_get();
+  size_t             count = sensor_device_count(reg);
+  uint32_t           changed[256];
+  size_t             n;
+
+  for (; worker->latest_count < count; worker->latest_count++) {
+    if (latest_add(worker, worker->latest_count) != 0) {
+      LOG_ERROR("worker %u: cannot serve the latest values of device %zu",
+                worker->id, worker->latest_count);
+      break;
+    }
+  }
+
+  do {
+    n = sizeof(changed) / sizeof(changed[0]);
+    if (!sensor_device_changes(reg, &worker->latest_seq, changed, &n)) {
+      /* too far behind to tell which: notify them all */
+      for (size_t i = 0; i < worker->latest_count; i++) {
+        if (worker->latest[i]) {
+          coap_resource_notify_observers(worker->latest[i], NULL);
+        }
+      }
+    }
+    for (size_t i = 0; i < n; i++) {
+      if (changed[i] < worker->latest_count && worker->latest[changed[i]]) {
+        coap_resource_notify_observers(worker->latest[changed[i]], NULL);
+      }
+    }
+  } while (n == sizeof(changed) / sizeof(changed[0]));
 }
 
 static void init_resources(coap_context_t *ctx)
@@ -101,80 +828,400 @@ static void init_resources(coap_context_t *ctx)
   coap_register_request_handler(r, COAP_REQUEST_POST, handle_snapshot_post);
 
   /* Advertise this resource in /.well-known/core */
-  coap_add_attr(r, coap_make_str_const("ct"), coap_make_str_const("50"),
-                0); /* 50 = application/json */
+  /* 50 = application/json, 60 = application/cbor,
+     112 = application/senml+cbor */
+  coap_add_attr(r, coap_make_str_const("ct"),
+                coap_make_str_const("\"50 60 112\""), 0);
   coap_add_attr(r, coap_make_str_const("title"),
                 coap_make_str_const("\"Sensor Snapshot\""), 0);
 
   coap_add_resource(ctx, r);
+
+  r = coap_resource_init(coap_make_str_const("sensor/query"), 0);
+  if (!r) {
+    return;
+  }
+
+  coap_register_request_handler(r, COAP_REQUEST_GET, handle_query_get);
+  coap_add_attr(r, coap_make_str_const("ct"), coap_make_str_const("50"), 0);
+  coap_add_attr(r, coap_make_str_const("title"),
+                coap_make_str_const("\"Readings of a channel\""), 0);
+
+  coap_add_resource(ctx, r);
+
+  r = coap_resource_init(coap_make_str_const("metrics"), 0);
+  if (!r) {
+    return;
+  }
+
+  coap_register_request_handler(r, COAP_REQUEST_GET, handle_metrics_get);
+  coap_add_attr(r, coap_make_str_const("ct"), coap_make_str_const("0"), 0);
+  coap_add_attr(r, coap_make_str_const("title"),
+                coap_make_str_const("\"Ingestion metrics\""), 0);
+
+  coap_add_resource(ctx, r);
 }
 
-/**
- * @brief Initialize the CoAP server and start listening on the given port
- *
- * @param port UDP port to listen on
- *
- * @return 0 on success, -1 on error
- */
-int coap_server_init(uint16_t port)
+/* Every COAP_SERVER_HOUSEKEEPING_MS */
+static void worker_housekeeping(coap_worker_t *worker)
+{
+  query_transfers_expire(worker);
+}
+
+static const struct {
+  unsigned int period_ms;
+  void (*run)(coap_worker_t *worker);
+} g_timers[WORKER_TIMERS] = {
+  {COAP_SERVER_HOUSEKEEPING_MS, worker_housekeeping},
+};
+
+static int worker_watch(coap_worker_t *worker, int fd, uint32_t event)
+{
+  struct epoll_event ev = {.events = EPOLLIN, .data.u32 = event};
+
+  return epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+/* Creates the epoll set of a worker and what it waits on besides libcoap */
+static int worker_events_init(coap_worker_t *worker)
+{
+  int coap_fd = coap_context_get_coap_fd(worker->ctx);
+
+  if (coap_fd < 0) {
+    LOG_ERROR("libcoap was built without epoll support");
+    return -1;
+  }
+  worker->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  worker->wake_fd  = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (worker->epoll_fd < 0 || worker->wake_fd < 0 ||
+      worker_watch(worker, coap_fd, WORKER_EVENT_COAP) != 0 ||
+      worker_watch(worker, worker->wake_fd, WORKER_EVENT_WAKE) != 0) {
+    LOG_ERROR("Failed to set up the event loop: %s", strerror(errno));
+    return -1;
+  }
+
+  for (size_t i = 0; i < WORKER_TIMERS; i++) {
+    struct itimerspec period = {0};
+
+    period.it_interval.tv_sec  = g_timers[i].period_ms / 1000;
+    period.it_interval.tv_nsec = (long)(g_timers[i].period_ms % 1000) *
+                                 1000000;
+    period.it_value            = period.it_interval;
+
+    worker->timer_fds[i] =
+      timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (worker->timer_fds[i] < 0 ||
+        timerfd_settime(worker->timer_fds[i], 0, &period, NULL) != 0 ||
+        worker_watch(worker, worker->timer_fds[i],
+                     WORKER_EVENT_TIMER + (uint32_t)i) != 0) {
+      LOG_ERROR("Failed to set up a timer: %s", strerror(errno));
+      return -1;
+    }
+  }
+
+  if (worker->deferred) {
+    db_acks_notify(worker->id, worker->wake_fd);
+  }
+  return 0;
+}
+
+static void worker_free(coap_worker_t *worker)
+{
+  for (size_t t = 0; t < COAP_SERVER_QUERY_TRANSFERS; t++) {
+    query_transfer_end(&worker->transfers[t]);
+  }
+  /* responses not sent yet are dropped, their readings are committed */
+  deferred_release(worker);
+  if (worker->ctx) {
+    coap_free_context(worker->ctx);
+    worker->ctx = NULL;
+  }
+  free(worker->latest);
+  worker->latest = NULL;
+
+  /* the writer may still be running */
+  db_acks_notify(worker->id, -1);
+  for (size_t i = 0; i < WORKER_TIMERS; i++) {
+    if (worker->timer_fds[i] >= 0) {
+      close(worker->timer_fds[i]);
+      worker->timer_fds[i] = -1;
+    }
+  }
+  if (worker->wake_fd >= 0) {
+    close(worker->wake_fd);
+    worker->wake_fd = -1;
+  }
+  if (worker->epoll_fd >= 0) {
+    close(worker->epoll_fd);
+    worker->epoll_fd = -1;
+  }
+}
+
+static int worker_init(coap_worker_t *worker, unsigned int id, uint16_t port,
+                       bool reuseport)
 {
   coap_endpoint_t *endpoint;
   coap_address_t   listen_addr;
 
-  coap_startup();
+  memset(worker, 0, sizeof(*worker));
+  worker->id       = id;
+  worker->epoll_fd = -1;
+  worker->wake_fd  = -1;
+  for (size_t i = 0; i < WORKER_TIMERS; i++) {
+    worker->timer_fds[i] = -1;
+  }
 
-  g_ctx = coap_new_context(NULL);
-  if (!g_ctx) {
-    fprintf(stderr, "Failed to create CoAP context\n");
+  worker->ctx = coap_new_context(NULL);
+  if (!worker->ctx) {
+    LOG_ERROR("Failed to create CoAP context");
     return -1;
   }
+  coap_context_set_app_data(worker->ctx, worker);
+  /* Block1 snapshots are reassembled and Block2 responses (/metrics) are
+     split by libcoap */
+  coap_context_set_block_mode(worker->ctx,
+                              COAP_BLOCK_USE_LIBCOAP | COAP_BLOCK_SINGLE_BODY);
+
+  if (g_response == COAP_SERVER_RESPONSE_SEPARATE) {
+    worker->deferred = calloc(DB_ACKS_MAX, sizeof(*worker->deferred));
+    if (!worker->deferred) {
+      LOG_ERROR("Failed to allocate the deferred responses");
+      goto error;
+    }
+  }
 
   coap_address_init(&listen_addr);
   listen_addr.addr.sa.sa_family        = AF_INET;
   listen_addr.addr.sin.sin_addr.s_addr = INADDR_ANY;
   listen_addr.addr.sin.sin_port        = htons(port);
 
-  endpoint = coap_new_endpoint(g_ctx, &listen_addr, COAP_PROTO_UDP);
+  reuseport_set(reuseport);
+  endpoint = coap_new_endpoint(worker->ctx, &listen_addr, COAP_PROTO_UDP);
+  reuseport_set(false);
   if (!endpoint) {
-    fprintf(stderr, "Failed to create CoAP endpoint on port %d\n", port);
-    coap_free_context(g_ctx);
-    g_ctx = NULL;
+    LOG_ERROR("Failed to create CoAP endpoint on port %d", port);
+    goto error;
+  }
+
+  init_resources(worker->ctx);
+  if (worker_events_init(worker) != 0) {
+    goto error;
+  }
+  return 0;
+
+error:
+  worker_free(worker);
+  return -1;
+}
+
+/**
+ * @brief Initialize the CoAP server and start listening on the given port
+ *
+ * With more than one worker, every worker gets its own context and its own
+ * SO_REUSEPORT socket bound to the same port, and the kernel load-balances
+ * clients across them (a given client always lands on the same worker).
+ *
+ * @param port     UDP port to listen on
+ * @param workers  Number of I/O threads, 1..COAP_SERVER_MAX_WORKERS
+ * @param response How stored snapshots are answered
+ *
+ * @return 0 on success, -1 on error
+ */
+int coap_server_init(uint16_t port, unsigned int workers,
+                     coap_server_response_t response)
+{
+  if (workers == 0 || workers > COAP_SERVER_MAX_WORKERS) {
+    LOG_ERROR("Worker count must be 1..%d", COAP_SERVER_MAX_WORKERS);
+    return -1;
+  }
+  g_response = response;
+
+  coap_startup();
+  if (response == COAP_SERVER_RESPONSE_SEPARATE && !coap_async_is_supported()) {
+    LOG_ERROR("Separate responses need libcoap built with async support");
+    coap_cleanup();
     return -1;
   }
 
-  init_resources(g_ctx);
+  for (g_worker_count = 0; g_worker_count < workers; g_worker_count++) {
+    if (worker_init(&g_workers[g_worker_count], g_worker_count, port,
+                    workers > 1) != 0) {
+      coap_server_cleanup();
+      return -1;
+    }
+  }
 
-  fprintf(stdout, "CoAP server listening on port %d\n", port);
+  LOG_INFO("CoAP server listening on port %d (%u worker%s, %s responses)",
+           port, workers, workers > 1 ? "s" : "", g_responses[response]);
   return 0;
 }
 
 /**
- * @brief Free the CoAP context and shut down the CoAP stack
+ * @brief Free the CoAP contexts and shut down the CoAP stack
  */
 void coap_server_cleanup(void)
 {
-  if (g_ctx) {
-    coap_free_context(g_ctx);
-    g_ctx = NULL;
+  for (unsigned int i = 0; i < g_worker_count; i++) {
+    worker_free(&g_workers[i]);
   }
+  g_worker_count = 0;
+  latest_close();
   coap_cleanup();
 }
 
+/* Wakes a worker up, once until it has read its eventfd */
+static void worker_wake(coap_worker_t *worker)
+{
+  if (!atomic_exchange(&worker->woken, true)) {
+    /* fails only on a full counter, which wakes it up too */
+    eventfd_write(worker->wake_fd, 1);
+  }
+}
+
+/* Reads the signals queued on the signalfd of the process */
+static void worker_signal(void)
+{
+  struct signalfd_siginfo info;
+
+  while (read(g_signal_fd, &info, sizeof(info)) == sizeof(info)) {
+    LOG_INFO("Received %s, shutting down",
+             info.ssi_signo == SIGTERM ? "SIGTERM" : "SIGINT");
+    coap_server_stop();
+  }
+}
+
+/* Whatever woke the worker up: commits, changes made by the other workers
+   and by its own snapshots */
+static void worker_poll(coap_worker_t *worker)
+{
+  latest_poll(worker);
+  if (worker->deferred) {
+    deferred_poll(worker);
+  }
+  if (worker->changed) {
+    worker->changed = false;
+    for (unsigned int i = 0; i < g_worker_count; i++) {
+      if (&g_workers[i] != worker) {
+        worker_wake(&g_workers[i]);
+      }
+    }
+  }
+}
+
+static void *worker_loop(void *arg)
+{
+  coap_worker_t     *worker = arg;
+  struct epoll_event events[COAP_SERVER_EPOLL_EVENTS];
+  coap_tick_t        now;
+  unsigned int       timeout_ms;
+  uint64_t           count;
+  int                n;
+  int                result;
+
+  while (!atomic_load(&g_stop)) {
+    /* sends what is due, the notifications marked by latest_poll()
+       included, and tells when libcoap has something to do next: 0 for
+       nothing */
+    coap_ticks(&now);
+    timeout_ms = coap_io_prepare_epoll(worker->ctx, now);
+
+    n = epoll_wait(worker->epoll_fd, events, COAP_SERVER_EPOLL_EVENTS,
+                   timeout_ms ? (int)timeout_ms : -1);
+    if (n < 0 && errno != EINTR) {
+      /* its socket would go unread: the server stops rather than run
+         short of a worker */
+      LOG_ERROR("worker %u: epoll_wait failed: %s", worker->id,
+                strerror(errno));
+      coap_server_stop();
+      break;
+    }
+
+    for (int i = 0; i < n; i++) {
+      uint32_t event = events[i].data.u32;
+
+      if (event == WORKER_EVENT_COAP) {
+        /* an error is about the datagram or peer at hand, the next ones
+           are still served */
+        result = coap_io_process(worker->ctx, COAP_IO_NO_WAIT);
+        if (result < 0) {
+          LOG_ERROR("worker %u: coap_io_process error: %d", worker->id,
+                    result);
+        }
+      } else if (event == WORKER_EVENT_WAKE) {
+        /* cleared before polling: a wakeup coming after the read is not
+           lost */
+        eventfd_read(worker->wake_fd, &count);
+        atomic_store(&worker->woken, false);
+      } else if (event == WORKER_EVENT_SIGNAL) {
+        worker_signal();
+      } else if (read(worker->timer_fds[event - WORKER_EVENT_TIMER], &count,
+                      sizeof(count)) == sizeof(count)) {
+        g_timers[event - WORKER_EVENT_TIMER].run(worker);
+      }
+    }
+    worker_poll(worker);
+  }
+  return NULL;
+}
+
 /**
- * @brief Run the CoAP server I/O loop until *stop is set to true
+ * @brief Run the CoAP server I/O loops until coap_server_stop()
+ *
+ * Worker 0 runs in the calling thread, the others in threads of their own
+ * that are joined before returning. Every worker's socket is bound, so the
+ * server does not run with some of them missing: if one cannot start, the
+ * others are stopped.
  *
- * @param stop Pointer to a flag that signals the loop to exit when set to true
+ * @param signal_fd signalfd of the signals that stop the server, read by
+ *                  worker 0; -1 for none
+ *
+ * @return 0 once stopped, -1 if the workers could not all be started
  */
-void coap_server_loop(volatile bool *stop)
+int coap_server_loop(int signal_fd)
 {
-  int result;
+  sigset_t     all;
+  sigset_t     prev;
+  unsigned int started = 1;
 
-  while (!*stop) {
-    result = coap_io_process(g_ctx, COAP_SERVER_TIMEOUT_MS);
+  g_signal_fd = signal_fd;
+  if (signal_fd >= 0 &&
+      worker_watch(&g_workers[0], signal_fd, WORKER_EVENT_SIGNAL) != 0) {
+    LOG_ERROR("Failed to watch the signals: %s", strerror(errno));
+    return -1;
+  }
 
-    if (result < 0) {
-      fprintf(stderr, "coap_io_process error: %d\n", result);
+  /* signals are for the main thread, SIGINT and SIGTERM through signal_fd:
+     workers inherit a full mask */
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &prev);
+  for (; started < g_worker_count; started++) {
+    if (pthread_create(&g_workers[started].thread, NULL, worker_loop,
+                       &g_workers[started]) != 0) {
+      LOG_ERROR("Failed to start CoAP worker %u", started);
       break;
     }
   }
+  pthread_sigmask(SIG_SETMASK, &prev, NULL);
+
+  if (started == g_worker_count) {
+    worker_loop(&g_workers[0]);
+  }
+
+  /* worker 0 may have left on an error: the others stop with it */
+  coap_server_stop();
+  for (unsigned int i = 1; i < started; i++) {
+    pthread_join(g_workers[i].thread, NULL);
+  }
+  return started == g_worker_count ? 0 : -1;
+}
+
+/**
+ * @brief Make every worker leave its loop, from any thread
+ */
+void coap_server_stop(void)
+{
+  atomic_store(&g_stop, true);
+  for (unsigned int i = 0; i < g_worker_count; i++) {
+    worker_wake(&g_workers[i]);
+  }
 }
@@ -1,41 +1,2164 @@
+#include <pthread.h>
+#include <signal.h>
 #include <sqlite3.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
 
+#include "chunk.h"
+#include "db.h"
+#include "log.h"
+#include "metrics.h"
+#include "ring.h"
 #include "sensor.h"
 
-static sqlite3 *g_db = NULL;
+typedef struct {
+  const char *name;
+  const char *journal_mode;
+  const char *synchronous;
+  int64_t     mmap_size;  /* bytes, 0 disables memory-mapped I/O */
+  int         cache_size; /* negative: KiB, as in PRAGMA cache_size */
+} db_profile_t;
+
+static const db_profile_t g_profiles[DB_DURABILITY_LAST] = {
+  [DB_DURABILITY_DEFAULT] = {"default", "DELETE", "FULL", 0, -2000},
+  [DB_DURABILITY_SAFE]    = {"safe", "WAL", "FULL", 0, -16384},
+  [DB_DURABILITY_FAST]    = {"fast", "WAL", "NORMAL", 256LL << 20, -65536},
+};
+
+static const char *const g_commit_modes[DB_COMMIT_LAST] = {
+  [DB_COMMIT_AUTOCOMMIT] = "autocommit",
+  [DB_COMMIT_SNAPSHOT]   = "snapshot",
+  [DB_COMMIT_BATCH]      = "batch",
+};
+
+static const char *const g_storages[DB_STORAGE_LAST] = {
+  [DB_STORAGE_ROWS]   = "rows",
+  [DB_STORAGE_CHUNKS] = "chunks",
+};
+
+static const char *const g_layouts[DB_LAYOUT_LAST] = {
+  [DB_LAYOUT_WIDE]    = "wide",
+  [DB_LAYOUT_COMPACT] = "compact",
+};
+
+/* Device that owns the channels of databases created before devices */
+#define DB_LEGACY_DEVICE "legacy"
+
+static sqlite3    *g_db  = NULL;
+static db_config_t g_cfg = DB_CONFIG_DEFAULT;
+
+/* Explicit transaction state, only used when commit_mode is not autocommit */
+static int          g_txn_open       = 0;
+static unsigned int g_txn_rows       = 0;
+static unsigned int g_txn_new_ids    = 0; /* devices and channels created */
+static uint64_t     g_txn_started_ms = 0;
+static uint64_t     g_txn_discards   = 0; /* transactions lost so far */
+
+/* In-memory copies of the devices table (name -> id) and of the channels
+   table ((device id, name) -> id), open addressing with linear probing.
+   Loaded once in db_init() and kept in sync on insert, so steady-state
+   ingestion never has to query either table. */
+typedef struct {
+  uint32_t hash;
+  int      id;     /* 0 marks an empty slot */
+  int      parent; /* device id of a channel, 0 for a device */
+  char     name[SENSOR_NAME_MAX_LEN];
+} db_cache_entry_t;
+
+typedef struct {
+  db_cache_entry_t *table;
+  size_t            cap;
+  size_t            len;
+  const char       *what; /* for error messages */
+} db_cache_t;
+
+_Static_assert(SENSOR_DEVICE_MAX_LEN <= SENSOR_NAME_MAX_LEN,
+               "device names must fit in a cache entry");
+
+#define DB_CACHE_MIN_CAP 64
+
+static db_cache_t g_device_cache  = {.what = "device cache"};
+static db_cache_t g_channel_cache = {.what = "channel cache"};
+
+/* Hot-path statements, prepared once in db_init() and kept for the life of
+   the connection. Each use is followed by sqlite3_reset() and
+   sqlite3_clear_bindings() so the next caller starts from a clean state. */
+static sqlite3_stmt *g_stmt_device_lookup  = NULL;
+static sqlite3_stmt *g_stmt_device_insert  = NULL;
+static sqlite3_stmt *g_stmt_channel_lookup = NULL;
+static sqlite3_stmt *g_stmt_channel_insert = NULL;
+static sqlite3_stmt *g_stmt_rollup_merge   = NULL;
+static sqlite3_stmt *g_stmt_rollup_mark    = NULL;
+static sqlite3_stmt *g_stmt_begin          = NULL;
+static sqlite3_stmt *g_stmt_commit         = NULL;
+static sqlite3_stmt *g_stmt_spool_save     = NULL;
+
+/* Open bucket of a channel at one rollup level, holding what has not been
+   written yet. The bucket start is kept once written so readings for older
+   buckets can be told apart. */
+typedef struct {
+  int64_t  bucket; /* INT64_MIN until the first reading */
+  int64_t  last_ts;
+  double   sum;
+  double   min;
+  double   max;
+  double   last;
+  uint32_t count; /* 0 if nothing is pending */
+} db_rollup_t;
+
+static const int64_t g_rollup_periods[DB_ROLLUP_LEVELS] = {
+  DB_ROLLUP_MINUTE_MS,
+  DB_ROLLUP_HOUR_MS,
+};
+
+/* Indexed by channel id, DB_ROLLUP_LEVELS entries per channel */
+static db_rollup_t *g_rollups         = NULL;
+static size_t       g_rollup_cap      = 0; /* channels */
+static int64_t      g_rollup_last_id  = 0; /* last reading inserted */
+static uint64_t     g_rollup_flush_ms = 0;
+static bool         g_rollup_failed   = false;
+
+static uint64_t db_now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t db_now_ms(void)
+{
+  return db_now_ns() / 1000000;
+}
+
+/* Wall clock, for the timestamps stored in the database */
+static int64_t db_wall_ms(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Look up a durability profile by its name
+ *
+ * @param name Profile name ("default", "safe" or "fast")
+ * @param out  Set to the matching profile on success
+ *
+ * @return 0 on success, -1 if the name is unknown
+ */
+int db_durability_from_string(const char *name, db_durability_t *out)
+{
+  for (int i = 0; i < DB_DURABILITY_LAST; i++) {
+    if (strcmp(g_profiles[i].name, name) == 0) {
+      *out = (db_durability_t)i;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+/**
+ * @brief Look up a commit mode by its name
+ *
+ * @param name Mode name ("autocommit", "snapshot" or "batch")
+ * @param out  Set to the matching mode on success
+ *
+ * @return 0 on success, -1 if the name is unknown
+ */
+int db_commit_mode_from_string(const char *name, db_commit_mode_t *out)
+{
+  for (int i = 0; i < DB_COMMIT_LAST; i++) {
+    if (strcmp(g_commit_modes[i], name) == 0) {
+      *out = (db_commit_mode_t)i;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+/**
+ * @brief Look up a storage engine by its name
+ *
+ * @param name Engine name ("rows" or "chunks")
+ * @param out  Set to the matching engine on success
+ *
+ * @return 0 on success, -1 if the name is unknown
+ */
+int db_storage_from_string(const char *name, db_storage_t *out)
+{
+  for (int i = 0; i < DB_STORAGE_LAST; i++) {
+    if (strcmp(g_storages[i], name) == 0) {
+      *out = (db_storage_t)i;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+/**
+ * @brief Look up a readings layout by its name
+ *
+ * @param name Layout name ("wide" or "compact")
+ * @param out  Set to the matching layout on success
+ *
+ * @return 0 on success, -1 if the name is unknown
+ */
+int db_layout_from_string(const char *name, db_layout_t *out)
+{
+  for (int i = 0; i < DB_LAYOUT_LAST; i++) {
+    if (strcmp(g_layouts[i], name) == 0) {
+      *out = (db_layout_t)i;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+/* FNV-1a over the parent id then the name */
+static uint32_t db_hash_key(int parent, const char *name)
+{
+  uint32_t h = 2166136261u;
+
+  for (unsigned int i = 0; i < sizeof(parent); i++) {
+    h ^= (uint8_t)((unsigned int)parent >> (8 * i));
+    h *= 16777619u;
+  }
+  while (*name) {
+    h ^= (uint8_t)*name++;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+static db_cache_entry_t *db_cache_slot(db_cache_entry_t *table, size_t cap,
+                                       uint32_t hash, int parent,
+                                       const char *name)
+{
+  size_t i = hash & (cap - 1);
+
+  while (table[i].id != 0) {
+    if (table[i].hash == hash && table[i].parent == parent &&
+        strcmp(table[i].name, name) == 0) {
+      break;
+    }
+    i = (i + 1) & (cap - 1);
+  }
+  return &table[i];
+}
+
+static int db_cache_resize(db_cache_t *cache, size_t cap)
+{
+  db_cache_entry_t *table;
+
+  table = calloc(cap, sizeof(*table));
+  if (!table) {
+    LOG_ERROR("%s: out of memory (%zu slots)", cache->what, cap);
+    return -1;
+  }
+
+  for (size_t i = 0; i < cache->cap; i++) {
+    db_cache_entry_t *e = &cache->table[i];
+    if (e->id != 0) {
+      *db_cache_slot(table, cap, e->hash, e->parent, e->name) = *e;
+    }
+  }
+
+  free(cache->table);
+  cache->table = table;
+  cache->cap   = cap;
+  return 0;
+}
+
+static int db_cache_grow(db_cache_t *cache)
+{
+  return db_cache_resize(cache, cache->cap ? cache->cap * 2 : DB_CACHE_MIN_CAP);
+}
+
+/* Size the table for n entries up front (failure is not fatal: put() grows
+   the table on demand anyway) */
+static void db_cache_reserve(db_cache_t *cache, size_t n)
+{
+  size_t cap = DB_CACHE_MIN_CAP;
+
+  while (cap < n * 2) {
+    cap *= 2;
+  }
+  if (cap > cache->cap) {
+    db_cache_resize(cache, cap);
+  }
+}
+
+/* Returns the cached id, or 0 if the key is not cached */
+static int db_cache_get(const db_cache_t *cache, int parent, const char *name)
+{
+  if (cache->len == 0) {
+    return 0;
+  }
+  return db_cache_slot(cache->table, cache->cap, db_hash_key(parent, name),
+                       parent, name)
+    ->id;
+}
+
+static int db_cache_put(db_cache_t *cache, int parent, const char *name,
+                        int id)
+{
+  db_cache_entry_t *e;
+  uint32_t          hash = db_hash_key(parent, name);
+
+  /* keep the load factor under 1/2 so probe sequences stay short */
+  if ((cache->len + 1) * 2 > cache->cap && db_cache_grow(cache) != 0) {
+    return -1;
+  }
+
+  e = db_cache_slot(cache->table, cache->cap, hash, parent, name);
+  if (e->id == 0) {
+    cache->len++;
+  }
+  e->hash   = hash;
+  e->id     = id;
+  e->parent = parent;
+  strncpy(e->name, name, SENSOR_NAME_MAX_LEN - 1);
+  e->name[SENSOR_NAME_MAX_LEN - 1] = '\0';
+  return 0;
+}
+
+static void db_cache_clear(db_cache_t *cache)
+{
+  free(cache->table);
+  cache->table = NULL;
+  cache->cap   = 0;
+  cache->len   = 0;
+}
+
+/* Fills a cache from a table. sql_max returns an upper bound of the row
+   count, sql_rows returns (id, parent, name) rows. */
+static int db_cache_load(db_cache_t *cache, const char *sql_max,
+                         const char *sql_rows)
+{
+  sqlite3_stmt *stmt = NULL;
+  int           rc;
+
+  db_cache_clear(cache);
+
+  /* ids are dense rowids: max(id) is an O(log n) upper bound of the row
+     count, good enough to size the table once instead of rehashing */
+  rc = sqlite3_prepare_v2(g_db, sql_max, -1, &stmt, NULL);
+  if (rc == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW) {
+    db_cache_reserve(cache, (size_t)sqlite3_column_int64(stmt, 0));
+  }
+  sqlite3_finalize(stmt);
+  stmt = NULL;
+
+  rc = sqlite3_prepare_v2(g_db, sql_rows, -1, &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    LOG_ERROR("%s: prepare failed: %s", cache->what,
+              sqlite3_errmsg(g_db));
+    return -1;
+  }
+
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    const char *name = (const char *)sqlite3_column_text(stmt, 2);
+
+    if (name && db_cache_put(cache, sqlite3_column_int(stmt, 1), name,
+                             sqlite3_column_int(stmt, 0)) != 0) {
+      rc = SQLITE_NOMEM;
+      break;
+    }
+  }
+  sqlite3_finalize(stmt);
+
+  if (rc != SQLITE_DONE) {
+    LOG_ERROR("%s: load failed: %s", cache->what, sqlite3_errstr(rc));
+    db_cache_clear(cache);
+    return -1;
+  }
+  return 0;
+}
+
+static int db_caches_load(void)
+{
+  if (db_cache_load(&g_device_cache, "SELECT max(id) FROM devices",
+                    "SELECT id, 0, name FROM devices") != 0) {
+    return -1;
+  }
+  return db_cache_load(&g_channel_cache, "SELECT max(id) FROM channels",
+                       "SELECT id, device_id, name FROM channels");
+}
+
+static void db_caches_clear(void)
+{
+  db_cache_clear(&g_device_cache);
+  db_cache_clear(&g_channel_cache);
+}
 
 static int db_exec(sqlite3 *db, const char *sql)
 {
-  int   rc;
-  char *err_msg;
+  int   rc;
+  char *err_msg;
+
+  rc = sqlite3_exec(db, sql, NULL, NULL, &err_msg);
+  if (rc != SQLITE_OK) {
+    LOG_ERROR("SQL error: %s", err_msg);
+    sqlite3_free(err_msg);
+    return -1;
+  }
+  return 0;
+}
+
+static int db_prepare(const char *sql, sqlite3_stmt **stmt)
+{
+  int rc;
+
+  rc = sqlite3_prepare_v3(g_db, sql, -1, SQLITE_PREPARE_PERSISTENT, stmt,
+                          NULL);
+  if (rc != SQLITE_OK) {
+    LOG_ERROR("sqlite3_prepare_v3 failed for '%s': %s", sql,
+              sqlite3_errmsg(g_db));
+    return -1;
+  }
+  return 0;
+}
+
+static void db_stmt_release(sqlite3_stmt *stmt)
+{
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
+}
+
+static void db_finalize_statements(void)
+{
+  sqlite3_finalize(g_stmt_device_lookup);
+  sqlite3_finalize(g_stmt_device_insert);
+  sqlite3_finalize(g_stmt_channel_lookup);
+  sqlite3_finalize(g_stmt_channel_insert);
+  sqlite3_finalize(g_stmt_rollup_merge);
+  sqlite3_finalize(g_stmt_rollup_mark);
+  sqlite3_finalize(g_stmt_begin);
+  sqlite3_finalize(g_stmt_commit);
+  sqlite3_finalize(g_stmt_spool_save);
+  g_stmt_device_lookup  = NULL;
+  g_stmt_device_insert  = NULL;
+  g_stmt_channel_lookup = NULL;
+  g_stmt_channel_insert = NULL;
+  g_stmt_rollup_merge   = NULL;
+  g_stmt_rollup_mark    = NULL;
+  g_stmt_begin          = NULL;
+  g_stmt_commit         = NULL;
+  g_stmt_spool_save     = NULL;
+}
+
+static int db_prepare_statements(void)
+{
+  if (db_prepare("SELECT id FROM devices WHERE name = ?",
+                 &g_stmt_device_lookup) != 0) {
+    goto error;
+  }
+  if (db_prepare("INSERT INTO devices (name, created_at) VALUES (?, ?)",
+                 &g_stmt_device_insert) != 0) {
+    goto error;
+  }
+  if (db_prepare("SELECT id FROM channels WHERE device_id = ? AND name = ?",
+                 &g_stmt_channel_lookup) != 0) {
+    goto error;
+  }
+  if (db_prepare("INSERT INTO channels (device_id, name, type) "
+                 "VALUES (?, ?, ?)",
+                 &g_stmt_channel_insert) != 0) {
+    goto error;
+  }
+  /* a bucket may be written several times: when it closes, by the periodic
+     flush, and once per late reading, so writes merge into the row */
+  if (db_prepare("INSERT INTO rollups "
+                 "(channel_id, period, bucket, count, sum, min, max, last, "
+                 "last_ts) "
+                 "VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?) "
+                 "ON CONFLICT (channel_id, period, bucket) DO UPDATE SET "
+                 "count = count + excluded.count,"
+                 "sum = sum + excluded.sum,"
+                 "min = min(min, excluded.min),"
+                 "max = max(max, excluded.max),"
+                 "last = CASE WHEN excluded.last_ts >= last_ts"
+                 "       THEN excluded.last ELSE last END,"
+                 "last_ts = max(last_ts, excluded.last_ts)",
+                 &g_stmt_rollup_merge) != 0) {
+    goto error;
+  }
+  if (db_prepare("UPDATE rollup_state SET reading_id = ?",
+                 &g_stmt_rollup_mark) != 0) {
+    goto error;
+  }
+  if (db_prepare("BEGIN IMMEDIATE", &g_stmt_begin) != 0) {
+    goto error;
+  }
+  if (db_prepare("COMMIT", &g_stmt_commit) != 0) {
+    goto error;
+  }
+  if (db_prepare("INSERT OR REPLACE INTO spool (stream, position) "
+                 "VALUES (?, ?)",
+                 &g_stmt_spool_save) != 0) {
+    goto error;
+  }
+  return 0;
+
+error:
+  db_finalize_statements();
+  return -1;
+}
+
+static int db_apply_profile(const db_profile_t *p)
+{
+  char sql[256];
+
+  snprintf(sql, sizeof(sql),
+           "PRAGMA journal_mode = %s;"
+           "PRAGMA synchronous = %s;"
+           "PRAGMA mmap_size = %lld;"
+           "PRAGMA cache_size = %d;",
+           p->journal_mode, p->synchronous, (long long)p->mmap_size,
+           p->cache_size);
+  return db_exec(g_db, sql);
+}
+
+/*
+ * Layouts
+ *
+ * The wide layout gives each reading a rowid, one column per value type of
+ * which only one is set, and an index on (channel_id, timestamp). The
+ * compact layout keeps the value in a single column of no declared type,
+ * where SQLite stores it as it was bound, in a WITHOUT ROWID table
+ * clustered on (channel_id, timestamp, id): one B-tree per table, no NULL
+ * columns and no sqlite_sequence update per insert. Bools are stored as
+ * integers and told apart by the type of their channel. Ids are handed out
+ * by the writer, as with partitions.
+ *
+ * Finding the last id, or the readings past the rollup mark, takes a full
+ * scan of a compact table: rollup_state.clean records that the last writer
+ * closed the database with the mark on its last reading, so a clean start
+ * needs neither.
+ *
+ * A database keeps the compact layout once it has it. A wide readings
+ * table is copied into a compact one DB_MIGRATE_BATCH rows at a time, one
+ * transaction per batch, then swapped with it: an interrupted migration
+ * goes on where it stopped.
+ */
+
+#define DB_MIGRATE_BATCH 100000
+
+#define DB_COMPACT_COLUMNS                                                     \
+  "  channel_id INTEGER NOT NULL REFERENCES channels(id),"                     \
+  "  timestamp  INTEGER NOT NULL,"                                             \
+  "  id         INTEGER NOT NULL,"                                             \
+  "  value,"                                                                   \
+  "  PRIMARY KEY (channel_id, timestamp, id)"
+
+static bool g_compact = false;
+
+/* Numeric value of a reading row, NULL for a string */
+static const char *db_layout_value(void)
+{
+  return g_compact ? "(CASE WHEN typeof(value) IN ('integer', 'real')"
+                     " THEN value END)"
+                   : "coalesce(value_float, value_int, value_bool)";
+}
+
+/* 1 if the table has the column, 0 if not, -1 on error */
+static int db_has_column(const char *table, const char *column)
+{
+  sqlite3_stmt *stmt = NULL;
+  int           rc   = -1;
+
+  if (sqlite3_prepare_v2(g_db,
+                         "SELECT count(*) FROM pragma_table_info(?1)"
+                         " WHERE name = ?2",
+                         -1, &stmt, NULL) == SQLITE_OK &&
+      sqlite3_bind_text(stmt, 1, table, -1, SQLITE_STATIC) == SQLITE_OK &&
+      sqlite3_bind_text(stmt, 2, column, -1, SQLITE_STATIC) == SQLITE_OK &&
+      sqlite3_step(stmt) == SQLITE_ROW) {
+    rc = sqlite3_column_int(stmt, 0) > 0;
+  }
+  if (rc < 0) {
+    LOG_ERROR("schema check failed: %s", sqlite3_errmsg(g_db));
+  }
+  sqlite3_finalize(stmt);
+  return rc;
+}
+
+/* The compact layout is kept once any readings table has it, a migration
+   in progress included */
+static int db_layout_init(void)
+{
+  sqlite3_stmt *stmt = NULL;
+  int           rc;
+
+  rc = sqlite3_prepare_v2(g_db,
+                          "SELECT count(*)"
+                          "  FROM sqlite_master m, pragma_table_info(m.name) p"
+                          " WHERE m.type = 'table'"
+                          "   AND m.name GLOB 'readings*' AND p.name = 'value'",
+                          -1, &stmt, NULL);
+  if (rc != SQLITE_OK || sqlite3_step(stmt) != SQLITE_ROW) {
+    LOG_ERROR("schema check failed: %s", sqlite3_errmsg(g_db));
+    sqlite3_finalize(stmt);
+    return -1;
+  }
+  g_compact = sqlite3_column_int(stmt, 0) > 0 ||
+              g_cfg.layout == DB_LAYOUT_COMPACT;
+  sqlite3_finalize(stmt);
+  return 0;
+}
+
+/* Rewrites a wide readings table with the compact layout, under the same
+   name. Ids are kept. */
+static int db_layout_migrate(const char *name, int64_t *copied)
+{
+  sqlite3_stmt *next = NULL;
+  sqlite3_stmt *copy = NULL;
+  int64_t       from = 0;
+  char          tmp[48];
+  char          sql[512];
+  int           rc;
+
+  snprintf(tmp, sizeof(tmp), "%s_compact", name);
+  snprintf(sql, sizeof(sql),
+           "CREATE TABLE IF NOT EXISTS \"%s\" (" DB_COMPACT_COLUMNS
+           ") WITHOUT ROWID;",
+           tmp);
+  if (db_exec(g_db, sql) != 0) {
+    return -1;
+  }
+
+  /* the rows already copied by an interrupted migration */
+  snprintf(sql, sizeof(sql), "SELECT coalesce(max(id), 0) FROM \"%s\"", tmp);
+  if (sqlite3_prepare_v2(g_db, sql, -1, &next, NULL) != SQLITE_OK ||
+      sqlite3_step(next) != SQLITE_ROW) {
+    goto error;
+  }
+  from = sqlite3_column_int64(next, 0);
+  sqlite3_finalize(next);
+  next = NULL;
+
+  snprintf(sql, sizeof(sql),
+           "SELECT id FROM \"%s\" WHERE id > ?1"
+           " ORDER BY id LIMIT 1 OFFSET %d",
+           name, DB_MIGRATE_BATCH - 1);
+  if (sqlite3_prepare_v2(g_db, sql, -1, &next, NULL) != SQLITE_OK) {
+    goto error;
+  }
+  snprintf(sql, sizeof(sql),
+           "INSERT INTO \"%s\" (channel_id, timestamp, id, value)"
+           "  SELECT channel_id, timestamp, id,"
+           "         coalesce(value_float, value_int, value_text, value_bool)"
+           "    FROM \"%s\" WHERE id > ?1 AND id <= ?2",
+           tmp, name);
+  if (sqlite3_prepare_v2(g_db, sql, -1, &copy, NULL) != SQLITE_OK) {
+    goto error;
+  }
+
+  for (;;) {
+    int64_t to = INT64_MAX; /* the last batch takes what is left */
+
+    sqlite3_bind_int64(next, 1, from);
+    rc = sqlite3_step(next);
+    if (rc == SQLITE_ROW) {
+      to = sqlite3_column_int64(next, 0);
+    }
+    sqlite3_reset(next);
+    if ((rc != SQLITE_ROW && rc != SQLITE_DONE) ||
+        db_exec(g_db, "BEGIN IMMEDIATE") != 0) {
+      goto error;
+    }
+    sqlite3_bind_int64(copy, 1, from);
+    sqlite3_bind_int64(copy, 2, to);
+    rc = sqlite3_step(copy);
+    sqlite3_reset(copy);
+    if (rc != SQLITE_DONE || db_exec(g_db, "COMMIT") != 0) {
+      goto error;
+    }
+    *copied += sqlite3_changes(g_db);
+    if (to == INT64_MAX) {
+      break;
+    }
+    from = to;
+  }
+
+  /* statements on the table would make DROP fail */
+  sqlite3_finalize(next);
+  sqlite3_finalize(copy);
+  next = NULL;
+  copy = NULL;
+  snprintf(sql, sizeof(sql),
+           "BEGIN IMMEDIATE;"
+           "DROP TABLE \"%s\";"
+           "ALTER TABLE \"%s\" RENAME TO \"%s\";"
+           "COMMIT;",
+           name, tmp, name);
+  if (db_exec(g_db, sql) != 0) {
+    goto error;
+  }
+  return 0;
+
+error:
+  LOG_ERROR("migration of %s failed: %s", name, sqlite3_errmsg(g_db));
+  sqlite3_finalize(next);
+  sqlite3_finalize(copy);
+  if (!sqlite3_get_autocommit(g_db)) {
+    db_exec(g_db, "ROLLBACK");
+  }
+  return -1;
+}
+
+/*
+ * Partitions
+ *
+ * By default readings go to the readings table. In partitioned mode every
+ * partition_ms period of timestamps gets a table of its own, named after
+ * the UTC hour it starts at (readings_YYYYMMDDHH) and listed in the
+ * partitions table. Expiring data is then a DROP TABLE of the oldest
+ * partitions: their pages go to the freelist for the next partitions to
+ * reuse, no B-tree is rewritten and the ingest path is not involved.
+ *
+ * Reading ids are handed out by the writer so they grow across partitions:
+ * the rollup mark is a reading id whatever the table.
+ */
+
+typedef struct {
+  int64_t       start;  /* first timestamp, inclusive */
+  int64_t       end;    /* exclusive */
+  sqlite3_stmt *insert; /* prepared on first insert */
+  char          name[32];
+} db_partition_t;
+
+static db_partition_t *g_parts       = NULL; /* sorted by start */
+static size_t          g_part_count  = 0;
+static size_t          g_part_cap    = 0;
+static size_t          g_part_last   = 0; /* partition of the last insert */
+static bool            g_partitioned = false;
+static uint64_t        g_expired     = 0; /* readings older than max age */
+static uint64_t        g_retained_ms = 0; /* last retention check */
+
+/* Last checkpoint, and sqlite3_total_changes() then */
+static uint64_t g_checkpoint_ms      = 0;
+static int64_t  g_checkpoint_changes = 0;
+
+/* Same columns as the readings table, but ids come from the writer */
+#define DB_PARTITION_COLUMNS                                                   \
+  "  id          INTEGER PRIMARY KEY,"                                         \
+  "  channel_id  INTEGER NOT NULL REFERENCES channels(id),"                    \
+  "  timestamp   INTEGER NOT NULL,"                                            \
+  "  value_float REAL,"                                                        \
+  "  value_int   INTEGER,"                                                     \
+  "  value_text  TEXT,"                                                        \
+  "  value_bool  BOOLEAN"
+
+static void db_parts_clear(void)
+{
+  for (size_t i = 0; i < g_part_count; i++) {
+    sqlite3_finalize(g_parts[i].insert);
+  }
+  free(g_parts);
+  g_parts      = NULL;
+  g_part_count = 0;
+  g_part_cap   = 0;
+  g_part_last  = 0;
+}
+
+static int db_parts_add(size_t at, const char *name, int64_t start,
+                        int64_t end)
+{
+  if (g_part_count == g_part_cap) {
+    size_t          cap   = g_part_cap ? g_part_cap * 2 : 64;
+    db_partition_t *parts = realloc(g_parts, cap * sizeof(*parts));
+
+    if (!parts) {
+      LOG_ERROR("partitions: out of memory");
+      return -1;
+    }
+    g_parts    = parts;
+    g_part_cap = cap;
+  }
+  memmove(&g_parts[at + 1], &g_parts[at],
+          (g_part_count - at) * sizeof(*g_parts));
+  g_part_count++;
+
+  g_parts[at].start  = start;
+  g_parts[at].end    = end;
+  g_parts[at].insert = NULL;
+  snprintf(g_parts[at].name, sizeof(g_parts[at].name), "%s", name);
+  return 0;
+}
+
+/* Lists the tables readings go to: the readings table alone, or every
+   partition */
+static int db_parts_load(void)
+{
+  sqlite3_stmt *stmt = NULL;
+  int           rc;
+
+  db_parts_clear();
+  if (!g_partitioned) {
+    return db_parts_add(0, "readings", INT64_MIN, INT64_MAX);
+  }
+
+  rc = sqlite3_prepare_v2(g_db,
+                          "SELECT name, start, end FROM partitions"
+                          " ORDER BY start",
+                          -1, &stmt, NULL);
+  if (rc == SQLITE_OK) {
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW &&
+           db_parts_add(g_part_count, (const char *)sqlite3_column_text(stmt, 0),
+                        sqlite3_column_int64(stmt, 1),
+                        sqlite3_column_int64(stmt, 2)) == 0) {
+    }
+  }
+  sqlite3_finalize(stmt);
+  if (rc != SQLITE_DONE) {
+    LOG_ERROR("partitions: load failed: %s", sqlite3_errmsg(g_db));
+    return -1;
+  }
+  return 0;
+}
+
+/* Migrates every wide readings table of a compact database */
+static int db_parts_migrate(void)
+{
+  uint64_t start_ms = db_now_ms();
+  int64_t  copied   = 0;
+  size_t   tables   = 0;
+
+  for (size_t i = 0; i < g_part_count; i++) {
+    int rc = db_has_column(g_parts[i].name, "value");
+
+    if (rc < 0) {
+      return -1;
+    }
+    if (rc == 1) {
+      continue;
+    }
+    if (tables++ == 0) {
+      LOG_INFO("Migrating readings to the compact layout");
+    }
+    if (db_layout_migrate(g_parts[i].name, &copied) != 0) {
+      return -1;
+    }
+  }
+  if (tables > 0) {
+    LOG_INFO("Migrated %lld readings in %zu tables in %llu ms",
+             (long long)copied, tables,
+             (unsigned long long)(db_now_ms() - start_ms));
+  }
+  return 0;
+}
+
+/* Largest reading id stored: max(id) is O(log n) per partition */
+static int db_parts_max_id(int64_t *out)
+{
+  *out = 0;
+  for (size_t i = 0; i < g_part_count; i++) {
+    sqlite3_stmt *stmt = NULL;
+    char          sql[96];
+
+    snprintf(sql, sizeof(sql), "SELECT coalesce(max(id), 0) FROM \"%s\"",
+             g_parts[i].name);
+    if (sqlite3_prepare_v2(g_db, sql, -1, &stmt, NULL) != SQLITE_OK ||
+        sqlite3_step(stmt) != SQLITE_ROW) {
+      LOG_ERROR("partitions: cannot read '%s': %s", g_parts[i].name,
+                sqlite3_errmsg(g_db));
+      sqlite3_finalize(stmt);
+      return -1;
+    }
+    if (sqlite3_column_int64(stmt, 0) > *out) {
+      *out = sqlite3_column_int64(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+  }
+  return 0;
+}
+
+static void db_part_name(char *buf, size_t len, int64_t start)
+{
+  time_t    t = (time_t)(start / 1000);
+  struct tm tm;
+
+  gmtime_r(&t, &tm);
+  strftime(buf, len, "readings_%Y%m%d%H", &tm);
+}
+
+/* Creates the partition of the period holding ts, at index at of the
+   list, in the current transaction. It is cut short where a neighbour
+   starts or ends, should the period have changed since the neighbour was
+   created: partitions never overlap. */
+static int db_part_create(size_t at, int64_t ts)
+{
+  int64_t period = (int64_t)g_cfg.partition_ms;
+  int64_t start  = ts - ((ts % period) + period) % period;
+  int64_t end    = start + period;
+  char    name[32];
+  char    table[512];
+  char    sql[1024];
+
+  if (at > 0 && start < g_parts[at - 1].end) {
+    start = g_parts[at - 1].end;
+  }
+  if (at < g_part_count && end > g_parts[at].start) {
+    end = g_parts[at].start;
+  }
+
+  db_part_name(name, sizeof(name), start);
+  if (g_compact) {
+    snprintf(table, sizeof(table),
+             "CREATE TABLE \"%s\" (" DB_COMPACT_COLUMNS ") WITHOUT ROWID;",
+             name);
+  } else {
+    snprintf(table, sizeof(table),
+             "CREATE TABLE \"%s\" (" DB_PARTITION_COLUMNS ");"
+             "CREATE INDEX \"%s_channel_time\""
+             "  ON \"%s\" (channel_id, timestamp);",
+             name, name, name);
+  }
+  /* a savepoint keeps the table and its catalog row together in
+     autocommit mode too */
+  snprintf(sql, sizeof(sql),
+           "SAVEPOINT partition;"
+           "%s"
+           "INSERT INTO partitions (name, start, end)"
+           "  VALUES ('%s', %lld, %lld);"
+           "RELEASE partition;",
+           table, name, (long long)start, (long long)end);
+  if (db_exec(g_db, sql) != 0) {
+    db_exec(g_db, "ROLLBACK TO partition; RELEASE partition;");
+    return -1;
+  }
+  return db_parts_add(at, name, start, end);
+}
+
+/* Partition a reading goes to, created if needed. NULL on error. */
+static db_partition_t *db_part_for(int64_t ts)
+{
+  size_t lo = 0;
+  size_t hi = g_part_count;
+
+  if (g_part_last < g_part_count && ts >= g_parts[g_part_last].start &&
+      ts < g_parts[g_part_last].end) {
+    return &g_parts[g_part_last];
+  }
+
+  /* first partition ending after ts */
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+
+    if (g_parts[mid].end <= ts) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo == g_part_count || ts < g_parts[lo].start) {
+    if (!g_partitioned || db_part_create(lo, ts) != 0) {
+      return NULL;
+    }
+  }
+
+  g_part_last = lo;
+  return &g_parts[lo];
+}
+
+static sqlite3_stmt *db_part_insert(db_partition_t *part)
+{
+  char sql[192];
+
+  if (!part->insert) {
+    snprintf(sql, sizeof(sql),
+             g_compact ? "INSERT INTO \"%s\" "
+                         "(channel_id, timestamp, value, id) "
+                         "VALUES (?, ?, ?, ?)"
+                       : "INSERT INTO \"%s\" "
+                         "(channel_id, timestamp, value_float, value_int, "
+                         "value_text, value_bool, id) "
+                         "VALUES (?, ?, ?, ?, ?, ?, ?)",
+             part->name);
+    if (db_prepare(sql, &part->insert) != 0) {
+      return NULL;
+    }
+  }
+  return part->insert;
+}
+
+static int db_part_drop(size_t i)
+{
+  db_partition_t *part = &g_parts[i];
+  char            sql[256];
+
+  /* a prepared statement on the table would make DROP fail */
+  sqlite3_finalize(part->insert);
+  part->insert = NULL;
+
+  snprintf(sql, sizeof(sql),
+           "SAVEPOINT partition;"
+           "DROP TABLE \"%s\";"
+           "DELETE FROM partitions WHERE name = '%s';"
+           "RELEASE partition;",
+           part->name, part->name);
+  if (db_exec(g_db, sql) != 0) {
+    db_exec(g_db, "ROLLBACK TO partition; RELEASE partition;");
+    return -1;
+  }
+  LOG_INFO("Dropped partition %s", part->name);
+
+  memmove(&g_parts[i], &g_parts[i + 1],
+          (g_part_count - i - 1) * sizeof(*g_parts));
+  g_part_count--;
+  g_part_last = 0;
+  return 0;
+}
+
+/* Bytes of the database file in use, free pages excluded */
+static int64_t db_used_bytes(void)
+{
+  sqlite3_stmt *stmt = NULL;
+  int64_t       used = -1;
+
+  if (sqlite3_prepare_v2(g_db,
+                         "SELECT (p.page_count - f.freelist_count) *"
+                         "       s.page_size"
+                         "  FROM pragma_page_count p, pragma_freelist_count f,"
+                         "       pragma_page_size s",
+                         -1, &stmt, NULL) == SQLITE_OK &&
+      sqlite3_step(stmt) == SQLITE_ROW) {
+    used = sqlite3_column_int64(stmt, 0);
+  }
+  sqlite3_finalize(stmt);
+  return used;
+}
+
+/* Drops the partitions older than the max age, then the oldest ones while
+   the database is over its budget. The newest partition is always kept. */
+static int db_retention_run(void)
+{
+  int64_t cutoff = db_wall_ms() - (int64_t)g_cfg.retention_ms;
+
+  if (g_expired > 0) {
+    LOG_INFO("Discarded %llu readings older than the max age",
+             (unsigned long long)g_expired);
+    g_expired = 0;
+  }
+
+  while (g_cfg.retention_ms > 0 && g_part_count > 1 &&
+         g_parts[0].end <= cutoff) {
+    if (db_part_drop(0) != 0) {
+      return -1;
+    }
+  }
+  while (g_cfg.disk_budget > 0 && g_part_count > 1 &&
+         db_used_bytes() > (int64_t)g_cfg.disk_budget) {
+    if (db_part_drop(0) != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* Partitioned mode is kept by a database once it has a partitions table.
+   An existing readings table becomes the first partition, widened to
+   whole periods so later partitions line up with it. */
+static int db_parts_init(void)
+{
+  sqlite3_stmt *stmt = NULL;
+  int           has_parts;
+  int           has_readings;
+  int64_t       min_ts;
+  int64_t       max_ts;
+  int64_t       count;
+  char          sql[512];
+  char          name[32];
+  int           rc;
+
+  rc = sqlite3_prepare_v2(
+    g_db,
+    "SELECT (SELECT count(*) FROM sqlite_master"
+    "         WHERE type = 'table' AND name = 'partitions'),"
+    "       (SELECT count(*) FROM sqlite_master"
+    "         WHERE type = 'table' AND name = 'readings')",
+    -1, &stmt, NULL);
+  if (rc != SQLITE_OK || sqlite3_step(stmt) != SQLITE_ROW) {
+    LOG_ERROR("schema check failed: %s", sqlite3_errmsg(g_db));
+    sqlite3_finalize(stmt);
+    return -1;
+  }
+  has_parts    = sqlite3_column_int(stmt, 0);
+  has_readings = sqlite3_column_int(stmt, 1);
+  sqlite3_finalize(stmt);
+
+  /* without a period given, new partitions are as wide as the newest one */
+  if (has_parts && g_cfg.partition_ms == 0) {
+    rc = sqlite3_prepare_v2(g_db,
+                            "SELECT end - start FROM partitions"
+                            " ORDER BY start DESC LIMIT 1",
+                            -1, &stmt, NULL);
+    g_cfg.partition_ms = rc == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW
+                           ? (uint64_t)sqlite3_column_int64(stmt, 0)
+                           : DB_PARTITION_MS_DEFAULT;
+    sqlite3_finalize(stmt);
+  }
+  g_partitioned = g_cfg.partition_ms > 0;
+  if (!g_partitioned) {
+    return 0;
+  }
+  if (g_cfg.partition_ms % DB_ROLLUP_HOUR_MS != 0) {
+    LOG_ERROR("partitions must be a whole number of hours");
+    return -1;
+  }
+
+  if (db_exec(g_db, "CREATE TABLE IF NOT EXISTS partitions ("
+                    "  name  TEXT    PRIMARY KEY,"
+                    "  start INTEGER NOT NULL,"
+                    "  end   INTEGER NOT NULL"
+                    ");") != 0) {
+    return -1;
+  }
+  if (!has_readings) {
+    return 0;
+  }
+
+  rc = sqlite3_prepare_v2(g_db,
+                          "SELECT count(*), min(timestamp), max(timestamp)"
+                          "  FROM readings",
+                          -1, &stmt, NULL);
+  if (rc != SQLITE_OK || sqlite3_step(stmt) != SQLITE_ROW) {
+    LOG_ERROR("readings check failed: %s", sqlite3_errmsg(g_db));
+    sqlite3_finalize(stmt);
+    return -1;
+  }
+  count  = sqlite3_column_int64(stmt, 0);
+  min_ts = sqlite3_column_int64(stmt, 1);
+  max_ts = sqlite3_column_int64(stmt, 2);
+  sqlite3_finalize(stmt);
+
+  if (count == 0) {
+    return db_exec(g_db, "DROP TABLE readings;");
+  }
+
+  int64_t period = (int64_t)g_cfg.partition_ms;
+  int64_t start  = min_ts - ((min_ts % period) + period) % period;
+  int64_t end    = max_ts - ((max_ts % period) + period) % period + period;
+
+  db_part_name(name, sizeof(name), start);
+  LOG_INFO("Moving %lld readings to partition %s", (long long)count,
+           name);
+  snprintf(sql, sizeof(sql),
+           "BEGIN IMMEDIATE;"
+           "ALTER TABLE readings RENAME TO \"%s\";"
+           "INSERT INTO partitions (name, start, end)"
+           "  VALUES ('%s', %lld, %lld);"
+           "COMMIT;",
+           name, name, (long long)start, (long long)end);
+  if (db_exec(g_db, sql) != 0) {
+    if (!sqlite3_get_autocommit(g_db)) {
+      db_exec(g_db, "ROLLBACK");
+    }
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Chunks
+ *
+ * With chunk storage, the readings table is only the head of the numeric
+ * series: readings are inserted there as usual, which keeps every
+ * durability and commit mode as it is, then each time the rollups are
+ * flushed, every channel with CHUNK_SAMPLES readings in the head has its
+ * oldest ones sealed into a compressed chunk (see chunk.h) and deleted
+ * from the head. String readings stay in the readings table.
+ *
+ * Sealing runs in the transaction that moves the rollup mark, right after
+ * it: a chunk only ever holds readings the rollups account for, and the
+ * rollup repair only has to read the chunks of the buckets it recomputes.
+ */
+
+static bool      g_chunked  = false;
+static uint32_t *g_head     = NULL; /* numeric readings in the head, by
+                                       channel */
+static size_t    g_head_cap = 0;
+
+static sqlite3_stmt *g_stmt_chunk_head   = NULL;
+static sqlite3_stmt *g_stmt_chunk_insert = NULL;
+static sqlite3_stmt *g_stmt_chunk_delete = NULL;
+static sqlite3_stmt *g_stmt_chunk_range  = NULL;
+
+static chunk_sample_t g_chunk_samples[CHUNK_SAMPLES];
+static uint8_t        g_chunk_buf[CHUNK_SIZE_MAX];
+
+/* Called for each sample of the chunks read by db_chunks_visit() */
+typedef void (*db_chunk_visit_t)(int64_t ts, double value, void *arg);
+
+static void db_chunks_clear(void)
+{
+  sqlite3_finalize(g_stmt_chunk_head);
+  sqlite3_finalize(g_stmt_chunk_insert);
+  sqlite3_finalize(g_stmt_chunk_delete);
+  sqlite3_finalize(g_stmt_chunk_range);
+  g_stmt_chunk_head   = NULL;
+  g_stmt_chunk_insert = NULL;
+  g_stmt_chunk_delete = NULL;
+  g_stmt_chunk_range  = NULL;
+  free(g_head);
+  g_head     = NULL;
+  g_head_cap = 0;
+}
+
+static int db_head_reserve(int channel_id)
+{
+  size_t    cap = g_head_cap ? g_head_cap : DB_CACHE_MIN_CAP;
+  uint32_t *head;
+
+  if ((size_t)channel_id < g_head_cap) {
+    return 0;
+  }
+  while (cap <= (size_t)channel_id) {
+    cap *= 2;
+  }
+  head = realloc(g_head, cap * sizeof(*head));
+  if (!head) {
+    LOG_ERROR("chunks: out of memory for %zu channels", cap);
+    return -1;
+  }
+  memset(head + g_head_cap, 0, (cap - g_head_cap) * sizeof(*head));
+  g_head     = head;
+  g_head_cap = cap;
+  return 0;
+}
+
+/* Counts the numeric readings of each channel still in the head */
+static int db_head_load(void)
+{
+  sqlite3_stmt *stmt = NULL;
+  char          sql[256];
+  int           rc;
+
+  if (g_head) {
+    memset(g_head, 0, g_head_cap * sizeof(*g_head));
+  }
+  snprintf(sql, sizeof(sql),
+           "SELECT channel_id, count(*) FROM readings"
+           " WHERE %s IS NOT NULL"
+           " GROUP BY channel_id",
+           db_layout_value());
+  rc = sqlite3_prepare_v2(g_db, sql, -1, &stmt, NULL);
+  if (rc == SQLITE_OK) {
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW &&
+           db_head_reserve(sqlite3_column_int(stmt, 0)) == 0) {
+      g_head[sqlite3_column_int(stmt, 0)] =
+        (uint32_t)sqlite3_column_int(stmt, 1);
+    }
+  }
+  sqlite3_finalize(stmt);
+  if (rc != SQLITE_DONE) {
+    LOG_ERROR("chunks: head count failed: %s", sqlite3_errmsg(g_db));
+    return -1;
+  }
+  return 0;
+}
+
+/* Chunk storage is kept by a database once it has a chunks table */
+static int db_chunks_init(void)
+{
+  sqlite3_stmt *stmt = NULL;
+  char          sql_head[512];
+  char          sql_delete[256];
+  int           rc;
+
+  rc = sqlite3_prepare_v2(g_db,
+                          "SELECT count(*) FROM sqlite_master"
+                          " WHERE type = 'table' AND name = 'chunks'",
+                          -1, &stmt, NULL);
+  if (rc != SQLITE_OK || sqlite3_step(stmt) != SQLITE_ROW) {
+    LOG_ERROR("schema check failed: %s", sqlite3_errmsg(g_db));
+    sqlite3_finalize(stmt);
+    return -1;
+  }
+  g_chunked = sqlite3_column_int(stmt, 0) > 0 ||
+              g_cfg.storage == DB_STORAGE_CHUNKS;
+  sqlite3_finalize(stmt);
+  if (!g_chunked) {
+    return 0;
+  }
+  if (g_partitioned) {
+    LOG_ERROR("chunk storage keeps its head in a single readings "
+              "table: it cannot be partitioned");
+    return -1;
+  }
+
+  /* start and end are the first and last timestamps of the chunk */
+  if (db_exec(g_db, "CREATE TABLE IF NOT EXISTS chunks ("
+                    "  id         INTEGER PRIMARY KEY,"
+                    "  channel_id INTEGER NOT NULL REFERENCES channels(id),"
+                    "  start      INTEGER NOT NULL,"
+                    "  end        INTEGER NOT NULL,"
+                    "  count      INTEGER NOT NULL,"
+                    "  data       BLOB    NOT NULL"
+                    ");"
+                    "CREATE INDEX IF NOT EXISTS idx_chunks_channel_time"
+                    "  ON chunks(channel_id, start);") != 0) {
+    return -1;
+  }
+
+  /* the compact layout reads the value three times, and the channel type
+     to tell bools from ints */
+  snprintf(sql_head, sizeof(sql_head),
+           "SELECT id, timestamp, %s"
+           "  FROM readings"
+           " WHERE channel_id = ?1 AND %s IS NOT NULL"
+           " ORDER BY timestamp, id"
+           " LIMIT ?2",
+           g_compact ? "value, value, value,"
+                       " (SELECT type FROM channels WHERE id = ?1)"
+                     : "value_float, value_int, value_bool",
+           db_layout_value());
+  snprintf(sql_delete, sizeof(sql_delete),
+           "DELETE FROM readings"
+           " WHERE channel_id = ?1 AND (timestamp, id) <= (?2, ?3)"
+           "   AND %s IS NOT NULL",
+           db_layout_value());
+  if (db_prepare(sql_head, &g_stmt_chunk_head) != 0 ||
+      db_prepare("INSERT INTO chunks (channel_id, start, end, count, data) "
+                 "VALUES (?, ?, ?, ?, ?)",
+                 &g_stmt_chunk_insert) != 0 ||
+      db_prepare(sql_delete, &g_stmt_chunk_delete) != 0 ||
+      db_prepare("SELECT data FROM chunks"
+                 " WHERE channel_id = ?1 AND start < ?2 AND end >= ?3",
+                 &g_stmt_chunk_range) != 0) {
+    return -1;
+  }
+  return db_head_load();
+}
+
+/* Type of a head row, from its non-NULL value column, or from the type of
+   its value and of its channel with the compact layout */
+static sensor_type_t db_head_type(sqlite3_stmt *stmt)
+{
+  if (g_compact) {
+    if (sqlite3_column_type(stmt, 2) == SQLITE_FLOAT) {
+      return SENSOR_TYPE_FLOAT;
+    }
+    return sqlite3_column_int(stmt, 5) == SENSOR_TYPE_BOOL &&
+               (sqlite3_column_int64(stmt, 2) & ~1) == 0
+             ? SENSOR_TYPE_BOOL
+             : SENSOR_TYPE_INT;
+  }
+  if (sqlite3_column_type(stmt, 2) != SQLITE_NULL) {
+    return SENSOR_TYPE_FLOAT;
+  }
+  if (sqlite3_column_type(stmt, 3) != SQLITE_NULL) {
+    return SENSOR_TYPE_INT;
+  }
+  return SENSOR_TYPE_BOOL;
+}
+
+/* Moves the oldest readings of a channel into one chunk, up to
+   CHUNK_SAMPLES of them and stopping where the value type changes.
+   Returns the number of readings moved, -1 on error. */
+static int db_chunk_seal(int channel_id)
+{
+  sqlite3_stmt *stmt    = g_stmt_chunk_head;
+  sensor_type_t type    = SENSOR_TYPE_LAST;
+  size_t        count   = 0;
+  int64_t       last_id = 0;
+  size_t        len;
+  int           rc;
+
+  if (sqlite3_bind_int(stmt, 1, channel_id) != SQLITE_OK ||
+      sqlite3_bind_int(stmt, 2, CHUNK_SAMPLES) != SQLITE_OK) {
+    LOG_ERROR("sqlite3_bind failed: %s", sqlite3_errmsg(g_db));
+    db_stmt_release(stmt);
+    return -1;
+  }
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    chunk_sample_t *s = &g_chunk_samples[count];
+
+    if (count == 0) {
+      type = db_head_type(stmt);
+    } else if (db_head_type(stmt) != type) {
+      break;
+    }
+    s->ts = sqlite3_column_int64(stmt, 1);
+    switch (type) {
+    case SENSOR_TYPE_FLOAT:
+      s->value.f = (float)sqlite3_column_double(stmt, 2);
+      break;
+    case SENSOR_TYPE_INT:
+      s->value.i = sqlite3_column_int(stmt, 3);
+      break;
+    default:
+      s->value.b = sqlite3_column_int(stmt, 4) != 0;
+      break;
+    }
+    last_id = sqlite3_column_int64(stmt, 0);
+    count++;
+  }
+  db_stmt_release(stmt);
+  if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+    LOG_ERROR("chunk read failed: %s", sqlite3_errmsg(g_db));
+    return -1;
+  }
+  if (count == 0) {
+    return 0;
+  }
+
+  len = chunk_encode(type, g_chunk_samples, count, g_chunk_buf,
+                     sizeof(g_chunk_buf));
+  if (len == 0) {
+    LOG_ERROR("chunks: cannot encode channel %d", channel_id);
+    return -1;
+  }
+
+  /* the chunk and the deletion of its readings go together */
+  if (db_exec(g_db, "SAVEPOINT chunk") != 0) {
+    return -1;
+  }
+  stmt = g_stmt_chunk_insert;
+  if (sqlite3_bind_int(stmt, 1, channel_id) != SQLITE_OK ||
+      sqlite3_bind_int64(stmt, 2, g_chunk_samples[0].ts) != SQLITE_OK ||
+      sqlite3_bind_int64(stmt, 3, g_chunk_samples[count - 1].ts) !=
+        SQLITE_OK ||
+      sqlite3_bind_int64(stmt, 4, (int64_t)count) != SQLITE_OK ||
+      sqlite3_bind_blob(stmt, 5, g_chunk_buf, (int)len, SQLITE_STATIC) !=
+        SQLITE_OK ||
+      sqlite3_step(stmt) != SQLITE_DONE) {
+    LOG_ERROR("chunk write failed: %s", sqlite3_errmsg(g_db));
+    goto error;
+  }
+  db_stmt_release(stmt);
+
+  stmt = g_stmt_chunk_delete;
+  if (sqlite3_bind_int(stmt, 1, channel_id) != SQLITE_OK ||
+      sqlite3_bind_int64(stmt, 2, g_chunk_samples[count - 1].ts) !=
+        SQLITE_OK ||
+      sqlite3_bind_int64(stmt, 3, last_id) != SQLITE_OK ||
+      sqlite3_step(stmt) != SQLITE_DONE) {
+    LOG_ERROR("chunk head delete failed: %s", sqlite3_errmsg(g_db));
+    goto error;
+  }
+  db_stmt_release(stmt);
+  return db_exec(g_db, "RELEASE chunk") == 0 ? (int)count : -1;
+
+error:
+  db_stmt_release(stmt);
+  if (!sqlite3_get_autocommit(g_db)) {
+    db_exec(g_db, "ROLLBACK TO chunk; RELEASE chunk");
+  }
+  return -1;
+}
+
+/* Seals every full chunk of the head, in the current transaction */
+static int db_chunks_seal(void)
+{
+  for (size_t ch = 0; ch < g_head_cap; ch++) {
+    while (g_head[ch] >= CHUNK_SAMPLES) {
+      int n = db_chunk_seal((int)ch);
+
+      if (n < 0) {
+        return -1;
+      }
+      g_head[ch] -= (uint32_t)n < g_head[ch] ? (uint32_t)n : g_head[ch];
+      if (n == 0) {
+        g_head[ch] = 0;
+      }
+    }
+  }
+  return 0;
+}
+
+/* Decodes the chunks of a channel overlapping [from, to) and calls visit
+   for their samples in that range, chunk by chunk */
+static int db_chunks_visit(int channel_id, int64_t from, int64_t to,
+                           db_chunk_visit_t visit, void *arg)
+{
+  sqlite3_stmt *stmt = g_stmt_chunk_range;
+  sensor_type_t type;
+  int           rc;
+
+  if (sqlite3_bind_int(stmt, 1, channel_id) != SQLITE_OK ||
+      sqlite3_bind_int64(stmt, 2, to) != SQLITE_OK ||
+      sqlite3_bind_int64(stmt, 3, from) != SQLITE_OK) {
+    LOG_ERROR("sqlite3_bind failed: %s", sqlite3_errmsg(g_db));
+    db_stmt_release(stmt);
+    return -1;
+  }
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    int n = chunk_decode(sqlite3_column_blob(stmt, 0),
+                         (size_t)sqlite3_column_bytes(stmt, 0), &type,
+                         g_chunk_samples, CHUNK_SAMPLES);
+
+    if (n < 0) {
+      LOG_ERROR("chunks: malformed chunk of channel %d", channel_id);
+      continue;
+    }
+    for (int i = 0; i < n; i++) {
+      const chunk_sample_t *s = &g_chunk_samples[i];
+
+      if (s->ts < from || s->ts >= to) {
+        continue;
+      }
+      visit(s->ts,
+            type == SENSOR_TYPE_FLOAT ? (double)s->value.f
+            : type == SENSOR_TYPE_INT ? (double)s->value.i
+                                      : (s->value.b ? 1.0 : 0.0),
+            arg);
+    }
+  }
+  db_stmt_release(stmt);
+  if (rc != SQLITE_DONE) {
+    LOG_ERROR("chunk read failed: %s", sqlite3_errmsg(g_db));
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Rollups
+ *
+ * Every numeric reading is folded into the open bucket of its channel at
+ * each level. A bucket is written when a reading for a later bucket
+ * arrives, and every DB_ROLLUP_FLUSH_MS for the buckets still open, always
+ * by merging into the stored row, so a bucket written in several parts
+ * adds up. A reading for a bucket older than the open one is merged
+ * directly. Rows are written in the transaction of the readings.
+ *
+ * The periodic flush writes every pending bucket and records the id of the
+ * last reading inserted in rollup_state: up to that id, every reading is
+ * accounted for. After a crash, or when a transaction is lost, the buckets
+ * of the readings past that id are recomputed from the readings.
+ */
+
+/* Start of the bucket of width period holding ts, negative ts included */
+static int64_t db_rollup_bucket(int64_t ts, int64_t period)
+{
+  return ts - ((ts % period) + period) % period;
+}
+
+static int db_rollup_write(int channel_id, size_t level, const db_rollup_t *r)
+{
+  sqlite3_stmt *stmt = g_stmt_rollup_merge;
+  int           rc;
+
+  if (sqlite3_bind_int(stmt, 1, channel_id) != SQLITE_OK ||
+      sqlite3_bind_int64(stmt, 2, g_rollup_periods[level]) != SQLITE_OK ||
+      sqlite3_bind_int64(stmt, 3, r->bucket) != SQLITE_OK ||
+      sqlite3_bind_int64(stmt, 4, r->count) != SQLITE_OK ||
+      sqlite3_bind_double(stmt, 5, r->sum) != SQLITE_OK ||
+      sqlite3_bind_double(stmt, 6, r->min) != SQLITE_OK ||
+      sqlite3_bind_double(stmt, 7, r->max) != SQLITE_OK ||
+      sqlite3_bind_double(stmt, 8, r->last) != SQLITE_OK ||
+      sqlite3_bind_int64(stmt, 9, r->last_ts) != SQLITE_OK) {
+    LOG_ERROR("sqlite3_bind failed: %s", sqlite3_errmsg(g_db));
+    goto error;
+  }
+
+  rc = sqlite3_step(stmt);
+  if (rc != SQLITE_DONE) {
+    LOG_ERROR("rollup write failed: %s", sqlite3_errmsg(g_db));
+    goto error;
+  }
+  db_stmt_release(stmt);
+  return 0;
+
+error:
+  db_stmt_release(stmt);
+  /* the readings are stored: keep the mark where it is so the next start
+     recomputes what this bucket misses */
+  g_rollup_failed = true;
+  return -1;
+}
+
+static void db_rollup_start(db_rollup_t *r, int64_t bucket, int64_t ts,
+                            double value)
+{
+  r->bucket  = bucket;
+  r->last_ts = ts;
+  r->sum     = value;
+  r->min     = value;
+  r->max     = value;
+  r->last    = value;
+  r->count   = 1;
+}
+
+static void db_rollup_merge(db_rollup_t *r, int64_t ts, double value)
+{
+  r->count++;
+  r->sum += value;
+  if (value < r->min) {
+    r->min = value;
+  }
+  if (value > r->max) {
+    r->max = value;
+  }
+  if (ts >= r->last_ts) {
+    r->last_ts = ts;
+    r->last    = value;
+  }
+}
+
+static int db_rollup_reserve(int channel_id)
+{
+  size_t       cap = g_rollup_cap ? g_rollup_cap : DB_CACHE_MIN_CAP;
+  db_rollup_t *rollups;
+
+  if ((size_t)channel_id < g_rollup_cap) {
+    return 0;
+  }
+  while (cap <= (size_t)channel_id) {
+    cap *= 2;
+  }
+  rollups = realloc(g_rollups, cap * DB_ROLLUP_LEVELS * sizeof(*rollups));
+  if (!rollups) {
+    LOG_ERROR("rollups: out of memory for %zu channels", cap);
+    return -1;
+  }
+  for (size_t i = g_rollup_cap * DB_ROLLUP_LEVELS; i < cap * DB_ROLLUP_LEVELS;
+       i++) {
+    rollups[i].bucket = INT64_MIN;
+    rollups[i].count  = 0;
+  }
+  g_rollups    = rollups;
+  g_rollup_cap = cap;
+  return 0;
+}
+
+static void db_rollup_add(int channel_id, int64_t ts, double value)
+{
+  if (db_rollup_reserve(channel_id) != 0) {
+    g_rollup_failed = true;
+    return;
+  }
+
+  for (size_t level = 0; level < DB_ROLLUP_LEVELS; level++) {
+    db_rollup_t *r      = &g_rollups[channel_id * DB_ROLLUP_LEVELS + level];
+    int64_t      bucket = db_rollup_bucket(ts, g_rollup_periods[level]);
+
+    if (bucket == r->bucket && r->count > 0) {
+      db_rollup_merge(r, ts, value);
+    } else if (bucket >= r->bucket) {
+      /* the open bucket closes */
+      if (r->count > 0) {
+        db_rollup_write(channel_id, level, r);
+      }
+      db_rollup_start(r, bucket, ts, value);
+    } else {
+      /* late reading */
+      db_rollup_t late;
+
+      db_rollup_start(&late, bucket, ts, value);
+      db_rollup_write(channel_id, level, &late);
+    }
+  }
+}
+
+/* Writes every pending bucket and moves the mark to the last reading, in
+   the current transaction */
+static int db_rollup_flush(void)
+{
+  sqlite3_stmt *stmt = g_stmt_rollup_mark;
+  int           rc;
+
+  for (size_t i = 0; i < g_rollup_cap * DB_ROLLUP_LEVELS; i++) {
+    if (g_rollups[i].count > 0) {
+      db_rollup_write((int)(i / DB_ROLLUP_LEVELS), i % DB_ROLLUP_LEVELS,
+                      &g_rollups[i]);
+      g_rollups[i].count = 0;
+    }
+  }
+  g_rollup_flush_ms = db_now_ms();
+  if (g_rollup_failed) {
+    return -1;
+  }
+
+  if (sqlite3_bind_int64(stmt, 1, g_rollup_last_id) != SQLITE_OK) {
+    LOG_ERROR("sqlite3_bind_int64 failed: %s", sqlite3_errmsg(g_db));
+    db_stmt_release(stmt);
+    return -1;
+  }
+  rc = sqlite3_step(stmt);
+  db_stmt_release(stmt);
+  if (rc != SQLITE_DONE) {
+    LOG_ERROR("rollup mark failed: %s", sqlite3_errmsg(g_db));
+    return -1;
+  }
+  return g_chunked ? db_chunks_seal() : 0;
+}
+
+/* A bucket recomputed by the repair, for the readings in chunks */
+typedef struct {
+  size_t      level;
+  db_rollup_t r;
+} db_rollup_dirty_t;
+
+typedef struct {
+  db_rollup_dirty_t *items; /* sorted by level then bucket */
+  size_t             count;
+} db_rollup_dirty_list_t;
+
+static void db_rollup_repair_visit(int64_t ts, double value, void *arg)
+{
+  db_rollup_dirty_list_t *list = arg;
+
+  for (size_t level = 0; level < DB_ROLLUP_LEVELS; level++) {
+    int64_t bucket = db_rollup_bucket(ts, g_rollup_periods[level]);
+    size_t  lo     = 0;
+    size_t  hi     = list->count;
+
+    while (lo < hi) {
+      size_t             mid = (lo + hi) / 2;
+      db_rollup_dirty_t *d   = &list->items[mid];
+
+      if (d->level < level || (d->level == level && d->r.bucket < bucket)) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    if (lo < list->count && list->items[lo].level == level &&
+        list->items[lo].r.bucket == bucket) {
+      db_rollup_t *r = &list->items[lo].r;
+
+      if (r->count == 0) {
+        db_rollup_start(r, bucket, ts, value);
+      } else {
+        db_rollup_merge(r, ts, value);
+      }
+    }
+  }
+}
+
+/* Adds the readings sealed in chunks to the dirty buckets of a channel */
+static int db_rollup_repair_channel(int channel_id,
+                                    db_rollup_dirty_list_t *list)
+{
+  int64_t from = INT64_MAX;
+  int64_t to   = INT64_MIN;
 
-  rc = sqlite3_exec(db, sql, NULL, NULL, &err_msg);
-  if (rc != SQLITE_OK) {
-    fprintf(stderr, "SQL error: %s\n", err_msg);
-    sqlite3_free(err_msg);
+  for (size_t i = 0; i < list->count; i++) {
+    int64_t start = list->items[i].r.bucket;
+    int64_t end   = start + g_rollup_periods[list->items[i].level];
+
+    from = start < from ? start : from;
+    to   = end > to ? end : to;
+  }
+  if (db_chunks_visit(channel_id, from, to, db_rollup_repair_visit, list) !=
+      0) {
+    return -1;
+  }
+  for (size_t i = 0; i < list->count; i++) {
+    if (list->items[i].r.count > 0 &&
+        db_rollup_write(channel_id, list->items[i].level,
+                        &list->items[i].r) != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* Same for every bucket listed in rollup_dirty */
+static int db_rollup_repair_chunks(void)
+{
+  sqlite3_stmt          *stmt       = NULL;
+  db_rollup_dirty_list_t list       = {0};
+  size_t                 cap        = 0;
+  int                    channel_id = -1;
+  int                    rc;
+
+  rc = sqlite3_prepare_v2(g_db,
+                          "SELECT channel_id, period, bucket FROM rollup_dirty"
+                          " ORDER BY channel_id, period, bucket",
+                          -1, &stmt, NULL);
+  while (rc == SQLITE_OK || rc == SQLITE_ROW) {
+    int next;
+
+    rc   = sqlite3_step(stmt);
+    next = rc == SQLITE_ROW ? sqlite3_column_int(stmt, 0) : -1;
+    if (next != channel_id && list.count > 0) {
+      if (db_rollup_repair_channel(channel_id, &list) != 0) {
+        goto error;
+      }
+      list.count = 0;
+    }
+    if (rc != SQLITE_ROW) {
+      break;
+    }
+    channel_id = next;
+
+    if (list.count == cap) {
+      size_t             new_cap = cap ? cap * 2 : 64;
+      db_rollup_dirty_t *items   =
+        realloc(list.items, new_cap * sizeof(*items));
+
+      if (!items) {
+        LOG_ERROR("rollups: out of memory");
+        goto error;
+      }
+      list.items = items;
+      cap        = new_cap;
+    }
+
+    db_rollup_dirty_t *d      = &list.items[list.count++];
+    int64_t            period = sqlite3_column_int64(stmt, 1);
+
+    d->level = 0;
+    while (d->level + 1 < DB_ROLLUP_LEVELS &&
+           g_rollup_periods[d->level] != period) {
+      d->level++;
+    }
+    d->r.bucket = sqlite3_column_int64(stmt, 2);
+    d->r.count  = 0;
+  }
+  if (rc != SQLITE_DONE) {
+    LOG_ERROR("rollup repair failed: %s", sqlite3_errmsg(g_db));
+    goto error;
+  }
+  sqlite3_finalize(stmt);
+  free(list.items);
+  return 0;
+
+error:
+  sqlite3_finalize(stmt);
+  free(list.items);
+  return -1;
+}
+
+/* Recomputes from the readings every bucket holding a reading past the
+   mark, then moves the mark to the last reading. Pending buckets are
+   dropped: they are part of what is recomputed. Partitions hold whole
+   hours, so each bucket is recomputed from a single partition, plus the
+   chunks of its channel with chunk storage. */
+static int db_rollup_repair(void)
+{
+  sqlite3_stmt *stmt     = NULL;
+  const char   *value    = db_layout_value();
+  int64_t       mark     = 0;
+  int64_t       last     = 0;
+  bool          clean;
+  uint64_t      start_ms = db_now_ms();
+  char          sql[4096];
+  int           rc;
+
+  for (size_t i = 0; i < g_rollup_cap * DB_ROLLUP_LEVELS; i++) {
+    g_rollups[i].count = 0;
+  }
+  g_rollup_failed = false;
+
+  rc = sqlite3_prepare_v2(g_db, "SELECT reading_id, clean FROM rollup_state",
+                          -1, &stmt, NULL);
+  if (rc != SQLITE_OK || sqlite3_step(stmt) != SQLITE_ROW) {
+    LOG_ERROR("rollup state check failed: %s", sqlite3_errmsg(g_db));
+    sqlite3_finalize(stmt);
+    return -1;
+  }
+  mark  = sqlite3_column_int64(stmt, 0);
+  clean = sqlite3_column_int(stmt, 1) != 0;
+  sqlite3_finalize(stmt);
+  /* compact tables have no rowid to find the last reading with */
+  if (g_compact && clean) {
+    last = mark;
+  } else if (db_parts_max_id(&last) != 0) {
+    return -1;
+  }
+
+  /* the partition holding the last id may have been dropped: ids must not
+     go back below the mark */
+  g_rollup_last_id  = last > mark ? last : mark;
+  g_rollup_flush_ms = start_ms;
+  if (last <= mark) {
+    return 0;
+  }
+
+  if (db_exec(g_db, "BEGIN IMMEDIATE;"
+                    "CREATE TEMP TABLE IF NOT EXISTS rollup_dirty ("
+                    "  channel_id INTEGER, period INTEGER, bucket INTEGER,"
+                    "  PRIMARY KEY (channel_id, period, bucket)"
+                    ") WITHOUT ROWID;") != 0) {
+    goto error;
+  }
+
+  for (size_t i = 0; i < g_part_count; i++) {
+    const char *name = g_parts[i].name;
+    size_t      n    = 0;
+
+    for (size_t level = 0; level < DB_ROLLUP_LEVELS; level++) {
+      long long p = (long long)g_rollup_periods[level];
+
+      n += (size_t)snprintf(
+        sql + n, sizeof(sql) - n,
+        "INSERT OR IGNORE INTO rollup_dirty"
+        "  SELECT channel_id, %lld, timestamp - ((timestamp %% %lld) + %lld)"
+        "         %% %lld"
+        "    FROM \"%s\" WHERE id > %lld AND %s IS NOT NULL;",
+        p, p, p, p, name, (long long)mark, value);
+    }
+    n += (size_t)snprintf(
+      sql + n, sizeof(sql) - n,
+      "DELETE FROM rollups WHERE (channel_id, period, bucket) IN"
+      "  (SELECT channel_id, period, bucket FROM rollup_dirty);"
+      "INSERT INTO rollups"
+      "  (channel_id, period, bucket, count, sum, min, max, last, last_ts)"
+      "  SELECT g.channel_id, g.period, g.bucket, g.n, g.s, g.lo, g.hi,"
+      "         (SELECT %s FROM \"%s\" r"
+      "           WHERE r.channel_id = g.channel_id"
+      "             AND r.timestamp = g.last_ts"
+      "             AND %s IS NOT NULL"
+      "           ORDER BY r.id DESC LIMIT 1),"
+      "         g.last_ts"
+      "    FROM (SELECT d.channel_id, d.period, d.bucket, count(*) AS n,"
+      "                 sum(%s) AS s, min(%s) AS lo, max(%s) AS hi,"
+      "                 max(r.timestamp) AS last_ts"
+      "            FROM rollup_dirty d"
+      "            JOIN \"%s\" r ON r.channel_id = d.channel_id"
+      "                         AND r.timestamp >= d.bucket"
+      "                         AND r.timestamp < d.bucket + d.period"
+      "           WHERE %s IS NOT NULL"
+      "           GROUP BY d.channel_id, d.period, d.bucket) g;",
+      value, name, value, value, value, value, name, value);
+    if (db_exec(g_db, sql) != 0 ||
+        (g_chunked && db_rollup_repair_chunks() != 0) ||
+        db_exec(g_db, "DELETE FROM rollup_dirty;") != 0) {
+      goto error;
+    }
+  }
+
+  snprintf(sql, sizeof(sql),
+           "UPDATE rollup_state SET reading_id = %lld;"
+           "COMMIT;",
+           (long long)last);
+  if (db_exec(g_db, sql) != 0) {
+    goto error;
+  }
+
+  LOG_INFO("Rebuilt the rollups of %lld readings in %llu ms",
+           (long long)(last - mark),
+           (unsigned long long)(db_now_ms() - start_ms));
+  return 0;
+
+error:
+  if (!sqlite3_get_autocommit(g_db)) {
+    db_exec(g_db, "ROLLBACK");
+  }
+  g_rollup_failed = true;
+  return -1;
+}
+
+/*
+ * Spool positions
+ *
+ * A snapshot appended to the spool carries its position down the queue.
+ * The position of the last one applied from each stream is written to the
+ * spool table in the transaction that commits it: after a crash,
+ * spool_open() replays what comes after, and once a whole segment is
+ * committed the spool deletes it.
+ */
+
+/* Writer thread only, except g_spool_saved, read by db_spool_committed() */
+static uint64_t         g_spool_applied[DB_MAX_PRODUCERS];
+static _Atomic uint64_t g_spool_saved[DB_MAX_PRODUCERS];
+static bool             g_spool_dirty = false;
+
+static int db_spool_load(void)
+{
+  sqlite3_stmt *stmt;
+  int           rc;
+
+  for (size_t i = 0; i < DB_MAX_PRODUCERS; i++) {
+    g_spool_applied[i] = 0;
+    atomic_store(&g_spool_saved[i], 0);
+  }
+  g_spool_dirty = false;
+
+  if (db_prepare("SELECT stream, position FROM spool", &stmt) != 0) {
+    return -1;
+  }
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    sqlite3_int64 stream = sqlite3_column_int64(stmt, 0);
+
+    if (stream >= 0 && stream < DB_MAX_PRODUCERS) {
+      g_spool_applied[stream] = (uint64_t)sqlite3_column_int64(stmt, 1);
+      atomic_store(&g_spool_saved[stream], g_spool_applied[stream]);
+    }
+  }
+  sqlite3_finalize(stmt);
+  if (rc != SQLITE_DONE) {
+    LOG_ERROR("Failed to load the spool positions: %s", sqlite3_errmsg(g_db));
+    return -1;
+  }
+  return 0;
+}
+
+/* Writes the positions applied since the last commit, in the transaction
+   about to commit */
+static int db_spool_save(void)
+{
+  if (!g_spool_dirty) {
+    return 0;
+  }
+  for (size_t i = 0; i < DB_MAX_PRODUCERS; i++) {
+    int rc;
+
+    if (g_spool_applied[i] == atomic_load(&g_spool_saved[i])) {
+      continue;
+    }
+    sqlite3_bind_int64(g_stmt_spool_save, 1, (sqlite3_int64)i);
+    sqlite3_bind_int64(g_stmt_spool_save, 2,
+                       (sqlite3_int64)g_spool_applied[i]);
+    rc = sqlite3_step(g_stmt_spool_save);
+    db_stmt_release(g_stmt_spool_save);
+    if (rc != SQLITE_DONE) {
+      /* the readings are still committed: a crash would replay them */
+      LOG_ERROR("Failed to save the spool position: %s",
+                sqlite3_errmsg(g_db));
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* Once the positions saved are on disk */
+static void db_spool_committed_all(void)
+{
+  for (size_t i = 0; i < DB_MAX_PRODUCERS; i++) {
+    atomic_store(&g_spool_saved[i], g_spool_applied[i]);
+  }
+  g_spool_dirty = false;
+}
+
+/**
+ * @brief Position in the spool of the last snapshot of a stream whose
+ *        readings are committed
+ *
+ * Safe from any thread.
+ *
+ * @param stream Spool stream, the producer that appended the snapshots
+ *
+ * @return DB_SPOOL_POS() of the snapshot, 0 if there is none
+ */
+uint64_t db_spool_committed(unsigned int stream)
+{
+  if (stream >= DB_MAX_PRODUCERS) {
+    return 0;
+  }
+  return atomic_load(&g_spool_saved[stream]);
+}
+
+/* Databases created before devices existed have channels keyed by name
+   alone: rebuild the table with a device_id column, every existing channel
+   going to a "legacy" device. Reading rows keep their channel ids. */
+static int db_migrate_channels(void)
+{
+  sqlite3_stmt *stmt = NULL;
+  int           exists;
+  int           has_device;
+  int           rc;
+
+  rc = sqlite3_prepare_v2(
+    g_db,
+    "SELECT (SELECT count(*) FROM sqlite_master"
+    "         WHERE type = 'table' AND name = 'channels'),"
+    "       (SELECT count(*) FROM pragma_table_info('channels')"
+    "         WHERE name = 'device_id')",
+    -1, &stmt, NULL);
+  if (rc != SQLITE_OK || sqlite3_step(stmt) != SQLITE_ROW) {
+    LOG_ERROR("schema check failed: %s", sqlite3_errmsg(g_db));
+    sqlite3_finalize(stmt);
+    return -1;
+  }
+  exists     = sqlite3_column_int(stmt, 0);
+  has_device = sqlite3_column_int(stmt, 1);
+  sqlite3_finalize(stmt);
+
+  if (!exists || has_device) {
+    return 0;
+  }
+
+  LOG_INFO("Migrating channels to per-device channels");
+  if (db_exec(g_db,
+              "BEGIN IMMEDIATE;"
+              "INSERT OR IGNORE INTO devices (name, created_at)"
+              "  VALUES ('" DB_LEGACY_DEVICE "', strftime('%s', 'now') * 1000);"
+              "CREATE TABLE channels_new ("
+              "  id        INTEGER PRIMARY KEY AUTOINCREMENT,"
+              "  device_id INTEGER NOT NULL REFERENCES devices(id),"
+              "  name      TEXT    NOT NULL,"
+              "  type      INTEGER NOT NULL,"
+              "  UNIQUE (device_id, name)"
+              ");"
+              "INSERT INTO channels_new (id, device_id, name, type)"
+              "  SELECT id, (SELECT id FROM devices"
+              "               WHERE name = '" DB_LEGACY_DEVICE "'),"
+              "         name, type FROM channels;"
+              "DROP TABLE channels;"
+              "ALTER TABLE channels_new RENAME TO channels;"
+              "COMMIT;") != 0) {
+    if (!sqlite3_get_autocommit(g_db)) {
+      db_exec(g_db, "ROLLBACK");
+    }
     return -1;
   }
   return 0;
 }
 
-int db_init(const char *path)
+/**
+ * @brief Open the database, create the schema and apply the configuration
+ *
+ * @param path Path of the SQLite database file
+ * @param cfg  Durability profile and commit mode, NULL for DB_CONFIG_DEFAULT
+ *
+ * @return 0 on success, -1 on error
+ */
+int db_init(const char *path, const db_config_t *cfg)
 {
+  if (cfg) {
+    g_cfg = *cfg;
+  }
+  if (g_cfg.batch_rows == 0) {
+    g_cfg.batch_rows = 1;
+  }
+  if (g_cfg.queue_capacity == 0) {
+    g_cfg.queue_capacity = DB_QUEUE_CAPACITY_DEFAULT;
+  }
+
   int rc = sqlite3_open(path, &g_db);
   if (rc != SQLITE_OK) {
-    fprintf(stderr, "Failed to open database '%s': %s\n", path,
-            sqlite3_errmsg(g_db));
+    LOG_ERROR("Failed to open database '%s': %s", path,
+              sqlite3_errmsg(g_db));
     sqlite3_close(g_db);
     g_db = NULL;
     return -1;
   }
 
+  if (db_apply_profile(&g_profiles[g_cfg.durability]) != 0) {
+    return -1;
+  }
+
+  const char *sql_devices =
+    "CREATE TABLE IF NOT EXISTS devices ("
+    "  id         INTEGER PRIMARY KEY AUTOINCREMENT,"
+    "  name       TEXT    NOT NULL UNIQUE,"
+    "  created_at INTEGER NOT NULL"
+    ");";
+
+  /* the (device_id, name) unique index doubles as the per-device channel
+     index: a device time-range scan is one range scan of
+     idx_readings_channel_time per channel of the device */
   const char *sql_channels =
     "CREATE TABLE IF NOT EXISTS channels ("
-    "  id    INTEGER PRIMARY KEY AUTOINCREMENT,"
-    "  name  TEXT    NOT NULL UNIQUE,"
-    "  type  INTEGER NOT NULL"
+    "  id        INTEGER PRIMARY KEY AUTOINCREMENT,"
+    "  device_id INTEGER NOT NULL REFERENCES devices(id),"
+    "  name      TEXT    NOT NULL,"
+    "  type      INTEGER NOT NULL,"
+    "  UNIQUE (device_id, name)"
     ");";
 
   const char *sql_readings =
@@ -53,171 +2176,566 @@ int db_init(const char *path)
     "CREATE INDEX IF NOT EXISTS idx_readings_channel_time"
     "  ON readings(channel_id, timestamp);";
 
+  const char *sql_readings_compact =
+    "CREATE TABLE IF NOT EXISTS readings (" DB_COMPACT_COLUMNS
+    ") WITHOUT ROWID;";
+
+  /* the key orders a channel's buckets by width then time: a time-range
+     scan at one width is one range scan of the table */
+  const char *sql_rollups =
+    "CREATE TABLE IF NOT EXISTS rollups ("
+    "  channel_id INTEGER NOT NULL REFERENCES channels(id),"
+    "  period     INTEGER NOT NULL,"
+    "  bucket     INTEGER NOT NULL,"
+    "  count      INTEGER NOT NULL,"
+    "  sum        REAL    NOT NULL,"
+    "  min        REAL    NOT NULL,"
+    "  max        REAL    NOT NULL,"
+    "  last       REAL    NOT NULL,"
+    "  last_ts    INTEGER NOT NULL,"
+    "  PRIMARY KEY (channel_id, period, bucket)"
+    ") WITHOUT ROWID;"
+    "CREATE TABLE IF NOT EXISTS rollup_state ("
+    "  id         INTEGER PRIMARY KEY CHECK (id = 0),"
+    "  reading_id INTEGER NOT NULL,"
+    "  clean      INTEGER NOT NULL DEFAULT 0"
+    ");"
+    "INSERT OR IGNORE INTO rollup_state (id, reading_id) VALUES (0, 0);";
+
+  /* last snapshot of each spool stream whose readings are in the database,
+     as DB_SPOOL_POS() */
+  const char *sql_spool =
+    "CREATE TABLE IF NOT EXISTS spool ("
+    "  stream   INTEGER PRIMARY KEY,"
+    "  position INTEGER NOT NULL"
+    ");";
+
+  if (db_exec(g_db, sql_devices) != 0) {
+    return -1;
+  }
+  if (db_migrate_channels() != 0) {
+    return -1;
+  }
   if (db_exec(g_db, sql_channels) != 0) {
     return -1;
   }
-  if (db_exec(g_db, sql_readings) != 0) {
+  if (db_layout_init() != 0 || db_parts_init() != 0) {
+    return -1;
+  }
+  /* an existing wide table keeps its index until it is migrated */
+  if (!g_partitioned &&
+      (db_exec(g_db, g_compact ? sql_readings_compact : sql_readings) != 0 ||
+       (!g_compact && db_exec(g_db, sql_index) != 0))) {
+    return -1;
+  }
+  if (!g_partitioned && (g_cfg.retention_ms > 0 || g_cfg.disk_budget > 0)) {
+    LOG_ERROR("retention drops partitions: it needs a partition "
+              "period");
+    return -1;
+  }
+  if (db_parts_load() != 0) {
+    return -1;
+  }
+  if (g_compact && db_parts_migrate() != 0) {
+    return -1;
+  }
+  if (db_chunks_init() != 0) {
+    return -1;
+  }
+  if (db_exec(g_db, sql_rollups) != 0 || db_exec(g_db, sql_spool) != 0) {
+    return -1;
+  }
+  /* rollup_state from before the clean flag */
+  rc = db_has_column("rollup_state", "clean");
+  if (rc < 0 ||
+      (rc == 0 && db_exec(g_db, "ALTER TABLE rollup_state ADD COLUMN"
+                                "  clean INTEGER NOT NULL DEFAULT 0;") != 0)) {
+    return -1;
+  }
+  if (db_prepare_statements() != 0 || db_spool_load() != 0) {
+    return -1;
+  }
+  /* a new rollups table is filled from the existing readings. Until
+     db_close(), readings may go past the mark. */
+  if (db_rollup_repair() != 0 ||
+      db_exec(g_db, "UPDATE rollup_state SET clean = 0;") != 0) {
+    return -1;
+  }
+  g_retained_ms        = db_now_ms();
+  g_checkpoint_ms      = g_retained_ms;
+  g_checkpoint_changes = sqlite3_total_changes64(g_db);
+  if (db_retention_run() != 0) {
     return -1;
   }
-  if (db_exec(g_db, sql_index) != 0) {
+
+  uint64_t load_start_ms = db_now_ms();
+  if (db_caches_load() != 0) {
     return -1;
   }
 
-  fprintf(stdout, "Database initialized at '%s'\n", path);
+  LOG_INFO("Database initialized at '%s' (profile=%s, commit=%s, "
+           "storage=%s, layout=%s)",
+           path, g_profiles[g_cfg.durability].name,
+           g_commit_modes[g_cfg.commit_mode],
+           g_storages[g_chunked ? DB_STORAGE_CHUNKS : DB_STORAGE_ROWS],
+           g_layouts[g_compact ? DB_LAYOUT_COMPACT : DB_LAYOUT_WIDE]);
+  LOG_INFO("Loaded %zu devices and %zu channels in %llu ms",
+           g_device_cache.len, g_channel_cache.len,
+           (unsigned long long)(db_now_ms() - load_start_ms));
+  if (g_partitioned) {
+    LOG_INFO("Readings in %zu partitions of %llu h", g_part_count,
+             (unsigned long long)(g_cfg.partition_ms / DB_ROLLUP_HOUR_MS));
+  }
   return 0;
 }
 
-/* Returns its ID if found, 0 if not found, -1 on error. */
-static int db_channel_lookup(const char *name)
+/* Steps a lookup statement whose parameters are bound. Returns its ID if
+   found, 0 if not found, -1 on error. */
+static int db_lookup_id(sqlite3_stmt *stmt)
 {
-  sqlite3_stmt *stmt = NULL;
-  int           id = -1;
-  int           rc;
+  int id = -1;
+  int rc;
 
-  rc = sqlite3_prepare_v2(g_db,
-         "SELECT id FROM channels WHERE name = ?",
-         -1, &stmt, NULL);
-  if (rc != SQLITE_OK) {
-    fprintf(stderr, "db_channel_lookup failed: %s\n",
-      sqlite3_errmsg(g_db));
-    goto error;
+  rc = sqlite3_step(stmt);
+  if (rc == SQLITE_ROW) {
+    id = sqlite3_column_int(stmt, 0);
+  } else if (rc == SQLITE_DONE) {
+    id = 0; /* not found: not an error */
+  } else {
+    LOG_ERROR("sqlite3_step failed: %s", sqlite3_errmsg(g_db));
+  }
+
+  db_stmt_release(stmt);
+  return id;
+}
+
+static int db_device_lookup(const char *name)
+{
+  sqlite3_stmt *stmt = g_stmt_device_lookup;
+
+  if (sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC) != SQLITE_OK) {
+    LOG_ERROR("sqlite3_bind_text failed: %s", sqlite3_errmsg(g_db));
+    db_stmt_release(stmt);
+    return -1;
+  }
+  return db_lookup_id(stmt);
+}
+
+static int db_channel_lookup(int device_id, const char *name)
+{
+  sqlite3_stmt *stmt = g_stmt_channel_lookup;
+
+  if (sqlite3_bind_int(stmt, 1, device_id) != SQLITE_OK ||
+      sqlite3_bind_text(stmt, 2, name, -1, SQLITE_STATIC) != SQLITE_OK) {
+    LOG_ERROR("sqlite3_bind failed: %s", sqlite3_errmsg(g_db));
+    db_stmt_release(stmt);
+    return -1;
+  }
+  return db_lookup_id(stmt);
+}
+
+/* Steps an INSERT whose parameters are bound. Returns the new row id, 0 if
+   the row already exists (created behind our back by another connection),
+   -1 on error. */
+static int db_insert_id(sqlite3_stmt *stmt)
+{
+  int id = -1;
+  int rc;
+
+  rc = sqlite3_step(stmt);
+  if (rc == SQLITE_DONE) {
+    id = (int)sqlite3_last_insert_rowid(g_db);
+    if (g_txn_open) {
+      g_txn_new_ids++;
+    }
+  } else if (rc == SQLITE_CONSTRAINT) {
+    id = 0;
+  } else {
+    LOG_ERROR("sqlite3_step failed: %s", sqlite3_errmsg(g_db));
+  }
+
+  db_stmt_release(stmt);
+  return id;
+}
+
+/**
+ * @brief Get the id of a device, creating it on first use
+ *
+ * @param name Device identifier
+ *
+ * @return The device id (> 0), or -1 on error
+ */
+int db_device_get_or_create(const char *name)
+{
+  sqlite3_stmt *stmt = g_stmt_device_insert;
+  int           id;
+
+  id = db_cache_get(&g_device_cache, 0, name);
+  if (id != 0) {
+    return id;
+  }
+
+  if (sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC) != SQLITE_OK ||
+      sqlite3_bind_int64(stmt, 2, db_wall_ms()) != SQLITE_OK) {
+    LOG_ERROR("sqlite3_bind failed: %s", sqlite3_errmsg(g_db));
+    db_stmt_release(stmt);
+    return -1;
+  }
+
+  id = db_insert_id(stmt);
+  if (id == 0) {
+    id = db_device_lookup(name);
+  }
+  if (id <= 0) {
+    return -1;
+  }
+
+  db_cache_put(&g_device_cache, 0, name, id);
+  return id;
+}
+
+static int db_channel_get_or_create(int device_id, const char *name,
+                                    sensor_type_t type)
+{
+  sqlite3_stmt *stmt = g_stmt_channel_insert;
+  int           id;
+
+  id = db_cache_get(&g_channel_cache, device_id, name);
+  if (id != 0) {
+    return id;
+  }
+
+  if (sqlite3_bind_int(stmt, 1, device_id) != SQLITE_OK ||
+      sqlite3_bind_text(stmt, 2, name, -1, SQLITE_STATIC) != SQLITE_OK ||
+      sqlite3_bind_int(stmt, 3, (int)type) != SQLITE_OK) {
+    LOG_ERROR("sqlite3_bind failed: %s", sqlite3_errmsg(g_db));
+    db_stmt_release(stmt);
+    return -1;
+  }
+
+  id = db_insert_id(stmt);
+  if (id == 0) {
+    id = db_channel_lookup(device_id, name);
+  }
+  if (id <= 0) {
+    return -1;
+  }
+
+  db_cache_put(&g_channel_cache, device_id, name, id);
+  return id;
+}
+
+/* Devices and channels created inside a transaction that did not make it to
+   disk must not stay in the caches with an id that does not exist. */
+static void db_txn_discarded(void)
+{
+  g_txn_open = 0;
+  g_txn_discards++;
+  /* the snapshots are lost, their positions are not applied */
+  for (size_t i = 0; i < DB_MAX_PRODUCERS; i++) {
+    g_spool_applied[i] = atomic_load(&g_spool_saved[i]);
+  }
+  g_spool_dirty = false;
+  if (g_txn_new_ids > 0) {
+    db_caches_load();
+  }
+  g_txn_new_ids = 0;
+  /* partitions may have been created or dropped */
+  if (g_partitioned) {
+    db_parts_load();
+  }
+  /* and chunks sealed */
+  if (g_chunked) {
+    db_head_load();
+  }
+  /* pending buckets hold readings that are gone, written buckets may miss
+     some that are not */
+  db_rollup_repair();
+}
+
+static int db_txn_begin(void)
+{
+  int rc;
+
+  if (g_txn_open) {
+    return 0;
+  }
+
+  rc = sqlite3_step(g_stmt_begin);
+  sqlite3_reset(g_stmt_begin);
+  if (rc != SQLITE_DONE) {
+    LOG_ERROR("BEGIN failed: %s", sqlite3_errmsg(g_db));
+    return -1;
+  }
+
+  g_txn_open       = 1;
+  g_txn_rows       = 0;
+  g_txn_new_ids    = 0;
+  g_txn_started_ms = db_now_ms();
+  return 0;
+}
+
+static int db_txn_commit(void)
+{
+  int rc;
+  int saved;
+
+  if (!g_txn_open) {
+    return 0;
+  }
+
+  saved = db_spool_save();
+  rc    = sqlite3_step(g_stmt_commit);
+  sqlite3_reset(g_stmt_commit);
+  if (rc != SQLITE_DONE) {
+    LOG_ERROR("COMMIT failed, %u readings lost: %s", g_txn_rows,
+              sqlite3_errmsg(g_db));
+    if (!sqlite3_get_autocommit(g_db)) {
+      db_exec(g_db, "ROLLBACK");
+    }
+    db_txn_discarded();
+    return -1;
   }
 
-  rc = sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
-  if (rc != SQLITE_OK) {
-    fprintf(stderr, "sqlite3_bind_text failed: %s\n",
-      sqlite3_errmsg(g_db));
-    goto error;
+  g_txn_open = 0;
+  if (saved == 0) {
+    db_spool_committed_all();
   }
+  return 0;
+}
 
-  rc = sqlite3_step(stmt);
-  if (rc == SQLITE_ROW) {
-    id = sqlite3_column_int(stmt, 0);
-  } else if (rc == SQLITE_DONE) {
-    id = 0; /* not found: not an error */
-  } else {
-    fprintf(stderr, "sqlite3_step failed: %s\n", sqlite3_errmsg(g_db));
-    goto error;
+/* Some errors (SQLITE_FULL, SQLITE_IOERR, ...) make SQLite roll back the
+   whole transaction on its own: forget about it so the next reading opens a
+   fresh one instead of running outside of any transaction. */
+static void db_txn_check_aborted(void)
+{
+  if (g_txn_open && sqlite3_get_autocommit(g_db)) {
+    LOG_ERROR("transaction rolled back by SQLite, %u readings lost",
+              g_txn_rows);
+    db_txn_discarded();
   }
+}
 
-  sqlite3_finalize(stmt);
-  return id;
-
-error:
-  if (stmt) {
-    sqlite3_finalize(stmt);
+/**
+ * @brief Mark the start of the readings of one snapshot
+ *
+ * Opens a transaction unless one is already open (batch mode) or the
+ * database runs in autocommit mode.
+ *
+ * @return 0 on success, -1 on error
+ */
+int db_snapshot_begin(void)
+{
+  if (g_cfg.commit_mode == DB_COMMIT_AUTOCOMMIT) {
+    return 0;
   }
-  return -1;
+  return db_txn_begin();
 }
 
-static int db_channel_get_or_create(const char *name, sensor_type_t type)
+/**
+ * @brief Mark the end of the readings of one snapshot
+ *
+ * Commits in snapshot mode; in batch mode only commits once the row or time
+ * threshold of the current batch has been reached.
+ *
+ * @return 0 on success, -1 on error
+ */
+int db_snapshot_end(void)
 {
-  sqlite3_stmt *stmt = NULL;
-  int           id;
-  int           rc;
-
-  id = db_channel_lookup(name);
-  if (id > 0) {
-    return id;
+  switch (g_cfg.commit_mode) {
+  case DB_COMMIT_SNAPSHOT:
+    return db_txn_commit();
+  case DB_COMMIT_BATCH:
+    return db_tick();
+  default:
+    return 0;
   }
+}
 
-  rc = sqlite3_prepare_v2(g_db,
-    "INSERT INTO channels (name, type) VALUES (?, ?)",
-    -1, &stmt, NULL);
-  if (rc != SQLITE_OK) {
-    fprintf(stderr, "sqlite3_prepare_v2 failed: %s\n", sqlite3_errmsg(g_db));
-    goto error;
-  }
+/**
+ * @brief Commit the pending batch if it is full or older than batch_ms
+ *
+ * Meant to be called periodically so an idle server does not keep readings
+ * uncommitted for longer than the configured window. Also writes the open
+ * rollup buckets every DB_ROLLUP_FLUSH_MS, applies the retention limits
+ * every DB_RETENTION_CHECK_MS and checkpoints the WAL every
+ * DB_CHECKPOINT_MS, see db_tick_due_ms().
+ *
+ * @return 0 on success, -1 on error
+ */
+int db_tick(void)
+{
+  uint64_t now_ms = db_now_ms();
+  bool     flush  = now_ms - g_rollup_flush_ms >= DB_ROLLUP_FLUSH_MS;
+  bool     retain = (g_cfg.retention_ms > 0 || g_cfg.disk_budget > 0) &&
+                    now_ms - g_retained_ms >= DB_RETENTION_CHECK_MS;
 
-  rc = sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
-  if (rc != SQLITE_OK) {
-    fprintf(stderr, "sqlite3_bind_text failed: %s\n", sqlite3_errmsg(g_db));
-    goto error;
+  if (flush || retain) {
+    bool own = !g_txn_open;
+
+    /* a failure is retried on the next period, not on every wakeup */
+    if (retain) {
+      g_retained_ms = now_ms;
+    }
+    if (db_txn_begin() != 0) {
+      if (flush) {
+        g_rollup_flush_ms = now_ms;
+      }
+      return -1;
+    }
+    if (flush) {
+      db_rollup_flush();
+    }
+    if (retain) {
+      db_retention_run();
+    }
+    if (own && g_cfg.commit_mode != DB_COMMIT_BATCH &&
+        db_txn_commit() != 0) {
+      return -1;
+    }
   }
 
-  rc = sqlite3_bind_int(stmt, 2, (int)type);
-  if (rc != SQLITE_OK) {
-    fprintf(stderr, "sqlite3_bind_int failed: %s\n", sqlite3_errmsg(g_db));
-    goto error;
+  if (g_cfg.commit_mode == DB_COMMIT_BATCH && g_txn_open &&
+      (g_txn_rows >= g_cfg.batch_rows ||
+       db_now_ms() - g_txn_started_ms >= g_cfg.batch_ms) &&
+      db_txn_commit() != 0) {
+    return -1;
   }
 
-  rc = sqlite3_step(stmt);
-  if (rc != SQLITE_DONE) {
-    fprintf(stderr, "sqlite3_step failed: %s\n", sqlite3_errmsg(g_db));
-    goto error;
+  /* outside of any transaction, so that the checkpoint does not wait for
+     the next commit to land in the WAL: PASSIVE never blocks the readers,
+     and autocheckpoint still bounds the WAL under a steady load */
+  if (!g_txn_open && now_ms - g_checkpoint_ms >= DB_CHECKPOINT_MS &&
+      sqlite3_total_changes64(g_db) != g_checkpoint_changes) {
+    g_checkpoint_ms      = now_ms;
+    g_checkpoint_changes = sqlite3_total_changes64(g_db);
+    if (sqlite3_wal_checkpoint_v2(g_db, NULL, SQLITE_CHECKPOINT_PASSIVE,
+                                  NULL, NULL) != SQLITE_OK) {
+      LOG_WARN("WAL checkpoint failed: %s", sqlite3_errmsg(g_db));
+    }
   }
+  return 0;
+}
 
-  sqlite3_finalize(stmt);
-  return (int)sqlite3_last_insert_rowid(g_db);
+/* When db_tick() has something to do next, in db_now_ms() time: the age
+   limit of the open batch, else the earliest of the periodic tasks */
+static uint64_t db_tick_due_ms(void)
+{
+  uint64_t due = g_rollup_flush_ms + DB_ROLLUP_FLUSH_MS;
 
-error:
-  if (stmt) {
-    sqlite3_finalize(stmt);
+  if (g_cfg.commit_mode == DB_COMMIT_BATCH && g_txn_open) {
+    return g_txn_started_ms + g_cfg.batch_ms;
   }
-  return -1;
+  if ((g_cfg.retention_ms > 0 || g_cfg.disk_budget > 0) &&
+      g_retained_ms + DB_RETENTION_CHECK_MS < due) {
+    due = g_retained_ms + DB_RETENTION_CHECK_MS;
+  }
+  if (sqlite3_total_changes64(g_db) != g_checkpoint_changes &&
+      g_checkpoint_ms + DB_CHECKPOINT_MS < due) {
+    due = g_checkpoint_ms + DB_CHECKPOINT_MS;
+  }
+  return due;
 }
 
-int db_insert_reading(const sensor_channel_t *ch, int64_t timestamp)
+/**
+ * @brief Commit any pending transaction regardless of the commit mode
+ *
+ * @return 0 on success, -1 on error
+ */
+int db_flush(void)
 {
-  sqlite3_stmt *stmt = NULL;
-  int           channel_id;
-  int           rc;
+  return db_txn_commit();
+}
+
+/**
+ * @brief Store one reading
+ *
+ * @param device_id Owner of the channel, from db_device_get_or_create()
+ * @param ch        Channel name, type and value
+ * @param timestamp Reading timestamp, in ms
+ *
+ * @return 0 on success, -1 on error
+ */
+int db_insert_reading(int device_id, const sensor_channel_t *ch,
+                      int64_t timestamp)
+{
+  sqlite3_stmt   *stmt = NULL;
+  db_partition_t *part;
+  int             channel_id;
+  int             col;
+  int             rc;
+
+  /* its partition would be dropped by the next retention check */
+  if (g_cfg.retention_ms > 0 &&
+      timestamp < db_wall_ms() - (int64_t)g_cfg.retention_ms) {
+    g_expired++;
+    return 0;
+  }
 
-  channel_id = db_channel_get_or_create(ch->name, ch->type);
+  channel_id = db_channel_get_or_create(device_id, ch->name, ch->type);
   if (channel_id <= 0) {
-    fprintf(stderr, "failed to get or create channel `%s`\n", ch->name);
+    LOG_ERROR("failed to get or create channel `%s`", ch->name);
     goto error;
   }
 
-  rc = sqlite3_prepare_v2(g_db,
-    "INSERT INTO readings "
-    "(channel_id, timestamp, value_float, value_int, value_text, value_bool) "
-    "VALUES (?, ?, ?, ?, ?, ?)",
-    -1, &stmt, NULL);
-  if (rc != SQLITE_OK) {
-    fprintf(stderr, "sqlite3_prepare_v2 failed: %s\n", sqlite3_errmsg(g_db));
+  part = db_part_for(timestamp);
+  if (!part || !(stmt = db_part_insert(part))) {
+    LOG_ERROR("no partition for timestamp %lld",
+              (long long)timestamp);
     goto error;
   }
 
+  /* ids grow across partitions and compact tables have no rowid: the
+     writer numbers the readings, the wide readings table numbers its own */
+  if (g_partitioned || g_compact) {
+    rc = sqlite3_bind_int64(stmt, g_compact ? 4 : 7, g_rollup_last_id + 1);
+    if (rc != SQLITE_OK) {
+      LOG_ERROR("sqlite3_bind_int64 failed: %s", sqlite3_errmsg(g_db));
+      goto error;
+    }
+  }
+
   rc = sqlite3_bind_int64(stmt, 1, channel_id);
   if (rc != SQLITE_OK) {
-    fprintf(stderr, "sqlite3_bind_int64 failed: %s\n", sqlite3_errmsg(g_db));
+    LOG_ERROR("sqlite3_bind_int64 failed: %s", sqlite3_errmsg(g_db));
     goto error;
   }
 
   rc = sqlite3_bind_int64(stmt, 2, timestamp);
   if (rc != SQLITE_OK) {
-    fprintf(stderr, "sqlite3_bind_int64 failed: %s\n", sqlite3_errmsg(g_db));
+    LOG_ERROR("sqlite3_bind_int64 failed: %s", sqlite3_errmsg(g_db));
     goto error;
   }
 
-  /* only bind the relevant column, leave the other NULL */
+  /* the single value column, or only the column of the type, the others
+     staying NULL */
+  col = g_compact ? 3 : 3 + (int)ch->type;
   switch (ch->type) {
   case SENSOR_TYPE_FLOAT:
-    rc = sqlite3_bind_double(stmt, 3, (double)ch->value.f);
+    rc = sqlite3_bind_double(stmt, col, (double)ch->value.f);
     if (rc != SQLITE_OK) {
-      fprintf(stderr, "sqlite3_bind_double failed: %s\n", sqlite3_errmsg(g_db));
+      LOG_ERROR("sqlite3_bind_double failed: %s", sqlite3_errmsg(g_db));
       goto error;
     }
     break;
   case SENSOR_TYPE_INT:
-    rc = sqlite3_bind_int(stmt, 4, ch->value.i);
+    rc = sqlite3_bind_int(stmt, col, ch->value.i);
     if (rc != SQLITE_OK) {
-      fprintf(stderr, "sqlite3_bind_int failed: %s\n", sqlite3_errmsg(g_db));
+      LOG_ERROR("sqlite3_bind_int failed: %s", sqlite3_errmsg(g_db));
       goto error;
     }
     break;
   case SENSOR_TYPE_STRING:
-    rc = sqlite3_bind_text(stmt, 5, ch->value.s, -1, SQLITE_TRANSIENT);
+    rc = sqlite3_bind_text(stmt, col, ch->value.s, -1, SQLITE_TRANSIENT);
     if (rc != SQLITE_OK) {
-      fprintf(stderr, "sqlite3_bind_text failed: %s\n", sqlite3_errmsg(g_db));
+      LOG_ERROR("sqlite3_bind_text failed: %s", sqlite3_errmsg(g_db));
       goto error;
     }
     break;
   case SENSOR_TYPE_BOOL:
-    rc = sqlite3_bind_int(stmt, 6, ch->value.b);
+    rc = sqlite3_bind_int(stmt, col, ch->value.b);
     if (rc != SQLITE_OK) {
-      fprintf(stderr, "sqlite3_bind_int failed: %s\n", sqlite3_errmsg(g_db));
+      LOG_ERROR("sqlite3_bind_int failed: %s", sqlite3_errmsg(g_db));
       goto error;
     }
     break;
@@ -227,23 +2745,729 @@ int db_insert_reading(const sensor_channel_t *ch, int64_t timestamp)
 
   rc = sqlite3_step(stmt);
   if (rc != SQLITE_DONE) {
-    fprintf(stderr, "sqlite3_step failed: %s\n", sqlite3_errmsg(g_db));
+    LOG_ERROR("sqlite3_step failed: %s", sqlite3_errmsg(g_db));
     goto error;
   }
-  sqlite3_finalize(stmt);
+  db_stmt_release(stmt);
+  if (g_txn_open) {
+    g_txn_rows++;
+  }
+
+  g_rollup_last_id = g_compact ? g_rollup_last_id + 1
+                               : sqlite3_last_insert_rowid(g_db);
+  switch (ch->type) {
+  case SENSOR_TYPE_FLOAT:
+    db_rollup_add(channel_id, timestamp, (double)ch->value.f);
+    break;
+  case SENSOR_TYPE_INT:
+    db_rollup_add(channel_id, timestamp, (double)ch->value.i);
+    break;
+  case SENSOR_TYPE_BOOL:
+    db_rollup_add(channel_id, timestamp, ch->value.b ? 1.0 : 0.0);
+    break;
+  default:
+    break;
+  }
+  if (g_chunked && ch->type != SENSOR_TYPE_STRING &&
+      ch->type != SENSOR_TYPE_LAST && db_head_reserve(channel_id) == 0) {
+    g_head[channel_id]++;
+  }
   return 0;
 
 error:
   if (stmt) {
-    sqlite3_finalize(stmt);
+    db_stmt_release(stmt);
   }
+  db_txn_check_aborted();
   return -1;
 }
 
 void db_close(void)
 {
+  if (g_db) {
+    /* with the mark on the last reading, the next start has nothing to
+       look for past it */
+    if (g_stmt_rollup_mark && db_txn_begin() == 0 &&
+        db_rollup_flush() == 0 && db_flush() == 0) {
+      db_exec(g_db, "UPDATE rollup_state SET clean = 1;");
+    }
+    db_flush();
+  }
+  db_finalize_statements();
+  db_parts_clear();
+  db_chunks_clear();
+  db_caches_clear();
+  free(g_rollups);
+  g_rollups    = NULL;
+  g_rollup_cap = 0;
   if (g_db) {
     sqlite3_close(g_db);
     g_db = NULL;
   }
 }
+
+/*
+ * Storage writer thread
+ *
+ * The CoAP handlers only copy readings into g_queues (one SPSC ring per
+ * producer thread); this thread owns the SQLite connection from
+ * db_writer_start() until db_writer_stop() and applies the queued readings in
+ * batches, so a slow fsync or checkpoint never stalls a CoAP I/O loop.
+ */
+
+#define DB_WRITER_BATCH   256  /* readings popped from the queue at once */
+#define DB_WRITER_LOG_MS  10000
+#define DB_WRITER_RATE_MS 250  /* busy time over which the rate is measured */
+
+/* A snapshot is queued as one header record naming the device, followed by
+   one record per reading */
+#define DB_RECORD_FIRST 0x01 /* snapshot header */
+#define DB_RECORD_LAST  0x02 /* last reading of a snapshot */
+#define DB_RECORD_ACK   0x04 /* header: the producer waits for the commit */
+
+typedef struct {
+  union {
+    sensor_channel_t channel; /* reading */
+    struct {                  /* header */
+      char           device[SENSOR_DEVICE_MAX_LEN];
+      db_spool_pos_t spool;
+    };
+  };
+  int64_t  timestamp;
+  uint64_t enqueued_ns;
+  uint8_t  flags;
+} db_record_t;
+
+/* A snapshot applied but not committed yet, whose producer waits for the
+   outcome */
+typedef struct {
+  unsigned int producer;
+  bool         failed;   /* a reading of it was refused */
+  uint64_t     discards; /* g_txn_discards when it was applied */
+} db_ack_pending_t;
+
+static ring_t          g_queues[DB_MAX_PRODUCERS];
+static ring_t          g_acks[DB_MAX_PRODUCERS]; /* db_acks_pop() statuses */
+static int             g_acks_fd[DB_MAX_PRODUCERS]; /* db_acks_notify() */
+static pthread_mutex_t g_acks_fd_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int    g_queue_count = 0;
+static pthread_t       g_writer;
+static pthread_mutex_t g_writer_lock    = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  g_writer_cond    = PTHREAD_COND_INITIALIZER;
+static atomic_bool     g_writer_running = false;
+static atomic_bool     g_writer_idle    = false;
+
+static _Atomic uint64_t g_stat_depth_max;
+static _Atomic uint64_t g_stat_written;
+static _Atomic uint64_t g_stat_failed;
+static _Atomic uint64_t g_stat_shed;
+static _Atomic uint64_t g_stat_refused;
+static _Atomic unsigned g_stat_shedding;
+static _Atomic uint64_t g_stat_lag_ns;
+static _Atomic uint64_t g_stat_rate;
+static _Atomic uint64_t g_stat_wait_ns_sum;
+static _Atomic uint64_t g_stat_wait_ns_max;
+
+/* Device of the snapshot being applied and when its header was applied,
+   writer thread only */
+static int            g_writer_device_id = -1;
+static uint64_t       g_writer_started_ns;
+static bool           g_writer_ack;    /* its producer waits for the commit */
+static bool           g_writer_failed; /* one of its readings was refused */
+static db_spool_pos_t g_writer_spool;  /* where it is in the spool */
+
+/* Snapshots to acknowledge once the open transaction commits, writer
+   thread only: DB_ACKS_MAX per producer, as many as it may have waiting */
+static db_ack_pending_t *g_acks_pending = NULL;
+static size_t            g_acks_count   = 0;
+
+/* Whether each producer refuses snapshots, written by that producer only */
+static bool g_shedding[DB_MAX_PRODUCERS];
+
+static void db_stat_max(_Atomic uint64_t *stat, uint64_t value)
+{
+  uint64_t cur = atomic_load_explicit(stat, memory_order_relaxed);
+
+  while (value > cur &&
+         !atomic_compare_exchange_weak_explicit(
+           stat, &cur, value, memory_order_relaxed, memory_order_relaxed)) {
+  }
+}
+
+static size_t db_queue_depth(void)
+{
+  size_t depth = 0;
+
+  for (unsigned int i = 0; i < g_queue_count; i++) {
+    depth += ring_count(&g_queues[i]);
+  }
+  return depth;
+}
+
+/* Sleep until a producer queues readings or until due_ms, in db_now_ms()
+   time */
+static void db_writer_wait(uint64_t due_ms)
+{
+  struct timespec deadline;
+  uint64_t        now_ms  = db_now_ms();
+  uint64_t        wait_ms = due_ms > now_ms ? due_ms - now_ms : 0;
+
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += (time_t)(wait_ms / 1000);
+  deadline.tv_nsec += (long)(wait_ms % 1000) * 1000000;
+  deadline.tv_sec += deadline.tv_nsec / 1000000000;
+  deadline.tv_nsec %= 1000000000;
+
+  pthread_mutex_lock(&g_writer_lock);
+  atomic_store(&g_writer_idle, true);
+  /* re-check under the lock: a producer that saw idle == false has already
+     published its readings, one that sees idle == true will signal */
+  if (db_queue_depth() == 0 && atomic_load(&g_writer_running) &&
+      wait_ms > 0) {
+    pthread_cond_timedwait(&g_writer_cond, &g_writer_lock, &deadline);
+  }
+  atomic_store(&g_writer_idle, false);
+  pthread_mutex_unlock(&g_writer_lock);
+}
+
+static void db_writer_wake(void)
+{
+  /* the readings are pushed with a release store, which a later load may
+     pass: the writer could then sleep on them until its next task */
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load(&g_writer_idle)) {
+    pthread_mutex_lock(&g_writer_lock);
+    pthread_cond_signal(&g_writer_cond);
+    pthread_mutex_unlock(&g_writer_lock);
+  }
+}
+
+/* Hand the outcome of the snapshots waiting for a commit to their
+   producers, once no transaction is open: they are then either on disk or
+   lost with the transactions that were discarded since they were applied */
+static void db_writer_ack(void)
+{
+  bool notify[DB_MAX_PRODUCERS] = {false};
+
+  if (g_txn_open || g_acks_count == 0) {
+    return;
+  }
+  for (size_t i = 0; i < g_acks_count; i++) {
+    db_ack_pending_t *a      = &g_acks_pending[i];
+    int               status = 0;
+
+    if (a->failed || a->discards != g_txn_discards) {
+      status = -1;
+    }
+    /* cannot fail: a producer has at most DB_ACKS_MAX acks outstanding */
+    ring_push(&g_acks[a->producer], &status);
+    notify[a->producer] = true;
+  }
+  g_acks_count = 0;
+
+  /* under the lock: a producer that unregistered its fd may close it */
+  pthread_mutex_lock(&g_acks_fd_lock);
+  for (unsigned int p = 0; p < g_queue_count; p++) {
+    /* fails only on a full counter, which wakes the producer up too */
+    if (notify[p] && g_acks_fd[p] >= 0) {
+      eventfd_write(g_acks_fd[p], 1);
+    }
+  }
+  pthread_mutex_unlock(&g_acks_fd_lock);
+}
+
+static void db_writer_ack_add(unsigned int producer)
+{
+  g_acks_pending[g_acks_count++] = (db_ack_pending_t){
+    .producer = producer,
+    .failed   = g_writer_failed,
+    .discards = g_txn_discards,
+  };
+}
+
+static void db_writer_apply(unsigned int producer, const db_record_t *rec,
+                            uint64_t now_ns)
+{
+  uint64_t wait_ns = now_ns - rec->enqueued_ns;
+
+  if (rec->flags & DB_RECORD_FIRST) {
+    g_writer_started_ns = db_now_ns();
+    g_writer_ack        = rec->flags & DB_RECORD_ACK;
+    g_writer_failed     = false;
+    g_writer_spool      = rec->spool;
+    db_snapshot_begin();
+    g_writer_device_id = db_device_get_or_create(rec->device);
+    if (g_writer_device_id <= 0) {
+      LOG_ERROR("db writer: cannot resolve device '%s'", rec->device);
+    }
+    return;
+  }
+
+  if (g_writer_device_id <= 0 ||
+      db_insert_reading(g_writer_device_id, &rec->channel, rec->timestamp) !=
+        0) {
+    LOG_ERROR("db writer: insert failed for '%s'", rec->channel.name);
+    atomic_fetch_add_explicit(&g_stat_failed, 1, memory_order_relaxed);
+    g_writer_failed = true;
+  } else {
+    atomic_fetch_add_explicit(&g_stat_written, 1, memory_order_relaxed);
+  }
+
+  if (rec->flags & DB_RECORD_LAST) {
+    if (g_writer_ack) {
+      db_writer_ack_add(producer);
+    }
+    if (g_writer_spool.segment != 0) {
+      uint64_t pos = DB_SPOOL_POS(g_writer_spool.segment, g_writer_spool.end);
+
+      /* only forward: the spool deletes what is behind the position */
+      if (pos > g_spool_applied[g_writer_spool.stream]) {
+        g_spool_applied[g_writer_spool.stream] = pos;
+        g_spool_dirty                          = true;
+      }
+    }
+    db_snapshot_end();
+    /* no transaction to save the position with */
+    if (g_cfg.commit_mode == DB_COMMIT_AUTOCOMMIT && db_spool_save() == 0) {
+      db_spool_committed_all();
+    }
+    db_writer_ack();
+    metrics_observe(METRICS_SLOT_WRITER, METRICS_HIST_DB,
+                    db_now_ns() - g_writer_started_ns);
+  }
+
+  atomic_fetch_add_explicit(&g_stat_wait_ns_sum, wait_ns, memory_order_relaxed);
+  db_stat_max(&g_stat_wait_ns_max, wait_ns);
+}
+
+static void db_writer_log_stats(void)
+{
+  db_writer_stats_t st;
+
+  db_writer_get_stats(&st);
+  LOG_INFO("db writer: depth=%zu/%zu max=%zu written=%llu failed=%llu "
+           "shed=%llu refused=%llu lag=%llums rate=%llu/s wait_avg=%lluus "
+           "wait_max=%lluus",
+           st.queue_depth, st.queue_capacity, st.queue_depth_max,
+           (unsigned long long)st.readings_written,
+           (unsigned long long)st.readings_failed,
+           (unsigned long long)st.snapshots_shed,
+           (unsigned long long)st.snapshots_refused,
+           (unsigned long long)st.lag_ms,
+           (unsigned long long)st.drain_rate,
+           (unsigned long long)st.queue_time_avg_us,
+           (unsigned long long)st.queue_time_max_us);
+}
+
+/* Apply up to DB_WRITER_BATCH records of one queue. A snapshot is pushed
+   with a single head update, so once its header is visible the rest is
+   too: keep popping until the snapshot is complete so its transaction
+   never interleaves with readings of another queue. */
+static size_t db_writer_drain(unsigned int producer)
+{
+  db_record_t batch[DB_WRITER_BATCH];
+  ring_t     *queue = &g_queues[producer];
+  size_t      total = 0;
+  size_t      n;
+
+  do {
+    n = ring_pop_n(queue, batch, DB_WRITER_BATCH);
+    if (n == 0) {
+      break;
+    }
+
+    uint64_t now_ns = db_now_ns();
+    for (size_t i = 0; i < n; i++) {
+      db_writer_apply(producer, &batch[i], now_ns);
+    }
+    atomic_store_explicit(&g_stat_lag_ns, now_ns - batch[n - 1].enqueued_ns,
+                          memory_order_relaxed);
+    total += n;
+  } while (!(batch[n - 1].flags & DB_RECORD_LAST));
+
+  return total;
+}
+
+/* Records applied per second of work, waits excluded, so that the rate is
+   what the writer can sustain and not what it was offered. Smoothed over a
+   few samples. */
+static void db_writer_measure(uint64_t records, uint64_t busy_ns)
+{
+  static uint64_t total_records = 0;
+  static uint64_t total_ns      = 0;
+  uint64_t        rate;
+
+  total_records += records;
+  total_ns += busy_ns;
+  if (total_ns < DB_WRITER_RATE_MS * 1000000ull) {
+    return;
+  }
+
+  rate = total_records * 1000000000ull / total_ns;
+  if (atomic_load_explicit(&g_stat_rate, memory_order_relaxed) > 0) {
+    rate = (atomic_load_explicit(&g_stat_rate, memory_order_relaxed) * 3 +
+            rate) / 4;
+  }
+  atomic_store_explicit(&g_stat_rate, rate, memory_order_relaxed);
+  total_records = 0;
+  total_ns      = 0;
+}
+
+static void *db_writer_main(void *arg)
+{
+  uint64_t last_log_ms  = db_now_ms();
+  uint64_t last_written = 0;
+
+  (void)arg;
+
+  for (;;) {
+    /* read the flag before draining: readings pushed before the stop
+       request are then guaranteed to be visible to ring_pop_n() */
+    bool     stopping = !atomic_load(&g_writer_running);
+    uint64_t start_ns = db_now_ns();
+    size_t   n        = 0;
+
+    for (unsigned int i = 0; i < g_queue_count; i++) {
+      n += db_writer_drain(i);
+    }
+
+    db_tick();
+    db_writer_ack();
+    if (n > 0) {
+      db_writer_measure(n, db_now_ns() - start_ns);
+    } else {
+      /* caught up: nothing waits */
+      atomic_store_explicit(&g_stat_lag_ns, 0, memory_order_relaxed);
+      if (stopping) {
+        break;
+      }
+      /* an idle writer wakes for its next task only, and to log what it
+         wrote last */
+      uint64_t due_ms = db_tick_due_ms();
+      if (atomic_load(&g_stat_written) != last_written &&
+          last_log_ms + DB_WRITER_LOG_MS < due_ms) {
+        due_ms = last_log_ms + DB_WRITER_LOG_MS;
+      }
+      db_writer_wait(due_ms);
+    }
+
+    uint64_t now_ms = db_now_ms();
+    if (now_ms - last_log_ms >= DB_WRITER_LOG_MS) {
+      uint64_t written = atomic_load(&g_stat_written);
+      if (written != last_written) {
+        db_writer_log_stats();
+        last_written = written;
+      }
+      last_log_ms = now_ms;
+    }
+  }
+
+  db_flush();
+  db_writer_ack();
+  return NULL;
+}
+
+static void db_queues_free(void)
+{
+  for (unsigned int i = 0; i < g_queue_count; i++) {
+    ring_free(&g_queues[i]);
+    ring_free(&g_acks[i]);
+    g_shedding[i] = false;
+  }
+  g_queue_count = 0;
+  atomic_store(&g_stat_shedding, 0);
+  free(g_acks_pending);
+  g_acks_pending = NULL;
+  g_acks_count   = 0;
+}
+
+/**
+ * @brief Start the storage writer thread
+ *
+ * From this point on the SQLite connection belongs to the writer thread:
+ * readings must be submitted with db_enqueue_snapshot() until
+ * db_writer_stop() returns.
+ *
+ * @param producers Number of threads that will enqueue readings; each one
+ *                  gets its own queue of queue_capacity records
+ *
+ * @return 0 on success, -1 on error
+ */
+int db_writer_start(unsigned int producers)
+{
+  sigset_t all;
+  sigset_t prev;
+  int      rc;
+
+  if (producers == 0 || producers > DB_MAX_PRODUCERS) {
+    LOG_ERROR("db writer: producer count must be 1..%d",
+              DB_MAX_PRODUCERS);
+    return -1;
+  }
+
+  for (; g_queue_count < producers; g_queue_count++) {
+    g_acks_fd[g_queue_count] = -1;
+    if (ring_init(&g_queues[g_queue_count], g_cfg.queue_capacity,
+                  sizeof(db_record_t)) != 0 ||
+        ring_init(&g_acks[g_queue_count], DB_ACKS_MAX, sizeof(int)) != 0) {
+      ring_free(&g_queues[g_queue_count]);
+      LOG_ERROR("db writer: cannot allocate a %zu records queue",
+                g_cfg.queue_capacity);
+      db_queues_free();
+      return -1;
+    }
+  }
+  g_acks_pending = malloc(producers * DB_ACKS_MAX * sizeof(*g_acks_pending));
+  if (!g_acks_pending) {
+    LOG_ERROR("db writer: cannot allocate the commit acks");
+    db_queues_free();
+    return -1;
+  }
+
+  /* signals are for the main thread: the writer inherits a full mask */
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &prev);
+  atomic_store(&g_writer_running, true);
+  rc = pthread_create(&g_writer, NULL, db_writer_main, NULL);
+  pthread_sigmask(SIG_SETMASK, &prev, NULL);
+  if (rc != 0) {
+    LOG_ERROR("db writer: pthread_create failed");
+    atomic_store(&g_writer_running, false);
+    db_queues_free();
+    return -1;
+  }
+
+  LOG_INFO("db writer started (%u queue(s) of %zu records)",
+           g_queue_count, g_queues[0].capacity);
+  return 0;
+}
+
+/**
+ * @brief Queue all the readings of one snapshot for the writer thread
+ *
+ * The snapshot is queued as a whole or not at all. Readings are copied, the
+ * channels can be modified as soon as this returns. Each producer index
+ * must only ever be used by one thread at a time.
+ *
+ * @param producer  Index of the calling producer, < the count given to
+ *                  db_writer_start()
+ * @param device    Identifier of the device that sent the snapshot
+ * @param channels  Channels holding the values to store
+ * @param count     Number of channels
+ * @param timestamp Snapshot timestamp, in ms
+ * @param ack       Report the outcome through db_acks_pop() once committed,
+ *                  at most DB_ACKS_MAX snapshots not popped yet. A snapshot
+ *                  without readings is not queued, and not reported.
+ * @param spool     Where the snapshot was appended to the spool, saved with
+ *                  its readings; NULL if it was not
+ *
+ * @return 0 on success, -1 if the queue does not have room for the snapshot
+ */
+int db_enqueue_snapshot(unsigned int producer, const char *device,
+                        sensor_channel_t *const *channels, size_t count,
+                        int64_t timestamp, bool ack,
+                        const db_spool_pos_t *spool)
+{
+  db_record_t recs[SENSOR_MAX_READINGS + 1];
+  uint64_t    now_ns = db_now_ns();
+  ring_t     *queue;
+
+  if (count == 0) {
+    return 0;
+  }
+  if (count > SENSOR_MAX_READINGS || producer >= g_queue_count) {
+    return -1;
+  }
+  queue = &g_queues[producer];
+
+  snprintf(recs[0].device, sizeof(recs[0].device), "%s", device);
+  recs[0].timestamp   = timestamp;
+  recs[0].enqueued_ns = now_ns;
+  recs[0].flags       = DB_RECORD_FIRST | (ack ? DB_RECORD_ACK : 0);
+  recs[0].spool       = spool ? *spool : (db_spool_pos_t){0};
+
+  for (size_t i = 1; i <= count; i++) {
+    recs[i].channel     = *channels[i - 1];
+    recs[i].timestamp   = timestamp;
+    recs[i].enqueued_ns = now_ns;
+    recs[i].flags       = 0;
+  }
+  recs[count].flags |= DB_RECORD_LAST;
+
+  if (ring_push_n(queue, recs, count + 1) != 0) {
+    atomic_fetch_add_explicit(&g_stat_shed, 1, memory_order_relaxed);
+    return -1;
+  }
+
+  db_stat_max(&g_stat_depth_max, ring_count(queue));
+
+  db_writer_wake();
+  return 0;
+}
+
+/**
+ * @brief Collect the outcome of the snapshots queued with an ack
+ *
+ * Outcomes come in the order the snapshots were queued, once the
+ * transaction holding them has committed, or failed.
+ *
+ * @param producer Index of the calling producer
+ * @param status   Filled with 0 for a snapshot on disk, -1 for one that
+ *                 was lost in part or in whole
+ * @param max      Size of status
+ *
+ * @return Number of outcomes collected
+ */
+size_t db_acks_pop(unsigned int producer, int *status, size_t max)
+{
+  if (producer >= g_queue_count) {
+    return 0;
+  }
+  return ring_pop_n(&g_acks[producer], status, max);
+}
+
+/**
+ * @brief Have the writer wake a producer up when outcomes are ready
+ *
+ * Once the outcomes of a commit are in the producer's ring, the writer adds
+ * 1 to the eventfd: the producer waits on it rather than polling
+ * db_acks_pop(). Once this returns with -1, the previous fd is no longer
+ * used and can be closed.
+ *
+ * @param producer Index of the producer
+ * @param fd       eventfd of the producer, -1 for none
+ */
+void db_acks_notify(unsigned int producer, int fd)
+{
+  if (producer < g_queue_count) {
+    pthread_mutex_lock(&g_acks_fd_lock);
+    g_acks_fd[producer] = fd;
+    pthread_mutex_unlock(&g_acks_fd_lock);
+  }
+}
+
+/**
+ * @brief Decide whether a producer takes a new snapshot
+ *
+ * Call it before parsing the snapshot: a saturated pipeline is better off
+ * refusing work early than accepting work it cannot commit. Past the high
+ * marks, snapshots are refused until the queue and the writer lag are both
+ * back under the low marks: the answer does not flap around one mark, and
+ * the writer keeps a backlog to work on meanwhile.
+ *
+ * @param producer Index of the calling producer, as for
+ *                 db_enqueue_snapshot()
+ *
+ * @return 0 if the snapshot may be queued, -1 if it is to be refused
+ */
+int db_admit(unsigned int producer)
+{
+  ring_t  *queue;
+  size_t   fill;
+  uint64_t lag_ms;
+
+  if (producer >= g_queue_count) {
+    return 0;
+  }
+  queue  = &g_queues[producer];
+  fill   = ring_count(queue) * 100 / queue->capacity;
+  lag_ms = atomic_load_explicit(&g_stat_lag_ns, memory_order_relaxed) /
+           1000000;
+
+  if (!g_shedding[producer]) {
+    if (fill < DB_SHED_HIGH_PCT && lag_ms < DB_SHED_LAG_HIGH_MS) {
+      return 0;
+    }
+    g_shedding[producer] = true;
+    atomic_fetch_add_explicit(&g_stat_shedding, 1, memory_order_relaxed);
+    LOG_WARN("db writer: queue %u %zu%% full, %llu ms behind: refusing "
+             "snapshots",
+             producer, fill, (unsigned long long)lag_ms);
+  } else if (fill <= DB_SHED_LOW_PCT && lag_ms <= DB_SHED_LAG_LOW_MS) {
+    g_shedding[producer] = false;
+    atomic_fetch_sub_explicit(&g_stat_shedding, 1, memory_order_relaxed);
+    LOG_DEBUG("db writer: queue %u %zu%% full, %llu ms behind: taking "
+              "snapshots again",
+              producer, fill, (unsigned long long)lag_ms);
+    return 0;
+  }
+
+  atomic_fetch_add_explicit(&g_stat_refused, 1, memory_order_relaxed);
+  return -1;
+}
+
+/**
+ * @brief How long a refused device should wait before sending again
+ *
+ * The time the writer needs to apply everything queued at its current
+ * rate, for the Max-Age of a 5.03 answer.
+ *
+ * @return Seconds, 1..DB_SHED_RETRY_MAX_S
+ */
+int db_retry_after_s(void)
+{
+  uint64_t rate = atomic_load_explicit(&g_stat_rate, memory_order_relaxed);
+  uint64_t s;
+
+  if (rate == 0) {
+    return DB_SHED_RETRY_MAX_S;
+  }
+  s = (db_queue_depth() + rate - 1) / rate;
+  if (s < 1) {
+    return 1;
+  }
+  return s > DB_SHED_RETRY_MAX_S ? DB_SHED_RETRY_MAX_S : (int)s;
+}
+
+/**
+ * @brief Snapshot the writer queue counters (safe from any thread)
+ *
+ * @param out Filled with the current counters
+ */
+void db_writer_get_stats(db_writer_stats_t *out)
+{
+  uint64_t done;
+
+  memset(out, 0, sizeof(*out));
+  if (g_queue_count == 0) {
+    return;
+  }
+
+  out->queue_depth        = db_queue_depth();
+  out->queue_capacity     = g_queues[0].capacity * g_queue_count;
+  out->queue_depth_max    = (size_t)atomic_load(&g_stat_depth_max);
+  out->readings_written   = atomic_load(&g_stat_written);
+  out->readings_failed    = atomic_load(&g_stat_failed);
+  out->snapshots_shed     = atomic_load(&g_stat_shed);
+  out->snapshots_refused  = atomic_load(&g_stat_refused);
+  out->producers_shedding = atomic_load(&g_stat_shedding);
+  out->lag_ms             = atomic_load(&g_stat_lag_ns) / 1000000;
+  out->drain_rate         = atomic_load(&g_stat_rate);
+
+  done = out->readings_written + out->readings_failed;
+  if (done > 0) {
+    out->queue_time_avg_us = atomic_load(&g_stat_wait_ns_sum) / done / 1000;
+  }
+  out->queue_time_max_us = atomic_load(&g_stat_wait_ns_max) / 1000;
+}
+
+/**
+ * @brief Stop the writer thread once every queued reading is committed
+ *
+ * Must be called after the producer has stopped and before db_close().
+ */
+void db_writer_stop(void)
+{
+  if (!atomic_load(&g_writer_running)) {
+    return;
+  }
+
+  atomic_store(&g_writer_running, false);
+  pthread_mutex_lock(&g_writer_lock);
+  pthread_cond_signal(&g_writer_cond);
+  pthread_mutex_unlock(&g_writer_lock);
+  pthread_join(g_writer, NULL);
+
+  db_writer_log_stats();
+  db_queues_free();
+}
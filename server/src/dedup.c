@@ -0,0 +1,222 @@
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dedup.h"
+#include "log.h"
+
+/*
+ * Set-associative table of fingerprints: the low bits of a fingerprint
+ * pick a set of DEDUP_WAYS entries, one cache line, and an entry is one
+ * 64-bit word holding the other 40 bits and when it expires:
+ *
+ *   tag (40 bits) | expiry, in seconds, modulo 2^24 (24 bits)
+ *
+ * A word is read and written whole, so the workers need no lock: two of
+ * them adding to the same set at once may lose one entry, which only costs
+ * a duplicate being stored. A zero word is a free entry.
+ */
+
+#define DEDUP_WAYS      8
+#define DEDUP_TIME_BITS 24
+#define DEDUP_TIME_MASK ((1u << DEDUP_TIME_BITS) - 1)
+#define DEDUP_SETS_MAX  (1u << DEDUP_TIME_BITS) /* set bits below the tag */
+
+typedef struct {
+  _Atomic uint64_t entries[DEDUP_WAYS];
+} dedup_set_t;
+
+_Static_assert(sizeof(dedup_set_t) == 64, "a set is one cache line");
+
+static dedup_set_t *g_sets     = NULL;
+static size_t       g_set_mask = 0;
+static unsigned int g_window_s = DEDUP_WINDOW_S_DEFAULT;
+
+static uint32_t dedup_now_s(uint64_t now_ns)
+{
+  return (uint32_t)(now_ns / 1000000000) & DEDUP_TIME_MASK;
+}
+
+static uint64_t dedup_tag(uint64_t fingerprint)
+{
+  uint64_t tag = fingerprint >> DEDUP_TIME_BITS;
+
+  return tag ? tag : 1;
+}
+
+/* Seconds an entry has left, 0 or less once it has expired */
+static int32_t dedup_left(uint64_t entry, uint32_t now_s)
+{
+  uint32_t diff = ((uint32_t)entry - now_s) & DEDUP_TIME_MASK;
+
+  /* sign-extend the 24-bit difference */
+  return (int32_t)(diff << (32 - DEDUP_TIME_BITS)) >> (32 - DEDUP_TIME_BITS);
+}
+
+/**
+ * @brief Allocate the table of fingerprints
+ *
+ * @param mem_limit Size of the table in bytes, 0 disables deduplication
+ * @param window_s  How long a snapshot is remembered, in seconds
+ *                  (1..DEDUP_WINDOW_S_MAX)
+ *
+ * @return 0 on success, -1 on error
+ */
+int dedup_init(size_t mem_limit, unsigned int window_s)
+{
+  size_t sets = 1;
+
+  if (window_s == 0 || window_s > DEDUP_WINDOW_S_MAX) {
+    LOG_ERROR("dedup: window must be 1..%u s", DEDUP_WINDOW_S_MAX);
+    return -1;
+  }
+  g_window_s = window_s;
+  if (mem_limit == 0) {
+    return 0;
+  }
+
+  while (sets * 2 * sizeof(dedup_set_t) <= mem_limit &&
+         sets * 2 <= DEDUP_SETS_MAX) {
+    sets *= 2;
+  }
+  g_sets = aligned_alloc(sizeof(dedup_set_t), sets * sizeof(dedup_set_t));
+  if (!g_sets) {
+    LOG_ERROR("dedup: cannot allocate %zu bytes", sets * sizeof(dedup_set_t));
+    return -1;
+  }
+  memset(g_sets, 0, sets * sizeof(dedup_set_t));
+  g_set_mask = sets - 1;
+
+  /* past that rate, entries make room before they expire and the window
+     is effectively shorter */
+  LOG_INFO("Duplicate snapshots remembered for %u s at up to %zu "
+           "snapshots/s (%zu entries, %zu KiB)",
+           window_s, sets * DEDUP_WAYS / window_s, sets * DEDUP_WAYS,
+           (sets * sizeof(dedup_set_t)) >> 10);
+  return 0;
+}
+
+/**
+ * @brief Free the table of fingerprints
+ */
+void dedup_close(void)
+{
+  free(g_sets);
+  g_sets     = NULL;
+  g_set_mask = 0;
+}
+
+/**
+ * @brief Whether snapshots are deduplicated at all
+ *
+ * @return true if dedup_init() allocated a table
+ */
+bool dedup_enabled(void)
+{
+  return g_sets != NULL;
+}
+
+/**
+ * @brief Hash bytes into a fingerprint, 8 bytes at a time
+ *
+ * @param seed Previous fingerprint, to hash several fields in turn, or 0
+ * @param data Bytes to hash
+ * @param len  Number of bytes
+ *
+ * @return The fingerprint
+ */
+uint64_t dedup_hash(uint64_t seed, const void *data, size_t len)
+{
+  const uint8_t *p = data;
+  uint64_t       h = (seed ^ 0x9e3779b97f4a7c15ull) + len;
+  uint64_t       w;
+
+  for (; len >= 8; p += 8, len -= 8) {
+    memcpy(&w, p, 8);
+    h = (h ^ w) * 0xbf58476d1ce4e5b9ull;
+    h ^= h >> 31;
+  }
+  if (len > 0) {
+    w = 0;
+    memcpy(&w, p, len);
+    h = (h ^ w) * 0xbf58476d1ce4e5b9ull;
+  }
+
+  h ^= h >> 29;
+  h *= 0x94d049bb133111ebull;
+  h ^= h >> 32;
+  return h;
+}
+
+/**
+ * @brief Look a snapshot up
+ *
+ * @param fingerprint dedup_hash() of the snapshot
+ * @param now_ns      Current time, from metrics_now_ns()
+ *
+ * @return true if it was added less than the window ago
+ */
+bool dedup_seen(uint64_t fingerprint, uint64_t now_ns)
+{
+  dedup_set_t *set;
+  uint64_t     tag   = dedup_tag(fingerprint);
+  uint32_t     now_s = dedup_now_s(now_ns);
+
+  if (!g_sets) {
+    return false;
+  }
+  set = &g_sets[fingerprint & g_set_mask];
+  for (size_t i = 0; i < DEDUP_WAYS; i++) {
+    uint64_t entry =
+      atomic_load_explicit(&set->entries[i], memory_order_relaxed);
+
+    if (entry >> DEDUP_TIME_BITS == tag && dedup_left(entry, now_s) > 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * @brief Remember a snapshot for the window, from now
+ *
+ * Call it once the snapshot is stored: a snapshot that was refused must be
+ * taken again when it is retransmitted.
+ *
+ * @param fingerprint dedup_hash() of the snapshot
+ * @param now_ns      Current time, from metrics_now_ns()
+ */
+void dedup_add(uint64_t fingerprint, uint64_t now_ns)
+{
+  dedup_set_t *set;
+  uint64_t     tag    = dedup_tag(fingerprint);
+  uint32_t     now_s  = dedup_now_s(now_ns);
+  size_t       victim = 0;
+  int32_t      least  = INT32_MAX;
+
+  if (!g_sets) {
+    return;
+  }
+  set = &g_sets[fingerprint & g_set_mask];
+  for (size_t i = 0; i < DEDUP_WAYS; i++) {
+    uint64_t entry =
+      atomic_load_explicit(&set->entries[i], memory_order_relaxed);
+    int32_t  left  = entry ? dedup_left(entry, now_s) : 0;
+
+    if (entry >> DEDUP_TIME_BITS == tag) {
+      victim = i;
+      break;
+    }
+    if (left < least) {
+      victim = i;
+      least  = left;
+    }
+  }
+  atomic_store_explicit(&set->entries[victim],
+                        tag << DEDUP_TIME_BITS |
+                          ((now_s + g_window_s) & DEDUP_TIME_MASK),
+                        memory_order_relaxed);
+}
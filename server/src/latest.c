@@ -0,0 +1,191 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "latest.h"
+#include "query.h"
+#include "sensor.h"
+
+/* Body of every device, at the version it was last rendered. A body is
+   rendered once per change and shared by every response and notification
+   sent from it, whatever the worker and the number of observers. */
+static latest_body_t **g_bodies   = NULL;
+static size_t          g_body_cap = 0;
+static pthread_mutex_t g_mutex    = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct {
+  FILE *out;
+  bool  first;
+} latest_render_t;
+
+static void latest_put_channel(const sensor_reg_channel_t *ch, void *arg)
+{
+  latest_render_t *r = arg;
+  char             buf[QUERY_STRING_MAX(SENSOR_NAME_MAX_LEN) +
+                       QUERY_STRING_MAX(SENSOR_STRING_MAX_LEN) + 2];
+  size_t           n = 0;
+
+  if (!ch->has_value) {
+    return;
+  }
+
+  if (!r->first) {
+    buf[n++] = ',';
+  }
+  /* the key is "<device>\0<name>\0" */
+  n += query_put_string(buf + n, sizeof(buf) - n,
+                        ch->key + strlen(ch->key) + 1);
+  buf[n++] = ':';
+
+  switch (ch->type) {
+  case SENSOR_TYPE_FLOAT:
+    n += query_put_float(buf + n, sizeof(buf) - n, ch->value.f);
+    break;
+  case SENSOR_TYPE_INT:
+    n += (size_t)snprintf(buf + n, sizeof(buf) - n, "%d", ch->value.i);
+    break;
+  case SENSOR_TYPE_STRING:
+    n += query_put_string(buf + n, sizeof(buf) - n, ch->value.s);
+    break;
+  default:
+    n += (size_t)snprintf(buf + n, sizeof(buf) - n, "%s",
+                          ch->value.b ? "true" : "false");
+    break;
+  }
+
+  /* sized for the worst escaping: nothing is ever cut */
+  fwrite(buf, 1, n, r->out);
+  r->first = false;
+}
+
+static latest_body_t *latest_render(sensor_registry_t *reg, size_t device)
+{
+  latest_render_t r = {.first = true};
+  latest_body_t  *body;
+  char           *text = NULL;
+  size_t          len  = 0;
+  char            name[SENSOR_DEVICE_MAX_LEN];
+  char            quoted[QUERY_STRING_MAX(SENSOR_DEVICE_MAX_LEN)];
+  uint32_t        version;
+
+  if (sensor_device_name(reg, device, name, sizeof(name)) != 0) {
+    return NULL;
+  }
+  r.out = open_memstream(&text, &len);
+  if (!r.out) {
+    return NULL;
+  }
+
+  query_put_string(quoted, sizeof(quoted), name);
+  fprintf(r.out, "{\"d\":%s,\"values\":{", quoted);
+  version = sensor_device_visit(reg, device, latest_put_channel, &r);
+  fputs("}}", r.out);
+  if (fclose(r.out) != 0 || version == 0) {
+    free(text);
+    return NULL;
+  }
+
+  body = malloc(sizeof(*body) + len);
+  if (body) {
+    body->version = version;
+    body->refs    = 1;
+    body->len     = len;
+    memcpy(body->data, text, len);
+  }
+  free(text);
+  return body;
+}
+
+/**
+ * @brief Get the body of a device at its current version, rendering it
+ *        only if a value changed since it was last asked for
+ *
+ * @param device Device number, as numbered by the registry
+ *
+ * @return A reference to the body, to drop with latest_body_put(), or NULL
+ *         if there is no such device or memory is short
+ */
+latest_body_t *latest_body_get(size_t device)
+{
+  sensor_registry_t *reg = sensor_reg_get();
+  latest_body_t     *body;
+  uint32_t           version;
+
+  version = sensor_device_version(reg, device);
+  if (version == 0) {
+    return NULL;
+  }
+
+  pthread_mutex_lock(&g_mutex);
+  if (device >= g_body_cap) {
+    size_t          cap = g_body_cap ? g_body_cap : 64;
+    latest_body_t **bodies;
+
+    while (cap <= device) {
+      cap *= 2;
+    }
+    bodies = realloc(g_bodies, cap * sizeof(*bodies));
+    if (!bodies) {
+      pthread_mutex_unlock(&g_mutex);
+      return NULL;
+    }
+    memset(bodies + g_body_cap, 0, (cap - g_body_cap) * sizeof(*bodies));
+    g_bodies   = bodies;
+    g_body_cap = cap;
+  }
+
+  body = g_bodies[device];
+  if (!body || body->version != version) {
+    /* rendered under the lock so concurrent GETs render it once */
+    latest_body_t *fresh = latest_render(reg, device);
+
+    if (!fresh) {
+      pthread_mutex_unlock(&g_mutex);
+      return NULL;
+    }
+    if (body && --body->refs == 0) {
+      free(body);
+    }
+    body             = fresh;
+    g_bodies[device] = body;
+  }
+  body->refs++;
+  pthread_mutex_unlock(&g_mutex);
+  return body;
+}
+
+/**
+ * @brief Drop a reference taken by latest_body_get()
+ * @param body Body to release, may be NULL
+ */
+void latest_body_put(latest_body_t *body)
+{
+  if (!body) {
+    return;
+  }
+  pthread_mutex_lock(&g_mutex);
+  if (--body->refs == 0) {
+    free(body);
+  }
+  pthread_mutex_unlock(&g_mutex);
+}
+
+/**
+ * @brief Release the cached bodies; bodies still referenced are freed by
+ *        their last latest_body_put()
+ */
+void latest_close(void)
+{
+  pthread_mutex_lock(&g_mutex);
+  for (size_t i = 0; i < g_body_cap; i++) {
+    if (g_bodies[i] && --g_bodies[i]->refs == 0) {
+      free(g_bodies[i]);
+    }
+  }
+  free(g_bodies);
+  g_bodies   = NULL;
+  g_body_cap = 0;
+  pthread_mutex_unlock(&g_mutex);
+}
@@ -0,0 +1,386 @@
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "log.h"
+#include "ring.h"
+
+/*
+ * Every thread that logs gets a ring of its own, registered on its first
+ * message: producing a message is a vsnprintf() into a record and a push,
+ * with no lock and no system call, but for the first message after the
+ * log went quiet, which wakes the background thread. That thread then
+ * drains the rings every LOG_FLUSH_MS until they stay empty, and writes the
+ * records out, each with its time. When a ring is full the message is
+ * dropped and counted, the I/O threads never wait for the output.
+ *
+ * Before log_init() and after log_close(), and in the threads that find no
+ * free ring, messages are written directly instead.
+ *
+ * Errors and warnings are rate limited per call site, told apart by their
+ * format string: past LOG_RATE_BURST messages in a second, the next ones
+ * are only counted, and the count is appended to the next message of the
+ * same site that goes out.
+ */
+
+#define LOG_SITES       16 /* rate limited call sites per thread */
+#define LOG_DRAIN_BATCH 64
+
+typedef struct {
+  uint64_t time_ns; /* CLOCK_REALTIME */
+  uint16_t len;
+  uint8_t  level;
+  char     text[LOG_LINE_MAX];
+} log_record_t;
+
+typedef struct {
+  ring_t           ring;
+  _Atomic uint64_t dropped;
+} log_thread_t;
+
+typedef struct {
+  const char *fmt; /* NULL if the slot is free */
+  uint64_t    second;
+  unsigned    count;      /* messages in that second */
+  unsigned    suppressed; /* messages not written in that second */
+} log_site_t;
+
+log_level_t g_log_level = LOG_LEVEL_INFO;
+
+static const char *const g_levels[LOG_LEVEL_LAST] = {"error", "warn", "info",
+                                                     "debug"};
+static const char *const g_labels[LOG_LEVEL_LAST] = {"ERROR", "WARN", "INFO",
+                                                     "DEBUG"};
+
+static log_thread_t   *g_threads[LOG_THREADS_MAX];
+static _Atomic size_t  g_thread_count = 0;
+static _Atomic bool    g_running      = false;
+static bool            g_stop         = false;
+static FILE           *g_file         = NULL; /* NULL: stdout and stderr */
+static pthread_t       g_thread;
+static pthread_mutex_t g_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  g_cond  = PTHREAD_COND_INITIALIZER;
+static atomic_bool     g_idle  = false; /* the log thread waits for records */
+
+static _Thread_local log_thread_t *g_self        = NULL;
+static _Thread_local bool          g_self_failed = false;
+static _Thread_local log_site_t    g_sites[LOG_SITES];
+
+/**
+ * @brief Look up a log level by its name
+ *
+ * @param name Level name ("error", "warn", "info" or "debug")
+ * @param out  Set to the matching level on success
+ *
+ * @return 0 on success, -1 if the name is unknown
+ */
+int log_level_from_string(const char *name, log_level_t *out)
+{
+  for (int i = 0; i < LOG_LEVEL_LAST; i++) {
+    if (strcmp(g_levels[i], name) == 0) {
+      *out = (log_level_t)i;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+static FILE *log_stream(log_level_t level)
+{
+  if (g_file) {
+    return g_file;
+  }
+  return level <= LOG_LEVEL_WARN ? stderr : stdout;
+}
+
+static void log_put(const log_record_t *r)
+{
+  struct tm tm;
+  time_t    sec = (time_t)(r->time_ns / 1000000000);
+  char      when[32];
+
+  gmtime_r(&sec, &tm);
+  strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", &tm);
+  fprintf(log_stream(r->level), "%s.%03uZ %-5s %.*s\n", when,
+          (unsigned)(r->time_ns / 1000000 % 1000), g_labels[r->level],
+          (int)r->len, r->text);
+}
+
+/* The rate limit of a call site: false if the message is to be dropped,
+   else the number of messages suppressed since it last went out */
+static bool log_site_pass(const char *fmt, unsigned *suppressed)
+{
+  log_site_t     *site = &g_sites[((uintptr_t)fmt >> 3) % LOG_SITES];
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  if (site->fmt != fmt) {
+    site->fmt        = fmt;
+    site->count      = 0;
+    site->suppressed = 0;
+    site->second     = (uint64_t)ts.tv_sec;
+  } else if (site->second != (uint64_t)ts.tv_sec) {
+    site->second = (uint64_t)ts.tv_sec;
+    site->count  = 0;
+  }
+  if (++site->count > LOG_RATE_BURST) {
+    site->suppressed++;
+    return false;
+  }
+  *suppressed      = site->suppressed;
+  site->suppressed = 0;
+  return true;
+}
+
+static log_thread_t *log_self(void)
+{
+  log_thread_t *t;
+  size_t        n;
+
+  if (g_self || g_self_failed) {
+    return g_self;
+  }
+  g_self_failed = true;
+  t             = calloc(1, sizeof(*t));
+  if (!t || ring_init(&t->ring, LOG_THREAD_RECORDS, sizeof(log_record_t))) {
+    free(t);
+    return NULL;
+  }
+
+  pthread_mutex_lock(&g_mutex);
+  n = atomic_load_explicit(&g_thread_count, memory_order_relaxed);
+  if (n < LOG_THREADS_MAX) {
+    g_threads[n] = t;
+    atomic_store_explicit(&g_thread_count, n + 1, memory_order_release);
+  }
+  pthread_mutex_unlock(&g_mutex);
+  if (n == LOG_THREADS_MAX) {
+    ring_free(&t->ring);
+    free(t);
+    return NULL;
+  }
+
+  g_self_failed = false;
+  g_self        = t;
+  return t;
+}
+
+/**
+ * @brief Log a message, see log_write()
+ */
+void log_vwrite(log_level_t level, const char *fmt, va_list args)
+{
+  log_record_t    r;
+  log_thread_t   *t;
+  struct timespec ts;
+  unsigned        suppressed = 0;
+  int             n;
+
+  if (level <= LOG_LEVEL_WARN && !log_site_pass(fmt, &suppressed)) {
+    return;
+  }
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  r.time_ns = (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+  r.level   = (uint8_t)level;
+  n         = vsnprintf(r.text, sizeof(r.text), fmt, args);
+  if (n < 0) {
+    return;
+  }
+  if ((size_t)n >= sizeof(r.text)) {
+    n = sizeof(r.text) - 1;
+  }
+  if (suppressed > 0) {
+    n += snprintf(r.text + n, sizeof(r.text) - (size_t)n,
+                  " (%u similar messages suppressed)", suppressed);
+    if ((size_t)n >= sizeof(r.text)) {
+      n = sizeof(r.text) - 1;
+    }
+  }
+  r.len = (uint16_t)n;
+
+  if (!atomic_load_explicit(&g_running, memory_order_acquire) ||
+      !(t = log_self())) {
+    log_put(&r);
+    return;
+  }
+  if (ring_push(&t->ring, &r) != 0) {
+    atomic_fetch_add_explicit(&t->dropped, 1, memory_order_relaxed);
+  }
+  /* the push is a release store, which the load of g_idle may pass */
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load(&g_idle)) {
+    pthread_mutex_lock(&g_mutex);
+    pthread_cond_signal(&g_cond);
+    pthread_mutex_unlock(&g_mutex);
+  }
+}
+
+/**
+ * @brief Log a message at a level, without a trailing newline
+ *
+ * Use the LOG_* macros: they skip the call, arguments included, when the
+ * level is disabled.
+ *
+ * @param level Level of the message
+ * @param fmt   printf() format
+ */
+void log_write(log_level_t level, const char *fmt, ...)
+{
+  va_list args;
+
+  va_start(args, fmt);
+  log_vwrite(level, fmt, args);
+  va_end(args);
+}
+
+/* Whether a thread logged something not written out yet */
+static bool log_pending(void)
+{
+  size_t count = atomic_load_explicit(&g_thread_count, memory_order_acquire);
+
+  for (size_t i = 0; i < count; i++) {
+    if (ring_count(&g_threads[i]->ring) > 0 ||
+        atomic_load_explicit(&g_threads[i]->dropped, memory_order_relaxed)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Writes out what every thread has logged so far */
+static void log_drain(log_record_t *batch)
+{
+  size_t count = atomic_load_explicit(&g_thread_count, memory_order_acquire);
+
+  for (size_t i = 0; i < count; i++) {
+    log_thread_t *t = g_threads[i];
+    uint64_t      dropped;
+    size_t        n;
+
+    while ((n = ring_pop_n(&t->ring, batch, LOG_DRAIN_BATCH)) > 0) {
+      for (size_t k = 0; k < n; k++) {
+        log_put(&batch[k]);
+      }
+    }
+    dropped = atomic_exchange_explicit(&t->dropped, 0, memory_order_relaxed);
+    if (dropped > 0) {
+      log_record_t    r = {.level = LOG_LEVEL_WARN};
+      struct timespec ts;
+
+      clock_gettime(CLOCK_REALTIME, &ts);
+      r.time_ns = (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+      r.len     = (uint16_t)snprintf(r.text, sizeof(r.text),
+                                     "log: %llu messages dropped, a thread "
+                                     "logged faster than they were written",
+                                     (unsigned long long)dropped);
+      log_put(&r);
+    }
+  }
+  if (g_file) {
+    fflush(g_file);
+  } else {
+    fflush(stdout);
+  }
+}
+
+static void *log_loop(void *arg)
+{
+  log_record_t   *batch = arg;
+  struct timespec deadline;
+  bool            stop;
+
+  do {
+    pthread_mutex_lock(&g_mutex);
+    atomic_store(&g_idle, true);
+    /* re-check under the lock: a thread that saw idle == false has already
+       pushed its record, one that sees idle == true will signal */
+    if (!g_stop && !log_pending()) {
+      pthread_cond_wait(&g_cond, &g_mutex);
+    }
+    atomic_store(&g_idle, false);
+    /* then the records of the next LOG_FLUSH_MS go out together */
+    if (!g_stop) {
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_nsec += LOG_FLUSH_MS * 1000000L;
+      if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+      }
+      pthread_cond_timedwait(&g_cond, &g_mutex, &deadline);
+    }
+    stop = g_stop;
+    pthread_mutex_unlock(&g_mutex);
+
+    log_drain(batch);
+  } while (!stop);
+  return batch;
+}
+
+/**
+ * @brief Start the thread that writes the log out
+ *
+ * @param path File to append to, NULL for stdout (stderr for errors and
+ *             warnings)
+ *
+ * @return 0 on success, -1 on error
+ */
+int log_init(const char *path)
+{
+  log_record_t *batch;
+
+  if (path) {
+    g_file = fopen(path, "a");
+    if (!g_file) {
+      LOG_ERROR("log: cannot open %s", path);
+      return -1;
+    }
+  }
+  batch = malloc(LOG_DRAIN_BATCH * sizeof(*batch));
+  g_stop = false;
+  if (!batch || pthread_create(&g_thread, NULL, log_loop, batch) != 0) {
+    free(batch);
+    if (g_file) {
+      fclose(g_file);
+      g_file = NULL;
+    }
+    LOG_ERROR("log: cannot start the log thread");
+    return -1;
+  }
+  atomic_store_explicit(&g_running, true, memory_order_release);
+  return 0;
+}
+
+/**
+ * @brief Write out what is left and stop the log thread
+ *
+ * Later messages are written directly. The rings are kept: a thread still
+ * running may be about to push to its own.
+ */
+void log_close(void)
+{
+  void *batch;
+
+  if (!atomic_load_explicit(&g_running, memory_order_acquire)) {
+    return;
+  }
+  atomic_store_explicit(&g_running, false, memory_order_release);
+
+  pthread_mutex_lock(&g_mutex);
+  g_stop = true;
+  pthread_cond_signal(&g_cond);
+  pthread_mutex_unlock(&g_mutex);
+  pthread_join(g_thread, &batch);
+  free(batch);
+
+  if (g_file) {
+    fclose(g_file);
+    g_file = NULL;
+  }
+}
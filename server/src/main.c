@@ -1,68 +1,283 @@
 #include <signal.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/signalfd.h>
+#include <unistd.h>
 
 #include "db.h"
+#include "dedup.h"
+#include "log.h"
+#include "query.h"
 #include "sensor.h"
+#include "snapshot_store.h"
+#include "spool.h"
 #include "coap_server.h"
 
-static volatile bool stop = false;
-
-void handle_sigint(int sig)
+/* Blocks SIGINT and SIGTERM in every thread, before any is started, and
+   returns a signalfd that the CoAP server reads them from, or -1 */
+static int setup_signal_fd(void)
 {
-  (void)sig;
-  stop = true;
+  sigset_t set;
+  int      fd;
+
+  sigemptyset(&set);
+  sigaddset(&set, SIGINT);
+  sigaddset(&set, SIGTERM);
+  if (pthread_sigmask(SIG_BLOCK, &set, NULL) != 0) {
+    perror("pthread_sigmask");
+    return -1;
+  }
+  fd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (fd < 0) {
+    perror("signalfd");
+  }
+  return fd;
 }
 
-int setup_sig_handler()
+static void usage(const char *prog)
 {
-  struct sigaction sa;
+  fprintf(stderr,
+          "Usage: %s [options] <db-name>\n"
+          "  -p <profile>  durability profile: default, safe, fast\n"
+          "                (default: default)\n"
+          "  -c <mode>     commit mode: autocommit, snapshot, batch\n"
+          "                (default: autocommit)\n"
+          "  -S <storage>  numeric readings storage: rows, chunks\n"
+          "                (default: rows, or chunks once used)\n"
+          "  -L <layout>   readings table columns: wide, compact\n"
+          "                (default: wide, or compact once used)\n"
+          "  -n <rows>     batch mode: commit every <rows> readings "
+          "(default: %d)\n"
+          "  -t <ms>       batch mode: commit at least every <ms> ms "
+          "(default: %d)\n"
+          "  -q <records>  storage queue capacity per worker (default: %d)\n"
+          "  -w <workers>  CoAP I/O threads sharing the port through "
+          "SO_REUSEPORT\n"
+          "                (default: 1, max: %d)\n"
+          "  -m <MiB>      memory limit of the channel registry "
+          "(default: %u)\n"
+          "  -r <conns>    read-only connections serving /sensor/query, "
+          "0 disables it\n"
+          "                (default: %d, max: %d, WAL profiles only)\n"
+          "  -P <hours>    one readings table per <hours> of timestamps\n"
+          "                (default: a single table, or as the existing "
+          "partitions)\n"
+          "  -A <days>     drop the partitions older than <days>\n"
+          "  -D <MiB>      drop the oldest partitions while the database "
+          "uses more\n"
+          "  -u <MiB>      memory of the duplicate snapshot table, "
+          "0 disables it\n"
+          "                (default: %u)\n"
+          "  -e <s>        how long a stored snapshot is recognised "
+          "(default: %u)\n"
+          "  -v <level>    log level: error, warn, info, debug "
+          "(default: info)\n"
+          "  -l <file>     append the log to <file> instead of "
+          "stdout/stderr\n"
+          "  -R <mode>     snapshot responses: piggybacked (2.04 once "
+          "queued),\n"
+          "                separate (empty ACK, 2.04 once committed)\n"
+          "                (default: piggybacked)\n"
+          "  -W <dir>      append snapshots to a spool in <dir> before "
+          "queueing them,\n"
+          "                replayed on startup if not committed\n",
+          prog, DB_BATCH_ROWS_DEFAULT, DB_BATCH_MS_DEFAULT,
+          DB_QUEUE_CAPACITY_DEFAULT, COAP_SERVER_MAX_WORKERS,
+          SENSOR_REG_MEM_LIMIT_DEFAULT >> 20, QUERY_POOL_SIZE_DEFAULT,
+          QUERY_POOL_MAX, DEDUP_MEM_LIMIT_DEFAULT >> 20,
+          DEDUP_WINDOW_S_DEFAULT);
+}
 
-  memset(&sa, 0, sizeof(sa));
+static int parse_args(int argc, char **argv, db_config_t *cfg,
+                      unsigned int *workers, size_t *reg_limit,
+                      unsigned int *readers, size_t *dedup_limit,
+                      unsigned int *dedup_window, const char **log_path,
+                      coap_server_response_t *response,
+                      const char **spool_dir, const char **db_path)
+{
+  int opt;
 
-  sa.sa_handler = handle_sigint;
-  sigemptyset(&sa.sa_mask);
-  sa.sa_flags = 0;
+  while ((opt = getopt(argc, argv,
+                       "p:c:S:L:n:t:q:w:m:r:P:A:D:u:e:v:l:R:W:")) != -1) {
+    switch (opt) {
+    case 'p':
+      if (db_durability_from_string(optarg, &cfg->durability) != 0) {
+        fprintf(stderr, "Unknown durability profile '%s'\n", optarg);
+        return -1;
+      }
+      break;
+    case 'c':
+      if (db_commit_mode_from_string(optarg, &cfg->commit_mode) != 0) {
+        fprintf(stderr, "Unknown commit mode '%s'\n", optarg);
+        return -1;
+      }
+      break;
+    case 'S':
+      if (db_storage_from_string(optarg, &cfg->storage) != 0) {
+        fprintf(stderr, "Unknown storage '%s'\n", optarg);
+        return -1;
+      }
+      break;
+    case 'L':
+      if (db_layout_from_string(optarg, &cfg->layout) != 0) {
+        fprintf(stderr, "Unknown layout '%s'\n", optarg);
+        return -1;
+      }
+      break;
+    case 'n':
+      cfg->batch_rows = (unsigned int)strtoul(optarg, NULL, 10);
+      break;
+    case 't':
+      cfg->batch_ms = (unsigned int)strtoul(optarg, NULL, 10);
+      break;
+    case 'q':
+      cfg->queue_capacity = (size_t)strtoul(optarg, NULL, 10);
+      break;
+    case 'w':
+      *workers = (unsigned int)strtoul(optarg, NULL, 10);
+      if (*workers == 0 || *workers > COAP_SERVER_MAX_WORKERS) {
+        fprintf(stderr, "Worker count must be 1..%d\n",
+                COAP_SERVER_MAX_WORKERS);
+        return -1;
+      }
+      break;
+    case 'm':
+      *reg_limit = (size_t)strtoul(optarg, NULL, 10) << 20;
+      break;
+    case 'r':
+      *readers = (unsigned int)strtoul(optarg, NULL, 10);
+      if (*readers > QUERY_POOL_MAX) {
+        fprintf(stderr, "Query connections must be 0..%d\n",
+                QUERY_POOL_MAX);
+        return -1;
+      }
+      break;
+    case 'P':
+      cfg->partition_ms = strtoull(optarg, NULL, 10) * DB_ROLLUP_HOUR_MS;
+      break;
+    case 'A':
+      cfg->retention_ms = strtoull(optarg, NULL, 10) * 24 * DB_ROLLUP_HOUR_MS;
+      break;
+    case 'D':
+      cfg->disk_budget = strtoull(optarg, NULL, 10) << 20;
+      break;
+    case 'u':
+      *dedup_limit = (size_t)strtoul(optarg, NULL, 10) << 20;
+      break;
+    case 'e':
+      *dedup_window = (unsigned int)strtoul(optarg, NULL, 10);
+      break;
+    case 'v':
+      if (log_level_from_string(optarg, &g_log_level) != 0) {
+        fprintf(stderr, "Unknown log level '%s'\n", optarg);
+        return -1;
+      }
+      break;
+    case 'l':
+      *log_path = optarg;
+      break;
+    case 'R':
+      if (coap_server_response_from_string(optarg, response) != 0) {
+        fprintf(stderr, "Unknown response mode '%s'\n", optarg);
+        return -1;
+      }
+      break;
+    case 'W':
+      *spool_dir = optarg;
+      break;
+    default:
+      return -1;
+    }
+  }
 
-  if (sigaction(SIGINT, &sa, NULL) == -1) {
-    perror("sigaction");
-    return (1);
+  if (optind >= argc) {
+    return -1;
   }
-  return (0);
+  *db_path = argv[optind];
+  return 0;
 }
 
 int main(int argc, char **argv)
 {
-  sensor_registry_t *reg;
+  sensor_registry_t     *reg;
+  db_config_t            db_cfg       = DB_CONFIG_DEFAULT;
+  const char            *db_path      = NULL;
+  unsigned int           workers      = 1;
+  size_t                 reg_limit    = SENSOR_REG_MEM_LIMIT_DEFAULT;
+  unsigned int           readers      = QUERY_POOL_SIZE_DEFAULT;
+  size_t                 dedup_limit  = DEDUP_MEM_LIMIT_DEFAULT;
+  unsigned int           dedup_window = DEDUP_WINDOW_S_DEFAULT;
+  const char            *log_path     = NULL;
+  coap_server_response_t response     = COAP_SERVER_RESPONSE_PIGGYBACKED;
+  const char            *spool_dir    = NULL;
+  int                    signal_fd;
+  int                    ret          = 0;
 
-  if (argc < 2) {
-    fprintf(stderr, "Usage: %s <db-name>\n", argv[0]);
+  if (parse_args(argc, argv, &db_cfg, &workers, &reg_limit, &readers,
+                 &dedup_limit, &dedup_window, &log_path, &response,
+                 &spool_dir, &db_path) != 0) {
+    usage(argv[0]);
     return -1;
   }
 
-  if (setup_sig_handler() != 0) {
+  signal_fd = setup_signal_fd();
+  if (signal_fd < 0) {
     return -1;
   }
 
-  if (db_init(argv[1]) != 0) {
+  if (log_init(log_path) != 0) {
     return -1;
   }
+  /* the error paths below return straight away: write out their messages */
+  atexit(log_close);
 
-  if (!(reg = sensor_reg_init())) {
-    fprintf(stderr, "sensor_reg_init() failed\n");
+  if (db_init(db_path, &db_cfg) != 0) {
     return -1;
   }
 
-  if (coap_server_init(COAP_SERVER_PORT) != 0) {
-    fprintf(stderr, "coap_server_init() failed\n");
+  if (query_pool_init(db_path, readers) != 0) {
     return -1;
   }
 
-  coap_server_loop(&stop);
+  if (db_writer_start(workers) != 0) {
+    return -1;
+  }
+
+  if (!(reg = sensor_reg_init(reg_limit))) {
+    LOG_ERROR("sensor_reg_init() failed");
+    return -1;
+  }
+
+  if (dedup_init(dedup_limit, dedup_window) != 0) {
+    return -1;
+  }
+
+  /* what the last run spooled but did not commit is queued first */
+  if (spool_dir &&
+      spool_open(spool_dir, workers, snapshot_replay, &workers) != 0) {
+    return -1;
+  }
+
+  if (coap_server_init(COAP_SERVER_PORT, workers, response) != 0) {
+    LOG_ERROR("coap_server_init() failed");
+    return -1;
+  }
+
+  /* a failed start still drains what the replay queued */
+  if (coap_server_loop(signal_fd) != 0) {
+    ret = -1;
+  }
 
   coap_server_cleanup();
+  close(signal_fd);
+  query_pool_close();
+  /* no more producers: drain the storage queue before closing the database */
+  db_writer_stop();
+  spool_close();
   sensor_reg_close(reg);
+  dedup_close();
   db_close();
-  return 0;
+  return ret;
 }
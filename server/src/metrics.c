@@ -0,0 +1,228 @@
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "db.h"
+#include "metrics.h"
+#include "sensor.h"
+
+/* Every slot is written by a single thread and read by whoever renders the
+   metrics, so recording is a relaxed load and store: no locked instruction
+   and no cache line shared between recording threads. */
+typedef struct {
+  _Atomic uint64_t counters[METRICS_COUNTER_LAST];
+  _Atomic uint64_t buckets[METRICS_HIST_LAST][METRICS_BUCKETS];
+  _Atomic uint64_t sum_ns[METRICS_HIST_LAST];
+} __attribute__((aligned(64))) metrics_slot_t;
+
+static metrics_slot_t g_slots[METRICS_MAX_SLOTS];
+
+static const struct {
+  const char *name;
+  const char *help;
+} g_counters[METRICS_COUNTER_LAST] = {
+  [METRICS_SNAPSHOTS]      = {"snapshots_received_total",
+                              "Snapshots received with a payload"},
+  [METRICS_PARSE_FAILURES] = {"snapshot_parse_failures_total",
+                              "Snapshots rejected as malformed or in an "
+                              "unsupported format"},
+  [METRICS_QUEUE_FULL]     = {"snapshots_shed_total",
+                              "Snapshots rejected because the storage queue "
+                              "was full"},
+  [METRICS_BYTES_IN]       = {"snapshot_bytes_total",
+                              "Snapshot payload bytes received"},
+  [METRICS_DUPLICATES]     = {"snapshot_duplicates_total",
+                              "Snapshots already stored, acknowledged "
+                              "without being parsed"},
+  [METRICS_DEDUP_MISSES]   = {"snapshot_dedup_misses_total",
+                              "Snapshots looked up in the duplicate table "
+                              "and not found"},
+  [METRICS_REFUSED]        = {"snapshots_refused_total",
+                              "Snapshots refused because the storage "
+                              "pipeline was saturated"},
+  [METRICS_LOST]           = {"snapshots_lost_total",
+                              "Snapshots answered 5.00 because their "
+                              "readings were not committed"},
+};
+
+static const struct {
+  const char *name;
+  const char *help;
+} g_hists[METRICS_HIST_LAST] = {
+  [METRICS_HIST_PARSE]   = {"snapshot_parse_seconds", "Payload decoding time"},
+  [METRICS_HIST_STORE]   = {"snapshot_store_seconds",
+                            "Registry update and storage queueing time"},
+  [METRICS_HIST_DB]      = {"snapshot_db_seconds",
+                            "Time the db writer spends writing one snapshot"},
+  [METRICS_HIST_HANDLER] = {"snapshot_handler_seconds",
+                            "Time spent in the snapshot handler"},
+  [METRICS_HIST_COMMIT]  = {"snapshot_commit_wait_seconds",
+                            "Time from queueing a snapshot to its separate "
+                            "response"},
+};
+
+static void metrics_inc(_Atomic uint64_t *v, uint64_t n)
+{
+  atomic_store_explicit(v, atomic_load_explicit(v, memory_order_relaxed) + n,
+                        memory_order_relaxed);
+}
+
+static uint64_t metrics_sum(size_t offset)
+{
+  uint64_t total = 0;
+
+  for (size_t i = 0; i < METRICS_MAX_SLOTS; i++) {
+    total += atomic_load_explicit(
+      (_Atomic uint64_t *)((char *)&g_slots[i] + offset),
+      memory_order_relaxed);
+  }
+  return total;
+}
+
+uint64_t metrics_now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * @brief Increment a counter
+ *
+ * @param slot    Slot of the calling thread, never shared with another
+ *                thread
+ * @param counter Counter to increment
+ * @param n       Increment
+ */
+void metrics_add(unsigned int slot, metrics_counter_t counter, uint64_t n)
+{
+  metrics_inc(&g_slots[slot].counters[counter], n);
+}
+
+/**
+ * @brief Record a duration in a histogram
+ *
+ * @param slot       Slot of the calling thread, never shared with another
+ *                   thread
+ * @param hist       Histogram to record in
+ * @param elapsed_ns Duration, in ns
+ */
+void metrics_observe(unsigned int slot, metrics_hist_t hist,
+                     uint64_t elapsed_ns)
+{
+  uint64_t us = elapsed_ns / 1000;
+  size_t   b  = us <= 1 ? 0 : (size_t)(64 - __builtin_clzll(us - 1));
+
+  if (b >= METRICS_BUCKETS) {
+    b = METRICS_BUCKETS - 1;
+  }
+  metrics_inc(&g_slots[slot].buckets[hist][b], 1);
+  metrics_inc(&g_slots[slot].sum_ns[hist], elapsed_ns);
+}
+
+/**
+ * @brief Render every metric in the Prometheus text format
+ *
+ * Slots are summed while other threads keep recording: each value is
+ * exact, but the values are not a consistent snapshot of one instant.
+ *
+ * @param out Set to the text, to be released with free()
+ * @param len Set to the text length
+ *
+ * @return 0 on success, -1 on error
+ */
+int metrics_render(char **out, size_t *len)
+{
+  db_writer_stats_t db;
+  size_t            channels;
+  size_t            mem_used;
+  FILE             *f;
+
+  *out = NULL;
+  f    = open_memstream(out, len);
+  if (!f) {
+    return -1;
+  }
+
+  for (int c = 0; c < METRICS_COUNTER_LAST; c++) {
+    fprintf(f, "# HELP gateway_%s %s\n# TYPE gateway_%s counter\n",
+            g_counters[c].name, g_counters[c].help, g_counters[c].name);
+    fprintf(f, "gateway_%s %llu\n", g_counters[c].name,
+            (unsigned long long)metrics_sum(
+              offsetof(metrics_slot_t, counters) + c * sizeof(uint64_t)));
+  }
+
+  db_writer_get_stats(&db);
+  fprintf(f,
+          "# HELP gateway_readings_stored_total Readings written to the "
+          "database\n"
+          "# TYPE gateway_readings_stored_total counter\n"
+          "gateway_readings_stored_total %llu\n"
+          "# HELP gateway_db_failures_total Readings the database refused\n"
+          "# TYPE gateway_db_failures_total counter\n"
+          "gateway_db_failures_total %llu\n"
+          "# HELP gateway_queue_depth Records waiting for the db writer\n"
+          "# TYPE gateway_queue_depth gauge\n"
+          "gateway_queue_depth %zu\n"
+          "# HELP gateway_queue_capacity Size of the storage queues, in "
+          "records\n"
+          "# TYPE gateway_queue_capacity gauge\n"
+          "gateway_queue_capacity %zu\n"
+          "# HELP gateway_storage_lag_seconds Time the last records written "
+          "waited in the queue\n"
+          "# TYPE gateway_storage_lag_seconds gauge\n"
+          "gateway_storage_lag_seconds %.3f\n"
+          "# HELP gateway_storage_rate Records the db writer applies per "
+          "second\n"
+          "# TYPE gateway_storage_rate gauge\n"
+          "gateway_storage_rate %llu\n"
+          "# HELP gateway_workers_shedding Workers refusing snapshots\n"
+          "# TYPE gateway_workers_shedding gauge\n"
+          "gateway_workers_shedding %u\n",
+          (unsigned long long)db.readings_written,
+          (unsigned long long)db.readings_failed, db.queue_depth,
+          db.queue_capacity, (double)db.lag_ms / 1e3,
+          (unsigned long long)db.drain_rate, db.producers_shedding);
+
+  sensor_reg_get_stats(sensor_reg_get(), &channels, &mem_used);
+  fprintf(f,
+          "# HELP gateway_registry_channels Channels in the registry\n"
+          "# TYPE gateway_registry_channels gauge\n"
+          "gateway_registry_channels %zu\n"
+          "# HELP gateway_registry_bytes Memory used by the registry\n"
+          "# TYPE gateway_registry_bytes gauge\n"
+          "gateway_registry_bytes %zu\n",
+          channels, mem_used);
+
+  for (int h = 0; h < METRICS_HIST_LAST; h++) {
+    uint64_t cumulative = 0;
+
+    fprintf(f, "# HELP gateway_%s %s\n# TYPE gateway_%s histogram\n",
+            g_hists[h].name, g_hists[h].help, g_hists[h].name);
+    for (int b = 0; b < METRICS_BUCKETS; b++) {
+      cumulative += metrics_sum(offsetof(metrics_slot_t, buckets) +
+                                (h * METRICS_BUCKETS + b) * sizeof(uint64_t));
+      if (b < METRICS_BUCKETS - 1) {
+        fprintf(f, "gateway_%s_bucket{le=\"%g\"} %llu\n", g_hists[h].name,
+                (double)(1ull << b) / 1e6, (unsigned long long)cumulative);
+      } else {
+        fprintf(f, "gateway_%s_bucket{le=\"+Inf\"} %llu\n", g_hists[h].name,
+                (unsigned long long)cumulative);
+      }
+    }
+    fprintf(f, "gateway_%s_sum %.6f\ngateway_%s_count %llu\n",
+            g_hists[h].name,
+            (double)metrics_sum(offsetof(metrics_slot_t, sum_ns) +
+                                h * sizeof(uint64_t)) / 1e9,
+            g_hists[h].name, (unsigned long long)cumulative);
+  }
+
+  if (fclose(f) != 0) {
+    free(*out);
+    *out = NULL;
+    return -1;
+  }
+  return 0;
+}
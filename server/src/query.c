@@ -0,0 +1,1248 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <sqlite3.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chunk.h"
+#include "db.h"
+#include "log.h"
+#include "query.h"
+
+/*
+ * Read side of the database
+ *
+ * Queries run on their own read-only connections. In WAL mode a reader
+ * works on a snapshot of the database and never blocks the writer thread,
+ * which is why the pool is only started with a WAL durability profile. A
+ * cursor keeps its statement, hence its read transaction, open between two
+ * blocks of a transfer: the WAL cannot be checkpointed past that snapshot
+ * until the cursor is closed.
+ *
+ * When readings are partitioned by time, a range query visits the
+ * partitions overlapping its range one after the other, in an explicit
+ * read transaction so all of them are read from the same snapshot. With
+ * chunk storage, it merges the chunks overlapping its range, decoded one at
+ * a time as the output reaches them, with the readings still in the head,
+ * in the same kind of transaction. With the compact layout, the channel is
+ * looked up first as well, its type telling bools from ints.
+ *
+ * The export tool reads rows rather than the JSON document, from a pool
+ * held in one read transaction: every channel it exports comes from the
+ * same snapshot.
+ */
+
+#define QUERY_CHUNK_MAX 1024 /* one row, or the document header */
+#define QUERY_BUSY_MS   100
+
+/* A reading decoded from a chunk */
+typedef struct {
+  chunk_sample_t s;
+  sensor_type_t  type;
+} query_sample_t;
+
+typedef enum {
+  QUERY_STATE_HEADER = 0,
+  QUERY_STATE_ROWS,
+  QUERY_STATE_DONE,
+} query_state_t;
+
+struct query_cursor {
+  sqlite3       *db;
+  sqlite3_stmt  *stmt; /* stmt_range or stmt_rollup, as the query needs */
+  sqlite3_stmt  *stmt_range;
+  sqlite3_stmt  *stmt_rollup;
+  sqlite3_stmt  *stmt_channel;   /* partitioned readings only */
+  sqlite3_stmt  *stmt_partition; /* partitioned readings only */
+  sqlite3_stmt  *stmt_scan;      /* range scan of the current partition */
+  int64_t        period; /* rollup width read, 0 for raw readings */
+  int64_t        channel_id;
+  int64_t        scanned; /* end of the last partition visited */
+  bool           partitioned;
+  bool           compact;      /* one value column, see db.c */
+  int            channel_type; /* compact layout only */
+
+  /* chunked readings only: the chunks by start and the head by time, each
+     statement being on a row not handed out yet while *_peek is set */
+  sqlite3_stmt   *stmt_chunks;
+  sqlite3_stmt   *stmt_head;
+  bool            chunk_peek;
+  bool            head_peek;
+  bool            chunked;
+  chunk_sample_t *decoded; /* CHUNK_SAMPLES */
+  query_sample_t *pending; /* decoded samples not handed out, by time */
+  size_t          pending_len;
+  size_t          pending_pos;
+  size_t          pending_cap;
+  query_sample_t *sample; /* row to write when it is not a statement's */
+
+  bool           in_use;
+  bool           held; /* a read transaction spans the queries, see
+                          query_pool_hold() */
+  query_state_t  state;
+  unsigned int   rows;
+  query_params_t params;
+  char           chunk[QUERY_CHUNK_MAX]; /* text not yet handed out */
+  size_t         chunk_len;
+  size_t         chunk_off;
+};
+
+/* Goes from the device and channel names to the channel through the two
+   unique indexes, then range-scans idx_readings_channel_time, which also
+   gives the order */
+static const char *const g_sql_range =
+  "SELECT r.timestamp, r.value_float, r.value_int, r.value_text,"
+  "       r.value_bool"
+  "  FROM devices d"
+  "  JOIN channels c ON c.device_id = d.id"
+  "  JOIN readings r ON r.channel_id = c.id"
+  " WHERE d.name = ?1 AND c.name = ?2"
+  "   AND r.timestamp >= ?3 AND r.timestamp < ?4"
+  " ORDER BY r.timestamp"
+  " LIMIT ?5;";
+
+/* With partitions: the channel, then the next partition overlapping
+   [?1, ?2) after ?3, then a range scan of its index */
+static const char *const g_sql_channel =
+  "SELECT c.id, c.type"
+  "  FROM devices d"
+  "  JOIN channels c ON c.device_id = d.id"
+  " WHERE d.name = ?1 AND c.name = ?2;";
+
+static const char *const g_sql_partition =
+  "SELECT name, end FROM partitions"
+  " WHERE end > ?1 AND start < ?2 AND start >= ?3"
+  " ORDER BY start"
+  " LIMIT 1;";
+
+static const char *const g_sql_scan =
+  "SELECT timestamp, value_float, value_int, value_text, value_bool"
+  "  FROM \"%s\""
+  " WHERE channel_id = ?1 AND timestamp >= ?2 AND timestamp < ?3"
+  " ORDER BY timestamp"
+  " LIMIT ?4;";
+
+/* Same with the compact layout, a range of its primary key */
+static const char *const g_sql_scan_compact =
+  "SELECT timestamp, value"
+  "  FROM \"%s\""
+  " WHERE channel_id = ?1 AND timestamp >= ?2 AND timestamp < ?3"
+  " ORDER BY timestamp"
+  " LIMIT ?4;";
+
+/* With chunks: those of the channel overlapping [?2, ?3), by start */
+static const char *const g_sql_chunks =
+  "SELECT start, data FROM chunks"
+  " WHERE channel_id = ?1 AND start < ?3 AND end >= ?2"
+  " ORDER BY start;";
+
+/* Buckets of the rollup level ?6, merged into buckets of width ?7 (a
+   multiple of ?6) by adding them up; the last value is that of the most
+   recent reading of the merged buckets */
+static const char *const g_sql_rollup =
+  "SELECT g.b, g.n, g.lo, g.hi, g.s / g.n,"
+  "       (SELECT l.last FROM rollups l"
+  "         WHERE l.channel_id = g.channel_id AND l.period = ?6"
+  "           AND l.bucket >= g.b AND l.bucket < g.b + ?7"
+  "         ORDER BY l.last_ts DESC LIMIT 1)"
+  "  FROM (SELECT r.channel_id,"
+  "               r.bucket - ((r.bucket % ?7) + ?7) % ?7 AS b,"
+  "               sum(r.count) AS n, sum(r.sum) AS s,"
+  "               min(r.min) AS lo, max(r.max) AS hi"
+  "          FROM devices d"
+  "          JOIN channels c ON c.device_id = d.id"
+  "          JOIN rollups r ON r.channel_id = c.id"
+  "         WHERE d.name = ?1 AND c.name = ?2 AND r.period = ?6"
+  "           AND r.bucket >= ?3 AND r.bucket < ?4"
+  "         GROUP BY b"
+  "         ORDER BY b"
+  "         LIMIT ?5) g;";
+
+/* Rollup widths, coarsest first */
+static const int64_t g_rollup_periods[DB_ROLLUP_LEVELS] = {
+  DB_ROLLUP_HOUR_MS,
+  DB_ROLLUP_MINUTE_MS,
+};
+
+static query_cursor_t  g_pool[QUERY_POOL_MAX];
+static unsigned int    g_pool_size = 0;
+static pthread_mutex_t g_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int query_is_wal(sqlite3 *db)
+{
+  sqlite3_stmt *stmt;
+  int           wal = 0;
+
+  if (sqlite3_prepare_v2(db, "PRAGMA journal_mode;", -1, &stmt, NULL) !=
+      SQLITE_OK) {
+    return -1;
+  }
+  if (sqlite3_step(stmt) == SQLITE_ROW) {
+    wal = sqlite3_stricmp((const char *)sqlite3_column_text(stmt, 0),
+                          "wal") == 0;
+  }
+  sqlite3_finalize(stmt);
+  return wal;
+}
+
+static int query_has_table(sqlite3 *db, const char *name)
+{
+  sqlite3_stmt *stmt;
+  int           rc;
+
+  if (sqlite3_prepare_v2(db,
+                         "SELECT count(*) FROM sqlite_master"
+                         " WHERE type = 'table' AND name = ?;",
+                         -1, &stmt, NULL) != SQLITE_OK ||
+      sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC) != SQLITE_OK) {
+    sqlite3_finalize(stmt);
+    return -1;
+  }
+  rc = sqlite3_step(stmt) == SQLITE_ROW ? sqlite3_column_int(stmt, 0) > 0
+                                        : -1;
+  sqlite3_finalize(stmt);
+  return rc;
+}
+
+/* 1 if the readings tables have the compact layout, 0 if not, -1 on
+   error */
+static int query_is_compact(sqlite3 *db)
+{
+  sqlite3_stmt *stmt;
+  int           rc;
+
+  if (sqlite3_prepare_v2(db,
+                         "SELECT count(*)"
+                         "  FROM sqlite_master m, pragma_table_info(m.name) p"
+                         " WHERE m.type = 'table'"
+                         "   AND m.name GLOB 'readings*' AND p.name = 'value';",
+                         -1, &stmt, NULL) != SQLITE_OK) {
+    return -1;
+  }
+  rc = sqlite3_step(stmt) == SQLITE_ROW ? sqlite3_column_int(stmt, 0) > 0
+                                        : -1;
+  sqlite3_finalize(stmt);
+  return rc;
+}
+
+/* LIMIT of the rows still wanted, -1 for no limit */
+static int query_limit(const query_cursor_t *cur)
+{
+  unsigned int left = cur->params.limit - cur->rows;
+
+  return left > INT_MAX ? -1 : (int)left;
+}
+
+static const char *query_sql_scan(const query_cursor_t *cur)
+{
+  return cur->compact ? g_sql_scan_compact : g_sql_scan;
+}
+
+static int query_conn_open(query_cursor_t *cur, const char *path)
+{
+  int rc;
+
+  rc = sqlite3_open_v2(path, &cur->db,
+                       SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, NULL);
+  if (rc != SQLITE_OK) {
+    LOG_ERROR("query: cannot open '%s' read-only: %s", path,
+              cur->db ? sqlite3_errmsg(cur->db) : sqlite3_errstr(rc));
+    return -1;
+  }
+  sqlite3_busy_timeout(cur->db, QUERY_BUSY_MS);
+
+  cur->partitioned = query_has_table(cur->db, "partitions") == 1;
+  rc               = query_has_table(cur->db, "chunks");
+  if (rc < 0) {
+    LOG_ERROR("query: schema check failed: %s",
+              sqlite3_errmsg(cur->db));
+    return -1;
+  }
+  cur->chunked = rc == 1;
+  rc           = query_is_compact(cur->db);
+  if (rc < 0) {
+    LOG_ERROR("query: schema check failed: %s",
+              sqlite3_errmsg(cur->db));
+    return -1;
+  }
+  cur->compact = rc == 1;
+
+  if (cur->partitioned) {
+    rc = sqlite3_prepare_v3(cur->db, g_sql_channel, -1,
+                            SQLITE_PREPARE_PERSISTENT, &cur->stmt_channel,
+                            NULL);
+    if (rc == SQLITE_OK) {
+      rc = sqlite3_prepare_v3(cur->db, g_sql_partition, -1,
+                              SQLITE_PREPARE_PERSISTENT, &cur->stmt_partition,
+                              NULL);
+    }
+  } else if (cur->chunked) {
+    char sql[256];
+
+    snprintf(sql, sizeof(sql), query_sql_scan(cur), "readings");
+    cur->decoded = malloc(CHUNK_SAMPLES * sizeof(*cur->decoded));
+    rc           = cur->decoded ? SQLITE_OK : SQLITE_NOMEM;
+    if (rc == SQLITE_OK) {
+      rc = sqlite3_prepare_v3(cur->db, g_sql_channel, -1,
+                              SQLITE_PREPARE_PERSISTENT, &cur->stmt_channel,
+                              NULL);
+    }
+    if (rc == SQLITE_OK) {
+      rc = sqlite3_prepare_v3(cur->db, g_sql_chunks, -1,
+                              SQLITE_PREPARE_PERSISTENT, &cur->stmt_chunks,
+                              NULL);
+    }
+    if (rc == SQLITE_OK) {
+      rc = sqlite3_prepare_v3(cur->db, sql, -1, SQLITE_PREPARE_PERSISTENT,
+                              &cur->stmt_head, NULL);
+    }
+  } else if (cur->compact) {
+    char sql[256];
+
+    snprintf(sql, sizeof(sql), g_sql_scan_compact, "readings");
+    rc = sqlite3_prepare_v3(cur->db, g_sql_channel, -1,
+                            SQLITE_PREPARE_PERSISTENT, &cur->stmt_channel,
+                            NULL);
+    if (rc == SQLITE_OK) {
+      rc = sqlite3_prepare_v3(cur->db, sql, -1, SQLITE_PREPARE_PERSISTENT,
+                              &cur->stmt_range, NULL);
+    }
+  } else {
+    rc = sqlite3_prepare_v3(cur->db, g_sql_range, -1,
+                            SQLITE_PREPARE_PERSISTENT, &cur->stmt_range, NULL);
+  }
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_prepare_v3(cur->db, g_sql_rollup, -1,
+                            SQLITE_PREPARE_PERSISTENT, &cur->stmt_rollup, NULL);
+  }
+  if (rc != SQLITE_OK) {
+    LOG_ERROR("query: failed to prepare statement: %s",
+              sqlite3_errmsg(cur->db));
+    return -1;
+  }
+  return 0;
+}
+
+static void query_conn_close(query_cursor_t *cur)
+{
+  sqlite3_finalize(cur->stmt_range);
+  sqlite3_finalize(cur->stmt_rollup);
+  sqlite3_finalize(cur->stmt_channel);
+  sqlite3_finalize(cur->stmt_partition);
+  sqlite3_finalize(cur->stmt_chunks);
+  sqlite3_finalize(cur->stmt_head);
+  sqlite3_close(cur->db);
+  free(cur->decoded);
+  free(cur->pending);
+  memset(cur, 0, sizeof(*cur));
+}
+
+/**
+ * @brief Open the read-only connections used by GET /sensor/query
+ *
+ * Must be called after db_init(). Queries stay disabled when the database
+ * is not in WAL mode: rollback-journal readers would block the writer.
+ *
+ * @param path Database file
+ * @param size Number of connections, i.e. of queries running at once;
+ *             0 disables queries
+ *
+ * @return 0 on success (queries possibly disabled), -1 on error
+ */
+int query_pool_init(const char *path, unsigned int size)
+{
+  if (size > QUERY_POOL_MAX) {
+    LOG_ERROR("query: pool size must be 0..%d", QUERY_POOL_MAX);
+    return -1;
+  }
+
+  for (g_pool_size = 0; g_pool_size < size; g_pool_size++) {
+    query_cursor_t *cur = &g_pool[g_pool_size];
+
+    if (query_conn_open(cur, path) != 0) {
+      query_conn_close(cur);
+      query_pool_close();
+      return -1;
+    }
+    if (g_pool_size == 0 && query_is_wal(cur->db) != 1) {
+      LOG_INFO("Queries disabled: they need a WAL profile "
+               "(-p safe or -p fast)");
+      query_conn_close(cur);
+      return 0;
+    }
+  }
+
+  if (g_pool_size > 0) {
+    LOG_INFO("Query pool: %u read-only connection%s", g_pool_size,
+             g_pool_size > 1 ? "s" : "");
+  }
+  return 0;
+}
+
+/**
+ * @brief Close the query connections
+ *
+ * Every cursor must have been closed.
+ */
+void query_pool_close(void)
+{
+  pthread_mutex_lock(&g_pool_lock);
+  for (unsigned int i = 0; i < g_pool_size; i++) {
+    query_conn_close(&g_pool[i]);
+  }
+  g_pool_size = 0;
+  pthread_mutex_unlock(&g_pool_lock);
+}
+
+bool query_pool_enabled(void)
+{
+  return g_pool_size > 0;
+}
+
+/**
+ * @brief Open a read transaction on every connection, kept until
+ *        query_pool_close()
+ *
+ * The queries that follow on a connection all read the snapshot it took
+ * here, rather than one each. The WAL cannot be checkpointed past it in the
+ * meantime.
+ *
+ * @return 0 on success, -1 on error
+ */
+int query_pool_hold(void)
+{
+  for (unsigned int i = 0; i < g_pool_size; i++) {
+    query_cursor_t *cur = &g_pool[i];
+
+    /* the snapshot is taken by the first read, not by BEGIN */
+    if (sqlite3_exec(cur->db,
+                     "BEGIN; SELECT count(*) FROM sqlite_master;", NULL,
+                     NULL, NULL) != SQLITE_OK) {
+      LOG_ERROR("query: cannot start the read transaction: %s",
+                sqlite3_errmsg(cur->db));
+      return -1;
+    }
+    cur->held = true;
+  }
+  return 0;
+}
+
+static int query_parse_int64(const char *s, size_t len, int64_t *out)
+{
+  char  buf[24];
+  char *end;
+
+  if (len == 0 || len >= sizeof(buf)) {
+    return -1;
+  }
+  memcpy(buf, s, len);
+  buf[len] = '\0';
+
+  errno = 0;
+  *out  = strtoll(buf, &end, 10);
+  return errno == 0 && *end == '\0' ? 0 : -1;
+}
+
+static int query_copy(char *dst, size_t size, const char *s, size_t len)
+{
+  if (len == 0 || len >= size) {
+    return -1;
+  }
+  memcpy(dst, s, len);
+  dst[len] = '\0';
+  return 0;
+}
+
+/**
+ * @brief Parse the Uri-Query of a range query
+ *
+ * d and ch are required; from, to and limit default to every reading, up to
+ * QUERY_LIMIT_DEFAULT of them. res asks for buckets of that many ms instead
+ * of readings. Unknown parameters are ignored.
+ *
+ * @param query Uri-Query options joined with '&', as libcoap passes them
+ * @param len   Length of query
+ * @param out   Filled with the parameters
+ *
+ * @return 0 on success, -1 if a parameter is missing or malformed
+ */
+int query_params_parse(const char *query, size_t len, query_params_t *out)
+{
+  const char *end = query + len;
+  int64_t     limit;
+
+  memset(out, 0, sizeof(*out));
+  out->from  = INT64_MIN;
+  out->to    = INT64_MAX;
+  out->limit = QUERY_LIMIT_DEFAULT;
+
+  while (query && query < end) {
+    const char *amp = memchr(query, '&', (size_t)(end - query));
+    const char *arg = amp ? amp : end;
+    const char *eq  = memchr(query, '=', (size_t)(arg - query));
+    int         rc  = 0;
+
+    if (eq) {
+      size_t      klen = (size_t)(eq - query);
+      const char *v    = eq + 1;
+      size_t      vlen = (size_t)(arg - v);
+
+      if (klen == 1 && query[0] == 'd') {
+        rc = query_copy(out->device, sizeof(out->device), v, vlen);
+      } else if (klen == 2 && memcmp(query, "ch", 2) == 0) {
+        rc = query_copy(out->channel, sizeof(out->channel), v, vlen);
+      } else if (klen == 4 && memcmp(query, "from", 4) == 0) {
+        rc = query_parse_int64(v, vlen, &out->from);
+      } else if (klen == 2 && memcmp(query, "to", 2) == 0) {
+        rc = query_parse_int64(v, vlen, &out->to);
+      } else if (klen == 5 && memcmp(query, "limit", 5) == 0) {
+        rc = query_parse_int64(v, vlen, &limit);
+        if (rc == 0 && (limit <= 0 || limit > QUERY_LIMIT_MAX)) {
+          rc = -1;
+        }
+        out->limit = (unsigned int)limit;
+      } else if (klen == 3 && memcmp(query, "res", 3) == 0) {
+        rc = query_parse_int64(v, vlen, &out->resolution);
+        if (rc == 0 && out->resolution <= 0) {
+          rc = -1;
+        }
+      }
+    }
+    if (rc != 0) {
+      return -1;
+    }
+    query = arg + 1;
+  }
+
+  if (out->device[0] == '\0' || out->channel[0] == '\0') {
+    return -1;
+  }
+  return 0;
+}
+
+/* Opens the read transaction and looks the channel up; partitions and
+   chunks are only looked at as the rows are read */
+static int query_open_channel(query_cursor_t *cur)
+{
+  sqlite3_stmt *stmt = cur->stmt_channel;
+  int           rc;
+
+  cur->channel_id   = 0;
+  cur->channel_type = SENSOR_TYPE_LAST;
+  cur->scanned      = INT64_MIN;
+  if ((!cur->held &&
+       sqlite3_exec(cur->db, "BEGIN", NULL, NULL, NULL) != SQLITE_OK) ||
+      sqlite3_bind_text(stmt, 1, cur->params.device, -1, SQLITE_STATIC) !=
+        SQLITE_OK ||
+      sqlite3_bind_text(stmt, 2, cur->params.channel, -1, SQLITE_STATIC) !=
+        SQLITE_OK) {
+    LOG_ERROR("query: bind failed: %s", sqlite3_errmsg(cur->db));
+    return -1;
+  }
+
+  rc = sqlite3_step(stmt);
+  if (rc == SQLITE_ROW) {
+    cur->channel_id   = sqlite3_column_int64(stmt, 0);
+    cur->channel_type = sqlite3_column_int(stmt, 1);
+  }
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
+  if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+    LOG_ERROR("query: channel lookup failed: %s",
+              sqlite3_errmsg(cur->db));
+    return -1;
+  }
+  return 0;
+}
+
+/* Starts the scan of the single compact readings table */
+static int query_open_compact(query_cursor_t *cur)
+{
+  if (sqlite3_bind_int64(cur->stmt, 1, cur->channel_id) != SQLITE_OK ||
+      sqlite3_bind_int64(cur->stmt, 2, cur->params.from) != SQLITE_OK ||
+      sqlite3_bind_int64(cur->stmt, 3, cur->params.to) != SQLITE_OK ||
+      sqlite3_bind_int(cur->stmt, 4, query_limit(cur)) != SQLITE_OK) {
+    LOG_ERROR("query: bind failed: %s", sqlite3_errmsg(cur->db));
+    return -1;
+  }
+  return 0;
+}
+
+/* Prepares the scan of the next partition overlapping the range. Returns
+   SQLITE_ROW if there is one, SQLITE_DONE if not, an error code otherwise */
+static int query_next_partition(query_cursor_t *cur)
+{
+  sqlite3_stmt *stmt = cur->stmt_partition;
+  char          sql[256];
+  int           rc;
+
+  if (cur->channel_id == 0 || cur->rows >= cur->params.limit) {
+    return SQLITE_DONE;
+  }
+
+  if (sqlite3_bind_int64(stmt, 1, cur->params.from) != SQLITE_OK ||
+      sqlite3_bind_int64(stmt, 2, cur->params.to) != SQLITE_OK ||
+      sqlite3_bind_int64(stmt, 3, cur->scanned) != SQLITE_OK) {
+    sqlite3_reset(stmt);
+    return SQLITE_ERROR;
+  }
+  rc = sqlite3_step(stmt);
+  if (rc == SQLITE_ROW) {
+    snprintf(sql, sizeof(sql), query_sql_scan(cur),
+             (const char *)sqlite3_column_text(stmt, 0));
+    cur->scanned = sqlite3_column_int64(stmt, 1);
+  }
+  sqlite3_reset(stmt);
+  if (rc != SQLITE_ROW) {
+    return rc;
+  }
+
+  rc = sqlite3_prepare_v2(cur->db, sql, -1, &cur->stmt_scan, NULL);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  cur->stmt = cur->stmt_scan;
+  if (sqlite3_bind_int64(cur->stmt, 1, cur->channel_id) != SQLITE_OK ||
+      sqlite3_bind_int64(cur->stmt, 2, cur->params.from) != SQLITE_OK ||
+      sqlite3_bind_int64(cur->stmt, 3, cur->params.to) != SQLITE_OK ||
+      sqlite3_bind_int(cur->stmt, 4, query_limit(cur)) != SQLITE_OK) {
+    return SQLITE_ERROR;
+  }
+  return SQLITE_ROW;
+}
+
+/* Starts the scans of the chunks and of the head */
+static int query_open_chunks(query_cursor_t *cur)
+{
+  int rc;
+
+  cur->chunk_peek  = false;
+  cur->head_peek   = false;
+  cur->pending_len = 0;
+  cur->pending_pos = 0;
+  cur->sample      = NULL;
+  if (cur->channel_id == 0) {
+    return 0;
+  }
+
+  if (sqlite3_bind_int64(cur->stmt_head, 1, cur->channel_id) != SQLITE_OK ||
+      sqlite3_bind_int64(cur->stmt_head, 2, cur->params.from) != SQLITE_OK ||
+      sqlite3_bind_int64(cur->stmt_head, 3, cur->params.to) != SQLITE_OK ||
+      sqlite3_bind_int(cur->stmt_head, 4, query_limit(cur)) != SQLITE_OK ||
+      sqlite3_bind_int64(cur->stmt_chunks, 1, cur->channel_id) != SQLITE_OK ||
+      sqlite3_bind_int64(cur->stmt_chunks, 2, cur->params.from) !=
+        SQLITE_OK ||
+      sqlite3_bind_int64(cur->stmt_chunks, 3, cur->params.to) != SQLITE_OK) {
+    LOG_ERROR("query: bind failed: %s", sqlite3_errmsg(cur->db));
+    return -1;
+  }
+
+  rc = sqlite3_step(cur->stmt_chunks);
+  if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+    LOG_ERROR("query: step failed: %s", sqlite3_errmsg(cur->db));
+    return -1;
+  }
+  cur->chunk_peek = rc == SQLITE_ROW;
+  return 0;
+}
+
+/* Decodes the chunk stmt_chunks is on, merges its samples in the range
+   into the pending ones, and moves to the next chunk */
+static int query_load_chunk(query_cursor_t *cur)
+{
+  sqlite3_stmt *stmt = cur->stmt_chunks;
+  sensor_type_t type;
+  size_t        left = cur->pending_len - cur->pending_pos;
+  size_t        n    = 0;
+  int           count;
+  int           rc;
+
+  count = chunk_decode(sqlite3_column_blob(stmt, 1),
+                       (size_t)sqlite3_column_bytes(stmt, 1), &type,
+                       cur->decoded, CHUNK_SAMPLES);
+  if (count < 0) {
+    LOG_ERROR("query: malformed chunk");
+    count = 0;
+  }
+
+  memmove(cur->pending, cur->pending + cur->pending_pos,
+          left * sizeof(*cur->pending));
+  cur->pending_pos = 0;
+  cur->pending_len = left;
+  if (left + (size_t)count > cur->pending_cap) {
+    size_t          cap     = left + CHUNK_SAMPLES;
+    query_sample_t *pending = realloc(cur->pending, cap * sizeof(*pending));
+
+    if (!pending) {
+      LOG_ERROR("query: out of memory");
+      return SQLITE_NOMEM;
+    }
+    cur->pending     = pending;
+    cur->pending_cap = cap;
+  }
+
+  /* the samples in range, then both sorted runs merged from the end */
+  for (int i = 0; i < count; i++) {
+    if (cur->decoded[i].ts >= cur->params.from &&
+        cur->decoded[i].ts < cur->params.to) {
+      cur->decoded[n++] = cur->decoded[i];
+    }
+  }
+  for (size_t i = left, j = n, k = left + n; j > 0;) {
+    if (i > 0 && cur->pending[i - 1].s.ts > cur->decoded[j - 1].ts) {
+      cur->pending[--k] = cur->pending[--i];
+    } else {
+      cur->pending[--k].s = cur->decoded[--j];
+      cur->pending[k].type = type;
+    }
+  }
+  cur->pending_len = left + n;
+
+  rc = sqlite3_step(stmt);
+  if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+    return rc;
+  }
+  cur->chunk_peek = rc == SQLITE_ROW;
+  return SQLITE_OK;
+}
+
+/* Next reading of a chunked channel: the earliest of the head row and the
+   pending samples, once every chunk starting before it is decoded */
+static int query_step_chunks(query_cursor_t *cur)
+{
+  int64_t head_ts;
+  int64_t next_ts;
+  int     rc;
+
+  cur->sample = NULL;
+  if (cur->channel_id == 0 || cur->rows >= cur->params.limit) {
+    return SQLITE_DONE;
+  }
+  if (!cur->head_peek) {
+    rc = sqlite3_step(cur->stmt_head);
+    if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+      return rc;
+    }
+    cur->head_peek = rc == SQLITE_ROW;
+  }
+
+  for (;;) {
+    head_ts = cur->head_peek ? sqlite3_column_int64(cur->stmt_head, 0)
+                             : INT64_MAX;
+    next_ts = cur->pending_pos < cur->pending_len
+                ? cur->pending[cur->pending_pos].s.ts
+                : INT64_MAX;
+    if (head_ts < next_ts) {
+      next_ts = head_ts;
+    }
+    if (!cur->chunk_peek ||
+        sqlite3_column_int64(cur->stmt_chunks, 0) > next_ts) {
+      break;
+    }
+    rc = query_load_chunk(cur);
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+  }
+
+  if (cur->pending_pos < cur->pending_len &&
+      cur->pending[cur->pending_pos].s.ts < head_ts) {
+    cur->sample = &cur->pending[cur->pending_pos++];
+    return SQLITE_ROW;
+  }
+  if (cur->head_peek) {
+    cur->stmt      = cur->stmt_head;
+    cur->head_peek = false;
+    return SQLITE_ROW;
+  }
+  return SQLITE_DONE;
+}
+
+/* Next row of the result, going through the partitions in time order */
+static int query_step(query_cursor_t *cur)
+{
+  int rc;
+
+  if (cur->chunked && !cur->period) {
+    return query_step_chunks(cur);
+  }
+  if (!cur->partitioned || cur->period) {
+    return sqlite3_step(cur->stmt);
+  }
+
+  for (;;) {
+    if (!cur->stmt_scan) {
+      rc = query_next_partition(cur);
+      if (rc != SQLITE_ROW) {
+        return rc;
+      }
+    }
+    rc = sqlite3_step(cur->stmt_scan);
+    if (rc != SQLITE_DONE) {
+      return rc;
+    }
+    sqlite3_finalize(cur->stmt_scan);
+    cur->stmt_scan = NULL;
+    cur->stmt      = NULL;
+  }
+}
+
+/**
+ * @brief Start a range query on a free pooled connection
+ *
+ * @param params Parsed query
+ * @param out    Set to the cursor, to be closed with query_close()
+ *
+ * @return 0 on success, QUERY_ERR_BUSY if every connection is in use, -1 on
+ *         error
+ */
+int query_open(const query_params_t *params, query_cursor_t **out)
+{
+  query_cursor_t *cur = NULL;
+
+  pthread_mutex_lock(&g_pool_lock);
+  for (unsigned int i = 0; i < g_pool_size; i++) {
+    if (!g_pool[i].in_use) {
+      cur         = &g_pool[i];
+      cur->in_use = true;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&g_pool_lock);
+  if (!cur) {
+    return g_pool_size > 0 ? QUERY_ERR_BUSY : -1;
+  }
+
+  cur->params    = *params;
+  cur->state     = QUERY_STATE_HEADER;
+  cur->rows      = 0;
+  cur->chunk_len = 0;
+  cur->chunk_off = 0;
+  cur->period    = 0;
+  cur->stmt      = cur->stmt_range;
+
+  /* the coarsest rollup the resolution is a multiple of; readings when it
+     is finer than every rollup */
+  for (size_t i = 0; i < DB_ROLLUP_LEVELS && params->resolution > 0; i++) {
+    if (params->resolution % g_rollup_periods[i] == 0) {
+      cur->period = g_rollup_periods[i];
+      cur->stmt   = cur->stmt_rollup;
+      break;
+    }
+  }
+  if ((cur->partitioned || cur->chunked || cur->compact) && !cur->period) {
+    if (query_open_channel(cur) != 0 ||
+        (cur->chunked && query_open_chunks(cur) != 0) ||
+        (!cur->partitioned && !cur->chunked && query_open_compact(cur) != 0)) {
+      query_close(cur);
+      return -1;
+    }
+    *out = cur;
+    return 0;
+  }
+  if (cur->period &&
+      (sqlite3_bind_int64(cur->stmt, 6, cur->period) != SQLITE_OK ||
+       sqlite3_bind_int64(cur->stmt, 7, params->resolution) != SQLITE_OK)) {
+    LOG_ERROR("query: bind failed: %s", sqlite3_errmsg(cur->db));
+    query_close(cur);
+    return -1;
+  }
+
+  if (sqlite3_bind_text(cur->stmt, 1, params->device, -1, SQLITE_STATIC) !=
+        SQLITE_OK ||
+      sqlite3_bind_text(cur->stmt, 2, params->channel, -1, SQLITE_STATIC) !=
+        SQLITE_OK ||
+      sqlite3_bind_int64(cur->stmt, 3, params->from) != SQLITE_OK ||
+      sqlite3_bind_int64(cur->stmt, 4, params->to) != SQLITE_OK ||
+      sqlite3_bind_int(cur->stmt, 5, query_limit(cur)) != SQLITE_OK) {
+    LOG_ERROR("query: bind failed: %s", sqlite3_errmsg(cur->db));
+    query_close(cur);
+    return -1;
+  }
+
+  *out = cur;
+  return 0;
+}
+
+/**
+ * @brief Append s as a JSON string, truncating rather than overflowing
+ * @return Number of bytes written
+ */
+size_t query_put_string(char *buf, size_t size, const char *s)
+{
+  size_t n = 0;
+
+  if (n < size) {
+    buf[n++] = '"';
+  }
+  for (; *s && n + 7 < size; s++) {
+    unsigned char c = (unsigned char)*s;
+
+    if (c == '"' || c == '\\') {
+      buf[n++] = '\\';
+      buf[n++] = (char)c;
+    } else if (c < 0x20) {
+      n += (size_t)snprintf(buf + n, size - n, "\\u%04x", c);
+    } else {
+      buf[n++] = (char)c;
+    }
+  }
+  if (n < size) {
+    buf[n++] = '"';
+  }
+  return n;
+}
+
+/**
+ * @brief Append the shortest text that reads back as the same float: values
+ *        are floats on the device, stored widened to double
+ * @return Number of bytes written, JSON null for NaN and infinities
+ */
+size_t query_put_float(char *buf, size_t size, double d)
+{
+  float f = (float)d;
+  int   n = 0;
+
+  if (!isfinite(f)) {
+    return (size_t)snprintf(buf, size, "null");
+  }
+  for (int precision = 6; precision <= 9; precision++) {
+    n = snprintf(buf, size, "%.*g", precision, (double)f);
+    if (strtof(buf, NULL) == f) {
+      break;
+    }
+  }
+  return (size_t)n;
+}
+
+/* Same for doubles: sums and averages of int channels need more than a
+   float */
+static size_t query_put_double(char *buf, size_t size, double d)
+{
+  int n = 0;
+
+  if (!isfinite(d)) {
+    return (size_t)snprintf(buf, size, "null");
+  }
+  for (int precision = 15; precision <= 17; precision++) {
+    n = snprintf(buf, size, "%.*g", precision, d);
+    if (strtod(buf, NULL) == d) {
+      break;
+    }
+  }
+  return (size_t)n;
+}
+
+/* [<bucket>,<count>,<min>,<max>,<avg>,<last>] */
+static size_t query_put_bucket(query_cursor_t *cur, char *buf, size_t size)
+{
+  sqlite3_stmt *stmt = cur->stmt;
+  size_t        n;
+
+  n = (size_t)snprintf(buf, size, "%s[%" PRId64 ",%" PRId64,
+                       cur->rows ? "," : "",
+                       (int64_t)sqlite3_column_int64(stmt, 0),
+                       (int64_t)sqlite3_column_int64(stmt, 1));
+  for (int col = 2; col <= 5; col++) {
+    n += (size_t)snprintf(buf + n, size - n, ",");
+    n += query_put_double(buf + n, size - n, sqlite3_column_double(stmt, col));
+  }
+  n += (size_t)snprintf(buf + n, size - n, "]");
+  return n;
+}
+
+/* The value of a compact row, written as its type: an integer is a bool
+   when its channel is */
+static size_t query_put_value(query_cursor_t *cur, char *buf, size_t size)
+{
+  sqlite3_stmt *stmt = cur->stmt;
+  int64_t       i;
+
+  switch (sqlite3_column_type(stmt, 1)) {
+  case SQLITE_FLOAT:
+    return query_put_float(buf, size, sqlite3_column_double(stmt, 1));
+  case SQLITE_INTEGER:
+    i = sqlite3_column_int64(stmt, 1);
+    if (cur->channel_type == SENSOR_TYPE_BOOL && (i == 0 || i == 1)) {
+      return (size_t)snprintf(buf, size, "%s", i ? "true" : "false");
+    }
+    return (size_t)snprintf(buf, size, "%" PRId64, i);
+  case SQLITE_TEXT:
+    return query_put_string(buf, size,
+                            (const char *)sqlite3_column_text(stmt, 1));
+  default:
+    return (size_t)snprintf(buf, size, "null");
+  }
+}
+
+static size_t query_put_row(query_cursor_t *cur, char *buf, size_t size)
+{
+  sqlite3_stmt *stmt = cur->stmt;
+  size_t        n;
+
+  n = (size_t)snprintf(buf, size, "%s[%" PRId64 ",", cur->rows ? "," : "",
+                       (int64_t)sqlite3_column_int64(stmt, 0));
+
+  if (cur->compact) {
+    n += query_put_value(cur, buf + n, size - n);
+  } else if (sqlite3_column_type(stmt, 1) != SQLITE_NULL) {
+    n += query_put_float(buf + n, size - n, sqlite3_column_double(stmt, 1));
+  } else if (sqlite3_column_type(stmt, 2) != SQLITE_NULL) {
+    n += (size_t)snprintf(buf + n, size - n, "%" PRId64,
+                          (int64_t)sqlite3_column_int64(stmt, 2));
+  } else if (sqlite3_column_type(stmt, 3) != SQLITE_NULL) {
+    n += query_put_string(buf + n, size - n,
+                          (const char *)sqlite3_column_text(stmt, 3));
+  } else if (sqlite3_column_type(stmt, 4) != SQLITE_NULL) {
+    n += (size_t)snprintf(buf + n, size - n, "%s",
+                          sqlite3_column_int(stmt, 4) ? "true" : "false");
+  } else {
+    n += (size_t)snprintf(buf + n, size - n, "null");
+  }
+
+  n += (size_t)snprintf(buf + n, size - n, "]");
+  return n;
+}
+
+/* Same for a reading decoded from a chunk */
+static size_t query_put_sample(query_cursor_t *cur, char *buf, size_t size)
+{
+  const query_sample_t *sample = cur->sample;
+  size_t                n;
+
+  n = (size_t)snprintf(buf, size, "%s[%" PRId64 ",", cur->rows ? "," : "",
+                       sample->s.ts);
+  switch (sample->type) {
+  case SENSOR_TYPE_FLOAT:
+    n += query_put_float(buf + n, size - n, (double)sample->s.value.f);
+    break;
+  case SENSOR_TYPE_INT:
+    n += (size_t)snprintf(buf + n, size - n, "%" PRId32, sample->s.value.i);
+    break;
+  default:
+    n += (size_t)snprintf(buf + n, size - n, "%s",
+                          sample->s.value.b ? "true" : "false");
+    break;
+  }
+  n += (size_t)snprintf(buf + n, size - n, "]");
+  return n;
+}
+
+/* Refills cur->chunk with the next piece of the document:
+   {"d":"<device>","ch":"<channel>","readings":[[<ts>,<value>],...]} or, from
+   rollups, {"d":...,"ch":...,"res":<ms>,"buckets":[[<start>,...],...]}
+   Leaves it empty once the document is complete. */
+static int query_next_chunk(query_cursor_t *cur)
+{
+  char  *buf  = cur->chunk;
+  size_t size = sizeof(cur->chunk);
+  size_t n    = 0;
+  int    rc;
+
+  cur->chunk_off = 0;
+  cur->chunk_len = 0;
+
+  switch (cur->state) {
+  case QUERY_STATE_HEADER:
+    n += (size_t)snprintf(buf, size, "{\"d\":");
+    n += query_put_string(buf + n, size - n, cur->params.device);
+    n += (size_t)snprintf(buf + n, size - n, ",\"ch\":");
+    n += query_put_string(buf + n, size - n, cur->params.channel);
+    if (cur->period) {
+      n += (size_t)snprintf(buf + n, size - n, ",\"res\":%" PRId64
+                            ",\"buckets\":[", cur->params.resolution);
+    } else {
+      n += (size_t)snprintf(buf + n, size - n, ",\"readings\":[");
+    }
+    cur->state = QUERY_STATE_ROWS;
+    break;
+  case QUERY_STATE_ROWS:
+    rc = query_step(cur);
+    if (rc == SQLITE_ROW) {
+      n = cur->period   ? query_put_bucket(cur, buf, size)
+          : cur->sample ? query_put_sample(cur, buf, size)
+                        : query_put_row(cur, buf, size);
+      cur->rows++;
+    } else if (rc == SQLITE_DONE) {
+      n          = (size_t)snprintf(buf, size, "]}");
+      cur->state = QUERY_STATE_DONE;
+    } else {
+      LOG_ERROR("query: step failed: %s", sqlite3_errmsg(cur->db));
+      return -1;
+    }
+    break;
+  case QUERY_STATE_DONE:
+    break;
+  }
+
+  cur->chunk_len = n < size ? n : size - 1;
+  return 0;
+}
+
+/**
+ * @brief Read the next bytes of the result document
+ *
+ * Rows are fetched from SQLite only as the document is read: memory use does
+ * not depend on the size of the result.
+ *
+ * @param cur  Cursor from query_open()
+ * @param buf  Destination
+ * @param len  Bytes wanted
+ * @param done Set to true once the end of the document has been read
+ *
+ * @return Bytes read, less than len only at the end of the document; -1 on
+ *         error
+ */
+ssize_t query_read(query_cursor_t *cur, char *buf, size_t len, bool *done)
+{
+  size_t n = 0;
+
+  *done = false;
+  while (n < len) {
+    if (cur->chunk_off == cur->chunk_len) {
+      if (query_next_chunk(cur) != 0) {
+        return -1;
+      }
+      if (cur->chunk_len == 0) {
+        break;
+      }
+    }
+
+    size_t take = cur->chunk_len - cur->chunk_off;
+    if (take > len - n) {
+      take = len - n;
+    }
+    memcpy(buf + n, cur->chunk + cur->chunk_off, take);
+    cur->chunk_off += take;
+    n += take;
+  }
+
+  /* look ahead so the caller knows whether this was the last block */
+  if (cur->chunk_off == cur->chunk_len && query_next_chunk(cur) != 0) {
+    return -1;
+  }
+  *done = cur->chunk_len == 0;
+  return (ssize_t)n;
+}
+
+/* The current row of a statement: the value column that is not NULL, or
+   with the compact layout the value, an integer being a bool when its
+   channel is */
+static void query_get_row(query_cursor_t *cur, query_row_t *row)
+{
+  sqlite3_stmt *stmt = cur->stmt;
+  int           col  = 1;
+
+  row->ts   = sqlite3_column_int64(stmt, 0);
+  row->type = SENSOR_TYPE_LAST;
+  while (!cur->compact && col < 4 &&
+         sqlite3_column_type(stmt, col) == SQLITE_NULL) {
+    col++;
+  }
+
+  switch (sqlite3_column_type(stmt, col)) {
+  case SQLITE_FLOAT:
+    row->type    = SENSOR_TYPE_FLOAT;
+    row->value.f = sqlite3_column_double(stmt, col);
+    break;
+  case SQLITE_INTEGER:
+    row->type    = SENSOR_TYPE_INT;
+    row->value.i = sqlite3_column_int64(stmt, col);
+    if (col == 4 || (cur->compact && cur->channel_type == SENSOR_TYPE_BOOL &&
+                     (row->value.i == 0 || row->value.i == 1))) {
+      row->type    = SENSOR_TYPE_BOOL;
+      row->value.b = row->value.i != 0;
+    }
+    break;
+  case SQLITE_TEXT:
+    row->type    = SENSOR_TYPE_STRING;
+    row->value.s = (const char *)sqlite3_column_text(stmt, col);
+    break;
+  default:
+    break;
+  }
+}
+
+/**
+ * @brief Read the next reading of the result, instead of the document
+ *
+ * Rollup queries have no readings: a query given res= must be read with
+ * query_read().
+ *
+ * @param cur Cursor from query_open()
+ * @param row Filled with the reading
+ *
+ * @return 1 if row was filled, 0 at the end of the result, -1 on error
+ */
+int query_next_row(query_cursor_t *cur, query_row_t *row)
+{
+  const query_sample_t *sample;
+  int                   rc;
+
+  if (cur->period) {
+    return -1;
+  }
+  rc = query_step(cur);
+  if (rc == SQLITE_DONE) {
+    return 0;
+  }
+  if (rc != SQLITE_ROW) {
+    LOG_ERROR("query: step failed: %s", sqlite3_errmsg(cur->db));
+    return -1;
+  }
+  cur->rows++;
+
+  sample = cur->sample;
+  if (!sample) {
+    query_get_row(cur, row);
+    return 1;
+  }
+  row->ts   = sample->s.ts;
+  row->type = sample->type;
+  switch (sample->type) {
+  case SENSOR_TYPE_FLOAT:
+    row->value.f = (double)sample->s.value.f;
+    break;
+  case SENSOR_TYPE_INT:
+    row->value.i = sample->s.value.i;
+    break;
+  default:
+    row->value.b = sample->s.value.b;
+    break;
+  }
+  return 1;
+}
+
+/**
+ * @brief End a query and give its connection back to the pool
+ *
+ * @param cur Cursor from query_open()
+ */
+void query_close(query_cursor_t *cur)
+{
+  /* ends the read transaction, the writer may checkpoint past it again */
+  if (cur->stmt && cur->stmt != cur->stmt_scan) {
+    sqlite3_reset(cur->stmt);
+    sqlite3_clear_bindings(cur->stmt);
+  }
+  sqlite3_finalize(cur->stmt_scan);
+  cur->stmt_scan = NULL;
+  cur->stmt      = NULL;
+  if (cur->chunked && cur->stmt_head) {
+    sqlite3_reset(cur->stmt_head);
+    sqlite3_clear_bindings(cur->stmt_head);
+    sqlite3_reset(cur->stmt_chunks);
+    sqlite3_clear_bindings(cur->stmt_chunks);
+  }
+  if (!cur->held && !sqlite3_get_autocommit(cur->db)) {
+    sqlite3_exec(cur->db, "COMMIT", NULL, NULL, NULL);
+  }
+
+  pthread_mutex_lock(&g_pool_lock);
+  cur->in_use = false;
+  pthread_mutex_unlock(&g_pool_lock);
+}
@@ -0,0 +1,58 @@
+/*
+ * SO_REUSEPORT for libcoap endpoints
+ *
+ * libcoap binds its UDP endpoints itself and only sets SO_REUSEADDR on them;
+ * there is no hook to add socket options between socket() and bind(). To
+ * run several contexts on the same port and let the kernel spread clients
+ * across them, this file wraps setsockopt(): on threads that called
+ * reuseport_set(true), every SO_REUSEADDR request is followed by
+ * SO_REUSEPORT on the same socket. Other threads and other options go
+ * straight to the C library.
+ */
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/socket.h>
+
+#include "reuseport.h"
+
+typedef int (*setsockopt_fn)(int, int, int, const void *, socklen_t);
+
+static _Thread_local bool t_reuseport = false;
+
+/**
+ * @brief Add SO_REUSEPORT to the sockets created by the calling thread
+ *
+ * @param enable true until the endpoints of this thread are bound
+ */
+void reuseport_set(bool enable)
+{
+  t_reuseport = enable;
+}
+
+int setsockopt(int fd, int level, int optname, const void *optval,
+               socklen_t optlen)
+{
+  static _Atomic(setsockopt_fn) real = NULL;
+  setsockopt_fn                 fn   = real;
+  int                           rc;
+
+  if (!fn) {
+    fn = (setsockopt_fn)dlsym(RTLD_NEXT, "setsockopt");
+    if (!fn) {
+      errno = ENOSYS;
+      return -1;
+    }
+    real = fn;
+  }
+
+  rc = fn(fd, level, optname, optval, optlen);
+  if (rc == 0 && t_reuseport && level == SOL_SOCKET &&
+      optname == SO_REUSEADDR) {
+    int on = 1;
+    rc     = fn(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+  }
+  return rc;
+}
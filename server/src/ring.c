@@ -0,0 +1,134 @@
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ring.h"
+
+/**
+ * @brief Allocate the storage of a ring
+ *
+ * @param ring      Ring to initialize
+ * @param capacity  Number of records, rounded up to a power of two
+ * @param elem_size Size of one record in bytes
+ *
+ * @return 0 on success, -1 on allocation failure
+ */
+int ring_init(ring_t *ring, size_t capacity, size_t elem_size)
+{
+  size_t cap = 1;
+
+  while (cap < capacity) {
+    cap <<= 1;
+  }
+
+  ring->buf = malloc(cap * elem_size);
+  if (!ring->buf) {
+    return -1;
+  }
+
+  atomic_init(&ring->head, 0);
+  atomic_init(&ring->tail, 0);
+  ring->capacity  = cap;
+  ring->mask      = cap - 1;
+  ring->elem_size = elem_size;
+  return 0;
+}
+
+/**
+ * @brief Release the storage of a ring
+ */
+void ring_free(ring_t *ring)
+{
+  free(ring->buf);
+  ring->buf      = NULL;
+  ring->capacity = 0;
+}
+
+/**
+ * @brief Number of records currently queued (safe from either side)
+ */
+size_t ring_count(ring_t *ring)
+{
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+  return head - tail;
+}
+
+/**
+ * @brief Number of free slots, as seen by the producer
+ */
+size_t ring_space(ring_t *ring)
+{
+  return ring->capacity - ring_count(ring);
+}
+
+/**
+ * @brief Append n records, all or nothing (producer side)
+ *
+ * @param ring  Ring to append to
+ * @param elems Array of n records
+ * @param n     Number of records
+ *
+ * @return 0 on success, -1 if fewer than n slots are free
+ */
+int ring_push_n(ring_t *ring, const void *elems, size_t n)
+{
+  size_t         head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  size_t         tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  const uint8_t *src  = elems;
+
+  if (ring->capacity - (head - tail) < n) {
+    return -1;
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    memcpy(ring->buf + ((head + i) & ring->mask) * ring->elem_size,
+           src + i * ring->elem_size, ring->elem_size);
+  }
+
+  atomic_store_explicit(&ring->head, head + n, memory_order_release);
+  return 0;
+}
+
+/**
+ * @brief Append one record (producer side)
+ *
+ * @return 0 on success, -1 if the ring is full
+ */
+int ring_push(ring_t *ring, const void *elem)
+{
+  return ring_push_n(ring, elem, 1);
+}
+
+/**
+ * @brief Remove up to max records (consumer side)
+ *
+ * @param ring Ring to drain
+ * @param out  Array receiving at most max records
+ * @param max  Capacity of out, in records
+ *
+ * @return Number of records copied to out
+ */
+size_t ring_pop_n(ring_t *ring, void *out, size_t max)
+{
+  size_t   tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  size_t   head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  size_t   n    = head - tail;
+  uint8_t *dst  = out;
+
+  if (n > max) {
+    n = max;
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    memcpy(dst + i * ring->elem_size,
+           ring->buf + ((tail + i) & ring->mask) * ring->elem_size,
+           ring->elem_size);
+  }
+
+  atomic_store_explicit(&ring->tail, tail + n, memory_order_release);
+  return n;
+}
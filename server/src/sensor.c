@@ -1,29 +1,302 @@
+#include <pthread.h>
 #include <stddef.h>
-#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "log.h"
 #include "sensor.h"
 
+#define SENSOR_REG_MIN_SLOTS  64
+#define SENSOR_REG_ALIGN      8
+#define SENSOR_REG_MAX_CHUNKS 0xffff /* 4 GiB of channels */
+
 static sensor_registry_t g_registry = {0};
 
+/* CoAP workers share the registry: serialize registration and updates */
+static pthread_mutex_t g_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static bool g_limit_logged = false;
+
+/* Reserve bytes against the memory limit */
+static int sensor_reg_charge(sensor_registry_t *reg, size_t bytes)
+{
+  if (bytes > reg->mem_limit - reg->mem_used) {
+    if (!g_limit_logged) {
+      LOG_WARN("Channel registry memory limit reached (%zu bytes, %zu "
+               "channels), new channels are not tracked",
+               reg->mem_limit, reg->count);
+      g_limit_logged = true;
+    }
+    return -1;
+  }
+  reg->mem_used += bytes;
+  return 0;
+}
+
+static void *sensor_reg_ptr(const sensor_registry_t *reg, uint32_t ref)
+{
+  return reg->chunks[(ref >> 16) - 1] + (ref & 0xffff);
+}
+
+static sensor_reg_channel_t *sensor_reg_deref(const sensor_registry_t *reg,
+                                              uint32_t                 ref)
+{
+  return sensor_reg_ptr(reg, ref);
+}
+
+static sensor_reg_device_t *sensor_reg_device(const sensor_registry_t *reg,
+                                              uint32_t                 ref)
+{
+  return sensor_reg_ptr(reg, ref);
+}
+
+/* Bump allocation in the arena, freed all at once by sensor_reg_free() */
+static uint32_t sensor_arena_alloc(sensor_registry_t *reg, size_t size)
+{
+  size = (size + SENSOR_REG_ALIGN - 1) & ~(size_t)(SENSOR_REG_ALIGN - 1);
+
+  if (reg->chunk_count == 0 ||
+      SENSOR_REG_CHUNK_SIZE - reg->chunk_used < size) {
+    if (reg->chunk_count == SENSOR_REG_MAX_CHUNKS) {
+      return 0;
+    }
+    if (reg->chunk_count == reg->chunk_cap) {
+      size_t cap   = reg->chunk_cap ? reg->chunk_cap * 2 : 16;
+      size_t bytes = (cap - reg->chunk_cap) * sizeof(*reg->chunks);
+      char **chunks;
+
+      if (sensor_reg_charge(reg, bytes) != 0) {
+        return 0;
+      }
+      chunks = realloc(reg->chunks, cap * sizeof(*reg->chunks));
+      if (!chunks) {
+        reg->mem_used -= bytes;
+        return 0;
+      }
+      reg->chunks    = chunks;
+      reg->chunk_cap = cap;
+    }
+
+    if (sensor_reg_charge(reg, SENSOR_REG_CHUNK_SIZE) != 0) {
+      return 0;
+    }
+    reg->chunks[reg->chunk_count] = malloc(SENSOR_REG_CHUNK_SIZE);
+    if (!reg->chunks[reg->chunk_count]) {
+      reg->mem_used -= SENSOR_REG_CHUNK_SIZE;
+      return 0;
+    }
+    reg->chunk_count++;
+    reg->chunk_used = 0;
+  }
+
+  uint32_t ref = (uint32_t)(reg->chunk_count << 16 | reg->chunk_used);
+  reg->chunk_used += size;
+  return ref;
+}
+
+/* Hash of the whole key, NUL separator included, 8 bytes at a time */
+static uint32_t sensor_hash_key(const char *key, size_t len)
+{
+  uint64_t h = 0x9e3779b97f4a7c15ull ^ len;
+  uint64_t w;
+
+  for (; len >= 8; key += 8, len -= 8) {
+    memcpy(&w, key, 8);
+    h = (h ^ w) * 0xbf58476d1ce4e5b9ull;
+    h ^= h >> 31;
+  }
+  if (len > 0) {
+    w = 0;
+    memcpy(&w, key, len);
+    h = (h ^ w) * 0xbf58476d1ce4e5b9ull;
+  }
+
+  h ^= h >> 29;
+  h *= 0x94d049bb133111ebull;
+  h ^= h >> 32;
+  return (uint32_t)h;
+}
+
+/* Slot holding the key, or the empty slot where it would be inserted */
+static sensor_reg_slot_t *sensor_reg_find(const sensor_registry_t *reg,
+                                          const char *key, size_t len,
+                                          uint32_t hash)
+{
+  size_t mask = reg->slot_cap - 1;
+
+  for (size_t i = hash & mask;; i = (i + 1) & mask) {
+    sensor_reg_slot_t *slot = &reg->slots[i];
+
+    if (slot->ref == 0) {
+      return slot;
+    }
+    if (slot->hash == hash) {
+      sensor_reg_channel_t *ch = sensor_reg_deref(reg, slot->ref);
+      if (ch->key_len == len && memcmp(ch->key, key, len) == 0) {
+        return slot;
+      }
+    }
+  }
+}
+
+/* Same for the device index */
+static sensor_reg_slot_t *sensor_reg_find_device(const sensor_registry_t *reg,
+                                                 const char *key, size_t len,
+                                                 uint32_t hash)
+{
+  size_t mask = reg->dev_slot_cap - 1;
+
+  for (size_t i = hash & mask;; i = (i + 1) & mask) {
+    sensor_reg_slot_t *slot = &reg->dev_slots[i];
+
+    if (slot->ref == 0) {
+      return slot;
+    }
+    if (slot->hash == hash) {
+      sensor_reg_device_t *dev = sensor_reg_device(reg, slot->ref);
+      if (dev->key_len == len && memcmp(dev->key, key, len) == 0) {
+        return slot;
+      }
+    }
+  }
+}
+
+/* Double a slot table; the old and new tables are both charged while
+   rehashing so the limit also bounds the peak */
+static int sensor_reg_grow(sensor_registry_t *reg, sensor_reg_slot_t **slots,
+                           size_t *slot_cap)
+{
+  size_t             cap   = *slot_cap ? *slot_cap * 2 : SENSOR_REG_MIN_SLOTS;
+  size_t             bytes = cap * sizeof(sensor_reg_slot_t);
+  sensor_reg_slot_t *old   = *slots;
+  size_t             old_n = *slot_cap;
+
+  if (sensor_reg_charge(reg, bytes) != 0) {
+    return -1;
+  }
+  *slots = calloc(cap, sizeof(sensor_reg_slot_t));
+  if (!*slots) {
+    *slots         = old;
+    reg->mem_used -= bytes;
+    return -1;
+  }
+  *slot_cap = cap;
+
+  for (size_t i = 0; i < old_n; i++) {
+    if (old[i].ref != 0) {
+      size_t j = old[i].hash & (cap - 1);
+
+      while ((*slots)[j].ref != 0) {
+        j = (j + 1) & (cap - 1);
+      }
+      (*slots)[j] = old[i];
+    }
+  }
+
+  free(old);
+  reg->mem_used -= old_n * sizeof(sensor_reg_slot_t);
+  return 0;
+}
+
+/* Device named by the first len bytes of key, created if needed. Returns
+   its arena reference, 0 if the memory limit is reached. */
+static uint32_t sensor_reg_device_get(sensor_registry_t *reg, const char *key,
+                                      size_t len)
+{
+  uint32_t             hash = sensor_hash_key(key, len);
+  sensor_reg_slot_t   *slot;
+  sensor_reg_device_t *dev;
+  uint32_t             ref;
+
+  if (reg->dev_slot_cap > 0) {
+    slot = sensor_reg_find_device(reg, key, len, hash);
+    if (slot->ref != 0) {
+      return slot->ref;
+    }
+  }
+
+  if ((reg->dev_count + 1) * 2 > reg->dev_slot_cap &&
+      sensor_reg_grow(reg, &reg->dev_slots, &reg->dev_slot_cap) != 0) {
+    return 0;
+  }
+  if (reg->dev_count == reg->dev_cap) {
+    size_t    cap   = reg->dev_cap ? reg->dev_cap * 2 : SENSOR_REG_MIN_SLOTS;
+    size_t    bytes = (cap - reg->dev_cap) * sizeof(*reg->devices);
+    uint32_t *devices;
+
+    if (sensor_reg_charge(reg, bytes) != 0) {
+      return 0;
+    }
+    devices = realloc(reg->devices, cap * sizeof(*reg->devices));
+    if (!devices) {
+      reg->mem_used -= bytes;
+      return 0;
+    }
+    reg->devices = devices;
+    reg->dev_cap = cap;
+  }
+
+  ref = sensor_arena_alloc(reg, sizeof(*dev) + len + 1);
+  if (ref == 0) {
+    return 0;
+  }
+  dev          = sensor_reg_device(reg, ref);
+  dev->first   = 0;
+  dev->version = 1;
+  dev->index   = (uint32_t)reg->dev_count;
+  dev->key_len = (uint16_t)len;
+  memcpy(dev->key, key, len);
+  dev->key[len] = '\0';
+
+  slot       = sensor_reg_find_device(reg, key, len, hash);
+  slot->hash = hash;
+  slot->ref  = ref;
+  reg->devices[reg->dev_count++] = ref;
+  return ref;
+}
+
+static void sensor_reg_free(sensor_registry_t *reg)
+{
+  for (size_t i = 0; i < reg->chunk_count; i++) {
+    free(reg->chunks[i]);
+  }
+  free(reg->chunks);
+  free(reg->slots);
+  free(reg->dev_slots);
+  free(reg->devices);
+
+  size_t limit = reg->mem_limit;
+  memset(reg, 0, sizeof(*reg));
+  reg->mem_limit = limit;
+}
+
 /**
  * @brief Initialize the sensor registry
+ *
+ * @param mem_limit Bytes the registry may allocate, index, channels and
+ *                  names included. Once reached, new channels are refused.
+ *
  * @return Pointer to the initialized registry, or NULL on failure
  */
-sensor_registry_t *sensor_reg_init(void)
+sensor_registry_t *sensor_reg_init(size_t mem_limit)
 {
-  g_registry.count = 0;
+  pthread_mutex_lock(&g_mutex);
+  sensor_reg_free(&g_registry);
+  g_registry.mem_limit = mem_limit;
+  g_limit_logged       = false;
+  pthread_mutex_unlock(&g_mutex);
   return &g_registry;
 }
 
 /**
- * @brief Close the sensor registry and reset its state
+ * @brief Close the sensor registry and release its memory
  * @param reg Pointer to the registry to close
  */
 void sensor_reg_close(sensor_registry_t *reg)
 {
-  reg->count = 0;
+  pthread_mutex_lock(&g_mutex);
+  sensor_reg_free(reg);
+  pthread_mutex_unlock(&g_mutex);
 }
 
 sensor_registry_t *sensor_reg_get()
@@ -31,43 +304,124 @@ sensor_registry_t *sensor_reg_get()
   return &g_registry;
 }
 
+/**
+ * @brief Read the size of a registry (safe from any thread)
+ *
+ * @param reg      Pointer to the sensor registry
+ * @param channels Set to the number of registered channels
+ * @param mem_used Set to the bytes allocated by the registry
+ */
+void sensor_reg_get_stats(sensor_registry_t *reg, size_t *channels,
+                          size_t *mem_used)
+{
+  pthread_mutex_lock(&g_mutex);
+  *channels = reg->count;
+  *mem_used = reg->mem_used;
+  pthread_mutex_unlock(&g_mutex);
+}
+
 /**
  * @brief Register a new sensor channel in the registry
  *
- * @param reg  Pointer to the sensor registry
- * @param name Unique name for the channel
- * @param type Sensor type to assign to the channel
+ * Lookups and insertions are O(1): channels are indexed by a hash of
+ * (device, name). The returned pointer stays valid until the registry is
+ * closed.
+ *
+ * @param reg    Pointer to the sensor registry
+ * @param device Device the channel belongs to
+ * @param name   Name of the channel, unique per device
+ * @param type   Sensor type to assign to the channel
  *
  * @return Pointer to the registered or existing channel, or NULL if the name
- *         is empty or the registry is full
+ *         is empty or the registry memory limit is reached
  */
-sensor_channel_t *sensor_channel_register(sensor_registry_t *reg,
-                                          const char *name, sensor_type_t type)
+sensor_reg_channel_t *sensor_channel_register(sensor_registry_t *reg,
+                                              const char        *device,
+                                              const char        *name,
+                                              sensor_type_t      type)
 {
-  sensor_channel_t *ch;
+  char                  key[SENSOR_DEVICE_MAX_LEN + SENSOR_NAME_MAX_LEN];
+  size_t                dev_len;
+  size_t                name_len;
+  size_t                len;
+  uint32_t              hash;
+  sensor_reg_slot_t    *slot;
+  sensor_reg_channel_t *ch;
 
-  if (!name || strlen(name) == 0) {
-    fprintf(stderr, "Channel name must not be empty\n");
+  if (!name || name[0] == '\0') {
+    LOG_WARN("Channel name must not be empty");
     return NULL;
   }
+  if (!device) {
+    device = "";
+  }
+
+  dev_len  = strnlen(device, SENSOR_DEVICE_MAX_LEN - 1);
+  name_len = strnlen(name, SENSOR_NAME_MAX_LEN - 1);
+  len      = dev_len + 1 + name_len;
+  memcpy(key, device, dev_len);
+  key[dev_len] = '\0';
+  memcpy(key + dev_len + 1, name, name_len);
+  key[len] = '\0';
+  hash     = sensor_hash_key(key, len);
 
-  for (size_t i = 0; i < reg->count; i++) {
-    if (strcmp(reg->channels[i].name, name) == 0) {
-      return &reg->channels[i];
+  pthread_mutex_lock(&g_mutex);
+
+  if (reg->slot_cap > 0) {
+    slot = sensor_reg_find(reg, key, len, hash);
+    if (slot->ref != 0) {
+      ch = sensor_reg_deref(reg, slot->ref);
+      pthread_mutex_unlock(&g_mutex);
+      return ch;
     }
   }
 
-  if (reg->count >= SENSOR_MAX_CHANNELS) {
-    fprintf(stderr, "Channel registry is full (max %i)", SENSOR_MAX_CHANNELS);
-    return NULL;
+  /* keep the load factor <= 1/2 */
+  if ((reg->count + 1) * 2 > reg->slot_cap &&
+      sensor_reg_grow(reg, &reg->slots, &reg->slot_cap) != 0) {
+    goto error;
   }
 
-  ch = &reg->channels[reg->count++];
+  uint32_t dev_ref = sensor_reg_device_get(reg, key, dev_len);
+  if (dev_ref == 0) {
+    goto error;
+  }
+
+  size_t size = sizeof(*ch) + len + 1;
+  if (type == SENSOR_TYPE_STRING) {
+    size += SENSOR_STRING_MAX_LEN;
+  }
+  uint32_t ref = sensor_arena_alloc(reg, size);
+  if (ref == 0) {
+    goto error;
+  }
+
+  ch = sensor_reg_deref(reg, ref);
   memset(ch, 0, sizeof(*ch));
-  strncpy(ch->name, name, SENSOR_NAME_MAX_LEN - 1);
-  ch->type      = type;
+  memcpy(ch->key, key, len + 1);
+  ch->key_len   = (uint16_t)len;
+  ch->type      = (uint8_t)type;
   ch->has_value = false;
+  if (type == SENSOR_TYPE_STRING) {
+    ch->value.s    = ch->key + len + 1;
+    ch->value.s[0] = '\0';
+  }
+
+  sensor_reg_device_t *dev = sensor_reg_device(reg, dev_ref);
+  ch->device = dev_ref;
+  ch->next   = dev->first;
+  dev->first = ref;
+
+  slot       = sensor_reg_find(reg, key, len, hash);
+  slot->hash = hash;
+  slot->ref  = ref;
+  reg->count++;
+  pthread_mutex_unlock(&g_mutex);
   return ch;
+
+error:
+  pthread_mutex_unlock(&g_mutex);
+  return NULL;
 }
 
 /**
@@ -76,16 +430,21 @@ sensor_channel_t *sensor_channel_register(sensor_registry_t *reg,
  * @param ch    Pointer to the sensor channel
  * @param value Float value to set
  *
- * @return 0 on success, -1 on failure
+ * @return 1 if the value changed, 0 if it did not, -1 on failure
  */
-int sensor_channel_update_float(sensor_channel_t *ch, float value)
+int sensor_channel_update_float(sensor_reg_channel_t *ch, float value)
 {
+  int changed;
+
   if (!ch || ch->type != SENSOR_TYPE_FLOAT) {
     return -1;
   }
+  pthread_mutex_lock(&g_mutex);
+  changed       = !ch->has_value || !(ch->value.f == value);
   ch->value.f   = value;
   ch->has_value = true;
-  return 0;
+  pthread_mutex_unlock(&g_mutex);
+  return changed;
 }
 
 /**
@@ -94,16 +453,21 @@ int sensor_channel_update_float(sensor_channel_t *ch, float value)
  * @param ch    Pointer to the sensor channel
  * @param value Integer value to set
  *
- * @return 0 on success, -1 on failure
+ * @return 1 if the value changed, 0 if it did not, -1 on failure
  */
-int sensor_channel_update_int(sensor_channel_t *ch, int value)
+int sensor_channel_update_int(sensor_reg_channel_t *ch, int value)
 {
+  int changed;
+
   if (!ch || ch->type != SENSOR_TYPE_INT) {
     return -1;
   }
+  pthread_mutex_lock(&g_mutex);
+  changed       = !ch->has_value || !(ch->value.i == value);
   ch->value.i   = value;
   ch->has_value = true;
-  return 0;
+  pthread_mutex_unlock(&g_mutex);
+  return changed;
 }
 
 /**
@@ -112,17 +476,23 @@ int sensor_channel_update_int(sensor_channel_t *ch, int value)
  * @param ch    Pointer to the sensor channel
  * @param value A pointer to a string to set
  *
- * @return 0 on success, -1 on failure
+ * @return 1 if the value changed, 0 if it did not, -1 on failure
  */
-int sensor_channel_update_string(sensor_channel_t *ch, const char *value)
+int sensor_channel_update_string(sensor_reg_channel_t *ch, const char *value)
 {
+  int changed;
+
   if (!ch || ch->type != SENSOR_TYPE_STRING || !value) {
     return -1;
   }
+  pthread_mutex_lock(&g_mutex);
+  changed = !ch->has_value ||
+            strncmp(ch->value.s, value, SENSOR_STRING_MAX_LEN - 1) != 0;
   strncpy(ch->value.s, value, SENSOR_STRING_MAX_LEN - 1);
   ch->value.s[SENSOR_STRING_MAX_LEN - 1] = '\0';
   ch->has_value = true;
-  return 0;
+  pthread_mutex_unlock(&g_mutex);
+  return changed;
 }
 
 /**
@@ -131,14 +501,164 @@ int sensor_channel_update_string(sensor_channel_t *ch, const char *value)
  * @param ch    Pointer to the sensor channel
  * @param value Boolean value to set
  *
- * @return 0 on success, -1 on failure
+ * @return 1 if the value changed, 0 if it did not, -1 on failure
  */
-int sensor_channel_update_bool(sensor_channel_t *ch, bool value)
+int sensor_channel_update_bool(sensor_reg_channel_t *ch, bool value)
 {
+  int changed;
+
   if (!ch || ch->type != SENSOR_TYPE_BOOL) {
     return -1;
   }
+  pthread_mutex_lock(&g_mutex);
+  changed       = !ch->has_value || !(ch->value.b == value);
   ch->value.b   = value;
   ch->has_value = true;
-  return 0;
+  pthread_mutex_unlock(&g_mutex);
+  return changed;
+}
+
+/**
+ * @brief Record that a value of the channel's device changed
+ *
+ * Bumps the device version and logs its number for
+ * sensor_device_changes(). Call it once per snapshot rather than once per
+ * changed channel.
+ *
+ * @param reg Pointer to the sensor registry
+ * @param ch  Any channel of the device
+ */
+void sensor_device_touch(sensor_registry_t          *reg,
+                         const sensor_reg_channel_t *ch)
+{
+  pthread_mutex_lock(&g_mutex);
+  sensor_reg_device_t *dev = sensor_reg_device(reg, ch->device);
+  dev->version++;
+  reg->changes[reg->change_seq & (SENSOR_REG_CHANGES - 1)] = dev->index;
+  reg->change_seq++;
+  pthread_mutex_unlock(&g_mutex);
+}
+
+/**
+ * @brief Number of devices known to the registry
+ * @param reg Pointer to the sensor registry
+ * @return Device count; devices are numbered from 0 in order of appearance
+ */
+size_t sensor_device_count(sensor_registry_t *reg)
+{
+  size_t count;
+
+  pthread_mutex_lock(&g_mutex);
+  count = reg->dev_count;
+  pthread_mutex_unlock(&g_mutex);
+  return count;
+}
+
+/**
+ * @brief Current version of a device, bumped by sensor_device_touch()
+ * @param reg   Pointer to the sensor registry
+ * @param index Device number
+ * @return Version, 0 if there is no such device
+ */
+uint32_t sensor_device_version(sensor_registry_t *reg, size_t index)
+{
+  uint32_t version = 0;
+
+  pthread_mutex_lock(&g_mutex);
+  if (index < reg->dev_count) {
+    version = sensor_reg_device(reg, reg->devices[index])->version;
+  }
+  pthread_mutex_unlock(&g_mutex);
+  return version;
+}
+
+/**
+ * @brief Copy the name of a device
+ *
+ * @param reg   Pointer to the sensor registry
+ * @param index Device number
+ * @param buf   Buffer receiving the NUL-terminated name
+ * @param len   Size of buf
+ *
+ * @return 0 on success, -1 if there is no such device or buf is too small
+ */
+int sensor_device_name(sensor_registry_t *reg, size_t index, char *buf,
+                       size_t len)
+{
+  int ret = -1;
+
+  pthread_mutex_lock(&g_mutex);
+  if (index < reg->dev_count) {
+    sensor_reg_device_t *dev = sensor_reg_device(reg, reg->devices[index]);
+    if (dev->key_len < len) {
+      memcpy(buf, dev->key, dev->key_len + 1);
+      ret = 0;
+    }
+  }
+  pthread_mutex_unlock(&g_mutex);
+  return ret;
+}
+
+/**
+ * @brief Call visit for every channel of a device, the registry locked so
+ *        the values read are consistent with the version returned
+ *
+ * @param reg   Pointer to the sensor registry
+ * @param index Device number
+ * @param visit Callback; it must not call back into the registry
+ * @param arg   Passed to visit
+ *
+ * @return Version of the device, 0 if there is no such device
+ */
+uint32_t sensor_device_visit(sensor_registry_t *reg, size_t index,
+                             sensor_channel_visit_t visit, void *arg)
+{
+  uint32_t version = 0;
+
+  pthread_mutex_lock(&g_mutex);
+  if (index < reg->dev_count) {
+    sensor_reg_device_t *dev = sensor_reg_device(reg, reg->devices[index]);
+
+    for (uint32_t ref = dev->first; ref != 0;) {
+      const sensor_reg_channel_t *ch = sensor_reg_deref(reg, ref);
+      visit(ch, arg);
+      ref = ch->next;
+    }
+    version = dev->version;
+  }
+  pthread_mutex_unlock(&g_mutex);
+  return version;
+}
+
+/**
+ * @brief Read the devices touched since a position of the change log
+ *
+ * A device touched several times is listed as many times.
+ *
+ * @param reg   Pointer to the sensor registry
+ * @param since Position of the reader, advanced past the entries returned
+ * @param out   Receives device numbers
+ * @param count In: capacity of out. Out: number of entries written.
+ *
+ * @return false if the reader fell behind and entries were lost: since is
+ *         then moved to the end of the log and nothing is returned
+ */
+bool sensor_device_changes(sensor_registry_t *reg, uint64_t *since,
+                           uint32_t *out, size_t *count)
+{
+  size_t n = 0;
+  bool   ok = true;
+
+  pthread_mutex_lock(&g_mutex);
+  if (reg->change_seq - *since > SENSOR_REG_CHANGES) {
+    *since = reg->change_seq;
+    ok     = false;
+  }
+  while (*since < reg->change_seq && n < *count) {
+    out[n++] = reg->changes[*since & (SENSOR_REG_CHANGES - 1)];
+    (*since)++;
+  }
+  pthread_mutex_unlock(&g_mutex);
+  *count = n;
+  return ok;
 }
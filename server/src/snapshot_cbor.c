@@ -0,0 +1,972 @@
+/*
+ * CBOR snapshot decoders
+ *
+ * Two binary encodings of a snapshot, both decoded in a single pass straight
+ * into a parsed_snapshot_t (no allocation):
+ *
+ *  - application/cbor (60): the JSON document as CBOR,
+ *      {"ts": int, "dev": tstr, "readings": [{"n": tstr, "t": uint, "v": any}]}
+ *    with the same field rules as parse_snapshot_json().
+ *
+ *  - application/senml+cbor (112): a SenML pack (RFC 8428), one record per
+ *    reading with integer labels. The reading type follows from the value
+ *    field: v as an integer is INT, v as a float is FLOAT, vs is STRING and
+ *    vb is BOOL. The base name is the device id ("dev" in the other
+ *    formats), the base value is honoured. bt carries the same clock as the
+ *    JSON 'ts' (device uptime), in seconds as SenML requires, and is
+ *    converted to ms: SenML relative times are not resolved against the
+ *    server clock.
+ *
+ * Both accept definite and indefinite length items, all integer and float
+ * widths, and ignore tags. Nesting is limited like the JSON parser.
+ */
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "sensor.h"
+#include "snapshot_parser.h"
+
+#define CBOR_NESTING_LIMIT 1000
+
+/* Keys we look for are short: only that many bytes of a key are kept */
+#define CBOR_KEY_MAX_LEN 16
+
+/* Argument of an indefinite length string, array or map */
+#define CBOR_INDEFINITE UINT64_MAX
+#define CBOR_BREAK      0xff
+
+enum {
+  CBOR_MAJOR_UINT = 0,
+  CBOR_MAJOR_NEGINT,
+  CBOR_MAJOR_BYTES,
+  CBOR_MAJOR_TEXT,
+  CBOR_MAJOR_ARRAY,
+  CBOR_MAJOR_MAP,
+  CBOR_MAJOR_TAG,
+  CBOR_MAJOR_SIMPLE,
+};
+
+/* SenML labels (RFC 8428, table 4) */
+enum {
+  SENML_BASE_VALUE = -5,
+  SENML_BASE_TIME  = -3,
+  SENML_BASE_NAME  = -2,
+  SENML_NAME       = 0,
+  SENML_VALUE      = 2,
+  SENML_STRING     = 3,
+  SENML_BOOL       = 4,
+  SENML_TIME       = 6,
+};
+
+typedef enum {
+  CBOR_VALUE_OTHER = 0, /* null, undefined, bytes, containers, ... */
+  CBOR_VALUE_INT,
+  CBOR_VALUE_FLOAT,
+  CBOR_VALUE_TEXT,
+  CBOR_VALUE_FALSE,
+  CBOR_VALUE_TRUE,
+} cbor_kind_t;
+
+typedef struct {
+  cbor_kind_t kind;
+  int64_t     i; /* CBOR_VALUE_INT */
+  double      d; /* CBOR_VALUE_INT and CBOR_VALUE_FLOAT */
+} cbor_value_t;
+
+typedef struct {
+  const uint8_t *p;
+  const uint8_t *end;
+  const uint8_t *start;
+  unsigned       depth;
+} cbor_cursor_t;
+
+/* Same truncation rule as json_str_t */
+typedef struct {
+  char  *buf;
+  size_t cap;
+} cbor_str_t;
+
+/* Reads the initial byte and argument of the next item. Floats keep their
+   raw bits in *arg. */
+static int cbor_head(cbor_cursor_t *c, unsigned *major, unsigned *info,
+                     uint64_t *arg)
+{
+  unsigned width;
+
+  if (c->p >= c->end) {
+    return -1;
+  }
+
+  *major = *c->p >> 5;
+  *info  = *c->p & 0x1f;
+  c->p++;
+
+  if (*info < 24) {
+    *arg = *info;
+    return 0;
+  }
+
+  if (*info == 31) {
+    /* break is handled by the container loops, never read as an item */
+    if (*major < CBOR_MAJOR_BYTES || *major > CBOR_MAJOR_MAP) {
+      return -1;
+    }
+    *arg = CBOR_INDEFINITE;
+    return 0;
+  }
+
+  if (*info > 27) {
+    return -1;
+  }
+
+  width = 1u << (*info - 24);
+  if ((size_t)(c->end - c->p) < width) {
+    return -1;
+  }
+
+  *arg = 0;
+  for (unsigned i = 0; i < width; i++) {
+    *arg = (*arg << 8) | *c->p++;
+  }
+  return 0;
+}
+
+static double half_to_double(uint16_t h)
+{
+  int    exp  = (h >> 10) & 0x1f;
+  int    mant = h & 0x3ff;
+  double val;
+
+  if (exp == 0) {
+    val = ldexp(mant, -24);
+  } else if (exp != 31) {
+    val = ldexp(mant + 1024, exp - 25);
+  } else {
+    val = mant == 0 ? INFINITY : NAN;
+  }
+  return h & 0x8000 ? -val : val;
+}
+
+/* Next element of a container with *remaining items left: false once the
+   container is exhausted (its break byte is consumed) */
+static bool cbor_next(cbor_cursor_t *c, uint64_t *remaining, int *err)
+{
+  if (*remaining == CBOR_INDEFINITE) {
+    if (c->p >= c->end) {
+      *err = -1;
+      return false;
+    }
+    if (*c->p == CBOR_BREAK) {
+      c->p++;
+      return false;
+    }
+    return true;
+  }
+
+  if (*remaining == 0) {
+    return false;
+  }
+  (*remaining)--;
+  return true;
+}
+
+static int cbor_enter(cbor_cursor_t *c)
+{
+  return ++c->depth > CBOR_NESTING_LIMIT ? -1 : 0;
+}
+
+/* Body of a text or byte string whose head has been read. Text is copied
+   into dst when given, chunks of an indefinite string are concatenated. */
+static int cbor_string(cbor_cursor_t *c, unsigned major, uint64_t len,
+                       cbor_str_t *dst)
+{
+  size_t   stored = 0;
+  uint64_t chunks = CBOR_INDEFINITE;
+  int      err    = 0;
+
+  if (len != CBOR_INDEFINITE) {
+    chunks = 1;
+  }
+
+  while (cbor_next(c, &chunks, &err)) {
+    if (chunks == CBOR_INDEFINITE) {
+      unsigned chunk_major;
+      unsigned info;
+
+      /* chunks are definite strings of the same major type */
+      if (cbor_head(c, &chunk_major, &info, &len) != 0 ||
+          chunk_major != major || len == CBOR_INDEFINITE) {
+        return -1;
+      }
+    }
+
+    if ((uint64_t)(c->end - c->p) < len) {
+      return -1;
+    }
+
+    if (dst && stored + 1 < dst->cap) {
+      size_t n = dst->cap - 1 - stored;
+
+      if (n > len) {
+        n = (size_t)len;
+      }
+      memcpy(dst->buf + stored, c->p, n);
+      stored += n;
+    }
+    c->p += len;
+  }
+
+  if (dst && dst->cap > 0) {
+    dst->buf[stored] = '\0';
+  }
+  return err;
+}
+
+/* Reads one item of any type. Scalars are decoded into *val, text is copied
+   into dst when given, everything else is skipped. */
+static int cbor_value(cbor_cursor_t *c, cbor_value_t *val, cbor_str_t *dst)
+{
+  unsigned major;
+  unsigned info;
+  uint64_t arg;
+  int      err = 0;
+
+  if (cbor_head(c, &major, &info, &arg) != 0) {
+    return -1;
+  }
+
+  val->kind = CBOR_VALUE_OTHER;
+
+  switch (major) {
+  case CBOR_MAJOR_UINT:
+    if (arg > INT64_MAX) {
+      val->kind = CBOR_VALUE_FLOAT;
+      val->d    = (double)arg;
+    } else {
+      val->kind = CBOR_VALUE_INT;
+      val->i    = (int64_t)arg;
+      val->d    = (double)val->i;
+    }
+    return 0;
+
+  case CBOR_MAJOR_NEGINT:
+    if (arg > INT64_MAX) {
+      val->kind = CBOR_VALUE_FLOAT;
+      val->d    = -1.0 - (double)arg;
+    } else {
+      val->kind = CBOR_VALUE_INT;
+      val->i    = -1 - (int64_t)arg;
+      val->d    = (double)val->i;
+    }
+    return 0;
+
+  case CBOR_MAJOR_BYTES:
+    return cbor_string(c, major, arg, NULL);
+
+  case CBOR_MAJOR_TEXT:
+    val->kind = CBOR_VALUE_TEXT;
+    return cbor_string(c, major, arg, dst);
+
+  case CBOR_MAJOR_ARRAY:
+  case CBOR_MAJOR_MAP:
+    if (cbor_enter(c) != 0) {
+      return -1;
+    }
+    if (major == CBOR_MAJOR_MAP && arg != CBOR_INDEFINITE) {
+      if (arg > UINT64_MAX / 2) {
+        return -1;
+      }
+      arg *= 2;
+    }
+    while (cbor_next(c, &arg, &err)) {
+      cbor_value_t skipped;
+
+      if (cbor_value(c, &skipped, NULL) != 0) {
+        return -1;
+      }
+    }
+    c->depth--;
+    return err;
+
+  case CBOR_MAJOR_TAG:
+    /* tags only annotate the item that follows */
+    if (cbor_enter(c) != 0 || cbor_value(c, val, dst) != 0) {
+      return -1;
+    }
+    c->depth--;
+    return 0;
+
+  default:
+    break;
+  }
+
+  switch (info) {
+  case 20:
+    val->kind = CBOR_VALUE_FALSE;
+    break;
+  case 21:
+    val->kind = CBOR_VALUE_TRUE;
+    break;
+  case 24:
+    /* two-byte encodings of the simple values 0..31 are not well-formed */
+    if (arg < 32) {
+      return -1;
+    }
+    break;
+  case 25:
+    val->kind = CBOR_VALUE_FLOAT;
+    val->d    = half_to_double((uint16_t)arg);
+    break;
+  case 26: {
+    uint32_t bits = (uint32_t)arg;
+    float    f;
+
+    memcpy(&f, &bits, sizeof(f));
+    val->kind = CBOR_VALUE_FLOAT;
+    val->d    = f;
+    break;
+  }
+  case 27:
+    val->kind = CBOR_VALUE_FLOAT;
+    memcpy(&val->d, &arg, sizeof(val->d));
+    break;
+  default:
+    break;
+  }
+  return 0;
+}
+
+static int cbor_skip(cbor_cursor_t *c)
+{
+  cbor_value_t val;
+
+  return cbor_value(c, &val, NULL);
+}
+
+/* Reads a map key: text keys land in key (empty for any other type), integer
+   keys in *label */
+static int cbor_key(cbor_cursor_t *c, char key[CBOR_KEY_MAX_LEN],
+                    int64_t *label, bool *is_label)
+{
+  cbor_value_t val;
+  cbor_str_t   dst = {key, CBOR_KEY_MAX_LEN};
+
+  *is_label = false;
+
+  if (cbor_value(c, &val, &dst) != 0) {
+    return -1;
+  }
+  if (val.kind != CBOR_VALUE_TEXT) {
+    key[0] = '\0';
+  }
+  if (val.kind == CBOR_VALUE_INT) {
+    *label    = val.i;
+    *is_label = true;
+  }
+  return 0;
+}
+
+static bool is_number(const cbor_value_t *v)
+{
+  return v->kind == CBOR_VALUE_INT || v->kind == CBOR_VALUE_FLOAT;
+}
+
+/* Opens the map or array the cursor is on */
+static int cbor_container(cbor_cursor_t *c, unsigned want, uint64_t *count)
+{
+  unsigned major;
+  unsigned info;
+
+  if (cbor_head(c, &major, &info, count) != 0 || cbor_enter(c) != 0) {
+    return -1;
+  }
+  if (major != want) {
+    return 1;
+  }
+  if (major == CBOR_MAJOR_MAP && *count != CBOR_INDEFINITE) {
+    if (*count > UINT64_MAX / 2) {
+      return -1;
+    }
+    *count *= 2;
+  }
+  return 0;
+}
+
+/* Peeks at the major type of the next item */
+static int cbor_peek(const cbor_cursor_t *c, unsigned *major)
+{
+  if (c->p >= c->end) {
+    return -1;
+  }
+  *major = *c->p >> 5;
+  return 0;
+}
+
+#define CBOR_WHO "parse_snapshot_cbor"
+
+/* One {"n", "t", "v"} map. Sets *ok when the reading is usable. */
+static int cbor_reading(cbor_cursor_t *c, parsed_reading_t *out, bool *ok)
+{
+  cbor_value_t n = {0};
+  cbor_value_t t = {0};
+  cbor_value_t v = {0};
+  bool         has_n = false;
+  bool         has_t = false;
+  bool         has_v = false;
+  char         v_str[SENSOR_STRING_MAX_LEN];
+  char         key[CBOR_KEY_MAX_LEN];
+  int64_t      label;
+  bool         is_label;
+  uint64_t     count;
+  int          err = 0;
+
+  *ok = false;
+  memset(out, 0, sizeof(*out));
+
+  if (cbor_container(c, CBOR_MAJOR_MAP, &count) != 0) {
+    return -1;
+  }
+
+  while (cbor_next(c, &count, &err)) {
+    if (cbor_key(c, key, &label, &is_label) != 0) {
+      return -1;
+    }
+    if (count != CBOR_INDEFINITE) {
+      count--;
+    }
+
+    if (!has_n && strcmp(key, "n") == 0) {
+      cbor_str_t dst = {out->name, SENSOR_NAME_MAX_LEN};
+      has_n          = true;
+      if (cbor_value(c, &n, &dst) != 0) {
+        return -1;
+      }
+    } else if (!has_t && strcmp(key, "t") == 0) {
+      has_t = true;
+      if (cbor_value(c, &t, NULL) != 0) {
+        return -1;
+      }
+    } else if (!has_v && strcmp(key, "v") == 0) {
+      cbor_str_t dst = {v_str, sizeof(v_str)};
+      has_v          = true;
+      if (cbor_value(c, &v, &dst) != 0) {
+        return -1;
+      }
+    } else if (cbor_skip(c) != 0) {
+      return -1;
+    }
+  }
+  if (err != 0) {
+    return -1;
+  }
+  c->depth--;
+
+  if (!has_n || n.kind != CBOR_VALUE_TEXT) {
+    out->name[0] = '\0';
+    parser_warn(CBOR_WHO, "reading missing 'n' field, skipping");
+    return 0;
+  }
+
+  if (!has_v || v.kind == CBOR_VALUE_OTHER) {
+    parser_warn(CBOR_WHO, "reading '%s' missing 'v' field, skipping",
+                out->name);
+    return 0;
+  }
+
+  if (!has_t || !is_number(&t)) {
+    parser_warn(CBOR_WHO, "reading '%s' missing or invalid 't' field, skipping",
+                out->name);
+    return 0;
+  }
+
+  int type_val = parser_to_int(t.d);
+  if (type_val < SENSOR_TYPE_FIRST || type_val >= SENSOR_TYPE_LAST) {
+    parser_warn(CBOR_WHO, "reading '%s' has unknown sensor type %d, skipping",
+                out->name, type_val);
+    return 0;
+  }
+
+  out->type  = (sensor_type_t)type_val;
+  double num = is_number(&v) ? v.d : 0.0;
+
+  switch (out->type) {
+  case SENSOR_TYPE_FLOAT:
+    out->value.f = (float)num;
+    break;
+  case SENSOR_TYPE_INT:
+    out->value.i = v.kind == CBOR_VALUE_INT ? parser_to_int((double)v.i)
+                                            : parser_to_int(num);
+    break;
+  case SENSOR_TYPE_STRING:
+    if (v.kind != CBOR_VALUE_TEXT) {
+      parser_warn(CBOR_WHO, "reading '%s' has a non-string 'v' field, skipping",
+                  out->name);
+      return 0;
+    }
+    memcpy(out->value.s, v_str, strlen(v_str) + 1);
+    break;
+  case SENSOR_TYPE_BOOL:
+    out->value.b = v.kind == CBOR_VALUE_TRUE;
+    break;
+  default:
+    break;
+  }
+
+  *ok = true;
+  return 0;
+}
+
+static int cbor_readings(cbor_cursor_t *c, parsed_snapshot_t *out)
+{
+  uint64_t count;
+  int      err = 0;
+
+  if (cbor_container(c, CBOR_MAJOR_ARRAY, &count) != 0) {
+    return -1;
+  }
+
+  while (cbor_next(c, &count, &err)) {
+    unsigned major;
+
+    if (cbor_peek(c, &major) != 0) {
+      return -1;
+    }
+
+    if (major != CBOR_MAJOR_MAP) {
+      parser_warn(CBOR_WHO, "reading missing 'n' field, skipping");
+      if (cbor_skip(c) != 0) {
+        return -1;
+      }
+      continue;
+    }
+
+    if (out->count >= SENSOR_MAX_READINGS) {
+      parser_warn(CBOR_WHO, "too many readings (max %d)", SENSOR_MAX_READINGS);
+      return -1;
+    }
+
+    bool ok;
+    if (cbor_reading(c, &out->readings[out->count], &ok) != 0) {
+      return -1;
+    }
+    if (ok) {
+      out->count++;
+    }
+  }
+
+  c->depth--;
+  return err;
+}
+
+/**
+ * @brief Parse a CBOR snapshot payload (Content-Format 60)
+ *
+ * Same document and same rules as parse_snapshot_json(), encoded as CBOR.
+ *
+ * @param buf Payload
+ * @param len Payload length
+ * @param out Filled with the readings and the snapshot timestamp
+ *
+ * @return 0 on success, -1 if the payload is not well-formed CBOR, lacks a
+ *         numeric 'ts' or a 'readings' array, or has too many readings
+ */
+int parse_snapshot_cbor(const uint8_t *buf, size_t len, parsed_snapshot_t *out)
+{
+  cbor_cursor_t c;
+  cbor_value_t  ts           = {0};
+  bool          has_ts       = false;
+  bool          has_readings = false;
+  bool          has_dev      = false;
+  bool          readings_ok  = false;
+  char          key[CBOR_KEY_MAX_LEN];
+  int64_t       label;
+  bool          is_label;
+  uint64_t      count;
+  int           err = 0;
+
+  if (!buf || len == 0 || !out) {
+    return -1;
+  }
+
+  /* readings are cleared one by one as they are parsed */
+  out->count        = 0;
+  out->timestamp_ms = 0;
+  out->device[0]    = '\0';
+
+  c.start = buf;
+  c.p     = buf;
+  c.end   = buf + len;
+  c.depth = 0;
+
+  switch (cbor_container(&c, CBOR_MAJOR_MAP, &count)) {
+  case 0:
+    break;
+  case 1:
+    parser_warn(CBOR_WHO, "missing or invalid 'ts' field");
+    return -1;
+  default:
+    goto malformed;
+  }
+
+  while (cbor_next(&c, &count, &err)) {
+    if (cbor_key(&c, key, &label, &is_label) != 0) {
+      goto malformed;
+    }
+    if (count != CBOR_INDEFINITE) {
+      count--;
+    }
+
+    if (!has_ts && strcmp(key, "ts") == 0) {
+      has_ts = true;
+      if (cbor_value(&c, &ts, NULL) != 0) {
+        goto malformed;
+      }
+    } else if (!has_dev && strcmp(key, "dev") == 0) {
+      cbor_value_t dev;
+      cbor_str_t   dst = {out->device, SENSOR_DEVICE_MAX_LEN};
+
+      has_dev = true;
+      if (cbor_value(&c, &dev, &dst) != 0) {
+        goto malformed;
+      }
+      if (dev.kind != CBOR_VALUE_TEXT) {
+        out->device[0] = '\0';
+      }
+    } else if (!has_readings && strcmp(key, "readings") == 0) {
+      unsigned major;
+
+      has_readings = true;
+      if (cbor_peek(&c, &major) != 0) {
+        goto malformed;
+      }
+      if (major == CBOR_MAJOR_ARRAY) {
+        readings_ok = true;
+        if (cbor_readings(&c, out) != 0) {
+          goto malformed;
+        }
+      } else if (cbor_skip(&c) != 0) {
+        goto malformed;
+      }
+    } else if (cbor_skip(&c) != 0) {
+      goto malformed;
+    }
+  }
+  if (err != 0) {
+    goto malformed;
+  }
+
+  if (!has_ts || !is_number(&ts)) {
+    parser_warn(CBOR_WHO, "missing or invalid 'ts' field");
+    return -1;
+  }
+  out->timestamp_ms =
+    ts.kind == CBOR_VALUE_INT ? ts.i : parser_to_int64(ts.d);
+
+  if (!readings_ok) {
+    parser_warn(CBOR_WHO, "missing or invalid 'readings' array");
+    return -1;
+  }
+  return 0;
+
+malformed:
+  parser_warn(CBOR_WHO, "CBOR parse failed at offset %zu",
+              (size_t)(c.p - c.start));
+  return -1;
+}
+
+#define SENML_WHO "parse_snapshot_senml"
+
+/* Base fields carry over from one record to the next */
+typedef struct {
+  char   name[SENSOR_DEVICE_MAX_LEN];
+  double time;
+  double value;
+  bool   has_time;
+} senml_base_t;
+
+/* One SenML record. Sets *ok when it holds a usable reading, *time to the
+   record's time when it has one. */
+static int senml_record(cbor_cursor_t *c, senml_base_t *base,
+                        parsed_reading_t *out, bool *ok, double *time,
+                        bool *has_time)
+{
+  cbor_value_t v = {0};
+  cbor_value_t t = {0};
+  cbor_value_t field;
+  bool         has_n = false;
+  bool         has_t = false;
+  bool         has_v = false;
+  bool         seen[SENML_TIME - SENML_BASE_VALUE + 1] = {false};
+  sensor_type_t type = SENSOR_TYPE_FLOAT;
+  char         name[SENSOR_NAME_MAX_LEN];
+  char         str[SENSOR_STRING_MAX_LEN];
+  char         key[CBOR_KEY_MAX_LEN];
+  int64_t      label;
+  bool         is_label;
+  uint64_t     count;
+  int          err = 0;
+
+  *ok       = false;
+  *has_time = false;
+  name[0]   = '\0';
+
+  if (cbor_container(c, CBOR_MAJOR_MAP, &count) != 0) {
+    return -1;
+  }
+
+  while (cbor_next(c, &count, &err)) {
+    if (cbor_key(c, key, &label, &is_label) != 0) {
+      return -1;
+    }
+    if (count != CBOR_INDEFINITE) {
+      count--;
+    }
+
+    /* unknown and repeated labels are skipped, the first one wins */
+    if (!is_label || label < SENML_BASE_VALUE || label > SENML_TIME ||
+        seen[label - SENML_BASE_VALUE]) {
+      if (cbor_skip(c) != 0) {
+        return -1;
+      }
+      continue;
+    }
+    seen[label - SENML_BASE_VALUE] = true;
+
+    switch (label) {
+    case SENML_BASE_NAME: {
+      cbor_str_t dst = {base->name, sizeof(base->name)};
+      if (cbor_value(c, &field, &dst) != 0) {
+        return -1;
+      }
+      if (field.kind != CBOR_VALUE_TEXT) {
+        base->name[0] = '\0';
+      }
+      break;
+    }
+    case SENML_BASE_TIME:
+      if (cbor_value(c, &field, NULL) != 0) {
+        return -1;
+      }
+      if (is_number(&field)) {
+        base->time     = field.d;
+        base->has_time = true;
+      }
+      break;
+    case SENML_BASE_VALUE:
+      if (cbor_value(c, &field, NULL) != 0) {
+        return -1;
+      }
+      base->value = is_number(&field) ? field.d : 0.0;
+      break;
+    case SENML_NAME: {
+      cbor_str_t dst = {name, sizeof(name)};
+      if (cbor_value(c, &field, &dst) != 0) {
+        return -1;
+      }
+      has_n = field.kind == CBOR_VALUE_TEXT;
+      break;
+    }
+    case SENML_TIME:
+      if (cbor_value(c, &t, NULL) != 0) {
+        return -1;
+      }
+      has_t = is_number(&t);
+      break;
+    case SENML_VALUE:
+    case SENML_STRING:
+    case SENML_BOOL: {
+      cbor_str_t dst = {str, sizeof(str)};
+
+      /* a record holds one value, extra value fields are ignored */
+      if (has_v) {
+        if (cbor_skip(c) != 0) {
+          return -1;
+        }
+        break;
+      }
+      if (cbor_value(c, &v, &dst) != 0) {
+        return -1;
+      }
+      if (label == SENML_VALUE && is_number(&v)) {
+        type  = v.kind == CBOR_VALUE_INT ? SENSOR_TYPE_INT : SENSOR_TYPE_FLOAT;
+        has_v = true;
+      } else if (label == SENML_STRING && v.kind == CBOR_VALUE_TEXT) {
+        type  = SENSOR_TYPE_STRING;
+        has_v = true;
+      } else if (label == SENML_BOOL &&
+                 (v.kind == CBOR_VALUE_TRUE || v.kind == CBOR_VALUE_FALSE)) {
+        type  = SENSOR_TYPE_BOOL;
+        has_v = true;
+      }
+      break;
+    }
+    default:
+      if (cbor_skip(c) != 0) {
+        return -1;
+      }
+      break;
+    }
+  }
+  if (err != 0) {
+    return -1;
+  }
+  c->depth--;
+
+  if (base->has_time || has_t) {
+    *time     = (base->has_time ? base->time : 0.0) + (has_t ? t.d : 0.0);
+    *has_time = true;
+  }
+
+  /* a record with no value only sets base fields */
+  if (!has_v) {
+    return 0;
+  }
+
+  memset(out, 0, sizeof(*out));
+  if (has_n) {
+    memcpy(out->name, name, strlen(name) + 1);
+  }
+  if (out->name[0] == '\0') {
+    parser_warn(SENML_WHO, "reading missing 'n' field, skipping");
+    return 0;
+  }
+
+  out->type = type;
+  switch (type) {
+  case SENSOR_TYPE_FLOAT:
+    out->value.f = (float)(base->value + v.d);
+    break;
+  case SENSOR_TYPE_INT:
+    out->value.i = parser_to_int((double)v.i + base->value);
+    break;
+  case SENSOR_TYPE_STRING:
+    memcpy(out->value.s, str, strlen(str) + 1);
+    break;
+  case SENSOR_TYPE_BOOL:
+    out->value.b = v.kind == CBOR_VALUE_TRUE;
+    break;
+  default:
+    break;
+  }
+
+  *ok = true;
+  return 0;
+}
+
+/**
+ * @brief Parse a SenML-CBOR snapshot payload (Content-Format 112)
+ *
+ * Records without a value only update the base fields. The snapshot
+ * timestamp is the time of the first record that has one, the device is the
+ * base name of the first reading; readings under another base name are
+ * skipped.
+ *
+ * @param buf Payload
+ * @param len Payload length
+ * @param out Filled with the readings and the snapshot timestamp
+ *
+ * @return 0 on success, -1 if the payload is not a well-formed SenML pack,
+ *         carries no time at all or has more than SENSOR_MAX_READINGS readings
+ */
+int parse_snapshot_senml(const uint8_t *buf, size_t len,
+                         parsed_snapshot_t *out)
+{
+  cbor_cursor_t c;
+  senml_base_t  base      = {0};
+  bool          has_ts     = false;
+  bool          has_device = false;
+  uint64_t      count;
+  int           err = 0;
+
+  if (!buf || len == 0 || !out) {
+    return -1;
+  }
+
+  /* readings are cleared one by one as they are parsed */
+  out->count        = 0;
+  out->timestamp_ms = 0;
+  out->device[0]    = '\0';
+
+  c.start = buf;
+  c.p     = buf;
+  c.end   = buf + len;
+  c.depth = 0;
+
+  switch (cbor_container(&c, CBOR_MAJOR_ARRAY, &count)) {
+  case 0:
+    break;
+  case 1:
+    parser_warn(SENML_WHO, "not a SenML pack");
+    return -1;
+  default:
+    goto malformed;
+  }
+
+  while (cbor_next(&c, &count, &err)) {
+    parsed_reading_t  scratch;
+    parsed_reading_t *dst = &scratch;
+    unsigned          major;
+    double            time;
+    bool              has_time;
+    bool              ok;
+
+    if (cbor_peek(&c, &major) != 0) {
+      goto malformed;
+    }
+    if (major != CBOR_MAJOR_MAP) {
+      parser_warn(SENML_WHO, "record is not a map, skipping");
+      if (cbor_skip(&c) != 0) {
+        goto malformed;
+      }
+      continue;
+    }
+
+    /* records that only set base fields are still accepted once full */
+    if (out->count < SENSOR_MAX_READINGS) {
+      dst = &out->readings[out->count];
+    }
+    if (senml_record(&c, &base, dst, &ok, &time, &has_time) != 0) {
+      goto malformed;
+    }
+
+    if (has_time && !has_ts) {
+      out->timestamp_ms = parser_to_int64(round(time * 1000.0));
+      has_ts            = true;
+    }
+
+    /* the base name in effect for the first reading names the device, a
+       pack is one snapshot of one device */
+    if (ok && !has_device) {
+      memcpy(out->device, base.name, sizeof(out->device));
+      has_device = true;
+    } else if (ok && strcmp(out->device, base.name) != 0) {
+      parser_warn(SENML_WHO, "reading '%s' of another device '%s', skipping",
+                  dst->name, base.name);
+      ok = false;
+    }
+
+    if (ok && dst == &scratch) {
+      parser_warn(SENML_WHO, "too many readings (max %d)", SENSOR_MAX_READINGS);
+      return -1;
+    }
+    if (ok) {
+      out->count++;
+    }
+  }
+  if (err != 0) {
+    goto malformed;
+  }
+
+  if (!has_ts) {
+    parser_warn(SENML_WHO, "missing or invalid 'bt' field");
+    return -1;
+  }
+  return 0;
+
+malformed:
+  parser_warn(SENML_WHO, "CBOR parse failed at offset %zu",
+              (size_t)(c.p - c.start));
+  return -1;
+}
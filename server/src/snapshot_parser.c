@@ -1,137 +1,709 @@
-#include <cjson/cJSON.h>
+/*
+ * Single-pass snapshot parser
+ *
+ * Parses {"ts": <number>, "dev": <string>,
+ *         "readings": [{"n": .., "t": .., "v": ..}, ...]}
+ * ("dev" is optional)
+ * straight from the payload buffer into a parsed_snapshot_t: no DOM, no heap
+ * allocation, every byte is looked at once. The whole document is still
+ * validated, with the same rules as the cJSON parser it replaces, so a
+ * payload is accepted or rejected exactly as before:
+ *  - the first occurrence of a duplicated key wins, later ones are skipped
+ *  - any bytes after the root value are ignored
+ *  - numbers are whatever strtod() accepts out of [0-9+-.eE], starting with
+ *    '-' or a digit, at most 63 characters
+ *  - nesting deeper than PARSER_NESTING_LIMIT is an error
+ */
+#include <limits.h>
 #include <stdarg.h>
+#include <stdbool.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 
+#include "log.h"
 #include "sensor.h"
 #include "snapshot_parser.h"
 
-static void log_error(const char *fmt, ...)
+/* Same as CJSON_NESTING_LIMIT */
+#define PARSER_NESTING_LIMIT 1000
+
+/* Longest number cJSON would hand to strtod() */
+#define PARSER_NUMBER_MAX_LEN 63
+
+/* Keys we look for are short: only that many bytes of a key are kept */
+#define PARSER_KEY_MAX_LEN 16
+
+typedef enum {
+  JSON_NULL,
+  JSON_FALSE,
+  JSON_TRUE,
+  JSON_NUMBER,
+  JSON_STRING,
+  JSON_ARRAY,
+  JSON_OBJECT,
+} json_type_t;
+
+typedef struct {
+  const char *p;
+  const char *end;
+  const char *start;
+  unsigned    depth;
+} json_cursor_t;
+
+/* Destination of a decoded string: decoding goes on past cap (the string is
+   still validated) but only the first cap - 1 bytes are stored */
+typedef struct {
+  char  *buf;
+  size_t cap;
+} json_str_t;
+
+#define JSON_WHO "parse_snapshot_json"
+
+/* Malformed payloads come from the devices: warnings, rate limited as one
+   call site across all the decoders */
+void parser_warn(const char *who, const char *fmt, ...)
 {
   va_list args;
+  char    msg[LOG_LINE_MAX];
 
+  if (LOG_LEVEL_WARN > LOG_LEVEL_MAX || LOG_LEVEL_WARN > g_log_level) {
+    return;
+  }
   va_start(args, fmt);
-  fprintf(stderr, "parse_snapshot_json: ");
-  fprintf(stderr, fmt, args);
-  fprintf(stderr, "\n");
+  vsnprintf(msg, sizeof(msg), fmt, args);
   va_end(args);
+  LOG_WARN("%s: %s", who, msg);
+}
+
+static void skip_ws(json_cursor_t *c)
+{
+  /* cJSON treats every byte <= ' ' as whitespace */
+  while (c->p < c->end && (unsigned char)*c->p <= ' ') {
+    c->p++;
+  }
+}
+
+static bool consume(json_cursor_t *c, char ch)
+{
+  skip_ws(c);
+  if (c->p < c->end && *c->p == ch) {
+    c->p++;
+    return true;
+  }
+  return false;
+}
+
+static int hex4(const char *s, unsigned *out)
+{
+  unsigned v = 0;
+
+  for (int i = 0; i < 4; i++) {
+    char ch = s[i];
+
+    v <<= 4;
+    if (ch >= '0' && ch <= '9') {
+      v |= (unsigned)(ch - '0');
+    } else if (ch >= 'a' && ch <= 'f') {
+      v |= (unsigned)(ch - 'a' + 10);
+    } else if (ch >= 'A' && ch <= 'F') {
+      v |= (unsigned)(ch - 'A' + 10);
+    } else {
+      return -1;
+    }
+  }
+  *out = v;
+  return 0;
+}
+
+static void str_put(json_str_t *dst, size_t *len, char ch)
+{
+  if (dst && *len + 1 < dst->cap) {
+    dst->buf[*len] = ch;
+  }
+  (*len)++;
 }
 
-static int parse_sensor_type(const cJSON *item, const char *name,
-                             sensor_type_t *out_type)
+/* \uXXXX (and its low surrogate if any) at s, with s < end. Returns the
+   number of input bytes used, or -1. */
+static int decode_utf16(const char *s, const char *end, json_str_t *dst,
+                        size_t *len)
 {
-  const cJSON *t = cJSON_GetObjectItemCaseSensitive(item, "t");
-  if (!cJSON_IsNumber(t)) {
-    log_error("reading '%s' missing or invalid 't' field, skipping", name);
+  unsigned cp;
+  unsigned lo;
+  int      used = 6;
+
+  if (end - s < 6 || hex4(s + 2, &cp) != 0) {
+    return -1;
+  }
+  if (cp >= 0xDC00 && cp <= 0xDFFF) {
     return -1;
   }
+  if (cp >= 0xD800 && cp <= 0xDBFF) {
+    if (end - s < 12 || s[6] != '\\' || s[7] != 'u' ||
+        hex4(s + 8, &lo) != 0 || lo < 0xDC00 || lo > 0xDFFF) {
+      return -1;
+    }
+    cp   = 0x10000 + (((cp & 0x3FF) << 10) | (lo & 0x3FF));
+    used = 12;
+  }
 
-  int type_val = t->valueint;
-  if (type_val < SENSOR_TYPE_FIRST || type_val >= SENSOR_TYPE_LAST) {
-    log_error("reading '%s' has unknown sensor type %d, skipping", name,
-              type_val);
+  if (cp < 0x80) {
+    str_put(dst, len, (char)cp);
+  } else if (cp < 0x800) {
+    str_put(dst, len, (char)(0xC0 | (cp >> 6)));
+    str_put(dst, len, (char)(0x80 | (cp & 0x3F)));
+  } else if (cp < 0x10000) {
+    str_put(dst, len, (char)(0xE0 | (cp >> 12)));
+    str_put(dst, len, (char)(0x80 | ((cp >> 6) & 0x3F)));
+    str_put(dst, len, (char)(0x80 | (cp & 0x3F)));
+  } else {
+    str_put(dst, len, (char)(0xF0 | (cp >> 18)));
+    str_put(dst, len, (char)(0x80 | ((cp >> 12) & 0x3F)));
+    str_put(dst, len, (char)(0x80 | ((cp >> 6) & 0x3F)));
+    str_put(dst, len, (char)(0x80 | (cp & 0x3F)));
+  }
+  return used;
+}
+
+/* Cursor on the opening quote. dst may be NULL to only validate. */
+static int parse_string(json_cursor_t *c, json_str_t *dst)
+{
+  const char *s   = c->p + 1;
+  const char *end = s;
+  size_t      len = 0;
+
+  /* find the closing quote first, like cJSON, so escapes are only decoded
+     within the string bounds */
+  while (end < c->end && *end != '"') {
+    if (*end == '\\') {
+      if (end + 1 >= c->end) {
+        return -1;
+      }
+      end++;
+    }
+    end++;
+  }
+  if (end >= c->end) {
     return -1;
   }
 
-  *out_type = (sensor_type_t)type_val;
+  while (s < end) {
+    if (*s != '\\') {
+      str_put(dst, &len, *s++);
+      continue;
+    }
+
+    switch (s[1]) {
+    case 'b':
+      str_put(dst, &len, '\b');
+      break;
+    case 'f':
+      str_put(dst, &len, '\f');
+      break;
+    case 'n':
+      str_put(dst, &len, '\n');
+      break;
+    case 'r':
+      str_put(dst, &len, '\r');
+      break;
+    case 't':
+      str_put(dst, &len, '\t');
+      break;
+    case '"':
+    case '\\':
+    case '/':
+      str_put(dst, &len, s[1]);
+      break;
+    case 'u': {
+      int used = decode_utf16(s, end, dst, &len);
+      if (used < 0) {
+        return -1;
+      }
+      s += used;
+      continue;
+    }
+    default:
+      return -1;
+    }
+    s += 2;
+  }
+
+  if (dst && dst->cap > 0) {
+    dst->buf[len < dst->cap ? len : dst->cap - 1] = '\0';
+  }
+  c->p = end + 1;
   return 0;
 }
 
-static int parse_reading(const cJSON *item, parsed_reading_t *out)
+static int parse_number(json_cursor_t *c, double *out)
 {
-  const cJSON *n = cJSON_GetObjectItemCaseSensitive(item, "n");
-  if (!cJSON_IsString(n) || n->valuestring == NULL) {
-    log_error("reading missing 'n' field, skipping");
+  char        tmp[PARSER_NUMBER_MAX_LEN + 1];
+  const char *s       = c->p;
+  size_t      n       = 0;
+  bool        integer = true;
+  int64_t     acc     = 0;
+
+  while (s + n < c->end && n < PARSER_NUMBER_MAX_LEN) {
+    char ch = s[n];
+
+    if (ch >= '0' && ch <= '9') {
+      if (n < 16) { /* longer ones miss the fast path, and would overflow */
+        acc = acc * 10 + (ch - '0');
+      }
+    } else if (ch == '-' && n == 0) {
+      /* sign of a plain integer */
+    } else if (ch == '+' || ch == '-' || ch == '.' || ch == 'e' ||
+               ch == 'E') {
+      integer = false;
+    } else {
+      break;
+    }
+    n++;
+  }
+
+  /* fast path: plain integers that a double represents exactly */
+  if (integer && n > (s[0] == '-' ? 1u : 0u) && n <= 16) {
+    *out = (double)(s[0] == '-' ? -acc : acc);
+    c->p += n;
+    return 0;
+  }
+
+  char *stop;
+  memcpy(tmp, s, n);
+  tmp[n] = '\0';
+  *out   = strtod(tmp, &stop);
+  if (stop == tmp) {
     return -1;
   }
+  c->p += stop - tmp;
+  return 0;
+}
+
+int parser_to_int(double d)
+{
+  if (d >= INT_MAX) {
+    return INT_MAX;
+  }
+  if (d <= (double)INT_MIN) {
+    return INT_MIN;
+  }
+  return (int)d;
+}
+
+int64_t parser_to_int64(double d)
+{
+  if (d >= (double)INT64_MAX) {
+    return INT64_MAX;
+  }
+  if (d <= (double)INT64_MIN) {
+    return INT64_MIN;
+  }
+  return (int64_t)d;
+}
+
+static int skip_value(json_cursor_t *c);
 
-  const cJSON *v = cJSON_GetObjectItemCaseSensitive(item, "v");
-  if (!cJSON_IsNumber(v) && !cJSON_IsString(v) && !cJSON_IsBool(v)) {
-    log_error("reading '%s' missing 'v' field, skipping", n->valuestring);
+/* Cursor on '[' or '{'. Validates and skips the whole container. */
+static int skip_container(json_cursor_t *c, char close, bool object)
+{
+  if (++c->depth > PARSER_NESTING_LIMIT) {
     return -1;
   }
+  c->p++;
+
+  if (!consume(c, close)) {
+    do {
+      if (object) {
+        skip_ws(c);
+        if (c->p >= c->end || *c->p != '"' || parse_string(c, NULL) != 0 ||
+            !consume(c, ':')) {
+          return -1;
+        }
+      }
+      if (skip_value(c) != 0) {
+        return -1;
+      }
+    } while (consume(c, ','));
+
+    if (!consume(c, close)) {
+      return -1;
+    }
+  }
 
-  sensor_type_t type;
-  if (parse_sensor_type(item, n->valuestring, &type) != 0) {
+  c->depth--;
+  return 0;
+}
+
+/*
+ * Parse the value under the cursor. Scalars are decoded into *num / *str
+ * when given; containers are only validated, callers that care about their
+ * content check for '[' / '{' before calling this.
+ */
+static int parse_value(json_cursor_t *c, json_type_t *type, double *num,
+                       json_str_t *str)
+{
+  skip_ws(c);
+  if (c->p >= c->end) {
+    return -1;
+  }
+
+  switch (*c->p) {
+  case '"':
+    *type = JSON_STRING;
+    return parse_string(c, str);
+  case '{':
+    *type = JSON_OBJECT;
+    return skip_container(c, '}', true);
+  case '[':
+    *type = JSON_ARRAY;
+    return skip_container(c, ']', false);
+  case 'n':
+    *type = JSON_NULL;
+    if (c->end - c->p >= 4 && strncmp(c->p, "null", 4) == 0) {
+      c->p += 4;
+      return 0;
+    }
+    return -1;
+  case 't':
+    *type = JSON_TRUE;
+    if (c->end - c->p >= 4 && strncmp(c->p, "true", 4) == 0) {
+      c->p += 4;
+      return 0;
+    }
+    return -1;
+  case 'f':
+    *type = JSON_FALSE;
+    if (c->end - c->p >= 5 && strncmp(c->p, "false", 5) == 0) {
+      c->p += 5;
+      return 0;
+    }
+    return -1;
+  default:
+    if (*c->p == '-' || (*c->p >= '0' && *c->p <= '9')) {
+      double tmp;
+      *type = JSON_NUMBER;
+      return parse_number(c, num ? num : &tmp);
+    }
+    return -1;
+  }
+}
+
+static int skip_value(json_cursor_t *c)
+{
+  json_type_t type;
+
+  return parse_value(c, &type, NULL, NULL);
+}
+
+/* Object member key under the cursor, decoded into key. A longer key is
+   truncated, which can never turn it into one of the short keys we match. */
+static int parse_key(json_cursor_t *c, char key[PARSER_KEY_MAX_LEN])
+{
+  json_str_t dst = {key, PARSER_KEY_MAX_LEN};
+
+  skip_ws(c);
+  if (c->p >= c->end || *c->p != '"' || parse_string(c, &dst) != 0) {
     return -1;
   }
+  return consume(c, ':') ? 0 : -1;
+}
+
+/* First occurrence of each field of a reading object */
+typedef struct {
+  bool        has_n;
+  bool        has_t;
+  bool        has_v;
+  json_type_t n_type;
+  json_type_t t_type;
+  json_type_t v_type;
+  double      t;
+  double      v;
+  char        v_str[SENSOR_STRING_MAX_LEN];
+} reading_fields_t;
+
+static void apply_reading(const reading_fields_t *f, parsed_reading_t *out,
+                          bool *ok)
+{
+  *ok = false;
+
+  if (!f->has_n || f->n_type != JSON_STRING) {
+    parser_warn(JSON_WHO, "reading missing 'n' field, skipping");
+    return;
+  }
+
+  if (!f->has_v || (f->v_type != JSON_NUMBER && f->v_type != JSON_STRING &&
+                    f->v_type != JSON_TRUE && f->v_type != JSON_FALSE)) {
+    parser_warn(JSON_WHO, "reading '%s' missing 'v' field, skipping",
+                out->name);
+    return;
+  }
+
+  if (!f->has_t || f->t_type != JSON_NUMBER) {
+    parser_warn(JSON_WHO, "reading '%s' missing or invalid 't' field, skipping",
+                out->name);
+    return;
+  }
 
-  strncpy(out->name, n->valuestring, SENSOR_NAME_MAX_LEN - 1);
-  out->name[SENSOR_NAME_MAX_LEN - 1] = '\0';
-  out->type                          = type;
+  int type_val = parser_to_int(f->t);
+  if (type_val < SENSOR_TYPE_FIRST || type_val >= SENSOR_TYPE_LAST) {
+    parser_warn(JSON_WHO, "reading '%s' has unknown sensor type %d, skipping",
+                out->name, type_val);
+    return;
+  }
+
+  out->type = (sensor_type_t)type_val;
 
-  switch (type) {
+  /* non-number values read as 0 for numeric types, like cJSON's
+     valuedouble / valueint */
+  double num = f->v_type == JSON_NUMBER ? f->v : 0.0;
+
+  switch (out->type) {
   case SENSOR_TYPE_FLOAT:
-    out->value.f = (float)v->valuedouble;
+    out->value.f = (float)num;
     break;
   case SENSOR_TYPE_INT:
-    out->value.i = v->valueint;
+    out->value.i = parser_to_int(num);
     break;
   case SENSOR_TYPE_STRING:
-    strncpy(out->value.s, v->valuestring, SENSOR_STRING_MAX_LEN - 1);
-    out->value.s[SENSOR_STRING_MAX_LEN - 1] = '\0';
+    if (f->v_type != JSON_STRING) {
+      parser_warn(JSON_WHO, "reading '%s' has a non-string 'v' field, skipping",
+                  out->name);
+      return;
+    }
+    memcpy(out->value.s, f->v_str, sizeof(out->value.s));
     break;
   case SENSOR_TYPE_BOOL:
-    out->value.b = cJSON_IsTrue(v);
+    out->value.b = f->v_type == JSON_TRUE;
     break;
   default:
     break;
   }
 
-  return 0;
+  *ok = true;
 }
 
-static int parse_readings_array(const cJSON *readings, parsed_snapshot_t *out)
+/* Cursor on the '{' of a reading. Fills out and sets *ok when the reading is
+   usable; returns -1 only if the document itself is malformed. */
+static int parse_reading(json_cursor_t *c, parsed_reading_t *out, bool *ok)
 {
-  const cJSON *item = NULL;
-  cJSON_ArrayForEach(item, readings)
-  {
-    if (out->count >= SENSOR_MAX_CHANNELS) {
-      log_error("too many readings, truncating");
-      break;
+  reading_fields_t f = {0};
+  char             key[PARSER_KEY_MAX_LEN];
+
+  if (++c->depth > PARSER_NESTING_LIMIT) {
+    return -1;
+  }
+  c->p++;
+
+  memset(out, 0, sizeof(*out));
+
+  if (!consume(c, '}')) {
+    do {
+      if (parse_key(c, key) != 0) {
+        return -1;
+      }
+
+      if (!f.has_n && strcmp(key, "n") == 0) {
+        json_str_t dst = {out->name, SENSOR_NAME_MAX_LEN};
+        f.has_n        = true;
+        if (parse_value(c, &f.n_type, NULL, &dst) != 0) {
+          return -1;
+        }
+      } else if (!f.has_t && strcmp(key, "t") == 0) {
+        f.has_t = true;
+        if (parse_value(c, &f.t_type, &f.t, NULL) != 0) {
+          return -1;
+        }
+      } else if (!f.has_v && strcmp(key, "v") == 0) {
+        json_str_t dst = {f.v_str, SENSOR_STRING_MAX_LEN};
+        f.has_v        = true;
+        if (parse_value(c, &f.v_type, &f.v, &dst) != 0) {
+          return -1;
+        }
+      } else if (skip_value(c) != 0) {
+        return -1;
+      }
+    } while (consume(c, ','));
+
+    if (!consume(c, '}')) {
+      return -1;
     }
+  }
+  c->depth--;
+
+  if (f.n_type != JSON_STRING) {
+    out->name[0] = '\0';
+  }
+  apply_reading(&f, out, ok);
+  return 0;
+}
+
+/* Cursor on the '[' of the readings array */
+static int parse_readings_array(json_cursor_t *c, parsed_snapshot_t *out)
+{
+  if (++c->depth > PARSER_NESTING_LIMIT) {
+    return -1;
+  }
+  c->p++;
+
+  if (!consume(c, ']')) {
+    do {
+      skip_ws(c);
+      if (c->p >= c->end) {
+        return -1;
+      }
 
-    if (parse_reading(item, &out->readings[out->count]) == 0) {
-      out->count++;
+      if (*c->p != '{') {
+        /* non-object items have no 'n' field, same message as cJSON path */
+        parser_warn(JSON_WHO, "reading missing 'n' field, skipping");
+        if (skip_value(c) != 0) {
+          return -1;
+        }
+        continue;
+      }
+
+      if (out->count >= SENSOR_MAX_READINGS) {
+        parser_warn(JSON_WHO, "too many readings (max %d)",
+                    SENSOR_MAX_READINGS);
+        return -1;
+      }
+
+      bool ok;
+      if (parse_reading(c, &out->readings[out->count], &ok) != 0) {
+        return -1;
+      }
+      if (ok) {
+        out->count++;
+      }
+    } while (consume(c, ','));
+
+    if (!consume(c, ']')) {
+      return -1;
     }
   }
 
+  c->depth--;
   return 0;
 }
 
+/**
+ * @brief Parse a JSON snapshot payload
+ *
+ * Invalid readings are skipped. A snapshot with more than
+ * SENSOR_MAX_READINGS readings is rejected as a whole rather than truncated.
+ * The buffer does not need to be NUL terminated.
+ *
+ * @param buf Payload
+ * @param len Payload length
+ * @param out Filled with the readings and the snapshot timestamp
+ *
+ * @return 0 on success, -1 if the payload is not valid JSON, lacks a
+ *         numeric 'ts' or a 'readings' array, or has too many readings
+ */
 int parse_snapshot_json(const char *buf, size_t len, parsed_snapshot_t *out)
 {
+  json_cursor_t c;
+  char          key[PARSER_KEY_MAX_LEN];
+  bool          has_ts       = false;
+  bool          has_readings = false;
+  bool          has_dev      = false;
+  json_type_t   ts_type      = JSON_NULL;
+  double        ts           = 0;
+  bool          readings_ok  = false;
+
   if (!buf || len == 0 || !out) {
     return -1;
   }
 
-  memset(out, 0, sizeof(*out));
+  /* readings are cleared one by one as they are parsed */
+  out->count        = 0;
+  out->timestamp_ms = 0;
+  out->device[0]    = '\0';
 
-  cJSON *root = cJSON_ParseWithLength(buf, len);
-  if (!root) {
-    const char *err = cJSON_GetErrorPtr();
-    log_error("JSON parse failed near: %s", err ? err : "unknown");
-    return -1;
+  c.start = buf;
+  c.p     = buf;
+  c.end   = buf + len;
+  c.depth = 0;
+
+  if (len >= 3 && memcmp(buf, "\xEF\xBB\xBF", 3) == 0) {
+    c.p += 3;
   }
 
-  const cJSON *ts = cJSON_GetObjectItemCaseSensitive(root, "ts");
-  if (!cJSON_IsNumber(ts)) {
-    log_error("missing or invalid 'ts' field");
-    cJSON_Delete(root);
+  skip_ws(&c);
+  if (c.p >= c.end) {
+    goto malformed;
+  }
+
+  if (*c.p != '{') {
+    /* valid JSON but not an object: there is no 'ts' to find */
+    if (skip_value(&c) != 0) {
+      goto malformed;
+    }
+    parser_warn(JSON_WHO, "missing or invalid 'ts' field");
     return -1;
   }
-  out->timestamp_ms = (int64_t)ts->valuedouble;
 
-  const cJSON *readings = cJSON_GetObjectItemCaseSensitive(root, "readings");
-  if (!cJSON_IsArray(readings)) {
-    log_error("missing or invalid 'readings' array");
-    cJSON_Delete(root);
+  c.depth++;
+  c.p++;
+  if (!consume(&c, '}')) {
+    do {
+      if (parse_key(&c, key) != 0) {
+        goto malformed;
+      }
+
+      if (!has_ts && strcmp(key, "ts") == 0) {
+        has_ts = true;
+        if (parse_value(&c, &ts_type, &ts, NULL) != 0) {
+          goto malformed;
+        }
+      } else if (!has_dev && strcmp(key, "dev") == 0) {
+        json_str_t  dst = {out->device, SENSOR_DEVICE_MAX_LEN};
+        json_type_t dev_type;
+
+        has_dev = true;
+        if (parse_value(&c, &dev_type, NULL, &dst) != 0) {
+          goto malformed;
+        }
+        if (dev_type != JSON_STRING) {
+          out->device[0] = '\0';
+        }
+      } else if (!has_readings && strcmp(key, "readings") == 0) {
+        has_readings = true;
+        skip_ws(&c);
+        if (c.p < c.end && *c.p == '[') {
+          if (parse_readings_array(&c, out) != 0) {
+            goto malformed;
+          }
+          readings_ok = true;
+        } else if (skip_value(&c) != 0) {
+          goto malformed;
+        }
+      } else if (skip_value(&c) != 0) {
+        goto malformed;
+      }
+    } while (consume(&c, ','));
+
+    if (!consume(&c, '}')) {
+      goto malformed;
+    }
+  }
+
+  if (!has_ts || ts_type != JSON_NUMBER) {
+    parser_warn(JSON_WHO, "missing or invalid 'ts' field");
     return -1;
   }
+  out->timestamp_ms = parser_to_int64(ts);
 
-  parse_readings_array(readings, out);
+  if (!readings_ok) {
+    parser_warn(JSON_WHO, "missing or invalid 'readings' array");
+    return -1;
+  }
 
-  cJSON_Delete(root);
   return 0;
+
+malformed:
+  parser_warn(JSON_WHO, "JSON parse failed at offset %zu",
+              (size_t)(c.p - c.start));
+  return -1;
 }
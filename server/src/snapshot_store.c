@@ -0,0 +1,155 @@
+#include <time.h>
+
+#include "db.h"
+#include "log.h"
+#include "sensor.h"
+#include "snapshot_store.h"
+#include "spool.h"
+
+/* How long a replayed snapshot waits for room in the storage queue */
+#define SNAPSHOT_REPLAY_WAIT_MS 1
+/* How long it waits at most: the writer is stuck past that */
+#define SNAPSHOT_REPLAY_TIMEOUT_MS 10000
+
+/* Storage is done by the db writer thread from its own copy of the
+   readings, queued first: a snapshot the queue has no room for is refused,
+   and must not show up as the latest values of its device. */
+static int snapshot_enqueue(unsigned int producer, const char *device,
+                            parsed_snapshot_t *snap, bool ack,
+                            const db_spool_pos_t *spool)
+{
+  sensor_channel_t *channels[SENSOR_MAX_READINGS];
+
+  for (size_t i = 0; i < snap->count; i++) {
+    channels[i] = &snap->readings[i];
+  }
+  return db_enqueue_snapshot(producer, device, channels, snap->count,
+                             snap->timestamp_ms, ack, spool);
+}
+
+/* The registry only keeps the latest values: a reading it has no room for
+   is still stored. Observers of the device are told about the snapshot
+   only if it changed one of its latest values. */
+static void snapshot_register(const char *device, parsed_snapshot_t *snap,
+                              bool *changed)
+{
+  sensor_registry_t    *reg     = sensor_reg_get();
+  sensor_reg_channel_t *touched = NULL;
+
+  for (size_t i = 0; i < snap->count; i++) {
+    parsed_reading_t *r = &snap->readings[i];
+
+    sensor_reg_channel_t *ch =
+      sensor_channel_register(reg, device, r->name, r->type);
+    if (!ch) {
+      LOG_WARN("snapshot_store: failed to register channel '%s/%s'", device,
+               r->name);
+      continue;
+    }
+
+    int updated = 0;
+    switch (r->type) {
+    case SENSOR_TYPE_FLOAT:
+      updated = sensor_channel_update_float(ch, r->value.f);
+      break;
+    case SENSOR_TYPE_INT:
+      updated = sensor_channel_update_int(ch, r->value.i);
+      break;
+    case SENSOR_TYPE_STRING:
+      updated = sensor_channel_update_string(ch, r->value.s);
+      break;
+    case SENSOR_TYPE_BOOL:
+      updated = sensor_channel_update_bool(ch, r->value.b);
+      break;
+    case SENSOR_TYPE_LAST:
+      break;
+    }
+    if (updated > 0) {
+      touched = ch;
+    }
+  }
+
+  if (touched) {
+    sensor_device_touch(reg, touched);
+  }
+  if (changed) {
+    *changed = touched != NULL;
+  }
+}
+
+/**
+ * @brief Hand a decoded snapshot over to the registry and to storage
+ *
+ * Everything the snapshot handler does once the payload is parsed and the
+ * device identified, kept apart from libcoap so it can be benchmarked.
+ * With a spool, the snapshot is appended to it before it is queued.
+ *
+ * @param producer Storage queue of the calling thread
+ * @param device   Identifier of the device that sent the snapshot
+ * @param snap     Decoded snapshot
+ * @param ack      Report its commit through db_acks_pop()
+ * @param changed  If not NULL, set to whether the snapshot changed a latest
+ *                 value of the device; one that cannot be queued changes
+ *                 none
+ *
+ * @return 0 on success, -1 if the storage queue is full or the spool
+ *         failed
+ */
+int snapshot_store(unsigned int producer, const char *device,
+                   parsed_snapshot_t *snap, bool ack, bool *changed)
+{
+  db_spool_pos_t pos = {0};
+
+  if (changed) {
+    *changed = false;
+  }
+  if (snap->count > 0 && spool_enabled() &&
+      spool_append(producer, device, snap, &pos) != 0) {
+    return -1;
+  }
+  if (snapshot_enqueue(producer, device, snap, ack, &pos) != 0) {
+    /* the device is told to send it again */
+    if (pos.segment != 0) {
+      spool_cancel(producer);
+    }
+    return -1;
+  }
+  snapshot_register(device, snap, changed);
+  return 0;
+}
+
+/**
+ * @brief Store a snapshot spool_open() replays, see spool_replay_fn
+ *
+ * Runs before the CoAP workers start. A snapshot goes to the storage queue
+ * of the worker that appended it, behind nothing that worker will queue:
+ * the positions of a stream are then committed in append order, and the
+ * spool never deletes a segment whose snapshots are still queued. Streams
+ * of a run with more workers share the queues. It waits for room in the
+ * queue, up to SNAPSHOT_REPLAY_TIMEOUT_MS, and updates the registry once
+ * the snapshot is queued.
+ *
+ * @param arg Number of workers, an unsigned int
+ *
+ * @return 0 on success, -1 if the queue stayed full
+ */
+int snapshot_replay(parsed_snapshot_t *snap, const db_spool_pos_t *pos,
+                    void *arg)
+{
+  const struct timespec wait    = {0, SNAPSHOT_REPLAY_WAIT_MS * 1000000L};
+  const unsigned int   *workers = arg;
+  unsigned int          queue   = pos->stream % *workers;
+  unsigned int          waited  = 0;
+
+  while (snapshot_enqueue(queue, snap->device, snap, false, pos) != 0) {
+    if (waited >= SNAPSHOT_REPLAY_TIMEOUT_MS) {
+      LOG_ERROR("snapshot_store: storage queue %u full for %u ms, replay "
+                "stopped", queue, waited);
+      return -1;
+    }
+    nanosleep(&wait, NULL);
+    waited += SNAPSHOT_REPLAY_WAIT_MS;
+  }
+  snapshot_register(snap->device, snap, NULL);
+  return 0;
+}
@@ -0,0 +1,746 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "spool.h"
+
+/*
+ * Every stream appends to one segment file at a time, named
+ * <stream>-<segment>.spool. Segment numbers grow across the streams and
+ * across runs, so the segments of a stream replay in order. A record holds
+ * one snapshot, in host byte order:
+ *
+ *   u32 body length | u32 CRC-32 of the body | body
+ *
+ *   body: i64 timestamp | u8 length, device | u16 readings, then for each:
+ *         u8 type | u8 length, name | value: 4 bytes for a float or an
+ *         int, 1 for a bool, u8 length and bytes for a string
+ *
+ * A type with SPOOL_NO_VALUE set has no value. Replay stops at the first
+ * record that is cut short or fails its CRC: the end of a write a crash
+ * interrupted.
+ *
+ * The producers only write(): fdatasync() and deleting the committed
+ * segments are left to a thread of the spool. Segments are preallocated,
+ * so a sync seldom has block allocations to write out with the data.
+ */
+
+#define SPOOL_NO_VALUE 0x80
+#define SPOOL_HEADER   8
+#define SPOOL_READING_MAX                                                      \
+  (2 + SENSOR_NAME_MAX_LEN + 1 + SENSOR_STRING_MAX_LEN)
+#define SPOOL_RECORD_MAX                                                       \
+  (SPOOL_HEADER + 8 + 1 + SENSOR_DEVICE_MAX_LEN + 2 +                          \
+   SENSOR_MAX_READINGS * SPOOL_READING_MAX)
+#define SPOOL_DIR_MAX  448
+#define SPOOL_PATH_MAX 512 /* directory, stream, segment */
+
+/* A segment no stream appends to any more, kept until it is committed */
+typedef struct {
+  unsigned int stream;
+  uint32_t     segment;
+  uint32_t     size; /* bytes of whole records */
+  int          fd;   /* -1 once synced and closed */
+} spool_segment_t;
+
+typedef struct {
+  pthread_mutex_t lock; /* fd, against the spool thread */
+  int             fd;   /* -1 until the first append */
+  uint32_t        segment;
+  uint32_t        size;
+  uint32_t        last; /* where the last record starts */
+  atomic_bool     dirty;
+  uint8_t        *buf; /* SPOOL_RECORD_MAX */
+} spool_stream_t;
+
+static char             g_dir[SPOOL_DIR_MAX];
+static int              g_dir_fd       = -1;
+static atomic_bool      g_dir_dirty    = false;
+static spool_stream_t  *g_streams      = NULL;
+static unsigned int     g_stream_count = 0;
+static _Atomic uint32_t g_next_segment = 1;
+static uint32_t         g_crc_table[256];
+
+/* Closed segments, by segment number */
+static spool_segment_t *g_closed       = NULL;
+static size_t           g_closed_count = 0;
+static size_t           g_closed_cap   = 0;
+
+static pthread_t       g_thread;
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  g_cond = PTHREAD_COND_INITIALIZER;
+static bool            g_stop = false;
+static atomic_bool     g_idle = false; /* the spool thread waits for work */
+
+static void spool_crc_init(void)
+{
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t c = i;
+
+    for (int k = 0; k < 8; k++) {
+      c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+    }
+    g_crc_table[i] = c;
+  }
+}
+
+static uint32_t spool_crc(const uint8_t *p, size_t len)
+{
+  uint32_t c = 0xffffffffu;
+
+  while (len--) {
+    c = g_crc_table[(c ^ *p++) & 0xff] ^ (c >> 8);
+  }
+  return c ^ 0xffffffffu;
+}
+
+static void spool_path(char *buf, size_t len, unsigned int stream,
+                       uint32_t segment)
+{
+  snprintf(buf, len, "%s/%02u-%010" PRIu32 ".spool", g_dir, stream, segment);
+}
+
+static uint8_t *spool_put(uint8_t *p, const void *data, size_t len)
+{
+  memcpy(p, data, len);
+  return p + len;
+}
+
+static uint8_t *spool_put_string(uint8_t *p, const char *s, size_t max)
+{
+  uint8_t len = (uint8_t)strnlen(s, max - 1);
+
+  *p++ = len;
+  return spool_put(p, s, len);
+}
+
+/* Encodes a snapshot into buf, returns the record length */
+static size_t spool_encode(uint8_t *buf, const char *device,
+                           const parsed_snapshot_t *snap)
+{
+  uint8_t *p     = buf + SPOOL_HEADER;
+  uint16_t count = (uint16_t)snap->count;
+  uint32_t len;
+  uint32_t crc;
+
+  p = spool_put(p, &snap->timestamp_ms, sizeof(snap->timestamp_ms));
+  p = spool_put_string(p, device, SENSOR_DEVICE_MAX_LEN);
+  p = spool_put(p, &count, sizeof(count));
+  for (size_t i = 0; i < snap->count; i++) {
+    const parsed_reading_t *r = &snap->readings[i];
+
+    *p++ = (uint8_t)(r->type | (r->has_value ? 0 : SPOOL_NO_VALUE));
+    p    = spool_put_string(p, r->name, SENSOR_NAME_MAX_LEN);
+    if (!r->has_value) {
+      continue;
+    }
+    switch (r->type) {
+    case SENSOR_TYPE_FLOAT:
+      p = spool_put(p, &r->value.f, sizeof(r->value.f));
+      break;
+    case SENSOR_TYPE_INT:
+      p = spool_put(p, &r->value.i, sizeof(r->value.i));
+      break;
+    case SENSOR_TYPE_STRING:
+      p = spool_put_string(p, r->value.s, SENSOR_STRING_MAX_LEN);
+      break;
+    case SENSOR_TYPE_BOOL:
+      *p++ = r->value.b;
+      break;
+    case SENSOR_TYPE_LAST:
+      break;
+    }
+  }
+
+  len = (uint32_t)(p - buf - SPOOL_HEADER);
+  crc = spool_crc(buf + SPOOL_HEADER, len);
+  memcpy(buf, &len, sizeof(len));
+  memcpy(buf + 4, &crc, sizeof(crc));
+  return SPOOL_HEADER + len;
+}
+
+static int spool_get(const uint8_t **p, const uint8_t *end, void *out,
+                     size_t len)
+{
+  if ((size_t)(end - *p) < len) {
+    return -1;
+  }
+  memcpy(out, *p, len);
+  *p += len;
+  return 0;
+}
+
+static int spool_get_string(const uint8_t **p, const uint8_t *end, char *out,
+                            size_t max)
+{
+  uint8_t len;
+
+  if (spool_get(p, end, &len, 1) != 0 || len >= max ||
+      spool_get(p, end, out, len) != 0) {
+    return -1;
+  }
+  out[len] = '\0';
+  return 0;
+}
+
+static int spool_decode(const uint8_t *p, size_t len, parsed_snapshot_t *snap)
+{
+  const uint8_t *end = p + len;
+  uint16_t       count;
+
+  if (spool_get(&p, end, &snap->timestamp_ms, sizeof(snap->timestamp_ms)) ||
+      spool_get_string(&p, end, snap->device, sizeof(snap->device)) ||
+      spool_get(&p, end, &count, sizeof(count)) ||
+      count > SENSOR_MAX_READINGS) {
+    return -1;
+  }
+  snap->count = count;
+  for (size_t i = 0; i < count; i++) {
+    parsed_reading_t *r = &snap->readings[i];
+    uint8_t           type;
+    int               rc = 0;
+
+    if (spool_get(&p, end, &type, 1) ||
+        (type & ~SPOOL_NO_VALUE) >= SENSOR_TYPE_LAST ||
+        spool_get_string(&p, end, r->name, sizeof(r->name))) {
+      return -1;
+    }
+    r->type      = (sensor_type_t)(type & ~SPOOL_NO_VALUE);
+    r->has_value = !(type & SPOOL_NO_VALUE);
+    if (!r->has_value) {
+      continue;
+    }
+    switch (r->type) {
+    case SENSOR_TYPE_FLOAT:
+      rc = spool_get(&p, end, &r->value.f, sizeof(r->value.f));
+      break;
+    case SENSOR_TYPE_INT:
+      rc = spool_get(&p, end, &r->value.i, sizeof(r->value.i));
+      break;
+    case SENSOR_TYPE_STRING:
+      rc = spool_get_string(&p, end, r->value.s, sizeof(r->value.s));
+      break;
+    case SENSOR_TYPE_BOOL:
+      rc = spool_get(&p, end, &type, 1);
+      r->value.b = type != 0;
+      break;
+    case SENSOR_TYPE_LAST:
+      break;
+    }
+    if (rc != 0) {
+      return -1;
+    }
+  }
+  return p == end ? 0 : -1;
+}
+
+/* Called with g_lock held */
+static int spool_closed_add(unsigned int stream, uint32_t segment,
+                            uint32_t size, int fd)
+{
+  if (g_closed_count == g_closed_cap) {
+    size_t           cap = g_closed_cap ? g_closed_cap * 2 : 16;
+    spool_segment_t *closed;
+
+    closed = realloc(g_closed, cap * sizeof(*closed));
+    if (!closed) {
+      return -1;
+    }
+    g_closed     = closed;
+    g_closed_cap = cap;
+  }
+  g_closed[g_closed_count++] = (spool_segment_t){
+    .stream = stream, .segment = segment, .size = size, .fd = fd};
+  return 0;
+}
+
+/* Tells the spool thread there is something to sync, if it waits for
+   work: a producer only takes g_lock then */
+static void spool_wake(void)
+{
+  if (atomic_load(&g_idle)) {
+    pthread_mutex_lock(&g_lock);
+    pthread_cond_signal(&g_cond);
+    pthread_mutex_unlock(&g_lock);
+  }
+}
+
+/* Syncs a segment before forgetting about it. Its snapshots are replayed
+   at the next start if they are not committed by then. */
+static void spool_fd_close(int fd)
+{
+  fdatasync(fd);
+  close(fd);
+}
+
+/* Closes the segment of a stream, if any, and opens the next one */
+static int spool_rotate(spool_stream_t *s, unsigned int stream)
+{
+  char     path[SPOOL_PATH_MAX];
+  uint32_t segment = atomic_fetch_add(&g_next_segment, 1);
+  int      fd;
+
+  spool_path(path, sizeof(path), stream, segment);
+  fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    LOG_ERROR("spool: cannot create %s: %s", path, strerror(errno));
+    return -1;
+  }
+  /* best effort, not every file system has it */
+  fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, SPOOL_SEGMENT_BYTES);
+
+  pthread_mutex_lock(&g_lock);
+  pthread_mutex_lock(&s->lock);
+  if (s->fd >= 0 && spool_closed_add(stream, s->segment, s->size, s->fd)) {
+    spool_fd_close(s->fd);
+  }
+  s->fd      = fd;
+  s->segment = segment;
+  s->size    = 0;
+  s->last    = 0;
+  pthread_mutex_unlock(&s->lock);
+  pthread_mutex_unlock(&g_lock);
+
+  atomic_store(&g_dir_dirty, true);
+  spool_wake();
+  return 0;
+}
+
+/**
+ * @brief Append a snapshot to the spool
+ *
+ * The snapshot survives a crash of the server once this returns, and a
+ * power loss at most SPOOL_SYNC_MS later.
+ *
+ * @param stream Producer appending it, 0..streams-1 of spool_open()
+ * @param device Identifier of the device that sent the snapshot
+ * @param snap   Decoded snapshot
+ * @param pos    Set to where it was appended, to queue it with
+ *
+ * @return 0 on success, -1 on error
+ */
+int spool_append(unsigned int stream, const char *device,
+                 const parsed_snapshot_t *snap, db_spool_pos_t *pos)
+{
+  spool_stream_t *s;
+  size_t          len;
+  ssize_t         n;
+
+  if (stream >= g_stream_count || snap->count > SENSOR_MAX_READINGS) {
+    return -1;
+  }
+  s = &g_streams[stream];
+  len = spool_encode(s->buf, device, snap);
+  if ((s->fd < 0 || s->size + len > SPOOL_SEGMENT_BYTES) &&
+      spool_rotate(s, stream) != 0) {
+    return -1;
+  }
+
+  n = write(s->fd, s->buf, len);
+  if (n != (ssize_t)len) {
+    LOG_ERROR("spool: append failed: %s",
+              n < 0 ? strerror(errno) : "short write");
+    if (n > 0 && ftruncate(s->fd, s->size) != 0) {
+      /* a torn record ends the segment for the replay: start a new one */
+      spool_rotate(s, stream);
+    }
+    return -1;
+  }
+
+  s->last = s->size;
+  s->size += (uint32_t)len;
+  /* ordered before g_idle is read, see spool_loop() */
+  atomic_store(&s->dirty, true);
+  spool_wake();
+
+  pos->stream  = stream;
+  pos->segment = s->segment;
+  pos->end     = s->size;
+  return 0;
+}
+
+/**
+ * @brief Take back the last snapshot spool_append() added to a stream
+ *
+ * For a snapshot that could not be queued after all: it is not to be
+ * replayed.
+ *
+ * @param stream Producer that appended it
+ */
+void spool_cancel(unsigned int stream)
+{
+  spool_stream_t *s;
+
+  if (stream >= g_stream_count) {
+    return;
+  }
+  s = &g_streams[stream];
+  if (s->fd < 0 || s->last == s->size) {
+    return;
+  }
+  if (ftruncate(s->fd, s->last) != 0) {
+    LOG_ERROR("spool: cannot take a snapshot back: %s", strerror(errno));
+    return;
+  }
+  s->size = s->last;
+}
+
+/**
+ * @brief Whether snapshots go through the spool
+ *
+ * @return true between spool_open() and spool_close()
+ */
+bool spool_enabled(void)
+{
+  return g_streams != NULL;
+}
+
+/* Syncs what was appended, then deletes the segments whose snapshots are
+   all committed */
+static void spool_sweep(void)
+{
+  char   path[SPOOL_PATH_MAX];
+  size_t kept = 0;
+
+  for (unsigned int i = 0; i < g_stream_count; i++) {
+    spool_stream_t *s = &g_streams[i];
+
+    if (atomic_exchange_explicit(&s->dirty, false, memory_order_relaxed)) {
+      pthread_mutex_lock(&s->lock);
+      if (s->fd >= 0 && fdatasync(s->fd) != 0) {
+        LOG_ERROR("spool: fdatasync failed: %s", strerror(errno));
+      }
+      pthread_mutex_unlock(&s->lock);
+    }
+  }
+  if (atomic_exchange(&g_dir_dirty, false)) {
+    fsync(g_dir_fd);
+  }
+
+  pthread_mutex_lock(&g_lock);
+  for (size_t i = 0; i < g_closed_count; i++) {
+    spool_segment_t *seg = &g_closed[i];
+
+    if (seg->fd >= 0) {
+      spool_fd_close(seg->fd);
+      seg->fd = -1;
+    }
+    /* an empty one holds nothing to replay */
+    if (seg->size > 0 && db_spool_committed(seg->stream) <
+                           DB_SPOOL_POS(seg->segment, seg->size)) {
+      g_closed[kept++] = *seg;
+      continue;
+    }
+    spool_path(path, sizeof(path), seg->stream, seg->segment);
+    if (unlink(path) != 0 && errno != ENOENT) {
+      LOG_ERROR("spool: cannot delete %s: %s", path, strerror(errno));
+    }
+  }
+  g_closed_count = kept;
+  pthread_mutex_unlock(&g_lock);
+}
+
+/* Whether an append is not synced yet */
+static bool spool_dirty(void)
+{
+  for (unsigned int i = 0; i < g_stream_count; i++) {
+    if (atomic_load(&g_streams[i].dirty)) {
+      return true;
+    }
+  }
+  return atomic_load(&g_dir_dirty);
+}
+
+/* Sleeps until an append, or while closed segments wait for their
+   snapshots to be committed, then gives the producers SPOOL_SYNC_MS to
+   append more before one sync covers them all */
+static void *spool_loop(void *arg)
+{
+  struct timespec deadline;
+  bool            stop;
+
+  (void)arg;
+  do {
+    pthread_mutex_lock(&g_lock);
+    atomic_store(&g_idle, true);
+    /* re-check under the lock: a producer that saw idle == false has
+       already marked its stream, one that sees idle == true will signal */
+    if (!g_stop && g_closed_count == 0 && !spool_dirty()) {
+      pthread_cond_wait(&g_cond, &g_lock);
+    }
+    atomic_store(&g_idle, false);
+    if (!g_stop) {
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_nsec += SPOOL_SYNC_MS * 1000000L;
+      if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+      }
+      pthread_cond_timedwait(&g_cond, &g_lock, &deadline);
+    }
+    stop = g_stop;
+    pthread_mutex_unlock(&g_lock);
+
+    spool_sweep();
+  } while (!stop);
+  return NULL;
+}
+
+static int spool_segment_cmp(const void *a, const void *b)
+{
+  uint32_t x = ((const spool_segment_t *)a)->segment;
+  uint32_t y = ((const spool_segment_t *)b)->segment;
+
+  return (x > y) - (x < y);
+}
+
+/* Lists the segments left by the previous runs into g_closed, oldest
+   first, their size still unknown */
+static int spool_scan(void)
+{
+  DIR           *dir = opendir(g_dir);
+  struct dirent *e;
+
+  if (!dir) {
+    LOG_ERROR("spool: cannot read %s: %s", g_dir, strerror(errno));
+    return -1;
+  }
+  while ((e = readdir(dir))) {
+    unsigned int stream;
+    uint32_t     segment;
+    int          end = 0;
+
+    if (sscanf(e->d_name, "%u-%" SCNu32 ".spool%n", &stream, &segment,
+               &end) != 2 ||
+        e->d_name[end] != '\0' || end == 0) {
+      continue;
+    }
+    if (stream >= DB_MAX_PRODUCERS) {
+      LOG_WARN("spool: ignoring %s, stream out of range", e->d_name);
+      continue;
+    }
+    if (spool_closed_add(stream, segment, 0, -1) != 0) {
+      closedir(dir);
+      return -1;
+    }
+    if (segment >= atomic_load(&g_next_segment)) {
+      atomic_store(&g_next_segment, segment + 1);
+    }
+  }
+  closedir(dir);
+  qsort(g_closed, g_closed_count, sizeof(*g_closed), spool_segment_cmp);
+  return 0;
+}
+
+/* Replays the snapshots of a segment after the committed position, and
+   sets the size of the segment to that of its whole records */
+static int spool_replay_segment(spool_segment_t *seg, spool_replay_fn replay,
+                                void *arg, uint64_t *replayed)
+{
+  static parsed_snapshot_t snap;
+  char                     path[SPOOL_PATH_MAX];
+  uint64_t                 committed = db_spool_committed(seg->stream);
+  uint8_t                 *buf       = NULL;
+  struct stat              st;
+  size_t                   off = 0;
+  int                      fd;
+
+  spool_path(path, sizeof(path), seg->stream, seg->segment);
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    LOG_ERROR("spool: cannot open %s: %s", path, strerror(errno));
+    goto error;
+  }
+  if (st.st_size > 0) {
+    buf = malloc((size_t)st.st_size);
+    if (!buf || read(fd, buf, (size_t)st.st_size) != st.st_size) {
+      LOG_ERROR("spool: cannot read %s", path);
+      goto error;
+    }
+  }
+
+  while ((size_t)st.st_size - off >= SPOOL_HEADER) {
+    uint32_t       len;
+    uint32_t       crc;
+    db_spool_pos_t pos;
+
+    memcpy(&len, buf + off, sizeof(len));
+    memcpy(&crc, buf + off + 4, sizeof(crc));
+    if (len > (size_t)st.st_size - off - SPOOL_HEADER ||
+        spool_crc(buf + off + SPOOL_HEADER, len) != crc ||
+        spool_decode(buf + off + SPOOL_HEADER, len, &snap) != 0) {
+      break;
+    }
+    off += SPOOL_HEADER + len;
+
+    pos = (db_spool_pos_t){
+      .stream = seg->stream, .segment = seg->segment, .end = (uint32_t)off};
+    if (DB_SPOOL_POS(pos.segment, pos.end) <= committed) {
+      continue;
+    }
+    if (replay(&snap, &pos, arg) != 0) {
+      goto error;
+    }
+    (*replayed)++;
+  }
+  if (off < (size_t)st.st_size) {
+    LOG_WARN("spool: %s ends with %zu bytes of a torn write", path,
+             (size_t)st.st_size - off);
+  }
+
+  seg->size = (uint32_t)off;
+  free(buf);
+  close(fd);
+  return 0;
+
+error:
+  free(buf);
+  if (fd >= 0) {
+    close(fd);
+  }
+  return -1;
+}
+
+static void spool_free(void)
+{
+  for (unsigned int i = 0; i < g_stream_count; i++) {
+    if (g_streams[i].fd >= 0) {
+      spool_fd_close(g_streams[i].fd);
+    }
+    pthread_mutex_destroy(&g_streams[i].lock);
+    free(g_streams[i].buf);
+  }
+  free(g_streams);
+  g_streams      = NULL;
+  g_stream_count = 0;
+  for (size_t i = 0; i < g_closed_count; i++) {
+    if (g_closed[i].fd >= 0) {
+      spool_fd_close(g_closed[i].fd);
+    }
+  }
+  free(g_closed);
+  g_closed       = NULL;
+  g_closed_count = 0;
+  g_closed_cap   = 0;
+  if (g_dir_fd >= 0) {
+    close(g_dir_fd);
+    g_dir_fd = -1;
+  }
+}
+
+/**
+ * @brief Open the spool, replay what it holds and start its thread
+ *
+ * Call it once the db writer runs and before any producer stores a
+ * snapshot: the snapshots the previous runs appended but did not commit
+ * are handed to replay first.
+ *
+ * @param dir     Directory of the segments, created if needed
+ * @param streams Number of producers that will append, 1..DB_MAX_PRODUCERS
+ * @param replay  Called for each snapshot to replay
+ * @param arg     Passed to replay
+ *
+ * @return 0 on success, -1 on error
+ */
+int spool_open(const char *dir, unsigned int streams, spool_replay_fn replay,
+               void *arg)
+{
+  uint64_t replayed = 0;
+  size_t   segments;
+
+  if (streams == 0 || streams > DB_MAX_PRODUCERS) {
+    LOG_ERROR("spool: stream count must be 1..%d", DB_MAX_PRODUCERS);
+    return -1;
+  }
+  if ((size_t)snprintf(g_dir, sizeof(g_dir), "%s", dir) >= sizeof(g_dir) ||
+      (mkdir(dir, 0755) != 0 && errno != EEXIST) ||
+      (g_dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+    LOG_ERROR("spool: cannot open %s: %s", dir, strerror(errno));
+    return -1;
+  }
+  spool_crc_init();
+
+  g_streams = calloc(streams, sizeof(*g_streams));
+  if (!g_streams) {
+    goto error;
+  }
+  for (; g_stream_count < streams; g_stream_count++) {
+    spool_stream_t *s = &g_streams[g_stream_count];
+
+    s->fd  = -1;
+    s->buf = malloc(SPOOL_RECORD_MAX);
+    pthread_mutex_init(&s->lock, NULL);
+    if (!s->buf) {
+      g_stream_count++;
+      goto error;
+    }
+  }
+
+  if (spool_scan() != 0) {
+    goto error;
+  }
+  segments = g_closed_count;
+  for (size_t i = 0; i < g_closed_count; i++) {
+    if (spool_replay_segment(&g_closed[i], replay, arg, &replayed) != 0) {
+      goto error;
+    }
+  }
+
+  g_stop = false;
+  if (pthread_create(&g_thread, NULL, spool_loop, NULL) != 0) {
+    LOG_ERROR("spool: cannot start the spool thread");
+    goto error;
+  }
+  LOG_INFO("Spool in '%s': %llu snapshots replayed from %zu segments", dir,
+           (unsigned long long)replayed, segments);
+  return 0;
+
+error:
+  LOG_ERROR("spool: cannot open %s", dir);
+  spool_free();
+  return -1;
+}
+
+/**
+ * @brief Sync the spool and stop its thread
+ *
+ * Call it once the producers are stopped and the db writer has committed
+ * what they queued: the segments are then deleted, the spool is left empty.
+ */
+void spool_close(void)
+{
+  if (!g_streams) {
+    return;
+  }
+  pthread_mutex_lock(&g_lock);
+  g_stop = true;
+  pthread_cond_signal(&g_cond);
+  pthread_mutex_unlock(&g_lock);
+  pthread_join(g_thread, NULL);
+
+  for (unsigned int i = 0; i < g_stream_count; i++) {
+    spool_stream_t *s = &g_streams[i];
+
+    if (s->fd >= 0 && spool_closed_add(i, s->segment, s->size, s->fd) == 0) {
+      s->fd = -1;
+    }
+  }
+  spool_sweep();
+  if (g_closed_count > 0) {
+    LOG_WARN("spool: %zu segments kept, their snapshots are not all "
+             "committed",
+             g_closed_count);
+  }
+  spool_free();
+}